@@ -0,0 +1,338 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/*
+ * record parsing benchmark: a synthetic host, every VM with the
+ * same disks and NICs, parsed by vminfo_parse, by the strcmp
+ * chains it used before, kept here as the reference, and through
+ * the shapes learned in the first round.
+ * Reports the cost per record and per field.
+ * Needs the libvirt test driver, for a domain to parse the records of.
+ *
+ * usage: bench_parse [VMS] [DISKS] [ROUNDS]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libvirt/libvirt.h>
+
+#include "vmonlib.h"
+#include "vminfo.h"
+
+
+enum {
+    DEFAULT_VMS = 300,
+    DEFAULT_DISKS = 10,
+    DEFAULT_ROUNDS = 20,
+    BENCH_VCPUS = 4,
+    BENCH_NICS = 2
+};
+
+static const char *TEST_URI = "test:///default";
+
+static const char *block_fields[] = {
+    "name", "path", "rd.reqs", "rd.bytes", "rd.times", "wr.reqs",
+    "wr.bytes", "wr.times", "fl.reqs", "fl.times", "allocation",
+    "capacity", "physical",
+};
+
+static const char *net_fields[] = {
+    "name", "rx.bytes", "rx.pkts", "rx.errs", "rx.drop",
+    "tx.bytes", "tx.pkts", "tx.errs", "tx.drop",
+};
+
+static virTypedParameterPtr
+param_add(virDomainStatsRecordPtr rec, int type, const char *field)
+{
+    virTypedParameterPtr item = &rec->params[rec->nparams++];
+    snprintf(item->field, sizeof(item->field), "%s", field);
+    item->type = type;
+    if (type == VIR_TYPED_PARAM_STRING) {
+        item->value.s = (char *)"vda";
+    } else if (type == VIR_TYPED_PARAM_UINT) {
+        item->value.ui = 1;
+    } else {
+        item->value.ul = rec->nparams;
+    }
+    return item;
+}
+
+static void
+record_build(virDomainStatsRecordPtr rec, virDomainPtr dom, int disks)
+{
+    char field[VIR_TYPED_PARAM_FIELD_LENGTH];
+    size_t j;
+    int i;
+
+    rec->dom = dom;
+    rec->params = calloc(64 + disks * G_N_ELEMENTS(block_fields) +
+                         BENCH_NICS * G_N_ELEMENTS(net_fields),
+                         sizeof(virTypedParameter));
+    rec->nparams = 0;
+
+    param_add(rec, VIR_TYPED_PARAM_INT, "state.state");
+    param_add(rec, VIR_TYPED_PARAM_INT, "state.reason");
+    param_add(rec, VIR_TYPED_PARAM_ULLONG, "cpu.time");
+    param_add(rec, VIR_TYPED_PARAM_ULLONG, "cpu.user");
+    param_add(rec, VIR_TYPED_PARAM_ULLONG, "cpu.system");
+    param_add(rec, VIR_TYPED_PARAM_ULLONG, "balloon.current");
+    param_add(rec, VIR_TYPED_PARAM_ULLONG, "balloon.maximum");
+    param_add(rec, VIR_TYPED_PARAM_UINT, "vcpu.current")->value.ui = BENCH_VCPUS;
+    param_add(rec, VIR_TYPED_PARAM_UINT, "vcpu.maximum")->value.ui = BENCH_VCPUS;
+    for (i = 0; i < BENCH_VCPUS; i++) {
+        snprintf(field, sizeof(field), "vcpu.%i.state", i);
+        param_add(rec, VIR_TYPED_PARAM_INT, field);
+        snprintf(field, sizeof(field), "vcpu.%i.time", i);
+        param_add(rec, VIR_TYPED_PARAM_ULLONG, field);
+    }
+    param_add(rec, VIR_TYPED_PARAM_UINT, "net.count")->value.ui = BENCH_NICS;
+    for (i = 0; i < BENCH_NICS; i++) {
+        for (j = 0; j < G_N_ELEMENTS(net_fields); j++) {
+            snprintf(field, sizeof(field), "net.%i.%s", i, net_fields[j]);
+            param_add(rec, (j == 0) ?VIR_TYPED_PARAM_STRING :VIR_TYPED_PARAM_ULLONG,
+                      field);
+        }
+    }
+    param_add(rec, VIR_TYPED_PARAM_UINT, "block.count")->value.ui = disks;
+    for (i = 0; i < disks; i++) {
+        for (j = 0; j < G_N_ELEMENTS(block_fields); j++) {
+            snprintf(field, sizeof(field), "block.%i.%s", i, block_fields[j]);
+            param_add(rec, (j < 2) ?VIR_TYPED_PARAM_STRING :VIR_TYPED_PARAM_ULLONG,
+                      field);
+        }
+    }
+}
+
+/* the reference: one strcmp chain per group, as before */
+
+#define DISPATCH(NAME, FIELD) do { \
+    if (strcmp(name, # NAME) == 0) { \
+        stats->FIELD = item->value.ul; \
+        return; \
+    } \
+} while (0)
+
+static void
+legacy_block_field(BlockStats *stats, const char *name,
+                   const virTypedParameterPtr item)
+{
+    if (strcmp(name, "name") == 0) {
+        strncpy(stats->name, item->value.s, STATS_NAME_LEN - 1);
+        return;
+    }
+    DISPATCH(rd.reqs, rd_reqs);
+    DISPATCH(rd.bytes, rd_bytes);
+    DISPATCH(rd.times, rd_times);
+    DISPATCH(wr.reqs, wr_reqs);
+    DISPATCH(wr.bytes, wr_bytes);
+    DISPATCH(wr.times, wr_times);
+    DISPATCH(fl.bytes, fl_bytes);
+    DISPATCH(fl.times, fl_times);
+    DISPATCH(allocation, allocation);
+    DISPATCH(capacity, capacity);
+    DISPATCH(physical, physical);
+}
+
+static void
+legacy_net_field(IfaceStats *stats, const char *name,
+                 const virTypedParameterPtr item)
+{
+    if (strcmp(name, "name") == 0) {
+        strncpy(stats->name, item->value.s, STATS_NAME_LEN - 1);
+        return;
+    }
+    DISPATCH(rx.bytes, rx_bytes);
+    DISPATCH(rx.pkts, rx_pkts);
+    DISPATCH(rx.errs, rx_errs);
+    DISPATCH(rx.drop, rx_drop);
+    DISPATCH(tx.bytes, tx_bytes);
+    DISPATCH(tx.pkts, tx_pkts);
+    DISPATCH(tx.errs, tx_errs);
+    DISPATCH(tx.drop, tx_drop);
+}
+
+#undef DISPATCH
+
+/* the suffix after "PREFIX.N.", if the index is below max */
+static const char *
+legacy_scan(const char *field, const char *prefix, size_t max, size_t *index)
+{
+    const char *pc = field + strlen(prefix);
+    char buf[128] = { '\0' };
+    size_t j;
+
+    if (strstr(field, prefix) != field) {
+        return NULL;
+    }
+    for (j = 0; j < sizeof(buf) - 1 && *pc >= '0' && *pc <= '9'; j++) {
+        buf[j] = *pc++;
+    }
+    *index = atol(buf);
+    return (*index < max) ?pc + 1 :NULL;
+}
+
+static void
+legacy_parse(VmInfo *vm, const virDomainStatsRecordPtr record)
+{
+    const char *suffix = NULL;
+    size_t index = 0;
+    int i;
+
+    for (i = 0; i < record->nparams; i++) {
+        const virTypedParameterPtr item = &record->params[i];
+        if (strcmp(item->field, "block.count") == 0) {
+            vm->block.nstats = item->value.ui;
+        }
+        if (strcmp(item->field, "net.count") == 0) {
+            vm->iface.nstats = item->value.ui;
+        }
+        if (strcmp(item->field, "vcpu.current") == 0) {
+            vm->vcpu.current = item->value.ui;
+        } else if (strcmp(item->field, "vcpu.maximum") == 0) {
+            vm->vcpu.nstats = item->value.ui;
+        }
+    }
+
+    for (i = 0; i < record->nparams; i++) {
+        const virTypedParameterPtr item = &record->params[i];
+        const char *field = item->field;
+
+        if (strcmp(field, "cpu.time") == 0) {
+            vm->pcpu.time = item->value.ul;
+        } else if (strcmp(field, "cpu.user") == 0) {
+            vm->pcpu.user = item->value.ul;
+        } else if (strcmp(field, "cpu.system") == 0) {
+            vm->pcpu.system = item->value.ul;
+        }
+        if (strcmp(field, "balloon.current") == 0) {
+            vm->balloon.current = item->value.ul;
+        } else if (strcmp(field, "balloon.maximum") == 0) {
+            vm->balloon.maximum = item->value.ul;
+        }
+        suffix = legacy_scan(field, "vcpu.", vm->vcpu.nstats, &index);
+        if (suffix && index < VCPU_STATS_NUM) {
+            if (strcmp(suffix, "state") == 0) {
+                vm->vcpu.stats[index].state = item->value.i;
+            } else if (strcmp(suffix, "time") == 0) {
+                vm->vcpu.stats[index].time = item->value.ul;
+            }
+        }
+        suffix = legacy_scan(field, "block.", vm->block.nstats, &index);
+        if (suffix && index < BLOCK_STATS_NUM) {
+            legacy_block_field(&vm->block.stats[index], suffix, item);
+        }
+        suffix = legacy_scan(field, "net.", vm->iface.nstats, &index);
+        if (suffix && index < IFACE_STATS_NUM) {
+            legacy_net_field(&vm->iface.stats[index], suffix, item);
+        }
+    }
+}
+
+static double
+per_op(gint64 start, long n)
+{
+    return (double)(g_get_monotonic_time() - start) * 1000.0 / n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int vms = (argc > 1) ?atoi(argv[1]) :DEFAULT_VMS;
+    int disks = (argc > 2) ?atoi(argv[2]) :DEFAULT_DISKS;
+    int rounds = (argc > 3) ?atoi(argv[3]) :DEFAULT_ROUNDS;
+    virDomainStatsRecord *records = NULL;
+    virConnectPtr conn = NULL;
+    virDomainPtr dom = NULL;
+    long params = 0;
+    VmShapes *shapes = NULL;
+    double legacy, hashed, shaped;
+    gint64 start;
+    int i, r;
+
+    if (vms <= 0 || disks < 0 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [VMS] [DISKS] [ROUNDS]\n", argv[0]);
+        return 1;
+    }
+    conn = virConnectOpen(TEST_URI);
+    dom = (conn) ?virDomainLookupByName(conn, "test") :NULL;
+    records = calloc(vms, sizeof(*records));
+    if (!dom || !records || vmshapes_init(&shapes) < 0) {
+        fprintf(stderr, "failed to set up the libvirt test driver\n");
+        return 1;
+    }
+    for (i = 0; i < vms; i++) {
+        record_build(&records[i], dom, disks);
+        params += records[i].nparams;
+    }
+
+    start = g_get_monotonic_time();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < vms; i++) {
+            VmInfo vm;
+            vminfo_init(&vm);
+            legacy_parse(&vm, &records[i]);
+        }
+    }
+    legacy = per_op(start, (long)rounds * vms);
+
+    start = g_get_monotonic_time();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < vms; i++) {
+            VmInfo vm;
+            vminfo_init(&vm);
+            vminfo_parse(&vm, &records[i]);
+            vminfo_free(&vm);
+        }
+    }
+    hashed = per_op(start, (long)rounds * vms);
+
+    start = g_get_monotonic_time();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < vms; i++) {
+            VmInfo vm;
+            vminfo_init(&vm);
+            vminfo_parse_shaped(&vm, &records[i], shapes, i + 1);
+            vminfo_free(&vm);
+        }
+    }
+    shaped = per_op(start, (long)rounds * vms);
+
+    printf("parse: vms=%i disks=%i fields=%li\n", vms, disks, params / vms);
+    printf("parse: strcmp record=%.0fns field=%.1fns\n",
+           legacy, legacy * vms / params);
+    printf("parse: hashed record=%.0fns field=%.1fns\n",
+           hashed, hashed * vms / params);
+    printf("parse: shaped record=%.0fns field=%.1fns\n",
+           shaped, shaped * vms / params);
+
+    for (i = 0; i < vms; i++) {
+        free(records[i].params);
+    }
+    free(records);
+    vmshapes_free(shapes);
+    virDomainFree(dom);
+    virConnectClose(conn);
+    return 0;
+}
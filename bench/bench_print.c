@@ -0,0 +1,250 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * serialization benchmark: a synthetic host, every VM with the same
+ * vcpus, disks and NICs, printed by vminfo_print_json, and by the
+ * fprintf() calls on a memstream it used before, kept here as the
+ * reference. Both must print the same text.
+ * Reports the cost per VM and per byte.
+ *
+ * usage: bench_print [VMS] [DISKS] [ROUNDS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "vminfo.h"
+
+
+enum {
+    DEFAULT_VMS = 300,
+    DEFAULT_DISKS = 10,
+    DEFAULT_ROUNDS = 200,
+    BENCH_VCPUS = 4,
+    BENCH_NICS = 2
+};
+
+static void
+vm_build(VmInfo *vm, int id, int disks)
+{
+    BlockStats *block = NULL;
+    IfaceStats *iface = vm->iface.stats;
+    unsigned long long value = 1000003ULL * (id + 1);
+    int i;
+
+    vminfo_init(vm);
+    snprintf(vm->uuid, sizeof(vm->uuid),
+             "%08x-0000-4000-8000-%012x", id, id);
+    vm->pcpu.time = value++ * 1000000;
+    vm->pcpu.user = value++ * 100000;
+    vm->pcpu.system = value++ * 100000;
+    vm->balloon.current = 4194304;
+    vm->balloon.maximum = 8388608;
+
+    vm->vcpu.nstats = BENCH_VCPUS;
+    vm->vcpu.current = BENCH_VCPUS;
+    for (i = 0; i < BENCH_VCPUS; i++) {
+        vm->vcpu.stats[i].present = 1;
+        vm->vcpu.stats[i].state = 1;
+        vm->vcpu.stats[i].time = value++ * 1000000;
+    }
+
+    if (disks > BLOCK_STATS_NUM) {
+        vm->block.xstats = calloc(disks, sizeof(BlockStats));
+    }
+    block = (vm->block.xstats) ?vm->block.xstats :vm->block.stats;
+    vm->block.nstats = disks;
+    for (i = 0; i < disks; i++) {
+        snprintf(block[i].name, sizeof(block[i].name), "vd%c", 'a' + i % 26);
+        block[i].rd_reqs = value++;
+        block[i].rd_bytes = value++ * 4096;
+        block[i].rd_times = value++ * 1000;
+        block[i].wr_reqs = value++;
+        block[i].wr_bytes = value++ * 4096;
+        block[i].wr_times = value++ * 1000;
+        block[i].allocation = value++ * 65536;
+        block[i].capacity = 21474836480ULL;
+        block[i].physical = 21474836480ULL;
+    }
+
+    vm->iface.nstats = BENCH_NICS;
+    for (i = 0; i < BENCH_NICS; i++) {
+        snprintf(iface[i].name, sizeof(iface[i].name), "vnet%i", i);
+        iface[i].rx_bytes = value++ * 1500;
+        iface[i].rx_pkts = value++;
+        iface[i].tx_bytes = value++ * 1500;
+        iface[i].tx_pkts = value++;
+    }
+}
+
+/* the reference: fprintf() per field, as before, without the stray commas */
+
+static void
+legacy_print_json(const VmInfo *vm, FILE *out)
+{
+    const VCpuStats *vcpus = (vm->vcpu.xstats) ?vm->vcpu.xstats :vm->vcpu.stats;
+    const BlockStats *block = (vm->block.xstats) ?vm->block.xstats :vm->block.stats;
+    const IfaceStats *iface = (vm->iface.xstats) ?vm->iface.xstats :vm->iface.stats;
+    size_t i;
+    int printed = 0;
+
+    fprintf(out, "{ \"vm-id\": \"%s\", ", vm->uuid);
+    fprintf(out, "\"pcpu\": { \"cpu.time\": %llu, \"cpu.user\": %llu,"
+                 " \"cpu.system\": %llu }, ",
+            vm->pcpu.time, vm->pcpu.user, vm->pcpu.system);
+    fprintf(out, "\"balloon\": { \"balloon.current\": %llu,"
+                 " \"balloon.maximum\": %llu }, ",
+            vm->balloon.current, vm->balloon.maximum);
+
+    fputs("\"vcpu\": {", out);
+    for (i = 0; i < vm->vcpu.nstats; i++) {
+        if (!vcpus[i].present) {
+            continue;
+        }
+        fprintf(out, "%s \"%zu\": { \"state\": %i, \"time\": %llu }",
+                (printed++ > 0) ?"," :"", i, vcpus[i].state, vcpus[i].time);
+    }
+    fputs(" }, ", out);
+
+    fputs("\"block\": {", out);
+    for (i = 0; i < vm->block.nstats; i++) {
+        fprintf(out, "%s \"%s\": { \"rd_bytes\": %llu,"
+                     " \"rd_operations\": %llu,"
+                     " \"rd_total_times\": %llu,"
+                     " \"wr_bytes\": %llu,"
+                     " \"wr_operations\": %llu,"
+                     " \"wr_total_times\": %llu,"
+                     " \"allocation\": %llu,"
+                     " \"capacity\": %llu,"
+                     " \"physical\": %llu }",
+                (i > 0) ?"," :"", block[i].name,
+                block[i].rd_bytes, block[i].rd_reqs, block[i].rd_times,
+                block[i].wr_bytes, block[i].wr_reqs, block[i].wr_times,
+                block[i].allocation, block[i].capacity, block[i].physical);
+    }
+    fputs(" }, ", out);
+
+    fputs("\"iface\": {", out);
+    for (i = 0; i < vm->iface.nstats; i++) {
+        fprintf(out, "%s \"%s\": { \"rx_bytes\": %llu,"
+                     " \"rx_pkts\": %llu,"
+                     " \"rx_errs\": %llu,"
+                     " \"rx_drop\": %llu,"
+                     " \"tx_bytes\": %llu,"
+                     " \"tx_pkts\": %llu,"
+                     " \"tx_errs\": %llu,"
+                     " \"tx_drop\": %llu }",
+                (i > 0) ?"," :"", iface[i].name,
+                iface[i].rx_bytes, iface[i].rx_pkts, iface[i].rx_errs,
+                iface[i].rx_drop, iface[i].tx_bytes, iface[i].tx_pkts,
+                iface[i].tx_errs, iface[i].tx_drop);
+    }
+    fputs(" } }", out);
+}
+
+static double
+per_op(gint64 start, long n)
+{
+    return (double)(g_get_monotonic_time() - start) * 1000.0 / n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int vms = (argc > 1) ?atoi(argv[1]) :DEFAULT_VMS;
+    int disks = (argc > 2) ?atoi(argv[2]) :DEFAULT_DISKS;
+    int rounds = (argc > 3) ?atoi(argv[3]) :DEFAULT_ROUNDS;
+    VmInfo *infos = NULL;
+    JsonBuf jb;
+    char *ptr = NULL;
+    size_t len = 0;
+    long bytes = 0;
+    double legacy, writer;
+    gint64 start;
+    FILE *out;
+    int i, r;
+
+    if (vms <= 0 || disks < 0 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [VMS] [DISKS] [ROUNDS]\n", argv[0]);
+        return 1;
+    }
+    infos = calloc(vms, sizeof(*infos));
+    if (!infos || jsonbuf_init(&jb, 0) < 0) {
+        fprintf(stderr, "failed to allocate the VMs\n");
+        return 1;
+    }
+    for (i = 0; i < vms; i++) {
+        vm_build(&infos[i], i, disks);
+    }
+
+    /* the same text, byte by byte */
+    for (i = 0; i < vms; i++) {
+        out = open_memstream(&ptr, &len);
+        legacy_print_json(&infos[i], out);
+        fclose(out);
+        jsonbuf_clear(&jb);
+        vminfo_print_json(&infos[i], &jb);
+        if (jb.len != len || memcmp(jb.ptr, ptr, len) != 0) {
+            fprintf(stderr, "vm %i: the texts differ\n%.*s\n%s\n",
+                    i, (int)jb.len, jb.ptr, ptr);
+            return 1;
+        }
+        bytes += len;
+        free(ptr);
+    }
+
+    start = g_get_monotonic_time();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < vms; i++) {
+            out = open_memstream(&ptr, &len);
+            legacy_print_json(&infos[i], out);
+            fclose(out);
+            free(ptr);
+        }
+    }
+    legacy = per_op(start, (long)rounds * vms);
+
+    start = g_get_monotonic_time();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < vms; i++) {
+            jsonbuf_clear(&jb);
+            vminfo_print_json(&infos[i], &jb);
+        }
+    }
+    writer = per_op(start, (long)rounds * vms);
+
+    printf("print: vms=%i disks=%i bytes=%li\n", vms, disks, bytes / vms);
+    printf("print: fprintf vm=%.0fns byte=%.2fns\n",
+           legacy, legacy * vms / bytes);
+    printf("print: jsonbuf vm=%.0fns byte=%.2fns\n",
+           writer, writer * vms / bytes);
+
+    for (i = 0; i < vms; i++) {
+        vminfo_free(&infos[i]);
+    }
+    free(infos);
+    jsonbuf_free(&jb);
+    return 0;
+}
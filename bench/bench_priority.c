@@ -0,0 +1,210 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/*
+ * latency benchmark: a stream of probe tasks competes with a
+ * large polling-like fan-out, once as high priority and once as
+ * low priority, the same class of the fan-out, which is the plain
+ * FIFO behaviour. Reports the queueing delay of the probes.
+ *
+ * usage: bench_priority [WORKERS] [FANOUT] [PROBES] [WORK_USEC]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmonlib.h"
+#include "executor.h"
+#include "scheduler.h"
+
+
+enum {
+    DEFAULT_WORKERS = 4,
+    DEFAULT_FANOUT = 20000, /* low priority tasks */
+    DEFAULT_PROBES = 200,
+    DEFAULT_WORK_USEC = 50,
+    PROBE_INTERVAL_USEC = 1000,
+    QUEUE_SIZE = 1000,
+    OVERFLOW_MEM = 64 * 1024 * 1024 /* bytes */
+};
+
+typedef struct BenchConf BenchConf;
+struct BenchConf {
+    Executor *exc;
+    int work_usec;
+    gint64 *latencies; /* microseconds, one per probe */
+    int pending;
+};
+
+typedef struct BenchTask BenchTask;
+struct BenchTask {
+    BenchConf *bc;
+    gint64 queued; /* monotonic microseconds */
+    int probe; /* index in latencies, or -1 */
+};
+
+static gint
+BenchWork(gpointer data)
+{
+    BenchTask *bt = data;
+    gint64 now = g_get_monotonic_time();
+
+    if (bt->probe >= 0) {
+        bt->bc->latencies[bt->probe] = now - bt->queued;
+    }
+    /* busy, like a libvirt call would keep us */
+    while (g_get_monotonic_time() - now < bt->bc->work_usec) {
+        /* spin */
+    }
+    return 0;
+}
+
+static gint
+BenchCollect(gpointer data, gint error, gboolean timeout)
+{
+    BenchTask *bt = data;
+    UNUSED(timeout);
+    __atomic_sub_fetch(&bt->bc->pending, 1, __ATOMIC_RELEASE);
+    return error;
+}
+
+static int
+cmp_gint64(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a;
+    gint64 y = *(const gint64 *)b;
+    return (x > y) - (x < y);
+}
+
+static gint64
+percentile(const gint64 *sorted, int n, int pct)
+{
+    int idx = (n * pct) / 100;
+    return sorted[MIN(idx, n - 1)];
+}
+
+static int
+run(Scheduler *sched, int workers, int fanout, int probes,
+    int work_usec, int probe_priority)
+{
+    TaskRequest *tasks = calloc(fanout, sizeof(TaskRequest));
+    BenchTask *bts = calloc(fanout, sizeof(BenchTask));
+    BenchConf bc;
+    int i, queued;
+
+    memset(&bc, 0, sizeof(bc));
+    bc.work_usec = work_usec;
+    bc.latencies = calloc(probes, sizeof(gint64));
+    bc.pending = fanout + probes;
+
+    if (!tasks || !bts || !bc.latencies ||
+        executor_init(&bc.exc, sched, workers, QUEUE_SIZE) < 0 ||
+        executor_set_overflow(bc.exc, EXECUTOR_OVERFLOW_GROW,
+                              0, OVERFLOW_MEM) < 0 ||
+        executor_start(bc.exc) < 0) {
+        fprintf(stderr, "failed to set up the executor\n");
+        return -1;
+    }
+
+    /* the whole fan-out lands at once, as a polling cycle does */
+    for (i = 0; i < fanout; i++) {
+        bts[i].bc = &bc;
+        bts[i].queued = g_get_monotonic_time();
+        bts[i].probe = -1;
+        tasks[i].work = BenchWork;
+        tasks[i].collect = BenchCollect;
+        tasks[i].data = &bts[i];
+        tasks[i].size = sizeof(bts[i]);
+        tasks[i].priority = EXECUTOR_PRIORITY_LOW;
+    }
+    queued = executor_dispatch_batch(bc.exc, tasks, fanout);
+    if (queued != fanout) {
+        fprintf(stderr, "queued only %i/%i tasks\n", queued, fanout);
+        return -1;
+    }
+
+    for (i = 0; i < probes; i++) {
+        BenchTask bt = { &bc, g_get_monotonic_time(), i };
+        if (executor_dispatch(bc.exc, BenchWork, BenchCollect,
+                              &bt, sizeof(bt), 0, probe_priority) < 0) {
+            fprintf(stderr, "failed to dispatch probe %i\n", i);
+            return -1;
+        }
+        usleep(PROBE_INTERVAL_USEC);
+    }
+
+    while (__atomic_load_n(&bc.pending, __ATOMIC_ACQUIRE) > 0) {
+        usleep(PROBE_INTERVAL_USEC);
+    }
+    executor_stop(bc.exc, TRUE);
+
+    qsort(bc.latencies, probes, sizeof(gint64), cmp_gint64);
+    printf("priority: probes=%s workers=%i fanout=%i probes=%i"
+           " p50=%" G_GINT64_FORMAT "us p99=%" G_GINT64_FORMAT "us"
+           " max=%" G_GINT64_FORMAT "us\n",
+           (probe_priority == EXECUTOR_PRIORITY_HIGH) ?"high" :"low",
+           workers, fanout, probes,
+           percentile(bc.latencies, probes, 50),
+           percentile(bc.latencies, probes, 99),
+           bc.latencies[probes - 1]);
+
+    executor_free(bc.exc);
+    free(bc.latencies);
+    free(bts);
+    free(tasks);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int workers = (argc > 1) ?atoi(argv[1]) :DEFAULT_WORKERS;
+    int fanout = (argc > 2) ?atoi(argv[2]) :DEFAULT_FANOUT;
+    int probes = (argc > 3) ?atoi(argv[3]) :DEFAULT_PROBES;
+    int work_usec = (argc > 4) ?atoi(argv[4]) :DEFAULT_WORK_USEC;
+    Scheduler *sched = NULL;
+
+    if (workers <= 0 || fanout <= 0 || probes <= 0 || work_usec < 0) {
+        fprintf(stderr, "usage: %s [WORKERS] [FANOUT] [PROBES] [WORK_USEC]\n",
+                argv[0]);
+        return 1;
+    }
+
+    if (scheduler_init(&sched, TRUE) < 0 || scheduler_start(sched) < 0) {
+        fprintf(stderr, "failed to set up the scheduler\n");
+        return 1;
+    }
+
+    if (run(sched, workers, fanout, probes, work_usec,
+            EXECUTOR_PRIORITY_LOW) < 0 ||
+        run(sched, workers, fanout, probes, work_usec,
+            EXECUTOR_PRIORITY_HIGH) < 0) {
+        return 1;
+    }
+
+    scheduler_stop(sched, TRUE);
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * contention benchmark: N producers and M consumers hammering
+ * one ring with TaskData-sized items, like the executor does.
+ *
+ * usage: bench_ringbuffer [PRODUCERS] [CONSUMERS] [ITEMS] [SIZE]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "ringbuffer.h"
+
+
+enum {
+    ITEM_SIZE = 128,
+    DEFAULT_THREADS = 4,
+    DEFAULT_ITEMS = 1000000,
+    DEFAULT_RING_SIZE = 1000
+};
+
+typedef struct BenchItem BenchItem;
+struct BenchItem {
+    long value;
+    uint8_t pad[ITEM_SIZE - sizeof(long)];
+};
+
+typedef struct BenchConf BenchConf;
+struct BenchConf {
+    RingBuffer *rb;
+    long items;
+    long full_retries;
+};
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+produce(void *data)
+{
+    BenchConf *bc = data;
+    BenchItem item;
+    long i;
+
+    memset(&item, 0, sizeof(item));
+    for (i = 0; i < bc->items; i++) {
+        item.value = i;
+        while (ringbuffer_put(bc->rb, &item) < 0) {
+            __atomic_add_fetch(&bc->full_retries, 1, __ATOMIC_RELAXED);
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *
+consume(void *data)
+{
+    BenchConf *bc = data;
+    BenchItem item;
+
+    for (;;) {
+        ringbuffer_get(bc->rb, &item);
+        if (item.value < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int producers = (argc > 1) ?atoi(argv[1]) :DEFAULT_THREADS;
+    int consumers = (argc > 2) ?atoi(argv[2]) :DEFAULT_THREADS;
+    long items = (argc > 3) ?atol(argv[3]) :DEFAULT_ITEMS;
+    int size = (argc > 4) ?atoi(argv[4]) :DEFAULT_RING_SIZE;
+    pthread_t *threads = NULL;
+    BenchConf bc;
+    BenchItem stop;
+    double begin, elapsed;
+    int i;
+
+    if (producers <= 0 || consumers <= 0 || items <= 0 || size <= 0) {
+        fprintf(stderr, "usage: %s [PRODUCERS] [CONSUMERS] [ITEMS] [SIZE]\n",
+                argv[0]);
+        return 1;
+    }
+
+    memset(&bc, 0, sizeof(bc));
+    bc.items = items / producers;
+    if (ringbuffer_init(&bc.rb, size, sizeof(BenchItem)) < 0) {
+        fprintf(stderr, "failed to create the ring\n");
+        return 1;
+    }
+
+    threads = calloc(producers + consumers, sizeof(pthread_t));
+
+    begin = now_sec();
+    for (i = 0; i < consumers; i++) {
+        pthread_create(&threads[i], NULL, consume, &bc);
+    }
+    for (i = 0; i < producers; i++) {
+        pthread_create(&threads[consumers + i], NULL, produce, &bc);
+    }
+    for (i = 0; i < producers; i++) {
+        pthread_join(threads[consumers + i], NULL);
+    }
+
+    memset(&stop, 0, sizeof(stop));
+    stop.value = -1;
+    for (i = 0; i < consumers; i++) {
+        while (ringbuffer_put(bc.rb, &stop) < 0) {
+            sched_yield();
+        }
+    }
+    for (i = 0; i < consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = now_sec() - begin;
+
+    printf("ringbuffer: producers=%i consumers=%i items=%li ring=%i"
+           " elapsed=%.3fs rate=%.0f ops/s full_retries=%li\n",
+           producers, consumers, bc.items * producers, size,
+           elapsed, (bc.items * producers) / elapsed, bc.full_retries);
+
+    free(threads);
+    ringbuffer_free(bc.rb);
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/*
+ * timeout bookkeeping benchmark: arms and cancels the per-task
+ * timeouts the way the executor does, against the GSource scheduler
+ * and against the timing wheel. The timeouts never expire.
+ * Reports the cost per operation, first with N timeouts pending at
+ * once, then arming and cancelling each one right away.
+ *
+ * usage: bench_scheduler [TIMERS]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vmonlib.h"
+#include "scheduler.h"
+
+
+enum {
+    DEFAULT_TIMERS = 100000,
+    BENCH_TIMEOUT = 60 * 1000, /* milliseconds */
+    SETTLE_USEC = 100 * 1000
+};
+
+static gboolean
+BenchTimeout(gpointer data)
+{
+    UNUSED(data);
+    return FALSE;
+}
+
+static double
+per_op(gint64 start, int n)
+{
+    return (double)(g_get_monotonic_time() - start) * 1000.0 / n;
+}
+
+static int
+run(const char *name, Scheduler *sched, int timers)
+{
+    guint *ids = calloc(timers, sizeof(guint));
+    double arm, del, pair;
+    gint64 start;
+    int i;
+
+    if (!ids || scheduler_start(sched) < 0) {
+        fprintf(stderr, "failed to set up the %s scheduler\n", name);
+        return -1;
+    }
+    usleep(SETTLE_USEC); /* let the scheduler thread come up */
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < timers; i++) {
+        ids[i] = scheduler_add(sched, BENCH_TIMEOUT, BenchTimeout, NULL);
+    }
+    arm = per_op(start, timers);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < timers; i++) {
+        scheduler_del(sched, ids[i]);
+    }
+    del = per_op(start, timers);
+
+    /* what a short task does */
+    start = g_get_monotonic_time();
+    for (i = 0; i < timers; i++) {
+        scheduler_del(sched, scheduler_add(sched, BENCH_TIMEOUT,
+                                           BenchTimeout, NULL));
+    }
+    pair = per_op(start, timers);
+
+    printf("scheduler: %s timers=%i add=%.1fns del=%.1fns add+del=%.1fns\n",
+           name, timers, arm, del, pair);
+
+    scheduler_stop(sched, TRUE);
+    scheduler_free(sched);
+    free(ids);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int timers = (argc > 1) ?atoi(argv[1]) :DEFAULT_TIMERS;
+    Scheduler *sched = NULL;
+
+    if (timers <= 0) {
+        fprintf(stderr, "usage: %s [TIMERS]\n", argv[0]);
+        return 1;
+    }
+
+    if (scheduler_init(&sched, TRUE) < 0 ||
+        run("gsource", sched, timers) < 0) {
+        return 1;
+    }
+    if (scheduler_init_wheel(&sched) < 0 ||
+        run("wheel", sched, timers) < 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+
+enum {
+    ARENA_MIN_SIZE = 4096
+};
+
+typedef union ArenaChunk ArenaChunk;
+union ArenaChunk {
+    struct {
+        ArenaChunk *next; /* the older ones */
+        size_t size;
+        size_t used;
+    } h;
+    long double align; /* keep the blocks aligned as malloc() does */
+};
+
+struct Arena {
+    ArenaChunk *chunk; /* the current one */
+    void *last; /* the most recent block */
+    size_t used; /* in the chunks before the current one */
+    ArenaStats stats;
+};
+
+
+static size_t
+align_size(size_t size)
+{
+    const size_t align = sizeof(ArenaChunk);
+    return (size + align - 1) / align * align;
+}
+
+static ArenaChunk *
+chunk_new(size_t size)
+{
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    if (chunk) {
+        chunk->h.next = NULL;
+        chunk->h.size = size;
+        chunk->h.used = 0;
+    }
+    return chunk;
+}
+
+int
+arena_init(Arena **arena, size_t size)
+{
+    Arena *ar = calloc(1, sizeof(Arena));
+
+    if (!ar) {
+        return -1;
+    }
+    size = align_size((size < ARENA_MIN_SIZE) ?ARENA_MIN_SIZE :size);
+    ar->chunk = chunk_new(size);
+    if (!ar->chunk) {
+        free(ar);
+        return -1;
+    }
+    ar->stats.size = size;
+    *arena = ar;
+    return 0;
+}
+
+static void
+chunks_free(ArenaChunk *chunk)
+{
+    while (chunk) {
+        ArenaChunk *next = chunk->h.next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+void
+arena_free(Arena *arena)
+{
+    if (!arena) {
+        return;
+    }
+    chunks_free(arena->chunk);
+    free(arena);
+}
+
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+    ArenaChunk *chunk = arena->chunk;
+    void *ptr = NULL;
+
+    size = align_size(size);
+    if (size > chunk->h.size - chunk->h.used) {
+        size_t grow = chunk->h.size * 2;
+        chunk = chunk_new((grow > size) ?grow :size);
+        if (!chunk) {
+            return NULL;
+        }
+        arena->used += arena->chunk->h.used;
+        chunk->h.next = arena->chunk;
+        arena->chunk = chunk;
+        arena->stats.size += chunk->h.size;
+        arena->stats.spills++;
+    }
+
+    ptr = (uint8_t *)(chunk + 1) + chunk->h.used;
+    chunk->h.used += size;
+    arena->last = ptr;
+    arena->stats.allocs++;
+    if (arena->used + chunk->h.used > arena->stats.peak) {
+        arena->stats.peak = arena->used + chunk->h.used;
+    }
+    return ptr;
+}
+
+void *
+arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t size)
+{
+    ArenaChunk *chunk = arena->chunk;
+    void *blk = NULL;
+
+    if (ptr && ptr == arena->last) {
+        size_t start = (uint8_t *)ptr - (uint8_t *)(chunk + 1);
+        if (align_size(size) <= chunk->h.size - start) {
+            chunk->h.used = start + align_size(size);
+            if (arena->used + chunk->h.used > arena->stats.peak) {
+                arena->stats.peak = arena->used + chunk->h.used;
+            }
+            return ptr;
+        }
+    }
+
+    blk = arena_alloc(arena, size);
+    if (blk && ptr) {
+        memcpy(blk, ptr, (old_size < size) ?old_size :size);
+    }
+    return blk;
+}
+
+char *
+arena_strdup(Arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *dup = arena_alloc(arena, len);
+    if (dup) {
+        memcpy(dup, str, len);
+    }
+    return dup;
+}
+
+void
+arena_reset(Arena *arena)
+{
+    ArenaChunk *chunk = arena->chunk;
+
+    if (chunk->h.next) {
+        /* spilled: make room for all of it next time, if we can */
+        ArenaChunk *merged = chunk_new(arena->stats.size);
+        if (merged) {
+            chunks_free(chunk);
+            arena->chunk = merged;
+        } else {
+            chunks_free(chunk->h.next);
+            chunk->h.next = NULL;
+            arena->stats.size = chunk->h.size;
+        }
+    }
+
+    arena->chunk->h.used = 0;
+    arena->used = 0;
+    arena->last = NULL;
+    arena->stats.resets++;
+}
+
+void
+arena_get_stats(Arena *arena, ArenaStats *stats)
+{
+    *stats = arena->stats;
+}
+
@@ -0,0 +1,72 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+
+/*
+ * bump allocator: blocks are carved in order out of one chunk, and
+ * all released at once by arena_reset. When the chunk runs out, the
+ * arena spills into extra chunks, merged into a bigger one at the next
+ * reset; so once it has seen its largest load, it does not malloc()
+ * anymore. Not thread safe: meant to be owned by one thread.
+ */
+typedef struct Arena Arena;
+
+typedef struct ArenaStats ArenaStats;
+struct ArenaStats {
+    unsigned long allocs;
+    unsigned long spills; /* chunks added, the first excluded */
+    unsigned long resets;
+    size_t size; /* bytes reserved */
+    size_t peak; /* bytes used between two resets, at most */
+};
+
+/* size: bytes of the first chunk */
+int
+arena_init(Arena **arena, size_t size);
+
+void
+arena_free(Arena *arena);
+
+void *
+arena_alloc(Arena *arena, size_t size);
+
+/*
+ * old_size: the size `ptr' was allocated with.
+ * The most recent block grows in place, if there is room.
+ */
+void *
+arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t size);
+
+char *
+arena_strdup(Arena *arena, const char *str);
+
+/* every block becomes invalid */
+void
+arena_reset(Arena *arena);
+
+void
+arena_get_stats(Arena *arena, ArenaStats *stats);
+
+#endif /* ARENA_H */
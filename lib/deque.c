@@ -0,0 +1,160 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "deque.h"
+
+
+#ifndef MIN
+#define MIN(A, B) (((A) < (B)) ?(A) :(B))
+#endif
+
+
+/*
+ * the lock is almost always uncontended: only the owner touches
+ * the bottom, thieves show up only when they ran out of work.
+ */
+struct Deque {
+    pthread_mutex_t lock;
+    int size;
+    int used;
+    int top; /* oldest item, thieves take from here */
+    size_t elem_size;
+    uint8_t *elems;
+};
+
+int
+deque_init(Deque **dq, int size, size_t elem_size)
+{
+    Deque *d = NULL;
+
+    if (size <= 0) {
+        return -1;
+    }
+    d = calloc(1, sizeof(Deque) + (size * elem_size));
+    if (d) {
+        pthread_mutex_init(&d->lock, 0);
+        d->size = size;
+        d->elem_size = elem_size;
+        d->elems = (uint8_t *)(d + 1);
+        *dq = d;
+        return 0;
+    }
+    return -1;
+}
+
+void
+deque_free(Deque *dq)
+{
+    if (dq) {
+        pthread_mutex_destroy(&dq->lock);
+    }
+    free(dq);
+}
+
+static void *
+dq_item_at(Deque *dq, int pos)
+{
+    return dq->elems + ((pos % dq->size) * dq->elem_size);
+}
+
+/* lockless peek, good enough to skip empty victims */
+int
+deque_empty(Deque *dq)
+{
+    return __atomic_load_n(&dq->used, __ATOMIC_RELAXED) == 0;
+}
+
+int
+deque_push(Deque *dq, const void *elem)
+{
+    int ret = -1;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->used < dq->size) {
+        memcpy(dq_item_at(dq, dq->top + dq->used), elem, dq->elem_size);
+        __atomic_store_n(&dq->used, dq->used + 1, __ATOMIC_RELAXED);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ret;
+}
+
+int
+deque_push_many(Deque *dq, const void *elems, int n)
+{
+    int j, count;
+    pthread_mutex_lock(&dq->lock);
+    count = MIN(n, dq->size - dq->used);
+    for (j = 0; j < count; j++) {
+        memcpy(dq_item_at(dq, dq->top + dq->used + j),
+               (const uint8_t *)elems + (j * dq->elem_size),
+               dq->elem_size);
+    }
+    __atomic_store_n(&dq->used, dq->used + count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&dq->lock);
+    return count;
+}
+
+int
+deque_room(Deque *dq)
+{
+    return dq->size - __atomic_load_n(&dq->used, __ATOMIC_RELAXED);
+}
+
+int
+deque_pop(Deque *dq, void *elem)
+{
+    int ret = -1;
+    if (deque_empty(dq)) {
+        return ret;
+    }
+    pthread_mutex_lock(&dq->lock);
+    if (dq->used > 0) {
+        __atomic_store_n(&dq->used, dq->used - 1, __ATOMIC_RELAXED);
+        memcpy(elem, dq_item_at(dq, dq->top + dq->used), dq->elem_size);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ret;
+}
+
+int
+deque_steal(Deque *dq, void *elem)
+{
+    int ret = -1;
+    if (deque_empty(dq)) {
+        return ret;
+    }
+    pthread_mutex_lock(&dq->lock);
+    if (dq->used > 0) {
+        memcpy(elem, dq_item_at(dq, dq->top), dq->elem_size);
+        dq->top = (dq->top + 1) % dq->size;
+        __atomic_store_n(&dq->used, dq->used - 1, __ATOMIC_RELAXED);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ret;
+}
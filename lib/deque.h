@@ -0,0 +1,60 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stdlib.h>
+
+/*
+ * bounded double ended queue, meant to be owned by one worker:
+ * the owner pushes and pops at the bottom, other workers steal
+ * from the top.
+ */
+typedef struct Deque Deque;
+
+int
+deque_init(Deque **dq, int size, size_t elem_size);
+
+void
+deque_free(Deque *dq);
+
+int
+deque_empty(Deque *dq);
+
+int
+deque_push(Deque *dq, const void *elem);
+
+/* returns how many of the n contiguous elements were pushed */
+int
+deque_push_many(Deque *dq, const void *elems, int n);
+
+/* free slots; stable for the owner, since thieves only make room */
+int
+deque_room(Deque *dq);
+
+int
+deque_pop(Deque *dq, void *elem);
+
+int
+deque_steal(Deque *dq, void *elem);
+
+#endif /* DEQUE_H */
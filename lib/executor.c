@@ -26,38 +26,155 @@
 #include <pthread.h>
 
 #include "vmonlib.h"
+#include "deque.h"
 #include "ringbuffer.h"
 #include "scheduler.h"
+#include "slab.h"
+#include "threading.h"
 #include "executor.h"
 
 
+enum {
+    WORKER_BATCH_SIZE = 8, /* tasks taken from the shared queue per wakeup */
+    DISPATCH_BATCH_SIZE = 32, /* tasks queued per synchronization */
+    OVERFLOW_SEGMENT_SIZE = 64, /* tasks */
+    PRIORITY_STARVATION_LIMIT = 16, /* tasks served before a lower class gets a turn */
+    CACHELINE_SIZE = 64,
+    KEYSET_SIZE = 64 /* initial slots, keep this a power of 2 */
+};
+
+/*
+ * keys, or handles, of the tasks in flight: open addressing, linear
+ * probing. Touched once per dispatch and once per completion, so a
+ * plain lock, separate from the executor one, is fine here.
+ */
+typedef struct KeySlot KeySlot;
+struct KeySlot {
+    guint64 key; /* 0 is a free slot */
+    unsigned int tasks; /* holding a handle */
+    gboolean cancelled;
+};
+
+typedef struct KeySet KeySet;
+struct KeySet {
+    KeySlot *slots;
+    size_t size;
+    size_t used;
+    pthread_mutex_t lock;
+};
+
+/* elastic pool tuning */
+enum {
+    POOL_CONTROL_PERIOD = 250, /* milliseconds */
+    POOL_GROW_WAIT = 1000, /* microseconds of queue wait always worth a worker */
+    POOL_SHRINK_LOAD = 25, /* percent busy, below which the pool is oversized */
+    POOL_SHRINK_TICKS = 8, /* ... for this many periods in a row */
+    POOL_EWMA_SHIFT = 2 /* weight of the new sample: 1/4 */
+};
+
+
+/*
+ * unbounded FIFO of fixed-size segments, used when the shared
+ * queue is full and the policy is EXECUTOR_OVERFLOW_GROW.
+ * Cold path by design: a plain lock is fine here.
+ */
+typedef struct OverflowSegment OverflowSegment;
+struct OverflowSegment {
+    OverflowSegment *next;
+    int head;
+    int tail;
+    TaskData tasks[OVERFLOW_SEGMENT_SIZE];
+};
+
+typedef struct Overflow Overflow;
+struct Overflow {
+    pthread_mutex_t lock;
+    OverflowSegment *first;
+    OverflowSegment *last;
+    OverflowSegment *spare; /* avoids malloc churn at the boundary */
+    int used; /* tasks; peeked without the lock */
+};
+
+/* everything queued for one priority class, but the worker deques */
+typedef struct TaskQueue TaskQueue;
+struct TaskQueue {
+    RingBuffer *tasks;
+    Overflow overflow;
+};
+
+
 typedef struct Worker Worker;
 
 typedef unsigned long WorkerID;
 
+/* load figures of one slot, across all the workers serving it */
+typedef struct SlotLoad SlotLoad;
+struct SlotLoad {
+    unsigned long tasks __attribute__((aligned(CACHELINE_SIZE)));
+    unsigned long wait; /* microseconds, from dispatch to start */
+    unsigned long service; /* microseconds, from start to completion */
+};
+
+/* state of the pool size controller, under the executor lock */
+typedef struct PoolControl PoolControl;
+struct PoolControl {
+    guint source; /* scheduler id */
+    SlotLoad last; /* totals at the previous period */
+    gint64 wait; /* moving averages, microseconds */
+    gint64 service;
+    int idle_ticks;
+};
+
 struct Executor {
-    Worker *workers;
-    WorkerID workers_count;
-    RingBuffer *tasks;
-    Scheduler *scheduler;
+    Worker **workers; /* one per slot, NULL if vacant; quarantined workers are not here */
+    WorkerID workers_count; /* slots, the maximum pool size */
+    int min_workers;
+    int active; /* occupied slots */
+    Worker *exited; /* Worker objects ready for reuse */
+    SlotLoad *loads; /* one per slot */
+    PoolControl control;
+    int spares; /* budget of extra threads replacing the hung ones */
+    int quarantined; /* hung workers not yet returned */
+    Deque **locals; /* one per worker slot and class, fixed after init */
+    TaskQueue queues[EXECUTOR_PRIORITY_NUM];
+    EventCount idle; /* workers with nothing to do sleep here */
+    EventCount room; /* blocked producers sleep here */
+    int overflow_policy;
+    int overflow_wait; /* milliseconds */
+    unsigned long overflow_max_segments; /* across all the classes */
+    ExecutorStats stats;
+    Slab *slab; /* payloads too big to be embedded */
+    KeySet keys;
+    KeySet handles; /* with the count of their tasks, and if cancelled */
+    int queue_size; /* tasks, of each shared queue */
+    Scheduler *scheduler; /* of the pool control */
+    Scheduler *timers; /* of the task timeouts */
     int running;
     pthread_mutex_t lock;
-    size_t max_data;
 };
 
-static int
-executor_replace(Executor *exc, WorkerID worker_id);
+static void
+executor_quarantine(Executor *exc, Worker *wo);
 
 
 struct Worker {
-    WorkerID id;
+    WorkerID id; /* the slot served */
     Executor *executor;
     Scheduler *scheduler;
     pthread_t thread;
     guint sched_id;
-    TaskData *current;
+    gint64 deadline; /* of the current task, monotonic microseconds */
+    TaskData *current; /* under the executor lock */
+    gboolean quarantined; /* set only while current is set */
+    gboolean retired; /* drain the own deques, then exit */
+    Deque **local; /* tasks dispatched by this worker, one per class */
+    int served; /* tasks taken since a lower class had its turn */
+    Worker *next; /* in the exited list */
 };
 
+/* the worker running on this thread, if any */
+static __thread Worker *this_worker = NULL;
+
 static gint
 StopWorker(gpointer data)
 {
@@ -78,223 +195,1513 @@ static gboolean
 worker_discard(gpointer w)
 {
     Worker *wo = w;
-    g_message("issuing discard for worker: %lu", wo->id);
-    if (wo->current) { /* paranoia */
+    Executor *exc = wo->executor;
+
+    pthread_mutex_lock(&exc->lock);
+    /* the timer may have raced with the task completion */
+    if (wo->current && !wo->quarantined &&
+        g_get_monotonic_time() >= wo->deadline) {
+        g_message("issuing discard for worker: %lu", wo->id);
         wo->current->td.discarded = 1;
+        executor_quarantine(exc, wo);
     }
-    executor_replace(wo->executor, wo->id);
+    pthread_mutex_unlock(&exc->lock);
     return FALSE;
 }
 
 
+#define STATS_ADD(EXC, FIELD, VALUE) \
+    __atomic_add_fetch(&(EXC)->stats.FIELD, (VALUE), __ATOMIC_RELAXED)
+
+#define STATS_SUB(EXC, FIELD, VALUE) \
+    __atomic_sub_fetch(&(EXC)->stats.FIELD, (VALUE), __ATOMIC_RELAXED)
+
+
 static int
-worker_execute(Worker *wo)
+keyset_init(KeySet *ks)
 {
-    TaskData task;
-    int err = 0;
+    ks->slots = calloc(KEYSET_SIZE, sizeof(KeySlot));
+    ks->size = KEYSET_SIZE;
+    ks->used = 0;
+    pthread_mutex_init(&ks->lock, 0);
+    return (ks->slots) ?0 :-1;
+}
 
-    memset(&task, 0, sizeof(task));
+static void
+keyset_free(KeySet *ks)
+{
+    pthread_mutex_destroy(&ks->lock);
+    free(ks->slots);
+}
+
+static inline size_t
+keyset_slot(const KeySet *ks, guint64 key)
+{
+    return ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (ks->size - 1);
+}
+
+/* returns the slot holding key, or the free one where it belongs */
+static size_t
+keyset_find(const KeySet *ks, guint64 key)
+{
+    size_t j = keyset_slot(ks, key);
+    while (ks->slots[j].key && ks->slots[j].key != key) {
+        j = (j + 1) & (ks->size - 1);
+    }
+    return j;
+}
 
-    err = ringbuffer_get(wo->executor->tasks, &task);
-    if (!err) {
-        void *data = (task.ud.xdata) ?task.ud.xdata :task.data;
-        int timeout = task.td.timeout;
+/* keeps the load below one half */
+static int
+keyset_grow(KeySet *ks)
+{
+    KeySlot *old = ks->slots;
+    size_t size = ks->size;
+    size_t j;
 
-        if (task.td.timeout) {
-            wo->sched_id = scheduler_add(wo->scheduler,
-                                         timeout,
-                                         worker_discard,
-                                         wo);
-            g_message("timeout for worker: %lu = %ims (sched_id=%u)",
-                      wo->id, timeout, wo->sched_id);
+    ks->slots = calloc(size * 2, sizeof(KeySlot));
+    if (!ks->slots) {
+        ks->slots = old;
+        return -1;
+    }
+    ks->size = size * 2;
+    for (j = 0; j < size; j++) {
+        if (old[j].key) {
+            ks->slots[keyset_find(ks, old[j].key)] = old[j];
         }
-        /* FIXME: scheduler_add failed */
+    }
+    free(old);
+    return 0;
+}
+
+/*
+ * returns the slot of key, added if missing, or NULL if the set
+ * cannot grow. Must be called with the set lock held.
+ */
+static KeySlot *
+keyset_insert(KeySet *ks, guint64 key)
+{
+    size_t j;
 
-        wo->current = &task;
-        err = task.td.work(data);
-        wo->current = NULL;
+    if ((ks->used + 1) * 2 > ks->size && keyset_grow(ks) < 0) {
+        g_warning("could not grow the task key set: %lu keys",
+                  (unsigned long)ks->used);
+        return NULL;
+    }
+    j = keyset_find(ks, key);
+    if (!ks->slots[j].key) {
+        ks->slots[j].key = key;
+        ks->slots[j].tasks = 0;
+        ks->slots[j].cancelled = FALSE;
+        ks->used++;
+    }
+    return &ks->slots[j];
+}
 
-        g_message("worker done: timeout=%i discarded=%i",
-                  timeout, task.td.discarded);
+/*
+ * backward shift deletion: no tombstones.
+ * Must be called with the set lock held.
+ */
+static void
+keyset_remove(KeySet *ks, size_t j)
+{
+    size_t mask = ks->size - 1;
+    size_t k;
 
-        if (timeout && !task.td.discarded) {
-            g_message("deleting timeout for worker: %lu (sched_id=%u)",
-                      wo->id, wo->sched_id);
-            scheduler_del(wo->scheduler, wo->sched_id);
+    ks->slots[j].key = 0;
+    ks->used--;
+    for (k = (j + 1) & mask; ks->slots[k].key; k = (k + 1) & mask) {
+        size_t home = keyset_slot(ks, ks->slots[k].key);
+        /* move back unless home lies cyclically in (j, k] */
+        if (((k - home) & mask) >= ((k - j) & mask)) {
+            ks->slots[j] = ks->slots[k];
+            ks->slots[k].key = 0;
+            j = k;
         }
-        err = task.td.collect(data, err, task.td.discarded);
     }
+}
 
-    g_message("worker executed err=%i", err);
-    return err;
+/* returns FALSE if the key is already in flight */
+static gboolean
+keyset_acquire(KeySet *ks, TaskKey key)
+{
+    gboolean acquired = FALSE;
+    KeySlot *slot;
+
+    pthread_mutex_lock(&ks->lock);
+    if (!ks->slots[keyset_find(ks, key)].key) {
+        slot = keyset_insert(ks, key);
+        acquired = (slot != NULL);
+    }
+    pthread_mutex_unlock(&ks->lock);
+    return acquired;
 }
 
-static void *
-worker_run(void *w)
+static void
+keyset_release(KeySet *ks, TaskKey key)
 {
-    Worker *wo = w;
-    gint err = 0;
+    size_t j;
 
-    g_message("worker %lu started", wo->id);
+    pthread_mutex_lock(&ks->lock);
+    j = keyset_find(ks, key);
+    if (ks->slots[j].key) {
+        keyset_remove(ks, j);
+    }
+    pthread_mutex_unlock(&ks->lock);
+}
 
-    while (!err) {
-        err = worker_execute(wo);
+/* one more task holds the handle */
+static int
+keyset_ref(KeySet *ks, TaskHandle handle)
+{
+    KeySlot *slot;
+
+    pthread_mutex_lock(&ks->lock);
+    slot = keyset_insert(ks, handle);
+    if (slot) {
+        slot->tasks++;
     }
+    pthread_mutex_unlock(&ks->lock);
+    return (slot) ?0 :-1;
+}
 
-    g_message("worker %lu done", wo->id);
-    return NULL;
+/* the handle, and its cancellation, retire with its last task */
+static void
+keyset_unref(KeySet *ks, TaskHandle handle)
+{
+    size_t j;
+
+    pthread_mutex_lock(&ks->lock);
+    j = keyset_find(ks, handle);
+    if (ks->slots[j].key && --ks->slots[j].tasks == 0) {
+        keyset_remove(ks, j);
+    }
+    pthread_mutex_unlock(&ks->lock);
+}
+
+/* returns FALSE if no task holds the handle */
+static gboolean
+keyset_cancel(KeySet *ks, TaskHandle handle)
+{
+    gboolean found = FALSE;
+    size_t j;
+
+    pthread_mutex_lock(&ks->lock);
+    j = keyset_find(ks, handle);
+    if (ks->slots[j].key) {
+        ks->slots[j].cancelled = TRUE;
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&ks->lock);
+    return found;
+}
+
+static gboolean
+keyset_cancelled(KeySet *ks, TaskHandle handle)
+{
+    gboolean cancelled = FALSE;
+    size_t j;
+
+    pthread_mutex_lock(&ks->lock);
+    j = keyset_find(ks, handle);
+    cancelled = (ks->slots[j].key && ks->slots[j].cancelled);
+    pthread_mutex_unlock(&ks->lock);
+    return cancelled;
+}
+
+static void
+overflow_init(Overflow *ov)
+{
+    memset(ov, 0, sizeof(*ov));
+    pthread_mutex_init(&ov->lock, 0);
+}
+
+static void
+overflow_free(Overflow *ov)
+{
+    OverflowSegment *seg = ov->first;
+    while (seg) {
+        OverflowSegment *next = seg->next;
+        free(seg);
+        seg = next;
+    }
+    free(ov->spare);
+    pthread_mutex_destroy(&ov->lock);
 }
 
 static int
-worker_init(Worker *wo, int id, Executor *exec, Scheduler *sched)
+overflow_empty(Overflow *ov)
 {
-    memset(wo, 0, sizeof(*wo) + exec->max_data);
-    wo->id = id;
-    wo->executor = exec;
-    wo->scheduler = sched;
-    return pthread_create(&wo->thread, 0, worker_run, wo);
+    return __atomic_load_n(&ov->used, __ATOMIC_RELAXED) == 0;
 }
 
 static int
-worker_join(Worker *wo, int wait)
+overflow_reserve(Executor *exc)
 {
-    if (wait && wo->current) {
+    unsigned long segs = STATS_ADD(exc, segments, 1);
+    unsigned long peak = __atomic_load_n(&exc->stats.segments_peak,
+                                         __ATOMIC_RELAXED);
+
+    if (segs > exc->overflow_max_segments) {
+        STATS_SUB(exc, segments, 1);
         return -1;
     }
-    return pthread_join(wo->thread, NULL);
+    while (segs > peak &&
+           !__atomic_compare_exchange_n(&exc->stats.segments_peak,
+                                        &peak, segs, FALSE,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* peak reloaded by the CAS */
+    }
+    return 0;
 }
 
-int
-executor_init(Executor **exc, Scheduler *sched,
-              int workers_count, int max_tasks)
+static int
+overflow_push(Executor *exc, Overflow *ov, const TaskData *tasks, int n)
 {
-    int err = -1;
-    Executor *ex = calloc(1, sizeof(*ex));
-    if (ex) {
-        pthread_mutex_init(&ex->lock, 0);
+    int done = 0;
 
-        ex->scheduler = sched;
+    pthread_mutex_lock(&ov->lock);
+    while (done < n) {
+        OverflowSegment *seg = ov->last;
 
-        err = ringbuffer_init(&ex->tasks, max_tasks, sizeof(TaskData));
+        if (!seg || seg->tail == OVERFLOW_SEGMENT_SIZE) {
+            if (overflow_reserve(exc) < 0) {
+                break;
+            }
+            if (ov->spare) {
+                seg = ov->spare;
+                ov->spare = NULL;
+            } else {
+                seg = malloc(sizeof(*seg));
+                if (!seg) {
+                    STATS_SUB(exc, segments, 1);
+                    break;
+                }
+            }
+            seg->next = NULL;
+            seg->head = 0;
+            seg->tail = 0;
+            if (ov->last) {
+                ov->last->next = seg;
+            } else {
+                ov->first = seg;
+            }
+            ov->last = seg;
+        }
 
-        ex->workers_count = workers_count;
+        memcpy(&seg->tasks[seg->tail++], &tasks[done++], sizeof(TaskData));
+    }
+    __atomic_store_n(&ov->used, ov->used + done, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ov->lock);
 
-        ex->workers = calloc(workers_count, sizeof(Worker));
-        *exc = ex;
-        err = 0;
-        g_message("executor started with %i workers", workers_count);
+    STATS_ADD(exc, overflowed, done);
+    return done;
+}
+
+static int
+overflow_pop(Executor *exc, Overflow *ov, TaskData *tasks, int n)
+{
+    int done = 0;
+
+    if (overflow_empty(ov)) {
+        return 0;
     }
-    return err;
+
+    pthread_mutex_lock(&ov->lock);
+    while (done < n && ov->first) {
+        OverflowSegment *seg = ov->first;
+
+        if (seg->head < seg->tail) {
+            memcpy(&tasks[done++], &seg->tasks[seg->head++], sizeof(TaskData));
+        }
+        if (seg->head == seg->tail &&
+            (seg->tail == OVERFLOW_SEGMENT_SIZE || seg != ov->last)) {
+            ov->first = seg->next;
+            if (!ov->first) {
+                ov->last = NULL;
+            }
+            if (ov->spare) {
+                free(seg);
+            } else {
+                ov->spare = seg;
+            }
+            STATS_SUB(exc, segments, 1);
+        } else if (seg->head == seg->tail) {
+            break;
+        }
+    }
+    __atomic_store_n(&ov->used, ov->used - done, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ov->lock);
+    return done;
 }
 
-int
-executor_free(Executor *exc)
+
+static Deque *
+executor_local(Executor *exc, WorkerID id, int prio)
 {
-    UNUSED(exc);
-    return 0; // TODO
+    return exc->locals[id * EXECUTOR_PRIORITY_NUM + prio];
 }
 
-int
-executor_start(Executor *exc)
+static int
+worker_retired(Worker *wo)
 {
-    int err = 0;
-    size_t j;
+    return __atomic_load_n(&wo->retired, __ATOMIC_ACQUIRE);
+}
 
-    if (exc->running) {
-        return EXECUTOR_ERROR_ALREADY_STARTED;
-    }
+static int
+worker_steal(Worker *wo, int prio, TaskData *task)
+{
+    Executor *exc = wo->executor;
+    WorkerID j;
 
-    exc->running = 1;
+    for (j = 1; j < exc->workers_count; j++) {
+        Deque *victim = executor_local(exc, (wo->id + j) % exc->workers_count,
+                                       prio);
+        if (deque_steal(victim, task) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
 
-    pthread_mutex_lock(&exc->lock);
+static void *
+task_data(TaskData *task)
+{
+    return (task->ud.xdata) ?task->ud.xdata :task->data;
+}
 
-    for (j = 0; j < exc->workers_count; j++) {
-        err = worker_init(exc->workers + j, j, exc, exc->scheduler);
+static void
+task_release(Executor *exc, TaskData *task)
+{
+    slab_release(exc->slab, task->ud.xdata);
+    task->ud.xdata = NULL;
+    if (task->td.key) {
+        keyset_release(&exc->keys, task->td.key);
+        task->td.key = 0;
+    }
+    if (task->td.handle) {
+        keyset_unref(&exc->handles, task->td.handle);
+        task->td.handle = 0;
     }
-
-    pthread_mutex_unlock(&exc->lock);
-    return err;
 }
 
-static int
-executor_stop_worker(Executor *exc)
+static void
+worker_reject(Executor *exc, TaskData *task)
 {
-    TaskData task;
-    memset(&task, 0, sizeof(task));
-    task.td.work = StopWorker;
-    task.td.collect = StopCollect;
-    return ringbuffer_put(exc->tasks, &task);
+    g_warning("dropping task: no room left to requeue it");
+    task->td.collect(task_data(task), EXECUTOR_ERROR_TOO_MANY_TASKS, FALSE);
+    task_release(exc, task);
 }
 
-int
-executor_stop(Executor *exc, int wait)
+/*
+ * drain a batch from the shared queue, or from the overflow once that
+ * is empty: run the first task, park the others on our deque, where
+ * idle workers can steal them.
+ */
+static int
+worker_fetch_batch(Worker *wo, int prio, TaskData *task)
 {
-    int err = 0;
-    size_t j;
+    Executor *exc = wo->executor;
+    TaskQueue *queue = &exc->queues[prio];
+    TaskData batch[WORKER_BATCH_SIZE];
+    int room = MIN(WORKER_BATCH_SIZE, 1 + deque_room(wo->local[prio]));
+    int got, parked, j;
 
-    for (j = 0; j < exc->workers_count; j++) {
-        executor_stop_worker(exc);
+    got = ringbuffer_get_many(queue->tasks, batch, room);
+    if (got > 0) {
+        eventcount_notify(&exc->room, got);
+    } else {
+        got = overflow_pop(exc, &queue->overflow, batch, room);
+    }
+    if (got <= 0) {
+        return -1;
     }
 
-    if (wait) {
-        for (j = 0; j < exc->workers_count; j++) {
-            err = worker_join(exc->workers + j, wait);
+    memcpy(task, &batch[0], sizeof(*task));
+    if (got > 1) {
+        parked = deque_push_many(wo->local[prio], batch + 1, got - 1);
+        for (j = 1 + parked; j < got; j++) {
+            worker_reject(exc, &batch[j]);
+        }
+        if (parked) {
+            eventcount_notify(&exc->idle, parked);
         }
     }
+    return 0;
+}
 
-    exc->running = 0;
-    return err;
+static int
+worker_try_fetch_class(Worker *wo, int prio, TaskData *task)
+{
+    if (deque_pop(wo->local[prio], task) == 0) {
+        return 0;
+    }
+    if (worker_retired(wo)) {
+        return -1; /* the shared work is for the others */
+    }
+    if (worker_fetch_batch(wo, prio, task) == 0) {
+        return 0;
+    }
+    return worker_steal(wo, prio, task);
 }
 
-int
-executor_dispatch(Executor *exc, TaskFunction work, TaskCollect collect,
-                  void *data, size_t size, int timeout)
+/*
+ * highest class first; every PRIORITY_STARVATION_LIMIT tasks
+ * the scan goes the other way round once.
+ */
+static int
+worker_try_fetch(Worker *wo, TaskData *task)
 {
-    TaskData task;
-    memset(&task, 0, sizeof(task));
+    int reverse = (wo->served + 1 >= PRIORITY_STARVATION_LIMIT);
+    int j;
 
-    if (size > TASK_DATA_EMBED_MAX_SIZE) {
-        g_message("could not embed task data: %lu > %i", /* FIXME */
-                  size, TASK_DATA_EMBED_MAX_SIZE);
-        return EXECUTOR_ERROR_TOO_MUCH_DATA; /* FIXME */
+    for (j = 0; j < EXECUTOR_PRIORITY_NUM; j++) {
+        int prio = (reverse) ?EXECUTOR_PRIORITY_NUM - 1 - j :j;
+        if (worker_try_fetch_class(wo, prio, task) == 0) {
+            wo->served = (reverse) ?0 :wo->served + 1;
+            return 0;
+        }
     }
-    if (!exc->running) {
-        return EXECUTOR_ERROR_NOT_RUNNING;
+    return -1;
+}
+
+/*
+ * for each class: own deque first, then the shared queue,
+ * then the other workers
+ */
+static int
+worker_fetch(Worker *wo, TaskData *task)
+{
+    Executor *exc = wo->executor;
+
+    for (;;) {
+        gint key;
+
+        if (worker_try_fetch(wo, task) == 0) {
+            return 0;
+        }
+        if (worker_retired(wo)) {
+            return -1;
+        }
+
+        key = eventcount_prepare(&exc->idle);
+        if (worker_try_fetch(wo, task) == 0 || worker_retired(wo)) {
+            eventcount_cancel(&exc->idle);
+            continue;
+        }
+        eventcount_wait(&exc->idle, key, -1);
     }
+}
+
+static void
+worker_account(Worker *wo, const TaskData *task, gint64 start)
+{
+    SlotLoad *load = &wo->executor->loads[wo->id];
+    gint64 now = g_get_monotonic_time();
+
+    __atomic_add_fetch(&load->tasks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&load->wait, start - task->td.queued, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&load->service, now - start, __ATOMIC_RELAXED);
+}
 
-    task.td.work = work;
-    task.td.collect = collect;
-    task.td.timeout = timeout;
-    task.ud.size = size;
-    task.ud.xdata = NULL;
-    memcpy(task.data, data, size);
-    return ringbuffer_put(exc->tasks, &task);
+static gboolean
+task_cancelled(Executor *exc, const TaskData *task)
+{
+    return task->td.handle && keyset_cancelled(&exc->handles, task->td.handle);
 }
 
+/*
+ * returns 1 if the task stops the worker. What the collect returns
+ * is only logged: a worker never dies of a task.
+ */
 static int
-executor_replace(Executor *exc, WorkerID worker_id)
+worker_process(Worker *wo, TaskData *task)
 {
-    int ret;
+    Executor *exc = wo->executor;
+    void *data = task_data(task);
+    int timeout = task->td.timeout;
+    gint64 start = g_get_monotonic_time();
+    int stop = (task->td.work == StopWorker);
+    int err = 0;
+
+    if (task_cancelled(exc, task)) {
+        STATS_ADD(exc, cancelled, 1);
+        err = task->td.collect(data, EXECUTOR_ERROR_CANCELLED, FALSE);
+        task_release(exc, task);
+        g_message("worker executed err=%i", err);
+        return stop;
+    }
+
     pthread_mutex_lock(&exc->lock);
-    if (worker_id < exc->workers_count) {
-        g_warning("replacing worker: %lu", worker_id);
-        ret = worker_init(exc->workers + worker_id, worker_id, exc, exc->scheduler);
-    } else {
-        ret = -1;
+    wo->current = task;
+    wo->deadline = start + timeout * 1000;
+    pthread_mutex_unlock(&exc->lock);
+
+    if (task->td.timeout) {
+        wo->sched_id = scheduler_add(wo->scheduler,
+                                     timeout,
+                                     worker_discard,
+                                     wo);
+        g_message("timeout for worker: %lu = %ims (sched_id=%u)",
+                  wo->id, timeout, wo->sched_id);
     }
+    /* FIXME: scheduler_add failed */
+
+    err = task->td.work(data);
+
+    pthread_mutex_lock(&exc->lock);
+    wo->current = NULL;
     pthread_mutex_unlock(&exc->lock);
-    return ret;
-}
 
+    if (task_cancelled(exc, task)) {
+        STATS_ADD(exc, cancelled, 1);
+        err = EXECUTOR_ERROR_CANCELLED; /* the result is unwanted */
+    }
 
-typedef void (*rb_dump)(void *ud, const void *item);
+    worker_account(wo, task, start);
 
-extern void
-ringbuffer_set_dump(RingBuffer *rb, rb_dump dump, void *ud);
+    g_message("worker done: timeout=%i discarded=%i",
+              timeout, task->td.discarded);
 
-void
-executor_set_dump(Executor *exc, rb_dump dump, void *ud)
-{
-    ringbuffer_set_dump(exc->tasks, dump, ud);
+    if (timeout && !task->td.discarded) {
+        g_message("deleting timeout for worker: %lu (sched_id=%u)",
+                  wo->id, wo->sched_id);
+        scheduler_del(wo->scheduler, wo->sched_id);
+    }
+    err = task->td.collect(data, err, task->td.discarded);
+    task_release(exc, task);
+
+    g_message("worker executed err=%i", err);
+    return stop;
+}
+
+/* -1 once retired, 1 once stopped */
+static int
+worker_execute(Worker *wo)
+{
+    TaskData task;
+
+    memset(&task, 0, sizeof(task));
+    if (worker_fetch(wo, &task) < 0) {
+        return -1;
+    }
+    return worker_process(wo, &task);
+}
+
+/*
+ * a stopped worker runs what it parked, since the last worker to stop
+ * leaves no thief behind. The stops of the others go back, for them.
+ */
+static void
+worker_drain(Worker *wo)
+{
+    Executor *exc = wo->executor;
+    TaskData stops[WORKER_BATCH_SIZE]; /* parked from one batch, at most */
+    TaskData task;
+    int n = 0, j;
+
+    for (j = 0; j < EXECUTOR_PRIORITY_NUM && !wo->quarantined; j++) {
+        while (!wo->quarantined && deque_pop(wo->local[j], &task) == 0) {
+            if (task.td.work == StopWorker && n < WORKER_BATCH_SIZE) {
+                memcpy(&stops[n++], &task, sizeof(task));
+            } else {
+                worker_process(wo, &task);
+            }
+        }
+    }
+    if (n) {
+        deque_push_many(wo->local[EXECUTOR_PRIORITY_LOW], stops, n);
+        eventcount_notify(&exc->idle, n);
+    }
+}
+
+/*
+ * a worker out of its slot, either quarantined or retired, is done.
+ * Its object is kept for reuse, not freed: a late timer may still
+ * reference it.
+ */
+static void
+worker_exit(Worker *wo)
+{
+    Executor *exc = wo->executor;
+
+    pthread_mutex_lock(&exc->lock);
+    if (wo->quarantined) {
+        g_message("worker %lu back from quarantine", wo->id);
+        exc->quarantined--;
+        STATS_ADD(exc, reclaimed, 1);
+    }
+    wo->next = exc->exited;
+    exc->exited = wo;
+    pthread_mutex_unlock(&exc->lock);
+}
+
+static void *
+worker_run(void *w)
+{
+    Worker *wo = w;
+    gint err = 0;
+
+    this_worker = wo;
+    g_message("worker %lu started", wo->id);
+
+    while (!err && !wo->quarantined) {
+        err = worker_execute(wo);
+    }
+    if (err > 0 && !wo->quarantined) {
+        worker_drain(wo);
+    }
+
+    g_message("worker %lu done", wo->id);
+    if (wo->quarantined || worker_retired(wo)) {
+        worker_exit(wo);
+    }
+    return NULL;
+}
+
+/* must be called with the executor lock held, once running */
+static Worker *
+worker_new(WorkerID id, Executor *exec)
+{
+    Worker *wo = exec->exited;
+
+    if (wo) {
+        exec->exited = wo->next;
+        memset(wo, 0, sizeof(*wo));
+    } else {
+        wo = calloc(1, sizeof(Worker));
+        if (!wo) {
+            return NULL;
+        }
+    }
+    wo->id = id;
+    wo->local = exec->locals + id * EXECUTOR_PRIORITY_NUM;
+    wo->executor = exec;
+    wo->scheduler = exec->timers;
+    if (pthread_create(&wo->thread, 0, worker_run, wo) != 0) {
+        wo->next = exec->exited;
+        exec->exited = wo;
+        return NULL;
+    }
+    return wo;
+}
+
+static int
+worker_join(Executor *exc, WorkerID id, int wait)
+{
+    Worker *wo = NULL;
+    int busy = 0;
+
+    pthread_mutex_lock(&exc->lock);
+    wo = exc->workers[id];
+    /* running its own stop task is not being busy */
+    busy = (wo && wo->current && wo->current->td.work != StopWorker);
+    pthread_mutex_unlock(&exc->lock);
+
+    if (!wo) {
+        return 0; /* vacant slot */
+    }
+    if (wait && busy) {
+        return -1;
+    }
+    return pthread_join(wo->thread, NULL);
+}
+
+/* the queues, and the local deques of every worker */
+static int
+executor_alloc_queues(Executor *exc, int max_tasks)
+{
+    int workers_count = exc->workers_count;
+    int j;
+
+    for (j = 0; j < EXECUTOR_PRIORITY_NUM; j++) {
+        if (ringbuffer_init(&exc->queues[j].tasks,
+                            max_tasks, sizeof(TaskData)) < 0) {
+            return -1;
+        }
+    }
+
+    exc->workers = calloc(workers_count, sizeof(Worker *));
+    exc->locals = calloc(workers_count * EXECUTOR_PRIORITY_NUM,
+                         sizeof(Deque *));
+    if (!exc->workers || !exc->locals) {
+        return -1;
+    }
+    for (j = 0; j < workers_count * EXECUTOR_PRIORITY_NUM; j++) {
+        if (deque_init(&exc->locals[j],
+                       MAX(max_tasks / workers_count, 1),
+                       sizeof(TaskData)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* also of a partly initialized executor */
+static void
+executor_release(Executor *exc)
+{
+    WorkerID j;
+
+    if (exc->workers) {
+        for (j = 0; j < exc->workers_count; j++) {
+            free(exc->workers[j]);
+        }
+    }
+    while (exc->exited) {
+        Worker *next = exc->exited->next;
+        free(exc->exited);
+        exc->exited = next;
+    }
+    free(exc->loads);
+    if (exc->locals) {
+        for (j = 0; j < exc->workers_count * EXECUTOR_PRIORITY_NUM; j++) {
+            deque_free(exc->locals[j]);
+        }
+    }
+    free(exc->locals);
+    free(exc->workers);
+    for (j = 0; j < EXECUTOR_PRIORITY_NUM; j++) {
+        ringbuffer_free(exc->queues[j].tasks);
+        overflow_free(&exc->queues[j].overflow);
+    }
+    slab_free(exc->slab);
+    keyset_free(&exc->keys);
+    keyset_free(&exc->handles);
+    pthread_mutex_destroy(&exc->lock);
+    free(exc);
+}
+
+/*
+ * move a hung worker out of its slot, and give the slot to a fresh
+ * thread, as long as the spare budget allows. Otherwise the slot
+ * stays with the hung worker until its call returns.
+ * Must be called with the executor lock held.
+ */
+static void
+executor_quarantine(Executor *exc, Worker *wo)
+{
+    Worker *spare = NULL;
+
+    if (exc->workers[wo->id] != wo) {
+        return; /* retired meanwhile, the slot is not its own */
+    }
+    if (exc->quarantined < exc->spares) {
+        spare = worker_new(wo->id, exc);
+    }
+    if (!spare) {
+        g_warning("worker %lu hung, no spare thread left", wo->id);
+        STATS_ADD(exc, spares_exhausted, 1);
+        return;
+    }
+
+    g_warning("worker %lu hung, quarantined", wo->id);
+    wo->quarantined = TRUE;
+    pthread_detach(wo->thread);
+    exc->workers[wo->id] = spare;
+    exc->quarantined++;
+    STATS_ADD(exc, quarantined, 1);
+}
+
+int
+executor_init(Executor **exc, Scheduler *sched,
+              int workers_count, int max_tasks)
+{
+    int err = -1;
+    int j;
+    Executor *ex = calloc(1, sizeof(*ex));
+    if (ex && posix_memalign((void **)&ex->loads, CACHELINE_SIZE,
+                             workers_count * sizeof(SlotLoad)) != 0) {
+        free(ex);
+        ex = NULL;
+    }
+    if (ex) {
+        pthread_mutex_init(&ex->lock, 0);
+        memset(ex->loads, 0, workers_count * sizeof(SlotLoad));
+
+        ex->scheduler = sched;
+        ex->timers = sched;
+        eventcount_init(&ex->idle);
+        eventcount_init(&ex->room);
+        ex->overflow_policy = EXECUTOR_OVERFLOW_REJECT;
+        ex->spares = workers_count;
+        ex->min_workers = workers_count;
+
+        for (j = 0; j < EXECUTOR_PRIORITY_NUM; j++) {
+            overflow_init(&ex->queues[j].overflow);
+        }
+        ex->workers_count = workers_count;
+        ex->queue_size = max_tasks;
+
+        if (keyset_init(&ex->keys) < 0 ||
+            keyset_init(&ex->handles) < 0 ||
+            slab_init(&ex->slab) < 0 ||
+            executor_alloc_queues(ex, max_tasks) < 0) {
+            executor_release(ex);
+            return -1;
+        }
+        *exc = ex;
+        err = 0;
+        g_message("executor started with %i workers", workers_count);
+    }
+    return err;
+}
+
+/*
+ * the executor must be stopped, or never started.
+ * Hung workers still in quarantine reference it, so in that case
+ * it is leaked instead.
+ */
+int
+executor_free(Executor *exc)
+{
+    pthread_mutex_lock(&exc->lock);
+    if (exc->quarantined > 0) {
+        g_warning("%i workers still in quarantine, not freeing the executor",
+                  exc->quarantined);
+        pthread_mutex_unlock(&exc->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&exc->lock);
+
+    executor_release(exc);
+    return 0;
+}
+
+int
+executor_set_overflow(Executor *exc, int policy, int wait, size_t max_mem)
+{
+    if (exc->running) {
+        return EXECUTOR_ERROR_ALREADY_STARTED;
+    }
+    exc->overflow_policy = policy;
+    exc->overflow_wait = wait;
+    exc->overflow_max_segments = max_mem / sizeof(OverflowSegment);
+    return 0;
+}
+
+int
+executor_set_elastic(Executor *exc, int min_workers)
+{
+    if (exc->running) {
+        return EXECUTOR_ERROR_ALREADY_STARTED;
+    }
+    exc->min_workers = CLAMP(min_workers, 1, (int)exc->workers_count);
+    return 0;
+}
+
+int
+executor_set_timers(Executor *exc, Scheduler *timers)
+{
+    if (exc->running) {
+        return EXECUTOR_ERROR_ALREADY_STARTED;
+    }
+    exc->timers = timers;
+    return 0;
+}
+
+int
+executor_set_spares(Executor *exc, int spares)
+{
+    if (exc->running) {
+        return EXECUTOR_ERROR_ALREADY_STARTED;
+    }
+    exc->spares = spares;
+    return 0;
+}
+
+void
+executor_get_stats(Executor *exc, ExecutorStats *stats)
+{
+    __atomic_load(&exc->stats.dispatched, &stats->dispatched, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.rejected, &stats->rejected, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.blocked, &stats->blocked, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.block_timeouts, &stats->block_timeouts, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.overflowed, &stats->overflowed, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.segments, &stats->segments, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.segments_peak, &stats->segments_peak, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.quarantined, &stats->quarantined, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.spares_exhausted, &stats->spares_exhausted, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.reclaimed, &stats->reclaimed, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.grown, &stats->grown, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.shrunk, &stats->shrunk, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.cancelled, &stats->cancelled, __ATOMIC_RELAXED);
+    __atomic_load(&exc->stats.busy, &stats->busy, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&exc->lock);
+    stats->workers = exc->active;
+    stats->workers_peak = exc->stats.workers_peak;
+    stats->wait_avg = exc->control.wait;
+    stats->service_avg = exc->control.service;
+    pthread_mutex_unlock(&exc->lock);
+}
+
+/* must be called with the executor lock held */
+static void
+executor_grow(Executor *exc, int count)
+{
+    WorkerID j;
+
+    for (j = 0; j < exc->workers_count && count > 0; j++) {
+        if (!exc->workers[j]) {
+            exc->workers[j] = worker_new(j, exc);
+            if (!exc->workers[j]) {
+                break;
+            }
+            exc->active++;
+            count--;
+            STATS_ADD(exc, grown, 1);
+        }
+    }
+    exc->stats.workers_peak = MAX(exc->stats.workers_peak,
+                                  (unsigned long)exc->active);
+}
+
+/*
+ * the worker in the highest slot leaves once its own deques are
+ * empty. Must be called with the executor lock held.
+ */
+static void
+executor_shrink(Executor *exc)
+{
+    WorkerID j = exc->workers_count;
+
+    if (exc->active <= exc->min_workers) {
+        return;
+    }
+    while (j-- > 0) {
+        Worker *wo = exc->workers[j];
+        if (wo) {
+            __atomic_store_n(&wo->retired, TRUE, __ATOMIC_RELEASE);
+            pthread_detach(wo->thread);
+            exc->workers[j] = NULL;
+            exc->active--;
+            STATS_ADD(exc, shrunk, 1);
+            break;
+        }
+    }
+    /* it may be sleeping, and we cannot tell which one it is */
+    eventcount_notify(&exc->idle, exc->workers_count + exc->spares);
+}
+
+static int
+executor_backlog(Executor *exc)
+{
+    int j;
+    for (j = 0; j < EXECUTOR_PRIORITY_NUM; j++) {
+        if (!ringbuffer_empty(exc->queues[j].tasks) ||
+            !overflow_empty(&exc->queues[j].overflow)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+ewma_update(gint64 *avg, gint64 sample)
+{
+    *avg += (sample - *avg) / (1 << POOL_EWMA_SHIFT);
+}
+
+/*
+ * periodic pool sizing: grow when tasks wait in the queues longer
+ * than they take to run, shrink when the workers stay mostly idle.
+ */
+static gboolean
+executor_control(gpointer data)
+{
+    Executor *exc = data;
+    PoolControl *pc = &exc->control;
+    SlotLoad now = { 0, 0, 0 };
+    unsigned long tasks, busy;
+    int load, backlog;
+    WorkerID j;
+
+    pthread_mutex_lock(&exc->lock);
+    if (!exc->running) {
+        pthread_mutex_unlock(&exc->lock);
+        return FALSE;
+    }
+
+    for (j = 0; j < exc->workers_count; j++) {
+        now.tasks += __atomic_load_n(&exc->loads[j].tasks, __ATOMIC_RELAXED);
+        now.wait += __atomic_load_n(&exc->loads[j].wait, __ATOMIC_RELAXED);
+        now.service += __atomic_load_n(&exc->loads[j].service, __ATOMIC_RELAXED);
+    }
+    tasks = now.tasks - pc->last.tasks;
+    busy = now.service - pc->last.service;
+    backlog = executor_backlog(exc);
+    if (tasks) {
+        ewma_update(&pc->wait, (now.wait - pc->last.wait) / tasks);
+        ewma_update(&pc->service, busy / tasks);
+    } else if (!backlog) {
+        pc->wait = 0; /* nobody is waiting */
+    }
+    pc->last = now;
+    load = busy * 100 / (MAX(exc->active, 1) * POOL_CONTROL_PERIOD * 1000);
+
+    if ((tasks == 0 && backlog) ||
+        pc->wait > MAX(pc->service, POOL_GROW_WAIT)) {
+        pc->idle_ticks = 0;
+        if (exc->active < (int)exc->workers_count) {
+            g_message("growing the pool: workers=%i wait=%lius service=%lius",
+                      exc->active, (long)pc->wait, (long)pc->service);
+            executor_grow(exc, MAX(exc->active / 2, 1));
+        }
+    } else if (load < POOL_SHRINK_LOAD && !backlog) {
+        if (++pc->idle_ticks >= POOL_SHRINK_TICKS &&
+            exc->active > exc->min_workers) {
+            g_message("shrinking the pool: workers=%i load=%i%%",
+                      exc->active, load);
+            executor_shrink(exc);
+            pc->idle_ticks = 0;
+        }
+    } else {
+        pc->idle_ticks = 0;
+    }
+
+    pthread_mutex_unlock(&exc->lock);
+    return TRUE;
+}
+
+int
+executor_start(Executor *exc)
+{
+    int err = 0;
+    size_t j;
+
+    if (exc->running) {
+        return EXECUTOR_ERROR_ALREADY_STARTED;
+    }
+
+    pthread_mutex_lock(&exc->lock);
+
+    exc->running = 1;
+
+    for (j = 0; j < (size_t)exc->min_workers; j++) {
+        exc->workers[j] = worker_new(j, exc);
+        if (!exc->workers[j]) {
+            err = -1;
+        } else {
+            exc->active++;
+        }
+    }
+    exc->stats.workers_peak = exc->active;
+
+    if (exc->min_workers < (int)exc->workers_count) {
+        exc->control.source = scheduler_add(exc->scheduler,
+                                            POOL_CONTROL_PERIOD,
+                                            executor_control,
+                                            exc);
+    }
+
+    pthread_mutex_unlock(&exc->lock);
+    return err;
+}
+
+/*
+ * tasks dispatched from within a worker of this executor stay on
+ * that worker's own deque, unless it is full; everything else
+ * goes through the shared queue. Returns how many were queued.
+ */
+static int
+executor_try_enqueue(Executor *exc, int prio, TaskData *tasks, int n)
+{
+    TaskQueue *queue = &exc->queues[prio];
+    int done = 0;
+    if (this_worker && this_worker->executor == exc) {
+        done = deque_push_many(this_worker->local[prio], tasks, n);
+    }
+    /* once spilled, keep FIFO order: the overflow drains first */
+    if (done < n && overflow_empty(&queue->overflow)) {
+        done += ringbuffer_put_many(queue->tasks, tasks + done, n - done);
+    }
+    return done;
+}
+
+static int
+executor_wait_room(Executor *exc, int prio, TaskData *tasks, int n)
+{
+    gint64 deadline = g_get_monotonic_time() + exc->overflow_wait * 1000;
+    int done = 0;
+
+    STATS_ADD(exc, blocked, 1);
+    while (done < n) {
+        gint64 now = g_get_monotonic_time();
+        gint key;
+
+        if (now >= deadline) {
+            STATS_ADD(exc, block_timeouts, 1);
+            break;
+        }
+
+        key = eventcount_prepare(&exc->room);
+        done += executor_try_enqueue(exc, prio, tasks + done, n - done);
+        if (done < n) {
+            eventcount_wait(&exc->room, key, (deadline - now + 999) / 1000);
+        } else {
+            eventcount_cancel(&exc->room);
+        }
+    }
+    return done;
+}
+
+/* the overflow policy applies to what does not fit */
+static int
+executor_enqueue_class(Executor *exc, int prio, TaskData *tasks, int n)
+{
+    int done = executor_try_enqueue(exc, prio, tasks, n);
+
+    if (done < n) {
+        switch (exc->overflow_policy) {
+        case EXECUTOR_OVERFLOW_BLOCK:
+            done += executor_wait_room(exc, prio, tasks + done, n - done);
+            break;
+        case EXECUTOR_OVERFLOW_GROW:
+            done += overflow_push(exc, &exc->queues[prio].overflow,
+                                  tasks + done, n - done);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (done) {
+        eventcount_notify(&exc->idle, done);
+    }
+    return done;
+}
+
+/* all the tasks must belong to the same class */
+static int
+executor_enqueue_many(Executor *exc, TaskData *tasks, int n)
+{
+    gint64 now = g_get_monotonic_time();
+    int done, j;
+
+    for (j = 0; j < n; j++) {
+        tasks[j].td.queued = now;
+    }
+
+    done = executor_enqueue_class(exc, tasks[0].td.priority, tasks, n);
+
+    if (done) {
+        STATS_ADD(exc, dispatched, done);
+    }
+    if (done < n) {
+        STATS_ADD(exc, rejected, n - done);
+    }
+    return done;
+}
+
+/*
+ * payloads too big to be embedded go out of line, in the slab.
+ * The key and the handle are held from here until task_release.
+ */
+static int
+task_init(Executor *exc, TaskData *task, const TaskRequest *req)
+{
+    memset(task, 0, sizeof(*task));
+
+    if (req->priority < 0 || req->priority >= EXECUTOR_PRIORITY_NUM) {
+        return EXECUTOR_ERROR_BAD_PRIORITY;
+    }
+
+    if (req->key && !keyset_acquire(&exc->keys, req->key)) {
+        return EXECUTOR_ERROR_BUSY;
+    }
+    task->td.key = req->key;
+
+    if (req->handle && keyset_ref(&exc->handles, req->handle) < 0) {
+        task_release(exc, task);
+        return EXECUTOR_ERROR_TOO_MANY_TASKS;
+    }
+    task->td.handle = req->handle;
+
+    if (req->size > TASK_DATA_EMBED_MAX_SIZE) {
+        task->ud.xdata = slab_alloc(exc->slab, req->size);
+        if (!task->ud.xdata) {
+            g_warning("could not allocate task data: %lu bytes", req->size);
+            task_release(exc, task);
+            return EXECUTOR_ERROR_TOO_MUCH_DATA;
+        }
+    }
+
+    task->td.work = req->work;
+    task->td.collect = req->collect;
+    task->td.timeout = req->timeout;
+    task->td.priority = req->priority;
+    task->ud.size = req->size;
+    memcpy(task_data(task), req->data, req->size);
+    return 0;
+}
+
+static int
+executor_stop_worker(Executor *exc)
+{
+    TaskData task;
+    memset(&task, 0, sizeof(task));
+    task.td.work = StopWorker;
+    task.td.collect = StopCollect;
+    task.td.priority = EXECUTOR_PRIORITY_LOW; /* let the queued work run */
+    return (executor_enqueue_many(exc, &task, 1) == 1) ?0 :-1;
+}
+
+static void
+executor_log_stats(Executor *exc)
+{
+    ExecutorStats st;
+    SlabStats sl;
+    executor_get_stats(exc, &st);
+    slab_get_stats(exc->slab, &sl);
+    g_message("executor stats: dispatched=%lu rejected=%lu"
+              " blocked=%lu block_timeouts=%lu"
+              " overflowed=%lu segments=%lu segments_peak=%lu"
+              " payload_allocs=%lu payload_large=%lu payload_slabs=%lu"
+              " quarantined=%lu spares_exhausted=%lu reclaimed=%lu"
+              " workers=%lu workers_peak=%lu grown=%lu shrunk=%lu"
+              " wait_avg=%luus service_avg=%luus cancelled=%lu busy=%lu",
+              st.dispatched, st.rejected,
+              st.blocked, st.block_timeouts,
+              st.overflowed, st.segments, st.segments_peak,
+              sl.allocs, sl.large, sl.slabs,
+              st.quarantined, st.spares_exhausted, st.reclaimed,
+              st.workers, st.workers_peak, st.grown, st.shrunk,
+              st.wait_avg, st.service_avg, st.cancelled, st.busy);
+}
+
+int
+executor_stop(Executor *exc, int wait)
+{
+    int err = 0;
+    int active = 0;
+    size_t j;
+
+    pthread_mutex_lock(&exc->lock);
+    exc->running = 0; /* the pool size is frozen from now on */
+    active = exc->active;
+    pthread_mutex_unlock(&exc->lock);
+
+    if (exc->control.source) {
+        scheduler_del(exc->scheduler, exc->control.source);
+    }
+
+    for (j = 0; j < (size_t)active; j++) {
+        executor_stop_worker(exc);
+    }
+
+    if (wait) {
+        for (j = 0; j < exc->workers_count; j++) {
+            err = worker_join(exc, j, wait);
+        }
+    }
+
+    executor_log_stats(exc);
+    return err;
+}
+
+int
+executor_dispatch(Executor *exc, TaskFunction work, TaskCollect collect,
+                  void *data, size_t size, int timeout, int priority)
+{
+    TaskData task;
+    TaskRequest req = { work, collect, data, size, timeout, priority, 0, 0 };
+    int err;
+
+    if (!exc->running) {
+        return EXECUTOR_ERROR_NOT_RUNNING;
+    }
+    err = task_init(exc, &task, &req);
+    if (err) {
+        return err;
+    }
+
+    if (executor_enqueue_many(exc, &task, 1) != 1) {
+        task_release(exc, &task);
+        return EXECUTOR_ERROR_TOO_MANY_TASKS;
+    }
+    return 0;
+}
+
+static void
+task_busy(Executor *exc, const TaskRequest *req)
+{
+    STATS_ADD(exc, busy, 1);
+    req->collect(req->data, EXECUTOR_ERROR_BUSY, FALSE);
+}
+
+int
+executor_dispatch_batch(Executor *exc, const TaskRequest *tasks, int n)
+{
+    TaskData batch[DISPATCH_BATCH_SIZE];
+    int pos[DISPATCH_BATCH_SIZE]; /* of the batched tasks, in tasks */
+    int queued = 0;
+
+    if (!exc->running) {
+        return EXECUTOR_ERROR_NOT_RUNNING;
+    }
+
+    while (queued < n) {
+        int priority = tasks[queued].priority;
+        int end = queued; /* tasks examined this round */
+        int j, k, count = 0, done, err = 0;
+
+        /* a run of tasks of the same class; busy ones are skipped */
+        while (end < n && count < DISPATCH_BATCH_SIZE &&
+               tasks[end].priority == priority) {
+            err = task_init(exc, &batch[count], &tasks[end]);
+            if (err && err != EXECUTOR_ERROR_BUSY) {
+                break;
+            }
+            if (!err) {
+                pos[count++] = end;
+            }
+            end++;
+        }
+
+        done = (count > 0) ?executor_enqueue_many(exc, batch, count) :0;
+        for (j = done; j < count; j++) {
+            task_release(exc, &batch[j]);
+        }
+        if (done < count) {
+            end = pos[done]; /* the first task not queued */
+        }
+
+        for (j = queued, k = 0; j < end; j++) {
+            if (k < count && pos[k] == j) {
+                k++;
+            } else {
+                task_busy(exc, &tasks[j]);
+            }
+        }
+        queued = end;
+        if ((err && err != EXECUTOR_ERROR_BUSY) || done < count) {
+            break;
+        }
+    }
+
+    return queued;
+}
+
+/*
+ * drops the tasks of handle out of a batch taken off the queues of a
+ * class, and puts the others back; returns how many were dropped.
+ */
+static int
+executor_purge_batch(Executor *exc, int prio, TaskHandle handle,
+                     TaskData *batch, int n)
+{
+    int kept = 0;
+    int j;
+
+    for (j = 0; j < n; j++) {
+        if (batch[j].td.handle != handle) {
+            if (kept < j) {
+                memcpy(&batch[kept], &batch[j], sizeof(TaskData));
+            }
+            kept++;
+            continue;
+        }
+        STATS_ADD(exc, cancelled, 1);
+        batch[j].td.collect(task_data(&batch[j]), EXECUTOR_ERROR_CANCELLED,
+                            FALSE);
+        task_release(exc, &batch[j]);
+    }
+
+    j = (kept) ?executor_enqueue_class(exc, prio, batch, kept) :0;
+    for (; j < kept; j++) {
+        worker_reject(exc, &batch[j]);
+    }
+    return n - kept;
+}
+
+/*
+ * the shared queue, the overflow and the worker deques of a class.
+ * Each is scanned once: what was put back may be seen again, but
+ * no more tasks than it held are taken off.
+ */
+static int
+executor_purge(Executor *exc, int prio, TaskHandle handle)
+{
+    TaskQueue *queue = &exc->queues[prio];
+    TaskData batch[WORKER_BATCH_SIZE];
+    int purged = 0;
+    int budget, got;
+    WorkerID j;
+
+    for (budget = exc->queue_size; budget > 0; budget -= got) {
+        got = ringbuffer_get_many(queue->tasks, batch,
+                                  MIN(budget, WORKER_BATCH_SIZE));
+        if (got <= 0) {
+            break;
+        }
+        eventcount_notify(&exc->room, got);
+        purged += executor_purge_batch(exc, prio, handle, batch, got);
+    }
+
+    budget = __atomic_load_n(&queue->overflow.used, __ATOMIC_RELAXED);
+    for (; budget > 0; budget -= got) {
+        got = overflow_pop(exc, &queue->overflow, batch,
+                           MIN(budget, WORKER_BATCH_SIZE));
+        if (got <= 0) {
+            break;
+        }
+        purged += executor_purge_batch(exc, prio, handle, batch, got);
+    }
+
+    /* stolen: the tasks left are queued anew */
+    for (j = 0; j < exc->workers_count; j++) {
+        Deque *local = executor_local(exc, j, prio);
+
+        budget = MAX(exc->queue_size / (int)exc->workers_count, 1);
+        for (; budget > 0; budget -= got) {
+            for (got = 0; got < MIN(budget, WORKER_BATCH_SIZE); got++) {
+                if (deque_steal(local, &batch[got]) < 0) {
+                    break;
+                }
+            }
+            if (got == 0) {
+                break;
+            }
+            purged += executor_purge_batch(exc, prio, handle, batch, got);
+        }
+    }
+    return purged;
+}
+
+int
+executor_cancel(Executor *exc, TaskHandle handle)
+{
+    int purged = 0;
+    int prio;
+
+    if (!exc->running) {
+        return EXECUTOR_ERROR_NOT_RUNNING;
+    }
+    if (!handle || !keyset_cancel(&exc->handles, handle)) {
+        return 0; /* nothing in flight */
+    }
+
+    for (prio = 0; prio < EXECUTOR_PRIORITY_NUM; prio++) {
+        purged += executor_purge(exc, prio, handle);
+    }
+
+    g_message("cancelled tasks: handle=%" G_GUINT64_FORMAT " purged=%i",
+              handle, purged);
+    return 0;
+}
+
+
+typedef void (*rb_dump)(void *ud, const void *item);
+
+extern void
+ringbuffer_set_dump(RingBuffer *rb, rb_dump dump, void *ud);
+
+void
+executor_set_dump(Executor *exc, rb_dump dump, void *ud)
+{
+    int j;
+    for (j = 0; j < EXECUTOR_PRIORITY_NUM; j++) {
+        ringbuffer_set_dump(exc->queues[j].tasks, dump, ud);
+    }
 }
 
@@ -36,12 +36,22 @@ typedef gint (*TaskFunction)(gpointer data);
 
 typedef gint (*TaskCollect)(gpointer data, gint error, gboolean timeout);
 
+/* tags tasks for executor_cancel; 0 is never cancelled */
+typedef guint64 TaskHandle;
+
+/* at most one task per key is in flight; 0 is no key */
+typedef guint64 TaskKey;
+
 typedef struct TaskBaseData TaskBaseData;
 struct TaskBaseData {
     TaskFunction work;
     TaskCollect collect;
+    gint64 queued; /* monotonic microseconds */
+    TaskHandle handle;
+    TaskKey key;
     gint timeout;
-    gboolean discarded;
+    gint16 priority;
+    gint16 discarded;
 };
 
 typedef struct TaskUserData TaskUserData;
@@ -51,7 +61,7 @@ struct TaskUserData {
 };
 
 enum {
-    TASK_DATA_SIZE = 128, /* keep this multiple of 2 */
+    TASK_DATA_SIZE = 192, /* keep this multiple of 64, the cache line */
     TASK_DATA_EMBED_MAX_SIZE = TASK_DATA_SIZE - sizeof(TaskBaseData) - sizeof(TaskUserData)
 };
 
@@ -63,17 +73,72 @@ struct TaskData {
 };
 
 
+/* lower value, served first */
+enum {
+    EXECUTOR_PRIORITY_HIGH = 0, /* on-demand requests */
+    EXECUTOR_PRIORITY_NORMAL,
+    EXECUTOR_PRIORITY_LOW, /* periodic polling */
+    EXECUTOR_PRIORITY_NUM
+};
+
+/* describes one task for executor_dispatch_batch */
+typedef struct TaskRequest TaskRequest;
+struct TaskRequest {
+    TaskFunction work;
+    TaskCollect collect;
+    void *data;
+    size_t size;
+    int timeout;
+    int priority;
+    TaskHandle handle;
+    TaskKey key;
+};
+
+
 enum {
     EXECUTOR_ERROR_NONE = 0,
     EXECUTOR_ERROR_NOT_RUNNING = -1,
     EXECUTOR_ERROR_ALREADY_STARTED = -2,
     EXECUTOR_ERROR_TOO_MANY_TASKS = -3,
-    EXECUTOR_ERROR_TOO_MUCH_DATA = -4
+    EXECUTOR_ERROR_TOO_MUCH_DATA = -4,
+    EXECUTOR_ERROR_BAD_PRIORITY = -5,
+    EXECUTOR_ERROR_CANCELLED = -6,
+    EXECUTOR_ERROR_BUSY = -7
+};
+
+/* what to do when the task queue is full */
+enum {
+    EXECUTOR_OVERFLOW_REJECT = 0, /* fail the dispatch */
+    EXECUTOR_OVERFLOW_BLOCK, /* wait for room, up to a deadline */
+    EXECUTOR_OVERFLOW_GROW /* spill in extra segments, up to a memory cap */
+};
+
+typedef struct ExecutorStats ExecutorStats;
+struct ExecutorStats {
+    unsigned long dispatched;
+    unsigned long rejected;
+    unsigned long blocked; /* dispatches which had to wait for room */
+    unsigned long block_timeouts; /* ... and gave up */
+    unsigned long overflowed; /* tasks queued in the overflow segments */
+    unsigned long segments; /* overflow segments in use */
+    unsigned long segments_peak;
+    unsigned long quarantined; /* hung workers replaced by a spare thread */
+    unsigned long spares_exhausted; /* ... not replaced, no spare left */
+    unsigned long reclaimed; /* quarantined workers whose call returned */
+    unsigned long workers; /* in the pool now */
+    unsigned long workers_peak;
+    unsigned long grown; /* workers added by the pool controller */
+    unsigned long shrunk; /* ... and retired */
+    unsigned long wait_avg; /* microseconds in the queue, moving average */
+    unsigned long service_avg; /* microseconds to run, moving average */
+    unsigned long cancelled; /* tasks dropped, or their results */
+    unsigned long busy; /* tasks skipped, their key was in flight */
 };
 
 typedef struct Executor Executor;
 
 
+/* workers_count is the maximum pool size */
 int
 executor_init(Executor **exc,
               Scheduler *sched,
@@ -89,17 +154,98 @@ int
 executor_start(Executor *exc);
 
 
+/*
+ * must be called before executor_start.
+ * wait: milliseconds, used by EXECUTOR_OVERFLOW_BLOCK.
+ * max_mem: bytes, used by EXECUTOR_OVERFLOW_GROW.
+ */
+int
+executor_set_overflow(Executor *exc, int policy, int wait, size_t max_mem);
+
+
+/*
+ * must be called before executor_start.
+ * The pool starts with min_workers, then a periodic controller
+ * adds workers when tasks wait in the queues longer than they take
+ * to run, and retires them after idle periods, never going below
+ * min_workers nor above the workers_count given to executor_init.
+ * Default: a static pool of workers_count.
+ */
+int
+executor_set_elastic(Executor *exc, int min_workers);
+
+
+/*
+ * must be called before executor_start.
+ * A worker whose task times out is quarantined, and a spare thread
+ * takes its place, up to `spares' hung workers at any time; so the
+ * executor never runs more than workers_count + spares threads.
+ * The quarantined thread exits once its call returns.
+ * Default: as many spares as workers.
+ */
+int
+executor_set_spares(Executor *exc, int spares);
+
+
+/*
+ * must be called before executor_start.
+ * The task timeouts go on `timers', the pool control stays on the
+ * scheduler given to executor_init: a control round may block, and
+ * so hold up the timeouts of the same scheduler.
+ * Default: the scheduler given to executor_init.
+ */
+int
+executor_set_timers(Executor *exc, Scheduler *timers);
+
+
+void
+executor_get_stats(Executor *exc, ExecutorStats *stats);
+
+
 int
 executor_stop(Executor *exc, int wait);
 
 
+/*
+ * withdraws the tasks tagged with `handle', also the ones dispatched
+ * before the last of them completes: then the handle is free again.
+ * Queued tasks are dropped at once, and collected by the caller;
+ * the others queued may be reordered. Running ones complete.
+ * Either way, their collect function gets EXECUTOR_ERROR_CANCELLED
+ * instead of the result, and should just release the task data.
+ */
+int
+executor_cancel(Executor *exc, TaskHandle handle);
+
+
+/*
+ * each priority class has its own queue. Workers serve them
+ * in strict priority order, except that every few tasks a lower
+ * class gets its turn, so sustained high priority load cannot
+ * starve it completely.
+ */
 int
 executor_dispatch(Executor *exc,
                   TaskFunction work,
                   TaskCollect collect,
                   void *data,
                   size_t size,
-                  int timeout);
+                  int timeout,
+                  int priority);
+
+/*
+ * queues the tasks in order, with as few synchronizations
+ * and wakeups as possible.
+ * returns how many tasks were consumed (the first N), or an error;
+ * the caller still owns the data of the tasks not consumed.
+ * A task whose key is still in flight is consumed but not queued:
+ * its collect function gets EXECUTOR_ERROR_BUSY right away,
+ * in the caller thread.
+ */
+int
+executor_dispatch_batch(Executor *exc,
+                        const TaskRequest *tasks,
+                        int n);
 
 #endif /* EXECUTOR_H */
 
@@ -0,0 +1,177 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jsonbuf.h"
+
+
+enum {
+    JSONBUF_DEFAULT_SIZE = 4096,
+    ULLONG_DIGITS_MAX = 20
+};
+
+/* the decimal digits of 0..99, two by two */
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char hex_digits[] = "0123456789abcdef";
+
+int
+jsonbuf_init(JsonBuf *jb, size_t size)
+{
+    memset(jb, 0, sizeof(*jb));
+    jb->size = (size) ?size :JSONBUF_DEFAULT_SIZE;
+    jb->ptr = malloc(jb->size);
+    if (!jb->ptr) {
+        jb->size = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void
+jsonbuf_free(JsonBuf *jb)
+{
+    free(jb->ptr);
+    memset(jb, 0, sizeof(*jb));
+}
+
+void
+jsonbuf_clear(JsonBuf *jb)
+{
+    jb->len = 0;
+    jb->error = 0;
+}
+
+/* room for len more bytes, or NULL */
+static char *
+jsonbuf_reserve(JsonBuf *jb, size_t len)
+{
+    if (jb->len + len > jb->size) {
+        size_t size = (jb->size) ?jb->size :JSONBUF_DEFAULT_SIZE;
+        char *ptr = NULL;
+        while (size < jb->len + len) {
+            size *= 2;
+        }
+        ptr = realloc(jb->ptr, size);
+        if (!ptr) {
+            jb->error = 1;
+            return NULL;
+        }
+        jb->ptr = ptr;
+        jb->size = size;
+    }
+    return jb->ptr + jb->len;
+}
+
+void
+jsonbuf_raw(JsonBuf *jb, const char *data, size_t len)
+{
+    char *dst = jsonbuf_reserve(jb, len);
+    if (dst) {
+        memcpy(dst, data, len);
+        jb->len += len;
+    }
+}
+
+void
+jsonbuf_ullong(JsonBuf *jb, unsigned long long value)
+{
+    char digits[ULLONG_DIGITS_MAX];
+    char *pos = digits + sizeof(digits);
+    char *dst = NULL;
+    size_t len = 0;
+
+    /* backwards, two digits at a time */
+    while (value >= 100) {
+        unsigned int pair = (value % 100) * 2;
+        value /= 100;
+        pos -= 2;
+        pos[0] = digit_pairs[pair];
+        pos[1] = digit_pairs[pair + 1];
+    }
+    if (value >= 10) {
+        pos -= 2;
+        pos[0] = digit_pairs[value * 2];
+        pos[1] = digit_pairs[value * 2 + 1];
+    } else {
+        *--pos = '0' + value;
+    }
+
+    len = digits + sizeof(digits) - pos;
+    dst = jsonbuf_reserve(jb, len);
+    if (dst) {
+        memcpy(dst, pos, len);
+        jb->len += len;
+    }
+}
+
+void
+jsonbuf_llong(JsonBuf *jb, long long value)
+{
+    if (value < 0) {
+        jsonbuf_raw(jb, "-", 1);
+        jsonbuf_ullong(jb, -(unsigned long long)value);
+    } else {
+        jsonbuf_ullong(jb, value);
+    }
+}
+
+void
+jsonbuf_string(JsonBuf *jb, const char *str)
+{
+    const char *run = str;
+    const char *pos = str;
+
+    jsonbuf_raw(jb, "\"", 1);
+    /* the runs which need no escaping are copied whole */
+    for (; *pos; pos++) {
+        unsigned char c = *pos;
+        char esc[6] = { '\\', 'u', '0', '0', 0, 0 };
+
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        jsonbuf_raw(jb, run, pos - run);
+        run = pos + 1;
+        if (c == '"' || c == '\\') {
+            esc[1] = c;
+            jsonbuf_raw(jb, esc, 2);
+        } else {
+            esc[4] = hex_digits[c >> 4];
+            esc[5] = hex_digits[c & 0xf];
+            jsonbuf_raw(jb, esc, sizeof(esc));
+        }
+    }
+    jsonbuf_raw(jb, run, pos - run);
+    jsonbuf_raw(jb, "\"", 1);
+}
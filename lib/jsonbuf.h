@@ -0,0 +1,67 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef JSONBUF_H
+#define JSONBUF_H
+
+#include <stdlib.h>
+
+/*
+ * a JSON text built in place, without stdio: the buffer is kept
+ * across texts, and grows only when a text does not fit.
+ * On allocation failure the text is truncated, and error is set.
+ */
+typedef struct JsonBuf JsonBuf;
+struct JsonBuf {
+    char *ptr; /* not terminated */
+    size_t len;
+    size_t size;
+    int error;
+};
+
+/* size: bytes preallocated, 0 for the default */
+int
+jsonbuf_init(JsonBuf *jb, size_t size);
+
+void
+jsonbuf_free(JsonBuf *jb);
+
+/* forgets the text, keeps the buffer */
+void
+jsonbuf_clear(JsonBuf *jb);
+
+void
+jsonbuf_raw(JsonBuf *jb, const char *data, size_t len);
+
+/* a literal, its length known at compile time */
+#define jsonbuf_lit(JB, LIT) jsonbuf_raw((JB), "" LIT, sizeof(LIT) - 1)
+
+void
+jsonbuf_ullong(JsonBuf *jb, unsigned long long value);
+
+void
+jsonbuf_llong(JsonBuf *jb, long long value);
+
+/* quoted and escaped */
+void
+jsonbuf_string(JsonBuf *jb, const char *str);
+
+#endif /* JSONBUF_H */
@@ -24,11 +24,27 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <pthread.h>
+#include <sched.h>
+
+#include "ringbuffer.h"
+#include "threading.h"
 
 
 #define UNUSED(IDENT) ((void)(IDENT))
 
+/*
+ * Bounded multi-producer/multi-consumer queue, after D. Vyukov.
+ * Each slot carries a sequence number telling which lap of the ring
+ * it belongs to, so producers and consumers only contend on the
+ * head/tail counters, never on a lock. Only consumers waiting on an
+ * empty ring go to sleep, using the futex-backed EventCount.
+ */
+
+enum {
+    CACHELINE_SIZE = 64,
+    RB_SPIN_COUNT = 16 /* before going to sleep */
+};
+
 
 typedef void (*rb_dump)(void *ud, const void *item);
 
@@ -40,47 +56,69 @@ no_dump(void *ud, const void *item)
     return;
 }
 
-typedef struct RingBuffer RingBuffer;
+typedef struct RingSlot RingSlot;
+struct RingSlot {
+    uint64_t seq;
+    /* elem_size bytes follows */
+};
+
 struct RingBuffer {
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
-    int waiters;
-
-    int size;
-    int used;
-    int start;
-    int end;
-    void *elems;
+    /* consumers side */
+    uint64_t head __attribute__((aligned(CACHELINE_SIZE)));
+
+    /* producers side */
+    uint64_t tail __attribute__((aligned(CACHELINE_SIZE)));
+
+    EventCount nonempty __attribute__((aligned(CACHELINE_SIZE)));
+
+    /* read-only after init */
+    int size __attribute__((aligned(CACHELINE_SIZE)));
     size_t elem_size;
+    size_t slot_size;
+    uint8_t *slots;
 
     rb_dump dump;
     void *dump_ud;
 };
 
+static RingSlot *
+rb_slot_at(RingBuffer *rb, uint64_t pos)
+{
+    return (RingSlot *)(rb->slots + (pos % rb->size) * rb->slot_size);
+}
+
+/* NOT thread safe: must be called while no producer or consumer runs */
 void
 ringbuffer_clear(RingBuffer *rb)
 {
-    pthread_mutex_lock(&rb->lock);
-    rb->start = 0;
-    rb->end = 0;
-    pthread_mutex_unlock(&rb->lock);
+    int i;
+    for (i = 0; i < rb->size; i++) {
+        rb_slot_at(rb, i)->seq = i;
+    }
+    rb->head = 0;
+    rb->tail = 0;
     return;
 }
 
 int
 ringbuffer_init(RingBuffer **rb, int size, size_t elem_size)
 {
-    void *ptr =NULL;
+    void *ptr = NULL;
+    size_t slot_size = sizeof(RingSlot) + ((elem_size + 7) & ~(size_t)7);
 
-    ptr = calloc(1, sizeof(RingBuffer) + (size * elem_size));
-    if (ptr) {
+    if (size <= 0) {
+        return -1;
+    }
+    if (posix_memalign(&ptr, CACHELINE_SIZE,
+                       sizeof(RingBuffer) + (size * slot_size)) == 0) {
         RingBuffer *buf = ptr;
 
-        pthread_mutex_init(&buf->lock, 0);
-        pthread_cond_init(&buf->cond, 0);
+        memset(buf, 0, sizeof(*buf));
+        eventcount_init(&buf->nonempty);
         buf->size = size;
-        buf->elems = buf + 1;
         buf->elem_size = elem_size;
+        buf->slot_size = slot_size;
+        buf->slots = (uint8_t *)(buf + 1);
         ringbuffer_clear(buf);
 
         buf->dump = no_dump;
@@ -97,86 +135,220 @@ ringbuffer_free(RingBuffer *rb)
     free(rb);
 }
 
-static int
-rb_is_full(const RingBuffer *rb)
+/*
+ * full/empty are snapshots: under concurrent access the answer
+ * may be stale by the time the caller looks at it.
+ */
+int
+ringbuffer_full(RingBuffer *rb)
 {
-    return rb->used == rb->size;
+    uint64_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+    return (tail - head) >= (uint64_t)rb->size;
 }
 
 int
-ringbuffer_full(RingBuffer *rb)
+ringbuffer_empty(RingBuffer *rb)
 {
-    int ret;
-    pthread_mutex_lock(&rb->lock);
-    ret = rb_is_full(rb);
-    pthread_mutex_unlock(&rb->lock);
-    return ret;
+    uint64_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+    return tail == head;
 }
 
 static int
-rb_is_empty(const RingBuffer *rb)
+rb_try_put(RingBuffer *rb, const void *elem)
 {
-    return !(rb->used);
+    uint64_t pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        RingSlot *slot = rb_slot_at(rb, pos);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)(seq - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&rb->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                memcpy(slot + 1, elem, rb->elem_size);
+                rb->dump(rb->dump_ud, slot + 1);
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+            /* lost the race: pos now holds the fresh tail */
+        } else if (dif < 0) {
+            return -1; /* full: slot still holds the previous lap */
+        } else {
+            pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+        }
+    }
 }
 
-int
-ringbuffer_empty(RingBuffer *rb)
+static int
+rb_try_get(RingBuffer *rb, void *elem)
 {
-    int ret;
-    pthread_mutex_lock(&rb->lock);
-    ret = rb_is_empty(rb);
-    pthread_mutex_unlock(&rb->lock);
-    return ret;
+    uint64_t pos = __atomic_load_n(&rb->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        RingSlot *slot = rb_slot_at(rb, pos);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)(seq - (pos + 1));
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&rb->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                memcpy(elem, slot + 1, rb->elem_size);
+                rb->dump(rb->dump_ud, slot + 1);
+                __atomic_store_n(&slot->seq, pos + rb->size,
+                                 __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (dif < 0) {
+            return -1; /* empty, or producer not done yet */
+        } else {
+            pos = __atomic_load_n(&rb->head, __ATOMIC_RELAXED);
+        }
+    }
 }
 
-static void *
-rb_item_at(RingBuffer *rb, int pos)
+/*
+ * batches reserve a run of consecutive slots with one CAS: first
+ * count how many slots of the run are ready, then claim exactly those.
+ */
+static int
+rb_try_put_many(RingBuffer *rb, const uint8_t *elems, int n)
 {
-    int off = (pos * rb->elem_size);
-    return ((uint8_t*)rb->elems) + off;
+    uint64_t pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int i, avail = 0;
+
+        while (avail < n) {
+            RingSlot *slot = rb_slot_at(rb, pos + avail);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + avail) {
+                break;
+            }
+            avail++;
+        }
+
+        if (avail == 0) {
+            RingSlot *slot = rb_slot_at(rb, pos);
+            uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if ((int64_t)(seq - pos) < 0) {
+                return 0; /* full */
+            }
+            pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&rb->tail, &pos, pos + avail, 1,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            for (i = 0; i < avail; i++) {
+                RingSlot *slot = rb_slot_at(rb, pos + i);
+                memcpy(slot + 1, elems + (i * rb->elem_size), rb->elem_size);
+                rb->dump(rb->dump_ud, slot + 1);
+                __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+            }
+            return avail;
+        }
+    }
 }
 
-int
-ringbuffer_put(RingBuffer *rb, void *elem)
+static int
+rb_try_get_many(RingBuffer *rb, uint8_t *elems, int n)
 {
-    int ret = 0;
-    pthread_mutex_lock(&rb->lock);
+    uint64_t pos = __atomic_load_n(&rb->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int i, ready = 0;
 
-    if (!rb_is_full(rb)) {
-        rb->used++;
-        memcpy(rb_item_at(rb, rb->end), elem, rb->elem_size);
-        rb->dump(rb->dump_ud, rb_item_at(rb, rb->end));
-        rb->end = (rb->end + 1) % rb->size;
+        while (ready < n) {
+            RingSlot *slot = rb_slot_at(rb, pos + ready);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + ready + 1) {
+                break;
+            }
+            ready++;
+        }
+
+        if (ready == 0) {
+            RingSlot *slot = rb_slot_at(rb, pos);
+            uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if ((int64_t)(seq - (pos + 1)) < 0) {
+                return 0; /* empty */
+            }
+            pos = __atomic_load_n(&rb->head, __ATOMIC_RELAXED);
+            continue;
+        }
 
-        if (rb->waiters > 0) {
-            pthread_cond_signal(&rb->cond);
+        if (__atomic_compare_exchange_n(&rb->head, &pos, pos + ready, 1,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            for (i = 0; i < ready; i++) {
+                RingSlot *slot = rb_slot_at(rb, pos + i);
+                memcpy(elems + (i * rb->elem_size), slot + 1, rb->elem_size);
+                rb->dump(rb->dump_ud, slot + 1);
+                __atomic_store_n(&slot->seq, pos + i + rb->size,
+                                 __ATOMIC_RELEASE);
+            }
+            return ready;
         }
-    } else {
-        ret = -1;
     }
+}
 
-    pthread_mutex_unlock(&rb->lock);
-    return ret;
+int
+ringbuffer_put_many(RingBuffer *rb, void *elems, int n)
+{
+    int done = (n > 0) ?rb_try_put_many(rb, elems, n) :0;
+    if (done > 0) {
+        eventcount_notify(&rb->nonempty, done);
+    }
+    return done;
 }
- 
+
 int
-ringbuffer_get(RingBuffer *rb, void *elem)
+ringbuffer_get_many(RingBuffer *rb, void *elems, int n)
 {
-    pthread_mutex_lock(&rb->lock);
+    return (n > 0) ?rb_try_get_many(rb, elems, n) :0;
+}
+
+int
+ringbuffer_try_get(RingBuffer *rb, void *elem)
+{
+    return rb_try_get(rb, elem);
+}
 
-    rb->waiters++;
-    while (rb_is_empty(rb)) {
-        pthread_cond_wait(&rb->cond, &rb->lock);
+int
+ringbuffer_put(RingBuffer *rb, void *elem)
+{
+    if (rb_try_put(rb, elem) < 0) {
+        return -1;
     }
-    rb->waiters--;
+    eventcount_notify(&rb->nonempty, 1);
+    return 0;
+}
+ 
+int
+ringbuffer_get(RingBuffer *rb, void *elem)
+{
+    for (;;) {
+        gint key;
+        int spin;
 
-    rb->used--;
-    memcpy(elem, rb_item_at(rb, rb->start), rb->elem_size);
-    rb->dump(rb->dump_ud, rb_item_at(rb, rb->start));
-    rb->start = (rb->start + 1) % rb->size;
+        for (spin = 0; spin < RB_SPIN_COUNT; spin++) {
+            if (rb_try_get(rb, elem) == 0) {
+                return 0;
+            }
+            sched_yield();
+        }
 
-    pthread_mutex_unlock(&rb->lock);
-    return 0;
+        key = eventcount_prepare(&rb->nonempty);
+        if (rb_try_get(rb, elem) == 0) {
+            eventcount_cancel(&rb->nonempty);
+            return 0;
+        }
+        eventcount_wait(&rb->nonempty, key, -1);
+    }
 }
 
 void
@@ -185,4 +357,3 @@ ringbuffer_set_dump(RingBuffer *rb, rb_dump dump, void *ud)
     rb->dump = dump;
     rb->dump_ud = ud;
 }
-
@@ -45,6 +45,20 @@ ringbuffer_put(RingBuffer *rb, void *elem);
 int
 ringbuffer_get(RingBuffer *rb, void *elem);
 
+/* like ringbuffer_get, but fails instead of blocking */
+int
+ringbuffer_try_get(RingBuffer *rb, void *elem);
+
+/*
+ * batch variants: move up to n contiguous elements with a single
+ * reservation. Return how many elements were moved; never block.
+ */
+int
+ringbuffer_put_many(RingBuffer *rb, void *elems, int n);
+
+int
+ringbuffer_get_many(RingBuffer *rb, void *elems, int n);
+
 
 #endif /* RINGBUFFER_H */
 
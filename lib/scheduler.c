@@ -19,20 +19,460 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "scheduler.h"
 #include "vmonlib.h"
 
 
+/*
+ * hierarchical timing wheel: WHEEL_LEVELS rings of WHEEL_SLOTS lists,
+ * each slot of a level spanning a whole ring of the level below.
+ * Arm and cancel are O(1); a timer moves down one level at most
+ * WHEEL_LEVELS - 1 times before it fires.
+ */
+enum {
+    WHEEL_TICK = 10, /* milliseconds */
+    WHEEL_BITS = 6,
+    WHEEL_SLOTS = 1 << WHEEL_BITS,
+    WHEEL_MASK = WHEEL_SLOTS - 1,
+    WHEEL_LEVELS = 4, /* WHEEL_SLOTS^4 ticks: about 46 hours */
+    WHEEL_INDEX_BITS = 20, /* up to 1M timers at once */
+    WHEEL_INDEX_MASK = (1 << WHEEL_INDEX_BITS) - 1,
+    WHEEL_MIN_TIMERS = 256,
+    WHEEL_NIL = -1
+};
+
+enum {
+    TIMER_FREE = 0,
+    TIMER_ARMED,
+    TIMER_FIRING,
+    TIMER_CANCELLED /* while firing */
+};
+
+typedef struct WheelTimer WheelTimer;
+struct WheelTimer {
+    ScheduledFunction task;
+    gpointer data;
+    uint64_t expire; /* tick */
+    int ticks; /* period */
+    int prev;
+    int next; /* also links the free and the expired lists */
+    short level;
+    short slot;
+    guint gen; /* tells apart the reuses of this entry */
+    int state;
+};
+
+/* timers are referenced by index: the array may be reallocated */
+typedef struct TimerWheel TimerWheel;
+struct TimerWheel {
+    pthread_mutex_t lock;
+    uint64_t now; /* ticks elapsed while armed */
+    int slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    WheelTimer *timers;
+    int size;
+    int free;
+    int armed;
+    gboolean ticking;
+    int timerfd;
+    int stopfd;
+    GThread *thread;
+};
+
+
 struct Scheduler {
     GMainContext *context;
     GMainLoop *loop;
     GThread *thread;
     gboolean standalone;
+    TimerWheel *wheel; /* if set, replaces all the above */
 };
 
 
+static TimerWheel *
+wheel_new(void)
+{
+    TimerWheel *w = calloc(1, sizeof(TimerWheel));
+    int l, s;
+
+    if (!w) {
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, 0);
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+        for (s = 0; s < WHEEL_SLOTS; s++) {
+            w->slots[l][s] = WHEEL_NIL;
+        }
+    }
+    w->free = WHEEL_NIL;
+    w->timerfd = -1;
+    w->stopfd = -1;
+    return w;
+}
+
+static void
+wheel_free(TimerWheel *w)
+{
+    pthread_mutex_destroy(&w->lock);
+    free(w->timers);
+    free(w);
+}
+
+static guint
+wheel_timer_id(TimerWheel *w, int idx)
+{
+    return (w->timers[idx].gen << WHEEL_INDEX_BITS) | (idx + 1);
+}
+
+static int
+wheel_timer_index(TimerWheel *w, guint id)
+{
+    int idx = (int)(id & WHEEL_INDEX_MASK) - 1;
+
+    if (idx < 0 || idx >= w->size ||
+        wheel_timer_id(w, idx) != id ||
+        w->timers[idx].state == TIMER_FREE) {
+        return WHEEL_NIL;
+    }
+    return idx;
+}
+
+static int
+wheel_timer_alloc(TimerWheel *w)
+{
+    int idx;
+
+    if (w->free == WHEEL_NIL) {
+        int size = (w->size) ?w->size * 2 :WHEEL_MIN_TIMERS;
+        WheelTimer *timers = NULL;
+
+        if (size > WHEEL_INDEX_MASK) {
+            return WHEEL_NIL;
+        }
+        timers = realloc(w->timers, size * sizeof(WheelTimer));
+        if (!timers) {
+            return WHEEL_NIL;
+        }
+        memset(timers + w->size, 0, (size - w->size) * sizeof(WheelTimer));
+        for (idx = size - 1; idx >= w->size; idx--) {
+            timers[idx].next = w->free;
+            w->free = idx;
+        }
+        w->timers = timers;
+        w->size = size;
+    }
+
+    idx = w->free;
+    w->free = w->timers[idx].next;
+    return idx;
+}
+
+static void
+wheel_timer_release(TimerWheel *w, int idx)
+{
+    WheelTimer *t = &w->timers[idx];
+    t->state = TIMER_FREE;
+    t->gen = (t->gen + 1) & (G_MAXUINT >> WHEEL_INDEX_BITS);
+    t->next = w->free;
+    w->free = idx;
+}
+
+static void
+wheel_link(TimerWheel *w, int idx)
+{
+    WheelTimer *t = &w->timers[idx];
+    uint64_t delta = (t->expire > w->now) ?t->expire - w->now :0;
+    int level = 0;
+    int *head;
+
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    t->level = level;
+    t->slot = (delta) ?(t->expire >> (WHEEL_BITS * level)) & WHEEL_MASK
+                      :w->now & WHEEL_MASK;
+
+    head = &w->slots[t->level][t->slot];
+    t->prev = WHEEL_NIL;
+    t->next = *head;
+    if (*head != WHEEL_NIL) {
+        w->timers[*head].prev = idx;
+    }
+    *head = idx;
+}
+
+static void
+wheel_unlink(TimerWheel *w, int idx)
+{
+    WheelTimer *t = &w->timers[idx];
+
+    if (t->prev != WHEEL_NIL) {
+        w->timers[t->prev].next = t->next;
+    } else {
+        w->slots[t->level][t->slot] = t->next;
+    }
+    if (t->next != WHEEL_NIL) {
+        w->timers[t->next].prev = t->prev;
+    }
+}
+
+/*
+ * ticks only while there are armed timers. Stopping is left to the
+ * timer thread, so a quick add/del pair does not cost two syscalls.
+ * Must be called with the lock held.
+ */
+static void
+wheel_set_ticking(TimerWheel *w, gboolean on)
+{
+    struct itimerspec its;
+
+    if (w->ticking == on) {
+        return;
+    }
+    w->ticking = on;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_interval.tv_nsec = WHEEL_TICK * 1000000L;
+        its.it_value = its.it_interval;
+    }
+    timerfd_settime(w->timerfd, 0, &its, NULL);
+}
+
+/* must be called with the lock held */
+static void
+wheel_arm(TimerWheel *w, int idx)
+{
+    WheelTimer *t = &w->timers[idx];
+
+    t->state = TIMER_ARMED;
+    /* one more tick: the current one is already partly gone */
+    t->expire = w->now + t->ticks + 1;
+    wheel_link(w, idx);
+    w->armed++;
+    wheel_set_ticking(w, TRUE);
+}
+
+/* must be called with the lock held */
+static void
+wheel_disarm(TimerWheel *w, int idx)
+{
+    wheel_unlink(w, idx);
+    w->armed--;
+}
+
+static void
+wheel_cascade(TimerWheel *w, int level)
+{
+    int *head = &w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    int idx = *head;
+
+    *head = WHEEL_NIL;
+    while (idx != WHEEL_NIL) {
+        int next = w->timers[idx].next;
+        wheel_link(w, idx);
+        idx = next;
+    }
+}
+
+/*
+ * advances by one tick; the timers expired are moved on the
+ * `expired' list. Must be called with the lock held.
+ */
+static void
+wheel_advance(TimerWheel *w, int *expired)
+{
+    int *head;
+    int level = 0;
+    int idx;
+
+    w->now++;
+    while (level < WHEEL_LEVELS - 1 &&
+           ((w->now >> (WHEEL_BITS * level)) & WHEEL_MASK) == 0) {
+        level++;
+    }
+    for (; level > 0; level--) {
+        wheel_cascade(w, level);
+    }
+
+    head = &w->slots[0][w->now & WHEEL_MASK];
+    idx = *head;
+    *head = WHEEL_NIL;
+    while (idx != WHEEL_NIL) {
+        int next = w->timers[idx].next;
+        w->timers[idx].state = TIMER_FIRING;
+        w->timers[idx].next = *expired;
+        *expired = idx;
+        w->armed--;
+        idx = next;
+    }
+}
+
+static void
+wheel_fire(TimerWheel *w, int expired)
+{
+    while (expired != WHEEL_NIL) {
+        WheelTimer t;
+        int idx = expired;
+        gboolean again;
+
+        pthread_mutex_lock(&w->lock);
+        memcpy(&t, &w->timers[idx], sizeof(t));
+        pthread_mutex_unlock(&w->lock);
+
+        expired = t.next;
+        again = t.task(t.data); /* outside the lock: it may add timers */
+
+        pthread_mutex_lock(&w->lock);
+        if (again && w->timers[idx].state == TIMER_FIRING) {
+            wheel_arm(w, idx);
+        } else {
+            wheel_timer_release(w, idx);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static gpointer
+wheel_run(gpointer data)
+{
+    TimerWheel *w = data;
+    struct pollfd fds[2];
+
+    fds[0].fd = w->timerfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = w->stopfd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        uint64_t ticks = 0;
+        int expired = WHEEL_NIL;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            g_warning("timing wheel poll failed: %i", errno);
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        if (read(w->timerfd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+            continue; /* disarmed meanwhile */
+        }
+
+        pthread_mutex_lock(&w->lock);
+        while (ticks-- > 0 && w->armed > 0) {
+            wheel_advance(w, &expired);
+        }
+        if (w->armed == 0 && expired == WHEEL_NIL) {
+            wheel_set_ticking(w, FALSE);
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        wheel_fire(w, expired);
+    }
+    return NULL;
+}
+
+static int
+wheel_start(TimerWheel *w)
+{
+    GError *error = NULL;
+
+    w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    w->stopfd = eventfd(0, EFD_CLOEXEC);
+    if (w->timerfd < 0 || w->stopfd < 0) {
+        g_message("timing wheel setup failed: %i", errno);
+        return -1;
+    }
+
+    w->thread = g_thread_try_new("scheduler", wheel_run, w, &error);
+    if (!w->thread) {
+        g_message("timing wheel start failed: %s", error->message);
+        g_error_free(error);
+        return -1;
+    }
+    g_message("timing wheel scheduler started");
+    return 0;
+}
+
+static void
+wheel_stop(TimerWheel *w)
+{
+    uint64_t one = 1;
+
+    if (w->thread) {
+        if (write(w->stopfd, &one, sizeof(one)) != sizeof(one)) {
+            g_warning("failed to stop the timing wheel: %i", errno);
+            return;
+        }
+        g_thread_join(w->thread);
+        w->thread = NULL;
+    }
+    if (w->timerfd >= 0) {
+        close(w->timerfd);
+    }
+    if (w->stopfd >= 0) {
+        close(w->stopfd);
+    }
+    w->timerfd = -1;
+    w->stopfd = -1;
+}
+
+static guint
+wheel_add(TimerWheel *w, int delay, ScheduledFunction task, gpointer data)
+{
+    guint id = 0;
+    int idx;
+
+    pthread_mutex_lock(&w->lock);
+    idx = wheel_timer_alloc(w);
+    if (idx != WHEEL_NIL) {
+        WheelTimer *t = &w->timers[idx];
+        t->task = task;
+        t->data = data;
+        t->ticks = MAX((delay + WHEEL_TICK - 1) / WHEEL_TICK, 1);
+        t->ticks = MIN(t->ticks, (1 << (WHEEL_BITS * WHEEL_LEVELS)) - 2);
+        wheel_arm(w, idx);
+        id = wheel_timer_id(w, idx);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return id;
+}
+
+static int
+wheel_del(TimerWheel *w, guint id)
+{
+    int idx;
+    int err = 0;
+
+    pthread_mutex_lock(&w->lock);
+    idx = wheel_timer_index(w, id);
+    if (idx == WHEEL_NIL) {
+        err = -1;
+    } else if (w->timers[idx].state == TIMER_ARMED) {
+        wheel_disarm(w, idx);
+        wheel_timer_release(w, idx);
+    } else if (w->timers[idx].state == TIMER_FIRING) {
+        /* too late for this run, but it will not run again */
+        w->timers[idx].state = TIMER_CANCELLED;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return err;
+}
+
+
 int scheduler_init(Scheduler **sched, gboolean standalone)
 {
     int err = -1;
@@ -45,8 +485,27 @@ int scheduler_init(Scheduler **sched, gboolean standalone)
     return err;
 }
 
+int scheduler_init_wheel(Scheduler **sched)
+{
+    int err = -1;
+    Scheduler *sc = calloc(1, sizeof(*sc));
+    if (sc) {
+        sc->wheel = wheel_new();
+        if (sc->wheel) {
+            *sched = sc;
+            err = 0;
+        } else {
+            free(sc);
+        }
+    }
+    return err;
+}
+
 int scheduler_free(Scheduler *sched)
 {
+    if (sched->wheel) {
+        wheel_free(sched->wheel);
+    }
     free(sched);
     return 0;
 }
@@ -87,6 +546,9 @@ scheduler_start_standalone(Scheduler *sched)
 
 int scheduler_start(Scheduler *sched)
 {
+    if (sched->wheel) {
+        return wheel_start(sched->wheel);
+    }
     if (!sched->standalone) {
         sched->context = g_main_context_default();
         sched->loop = NULL; /* MUST be null */
@@ -98,7 +560,9 @@ int scheduler_start(Scheduler *sched)
 int scheduler_stop(Scheduler *sched, int wait)
 {
     UNUSED(wait);
-    if (sched->standalone) {
+    if (sched->wheel) {
+        wheel_stop(sched->wheel);
+    } else if (sched->standalone) {
         g_main_loop_quit(sched->loop);
         g_thread_join(sched->thread);
     }
@@ -108,8 +572,13 @@ int scheduler_stop(Scheduler *sched, int wait)
 guint scheduler_add(Scheduler *sched, int delay, ScheduledFunction task, gpointer data)
 {
     guint id;
-    GSource *source = g_timeout_source_new(delay); /* ms */
+    GSource *source = NULL;
+
+    if (sched->wheel) {
+        return wheel_add(sched->wheel, delay, task, data);
+    }
 
+    source = g_timeout_source_new(delay); /* ms */
     g_source_set_callback(source, task, data, NULL);
     id = g_source_attach(source, sched->context);
     g_source_unref(source);
@@ -119,8 +588,18 @@ guint scheduler_add(Scheduler *sched, int delay, ScheduledFunction task, gpointe
 
 int scheduler_del(Scheduler *sched, guint id)
 {
-    UNUSED(sched);
-    g_source_remove(id);
+    GSource *source = NULL;
+
+    if (sched->wheel) {
+        return wheel_del(sched->wheel, id);
+    }
+
+    /* g_source_remove() only looks in the global default context */
+    source = g_main_context_find_source_by_id(sched->context, id);
+    if (!source) {
+        return -1;
+    }
+    g_source_destroy(source);
     return 0;
 }
 
@@ -38,6 +38,13 @@ typedef gboolean (*ScheduledFunction)(gpointer data);
  */
 int scheduler_init(Scheduler **sched, gboolean standalone);
 
+/*
+ * hierarchical timing wheel driven by its own timer thread:
+ * O(1) add and del, 10ms resolution, never fires early.
+ * Tasks run in the timer thread, so they must be quick.
+ */
+int scheduler_init_wheel(Scheduler **sched);
+
 int scheduler_free(Scheduler *sched);
 
 int scheduler_start(Scheduler *sched);
@@ -53,6 +60,10 @@ guint scheduler_add(Scheduler *sched,
                     ScheduledFunction task,
                     gpointer data);
 
+/*
+ * a task already running completes, but it is not rescheduled
+ * returns -1 if `id' is unknown
+ */
 int scheduler_del(Scheduler *sched, guint id);
 
 
@@ -0,0 +1,212 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "slab.h"
+
+
+enum {
+    SLAB_MIN_SHIFT = 8, /* 256 bytes, the smallest class */
+    SLAB_CLASSES = 9, /* up to 64 KiB */
+    SLAB_CHUNK_SIZE = 256 * 1024, /* bytes carved at once */
+    SLAB_LARGE = -1
+};
+
+/* the header in front of every block */
+typedef union SlabBlock SlabBlock;
+union SlabBlock {
+    struct {
+        SlabBlock *next; /* in the free list */
+        int size_class;
+    } h;
+    long double align; /* keep the payload aligned as malloc() does */
+};
+
+typedef union SlabChunk SlabChunk;
+union SlabChunk {
+    SlabChunk *next;
+    long double align;
+};
+
+typedef struct SlabClass SlabClass;
+struct SlabClass {
+    pthread_mutex_t lock;
+    SlabBlock *free;
+    SlabChunk *chunks;
+};
+
+struct Slab {
+    SlabClass classes[SLAB_CLASSES];
+    SlabStats stats;
+};
+
+
+#define STATS_ADD(SLAB, FIELD, VALUE) \
+    __atomic_add_fetch(&(SLAB)->stats.FIELD, (VALUE), __ATOMIC_RELAXED)
+
+
+static size_t
+class_size(int cls)
+{
+    return (size_t)1 << (SLAB_MIN_SHIFT + cls);
+}
+
+static int
+class_of(size_t size)
+{
+    int cls = 0;
+    while (cls < SLAB_CLASSES && class_size(cls) < size) {
+        cls++;
+    }
+    return (cls < SLAB_CLASSES) ?cls :SLAB_LARGE;
+}
+
+int
+slab_init(Slab **slab)
+{
+    Slab *sl = calloc(1, sizeof(Slab));
+    int j;
+
+    if (!sl) {
+        return -1;
+    }
+    for (j = 0; j < SLAB_CLASSES; j++) {
+        pthread_mutex_init(&sl->classes[j].lock, 0);
+    }
+    *slab = sl;
+    return 0;
+}
+
+void
+slab_free(Slab *slab)
+{
+    int j;
+
+    if (!slab) {
+        return;
+    }
+    for (j = 0; j < SLAB_CLASSES; j++) {
+        SlabChunk *chunk = slab->classes[j].chunks;
+        while (chunk) {
+            SlabChunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        pthread_mutex_destroy(&slab->classes[j].lock);
+    }
+    free(slab);
+}
+
+/* must be called with the class lock held */
+static int
+slab_grow(Slab *slab, int cls)
+{
+    SlabClass *sc = &slab->classes[cls];
+    size_t block_size = sizeof(SlabBlock) + class_size(cls);
+    size_t count = SLAB_CHUNK_SIZE / block_size;
+    SlabChunk *chunk = malloc(sizeof(SlabChunk) + count * block_size);
+    uint8_t *blocks;
+    size_t j;
+
+    if (!chunk) {
+        return -1;
+    }
+    chunk->next = sc->chunks;
+    sc->chunks = chunk;
+
+    blocks = (uint8_t *)(chunk + 1);
+    for (j = 0; j < count; j++) {
+        SlabBlock *block = (SlabBlock *)(blocks + j * block_size);
+        block->h.size_class = cls;
+        block->h.next = sc->free;
+        sc->free = block;
+    }
+
+    STATS_ADD(slab, slabs, 1);
+    return 0;
+}
+
+void *
+slab_alloc(Slab *slab, size_t size)
+{
+    int cls = class_of(size);
+    SlabBlock *block = NULL;
+
+    if (cls == SLAB_LARGE) {
+        block = malloc(sizeof(SlabBlock) + size);
+        if (!block) {
+            return NULL;
+        }
+        block->h.size_class = SLAB_LARGE;
+        STATS_ADD(slab, large, 1);
+    } else {
+        SlabClass *sc = &slab->classes[cls];
+
+        pthread_mutex_lock(&sc->lock);
+        if (sc->free || slab_grow(slab, cls) == 0) {
+            block = sc->free;
+            sc->free = block->h.next;
+        }
+        pthread_mutex_unlock(&sc->lock);
+
+        if (!block) {
+            return NULL;
+        }
+    }
+
+    STATS_ADD(slab, allocs, 1);
+    return block + 1;
+}
+
+void
+slab_release(Slab *slab, void *ptr)
+{
+    SlabBlock *block;
+    SlabClass *sc;
+
+    if (!ptr) {
+        return;
+    }
+    block = (SlabBlock *)ptr - 1;
+    if (block->h.size_class == SLAB_LARGE) {
+        free(block);
+        return;
+    }
+
+    sc = &slab->classes[block->h.size_class];
+    pthread_mutex_lock(&sc->lock);
+    block->h.next = sc->free;
+    sc->free = block;
+    pthread_mutex_unlock(&sc->lock);
+}
+
+void
+slab_get_stats(Slab *slab, SlabStats *stats)
+{
+    __atomic_load(&slab->stats.allocs, &stats->allocs, __ATOMIC_RELAXED);
+    __atomic_load(&slab->stats.large, &stats->large, __ATOMIC_RELAXED);
+    __atomic_load(&slab->stats.slabs, &stats->slabs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,61 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdlib.h>
+
+/*
+ * pool of memory blocks in power of two size classes, carved out
+ * of big slabs and recycled through per-class free lists.
+ * Blocks bigger than the largest class are plain malloc()s.
+ * Thread safe.
+ */
+typedef struct Slab Slab;
+
+typedef struct SlabStats SlabStats;
+struct SlabStats {
+    unsigned long allocs;
+    unsigned long large; /* allocations served by malloc() */
+    unsigned long slabs; /* slabs carved so far */
+};
+
+int
+slab_init(Slab **slab);
+
+/*
+ * releases all the slabs, so any block still in use becomes invalid.
+ * Large blocks still in use are not tracked, and they leak.
+ */
+void
+slab_free(Slab *slab);
+
+void *
+slab_alloc(Slab *slab, size_t size);
+
+void
+slab_release(Slab *slab, void *ptr);
+
+void
+slab_get_stats(Slab *slab, SlabStats *stats);
+
+#endif /* SLAB_H */
@@ -19,6 +19,13 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
 #include "threading.h"
 
 
@@ -97,3 +104,65 @@ event_wait(Event *ev, gint timeout) /* ms */
     return ret;
 }
 
+
+
+static int
+futex_wait(gint *addr, gint val, gint timeout) /* ms */
+{
+    struct timespec ts;
+    struct timespec *tsp = NULL;
+
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        tsp = &ts;
+    }
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0);
+}
+
+static int
+futex_wake(gint *addr, gint count)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void
+eventcount_init(EventCount *ec)
+{
+    ec->seq = 0;
+    ec->waiters = 0;
+}
+
+gint
+eventcount_prepare(EventCount *ec)
+{
+    __atomic_add_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ec->seq, __ATOMIC_SEQ_CST);
+}
+
+void
+eventcount_cancel(EventCount *ec)
+{
+    __atomic_sub_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+gboolean
+eventcount_wait(EventCount *ec, gint key, gint timeout) /* ms */
+{
+    int rc = futex_wait(&ec->seq, key, timeout);
+    int err = (rc < 0) ?errno :0;
+
+    __atomic_sub_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+    return err != ETIMEDOUT;
+}
+
+void
+eventcount_notify(EventCount *ec, gint count)
+{
+    /* pairs with the increment in eventcount_prepare */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ec->waiters, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(&ec->seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&ec->seq, (count > 0) ?count :INT_MAX);
+    }
+}
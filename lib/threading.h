@@ -50,5 +50,33 @@ event_is_set(Event *ev);
 gboolean
 event_wait(Event *ev, gint timeout); /* ms */
 
+
+/*
+ * lightweight wait/notify for lock-free structures:
+ * the waiter takes a key with eventcount_prepare, rechecks its
+ * condition, then sleeps on the key; the notifier only enters the
+ * kernel if someone is actually sleeping.
+ */
+typedef struct EventCount EventCount;
+struct EventCount {
+    gint seq;
+    gint waiters;
+};
+
+void
+eventcount_init(EventCount *ec);
+
+gint
+eventcount_prepare(EventCount *ec);
+
+void
+eventcount_cancel(EventCount *ec);
+
+gboolean
+eventcount_wait(EventCount *ec, gint key, gint timeout); /* ms, <0: forever */
+
+void
+eventcount_notify(EventCount *ec, gint count);
+
 #endif /* THREADING_H */
 
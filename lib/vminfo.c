@@ -64,29 +64,38 @@ vminfo_init(VmInfo *vm)
     memset(vm, 0, sizeof(*vm));
 }
 
+void
+vminfo_init_arena(VmInfo *vm, Arena *arena)
+{
+    memset(vm, 0, sizeof(*vm));
+    vm->arena = arena;
+}
+
 void
 vminfo_free(VmInfo *vm)
 {
+    if (vm->arena) {
+        return;
+    }
     vcpuinfo_free(&vm->vcpu);
     blockinfo_free(&vm->block);
     ifaceinfo_free(&vm->iface);
 }
 
 static void
-vm_send_event_block(const char *type, const BlockStats *stats, FILE *out)
+vm_send_event_block(const char *type, const BlockStats *stats, JsonBuf *out)
 {
-    fprintf(out,
-            "{\"event\": \"%s\","
-            " \"class\": \"block\","
-            " \"device\": \"%s\","
-            " \"allocation\": %llu,"
-            " \"capacity\": %llu,"
-            " \"physical\": %llu}",
-            type,
-            (stats->xname) ?stats->xname :stats->name,
-            stats->allocation,
-            stats->capacity,
-            stats->physical);
+    jsonbuf_lit(out, "{\"event\": ");
+    jsonbuf_string(out, type);
+    jsonbuf_lit(out, ", \"class\": \"block\", \"device\": ");
+    jsonbuf_string(out, (stats->xname) ?stats->xname :stats->name);
+    jsonbuf_lit(out, ", \"allocation\": ");
+    jsonbuf_ullong(out, stats->allocation);
+    jsonbuf_lit(out, ", \"capacity\": ");
+    jsonbuf_ullong(out, stats->capacity);
+    jsonbuf_lit(out, ", \"physical\": ");
+    jsonbuf_ullong(out, stats->physical);
+    jsonbuf_lit(out, "}");
 }
 
 enum {
@@ -112,7 +121,7 @@ vm_check_triggered_usage_threshold(const BlockStats *stats,
 }
 
 int
-vminfo_send_events(VmInfo *vm, const VmChecks *checks, FILE *out)
+vminfo_send_events(VmInfo *vm, const VmChecks *checks, JsonBuf *out)
 {
     int err = 0;
     size_t i;
@@ -26,6 +26,9 @@
 
 #include <libvirt/libvirt.h>
 
+#include "arena.h"
+#include "jsonbuf.h"
+
 
 enum {
     STATS_NAME_LEN = 128,
@@ -130,6 +133,8 @@ struct VmInfo {
     VCpuInfo vcpu;
     BlockInfo block;
     IfaceInfo iface;
+
+    Arena *arena; /* of the dynamic parts, if any */
 };
 
 
@@ -141,15 +146,47 @@ struct VmChecks {
 void
 vminfo_init(VmInfo *vm);
 
+/* the dynamic parts are carved from the arena, and go with its reset */
+void
+vminfo_init_arena(VmInfo *vm, Arena *arena);
+
 int
 vminfo_parse(VmInfo *vm,
              const virDomainStatsRecordPtr record);
 
+/*
+ * the field layouts of the records seen, per domain: a record with a
+ * known layout is decoded by index, without looking at the names.
+ */
+typedef struct VmShapes VmShapes;
+
+int
+vmshapes_init(VmShapes **shapes);
+
+void
+vmshapes_free(VmShapes *shapes);
+
+void
+vmshapes_stats(VmShapes *shapes, unsigned long *domains,
+               unsigned long *hits, unsigned long *learned);
+
+/*
+ * like vminfo_parse, through the layout of the previous records with
+ * the same key, if any. The key tells apart the domains, and the stats
+ * asked for; 0, or no shapes, parses the names.
+ */
+int
+vminfo_parse_shaped(VmInfo *vm,
+                    const virDomainStatsRecordPtr record,
+                    VmShapes *shapes, unsigned long long key);
+
+/* appends to the text in out; -1 if it is truncated */
 int
-vminfo_print_json(VmInfo *vm, FILE *out);
+vminfo_print_json(VmInfo *vm, JsonBuf *out);
 
+/* appends them to the text in out */
 int
-vminfo_send_events(VmInfo *vm, const VmChecks *checks, FILE *out);
+vminfo_send_events(VmInfo *vm, const VmChecks *checks, JsonBuf *out);
 
 void
 vminfo_free(VmInfo *vm);
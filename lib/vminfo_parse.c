@@ -20,335 +20,705 @@
  */
 
 #include <ctype.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "vminfo.h"
 
 
 enum {
-    INDEX_BUF_SIZE = 128,
-    PARAM_BUF_SIZE = 2048
+    FIELD_HASH_BITS = 6,
+    FIELD_HASH_MUL = 0x520d91d1, /* no two fields share a slot */
+    FIELD_DEVICES_MAX = 4096 /* per group, past these they are ignored */
 };
 
+enum {
+    FIELD_GROUP_VM, /* offset in VmInfo */
+    FIELD_GROUP_VCPU, /* per device: offset in the stats of the index */
+    FIELD_GROUP_BLOCK,
+    FIELD_GROUP_NET,
+    FIELD_GROUPS
+};
 
-static int
-strequals(const char *s1, const char *s2)
-{
-    return strcmp(s1, s2) == 0;
-}
-
-static int
-strstartswith(const char *longest, const char *prefix)
-{
-    char *ret = strstr(longest, prefix);
-    return ret == longest;
-}
+enum {
+    FIELD_ULLONG,
+    FIELD_INT,
+    FIELD_SIZE,
+    FIELD_COUNT, /* of the devices of the group */
+    FIELD_NAME
+};
 
+/* where a field goes, from its name without the device index */
+typedef struct FieldSlot FieldSlot;
+struct FieldSlot {
+    const char *key;
+    int group;
+    int type;
+    size_t offset;
+};
 
-#define DISPATCH(NAME, FIELD) do { \
-    if (strequals(name, # NAME)) { \
-        stats->FIELD = item->value.ul; \
-        return; \
-    } \
-} while (0)
+#define SLOT(HASH, KEY, GROUP, TYPE, STRUCT, MEMBER) \
+    [HASH] = { KEY, FIELD_GROUP_ ## GROUP, FIELD_ ## TYPE, \
+               offsetof(STRUCT, MEMBER) }
 
+#define COUNT(HASH, KEY, GROUP) \
+    [HASH] = { KEY, FIELD_GROUP_ ## GROUP, FIELD_COUNT, 0 }
 
-#define SETUP(STATS, NAME, ITEM) do { \
-    if (strequals(NAME, "name")) { \
-        size_t len = strlen(ITEM->value.s); \
-        if (len > (STATS_NAME_LEN - 1)) { \
-            STATS->xname = strdup(ITEM->value.s); \
-        } else { \
-            strncpy(STATS->name, ITEM->value.s, STATS_NAME_LEN); \
-        } \
-        return; \
-    } \
-} while (0)
+/*
+ * perfect hash over the libvirt field grammar, group[.N].suffix.
+ * The slots come from field_hash() on the keys: adding a field means
+ * searching a FIELD_HASH_MUL which still spreads them all apart, then
+ * listing it in the known fields of tests/test_vminfo.c.
+ */
+static const FieldSlot field_slots[1 << FIELD_HASH_BITS] = {
+    SLOT(56, "cpu.time", VM, ULLONG, VmInfo, pcpu.time),
+    SLOT(22, "cpu.user", VM, ULLONG, VmInfo, pcpu.user),
+    SLOT(45, "cpu.system", VM, ULLONG, VmInfo, pcpu.system),
+
+    SLOT(36, "balloon.current", VM, ULLONG, VmInfo, balloon.current),
+    SLOT(0, "balloon.maximum", VM, ULLONG, VmInfo, balloon.maximum),
+
+    SLOT(42, "vcpu.current", VM, SIZE, VmInfo, vcpu.current),
+    COUNT(5, "vcpu.maximum", VCPU),
+    SLOT(12, "vcpu.state", VCPU, INT, VCpuStats, state),
+    SLOT(8, "vcpu.time", VCPU, ULLONG, VCpuStats, time),
+
+    COUNT(26, "block.count", BLOCK),
+    SLOT(58, "block.name", BLOCK, NAME, BlockStats, xname),
+    SLOT(6, "block.rd.reqs", BLOCK, ULLONG, BlockStats, rd_reqs),
+    SLOT(20, "block.rd.bytes", BLOCK, ULLONG, BlockStats, rd_bytes),
+    SLOT(21, "block.rd.times", BLOCK, ULLONG, BlockStats, rd_times),
+    SLOT(50, "block.wr.reqs", BLOCK, ULLONG, BlockStats, wr_reqs),
+    SLOT(31, "block.wr.bytes", BLOCK, ULLONG, BlockStats, wr_bytes),
+    SLOT(33, "block.wr.times", BLOCK, ULLONG, BlockStats, wr_times),
+    SLOT(63, "block.fl.bytes", BLOCK, ULLONG, BlockStats, fl_bytes),
+    SLOT(1, "block.fl.times", BLOCK, ULLONG, BlockStats, fl_times),
+    SLOT(18, "block.allocation", BLOCK, ULLONG, BlockStats, allocation),
+    SLOT(7, "block.capacity", BLOCK, ULLONG, BlockStats, capacity),
+    SLOT(54, "block.physical", BLOCK, ULLONG, BlockStats, physical),
+
+    COUNT(51, "net.count", NET),
+    SLOT(23, "net.name", NET, NAME, IfaceStats, xname),
+    SLOT(32, "net.rx.bytes", NET, ULLONG, IfaceStats, rx_bytes),
+    SLOT(4, "net.rx.pkts", NET, ULLONG, IfaceStats, rx_pkts),
+    SLOT(47, "net.rx.errs", NET, ULLONG, IfaceStats, rx_errs),
+    SLOT(24, "net.rx.drop", NET, ULLONG, IfaceStats, rx_drop),
+    SLOT(39, "net.tx.bytes", NET, ULLONG, IfaceStats, tx_bytes),
+    SLOT(57, "net.tx.pkts", NET, ULLONG, IfaceStats, tx_pkts),
+    SLOT(37, "net.tx.errs", NET, ULLONG, IfaceStats, tx_errs),
+    SLOT(14, "net.tx.drop", NET, ULLONG, IfaceStats, tx_drop),
+    /* intentionally ignore state, yet */
+};
 
+#undef COUNT
+#undef SLOT
 
-static void
-blockinfo_parse_field(BlockStats *stats, const char *name,
-                      const virTypedParameterPtr item)
+static uint32_t
+field_hash(uint32_t h, const char *s, const char *end)
 {
-    SETUP(stats, name, item);
-
-    DISPATCH(rd.reqs, rd_reqs);
-    DISPATCH(rd.bytes, rd_bytes);
-    DISPATCH(rd.times, rd_times);
-
-    DISPATCH(wr.reqs, wr_reqs);
-    DISPATCH(wr.bytes, wr_bytes);
-    DISPATCH(wr.times, wr_times);
-
-    DISPATCH(fl.bytes, fl_bytes);
-    DISPATCH(fl.times, fl_times);
+    for (; s < end; s++) {
+        h = h * 31 + (unsigned char)*s;
+    }
+    return h;
+}
 
-    DISPATCH(allocation, allocation);
-    DISPATCH(capacity, capacity);
-    DISPATCH(physical, physical);
+/*
+ * one pass over the name: hashes the group and the suffix, reads the
+ * device index in between. NULL if vmon does not want the field.
+ */
+static const FieldSlot *
+field_lookup(const char *field, size_t *index)
+{
+    const FieldSlot *slot = NULL;
+    const char *suffix = NULL;
+    const char *pc = strchr(field, '.');
+    int indexed = 0;
+    uint32_t h = 0;
+    size_t prefix = 0;
+
+    if (!pc) {
+        return NULL;
+    }
+    prefix = pc - field + 1; /* with the dot */
+    h = field_hash(0, field, field + prefix);
+
+    suffix = field + prefix;
+    if (isdigit((unsigned char)*suffix)) {
+        *index = 0;
+        for (; isdigit((unsigned char)*suffix); suffix++) {
+            *index = *index * 10 + (*suffix - '0');
+        }
+        if (*suffix++ != '.') {
+            return NULL;
+        }
+        indexed = 1;
+    }
+    pc = suffix + strlen(suffix);
+    h = field_hash(h, suffix, pc);
+
+    slot = &field_slots[(uint32_t)(h * FIELD_HASH_MUL) >> (32 - FIELD_HASH_BITS)];
+    if (!slot->key ||
+        (slot->group != FIELD_GROUP_VM && slot->type != FIELD_COUNT) != indexed ||
+        strncmp(slot->key, field, prefix) != 0 ||
+        strcmp(slot->key + prefix, suffix) != 0) {
+        return NULL;
+    }
+    return slot;
 }
 
+static unsigned long long
+typed_value(const virTypedParameterPtr item)
+{
+    switch (item->type) {
+    case VIR_TYPED_PARAM_INT:
+        return item->value.i;
+    case VIR_TYPED_PARAM_UINT:
+        return item->value.ui;
+    case VIR_TYPED_PARAM_LLONG:
+        return item->value.l;
+    case VIR_TYPED_PARAM_ULLONG:
+        return item->value.ul;
+    case VIR_TYPED_PARAM_BOOLEAN:
+        return item->value.b;
+    default:
+        return 0;
+    }
+}
 
 static void
-ifaceinfo_parse_field(IfaceStats *stats, const char *name,
-                      const virTypedParameterPtr item)
+name_copy(Arena *arena, char **xname, char *name, const char *value)
 {
-    SETUP(stats, name, item);
-
-    DISPATCH(rx.bytes, rx_bytes);
-    DISPATCH(rx.pkts, rx_pkts);
-    DISPATCH(rx.errs, rx_errs);
-    DISPATCH(rx.drop, rx_drop);
-
-    DISPATCH(tx.bytes, tx_bytes);
-    DISPATCH(tx.pkts, tx_pkts);
-    DISPATCH(tx.errs, tx_errs);
-    DISPATCH(tx.drop, tx_drop);
+    if (strlen(value) > (STATS_NAME_LEN - 1)) {
+        *xname = (arena) ?arena_strdup(arena, value) :strdup(value);
+    } else {
+        strncpy(name, value, STATS_NAME_LEN);
+    }
 }
 
-#undef SETUP
+static const size_t field_group_size[FIELD_GROUPS] = {
+    [FIELD_GROUP_VM] = sizeof(VmInfo),
+    [FIELD_GROUP_VCPU] = sizeof(VCpuStats),
+    [FIELD_GROUP_BLOCK] = sizeof(BlockStats),
+    [FIELD_GROUP_NET] = sizeof(IfaceStats),
+};
 
-#undef DISPATCH
+/* where each group starts, and how many devices: once they are sized */
+static void
+field_bases(VmInfo *vm, char *bases[FIELD_GROUPS], size_t counts[FIELD_GROUPS])
+{
+    bases[FIELD_GROUP_VM] = (char *)vm;
+    counts[FIELD_GROUP_VM] = 1;
+    bases[FIELD_GROUP_VCPU] = (char *)((vm->vcpu.xstats) ?vm->vcpu.xstats :vm->vcpu.stats);
+    counts[FIELD_GROUP_VCPU] = vm->vcpu.nstats;
+    bases[FIELD_GROUP_BLOCK] = (char *)((vm->block.xstats) ?vm->block.xstats :vm->block.stats);
+    counts[FIELD_GROUP_BLOCK] = vm->block.nstats;
+    bases[FIELD_GROUP_NET] = (char *)((vm->iface.xstats) ?vm->iface.xstats :vm->iface.stats);
+    counts[FIELD_GROUP_NET] = vm->iface.nstats;
+}
 
+/* offset: from where the group starts */
 static void
-vcpuinfo_parse_field(VCpuStats *stats, const char *name,
-                     const virTypedParameterPtr item)
+field_write(VmInfo *vm, char *const bases[FIELD_GROUPS], int group, int type,
+            size_t offset, const virTypedParameterPtr item)
 {
-    if (strequals(name, "state")) {
-        stats->present = 1;
-        stats->state = item->value.i;
-        return;
+    char *dst = bases[group] + offset;
+
+    switch (type) {
+    case FIELD_ULLONG:
+        *(unsigned long long *)dst = typed_value(item);
+        break;
+    case FIELD_INT:
+        *(int *)dst = (int)typed_value(item);
+        break;
+    case FIELD_SIZE:
+        *(size_t *)dst = typed_value(item);
+        break;
+    case FIELD_NAME:
+        if (item->type != VIR_TYPED_PARAM_STRING) {
+            break;
+        }
+        if (group == FIELD_GROUP_BLOCK) {
+            BlockStats *stats = (BlockStats *)(dst - offsetof(BlockStats, xname));
+            name_copy(vm->arena, &stats->xname, stats->name, item->value.s);
+        } else {
+            IfaceStats *stats = (IfaceStats *)(dst - offsetof(IfaceStats, xname));
+            name_copy(vm->arena, &stats->xname, stats->name, item->value.s);
+        }
+        break;
     }
-    if (strequals(name, "time")) {
-        stats->present = 1;
-        stats->time = item->value.ul;
-        return;
+    if (group == FIELD_GROUP_VCPU) {
+        VCpuStats *stats = (VCpuStats *)bases[group];
+        stats[offset / sizeof(VCpuStats)].present = 1;
     }
-    return;
 }
 
 
-#define ALLOC_XSTATS(subset, MAXSTATS, ITEMSIZE) do { \
-    if (subset->nstats > MAXSTATS) { \
-        subset->xstats = calloc(subset->nstats, ITEMSIZE); \
-        if (subset->xstats == NULL) { \
-            goto cleanup; \
-        } \
-    } \
-} while (0)
+/*
+ * the shape of the records of a domain: which param goes where.
+ * libvirt sends them in the same order every time, until the devices
+ * change. The device counts and the param types must stay the same,
+ * or the shape is learned again.
+ */
+enum {
+    SHAPE_SIZES_MAX = 4, /* vcpu.current, vcpu.maximum, block.count, net.count */
+    SHAPE_TABLE_SIZE = 64, /* initial slots, keep this a power of 2 */
+    SHAPE_STALE = 3600 /* seconds: forgotten, if not seen */
+};
 
+typedef struct ShapeOp ShapeOp;
+struct ShapeOp {
+    int param;
+    int ptype; /* VIR_TYPED_PARAM_* */
+    int group;
+    int type;
+    size_t offset; /* from where the group starts */
+    unsigned long long value; /* of the sizes, which cannot change */
+};
 
-static int
-vminfo_setup(VmInfo *vm,  const virDomainStatsRecordPtr record)
-{
-    VCpuInfo *vcpu = &vm->vcpu;
-    BlockInfo *block = &vm->block;
-    IfaceInfo *iface = &vm->iface;
-    int i;
+typedef struct VmShape VmShape;
+struct VmShape {
+    int refs;
+    int nparams;
+    int nsizes;
+    ShapeOp sizes[SHAPE_SIZES_MAX];
+    size_t counts[FIELD_GROUPS]; /* of the devices, as parsed */
+    unsigned long long names; /* hash of the field names, in order */
+    int nops;
+    ShapeOp ops[]; /* nparams at most */
+};
 
-    for (i = 0; i < record->nparams; i++) {
-        const virTypedParameterPtr item = &record->params[i]; /* shortcut */
+typedef struct ShapeEntry ShapeEntry;
+struct ShapeEntry {
+    unsigned long long key; /* 0 is a free slot */
+    time_t seen;
+    VmShape *shape;
+};
 
-        if (strequals(item->field, "block.count")) {
-            block->nstats = item->value.ul;
-        }
-        if (strequals(item->field, "net.count")) {
-            iface->nstats = item->value.ul;
-        }
-        if (strequals(item->field, "vcpu.current")) {
-            vcpu->current = item->value.ul;
-        } else if (strequals(item->field, "vcpu.maximum")) {
-            vcpu->nstats = item->value.ul;
-        }
+/* open addressing, linear probing; stale entries go when growing */
+struct VmShapes {
+    ShapeEntry *slots;
+    size_t size;
+    size_t used;
+    unsigned long hits;
+    unsigned long learned;
+    pthread_mutex_t lock;
+};
+
+static VmShape *
+shape_new(int nparams)
+{
+    VmShape *shape = calloc(1, sizeof(VmShape) + nparams * sizeof(ShapeOp));
+    if (shape) {
+        shape->refs = 1;
+        shape->nparams = nparams;
     }
+    return shape;
+}
 
-    ALLOC_XSTATS(vcpu, VCPU_STATS_NUM, sizeof(VCpuInfo));
-    ALLOC_XSTATS(block, BLOCK_STATS_NUM, sizeof(BlockStats));
-    ALLOC_XSTATS(iface, IFACE_STATS_NUM, sizeof(IfaceStats));
+/* -1 if the shape cannot take it */
+static int
+shape_add(VmShape *shape, int param, int group, int type, size_t offset,
+          const virTypedParameterPtr item)
+{
+    ShapeOp *op = NULL;
 
+    if (type == FIELD_SIZE || type == FIELD_COUNT) {
+        if (shape->nsizes == SHAPE_SIZES_MAX) {
+            return -1;
+        }
+        op = &shape->sizes[shape->nsizes++];
+        op->value = typed_value(item);
+    } else {
+        op = &shape->ops[shape->nops++];
+    }
+    op->param = param;
+    op->ptype = item->type;
+    op->group = group;
+    op->type = type;
+    op->offset = offset;
     return 0;
-
-cleanup:
-    free(block->xstats);
-    free(vcpu->xstats);
-    return -1;
 }
 
-#undef ALLOC_XSTATS
+/* FNV-1a: same counts and types can still come with other fields */
+static unsigned long long
+shape_names(const virDomainStatsRecordPtr record)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    const char *c;
+    int i;
+
+    for (i = 0; i < record->nparams; i++) {
+        for (c = record->params[i].field; *c; c++) {
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        }
+        hash *= 1099511628211ULL; /* the terminator, as a separator */
+    }
+    return hash;
+}
 
+static int
+field_resize(VmInfo *vm, int group, size_t n);
 
+/* -1 if the record does not have this shape: vm is half done */
 static int
-pcpuinfo_parse(PCpuInfo *pcpu,
-               const virTypedParameterPtr item)
+shape_apply(VmInfo *vm, const VmShape *shape,
+            const virDomainStatsRecordPtr record)
 {
-    if (strequals(item->field, "cpu.time")) {
-        pcpu->time = item->value.ul;
-        return 0;
+    char *bases[FIELD_GROUPS];
+    size_t counts[FIELD_GROUPS];
+    int i;
+
+    if (record->nparams != shape->nparams ||
+        shape_names(record) != shape->names) {
+        return -1;
     }
-    if (strequals(item->field, "cpu.user")) {
-        pcpu->user = item->value.ul;
-        return 0;
+    for (i = 0; i < shape->nsizes; i++) {
+        const ShapeOp *op = &shape->sizes[i];
+        const virTypedParameterPtr item = &record->params[op->param];
+        if (item->type != op->ptype || typed_value(item) != op->value) {
+            return -1;
+        }
+    }
+    for (i = FIELD_GROUP_VM + 1; i < FIELD_GROUPS; i++) {
+        if (field_resize(vm, i, shape->counts[i]) < 0) {
+            return -1;
+        }
+    }
+
+    field_bases(vm, bases, counts);
+    for (i = 0; i < shape->nsizes; i++) {
+        const ShapeOp *op = &shape->sizes[i];
+        if (op->type == FIELD_SIZE) {
+            field_write(vm, bases, op->group, op->type, op->offset,
+                        &record->params[op->param]);
+        }
+    }
+    for (i = 0; i < shape->nops; i++) {
+        const ShapeOp *op = &shape->ops[i];
+        const virTypedParameterPtr item = &record->params[op->param];
+        if (item->type != op->ptype) {
+            return -1;
+        }
+        field_write(vm, bases, op->group, op->type, op->offset, item);
     }
-    if (strequals(item->field, "cpu.system")) {
-        pcpu->system = item->value.ul;
-        return 0;
-    }        
     return 0;
 }
 
-
-static int
-ballooninfo_parse(BalloonInfo *balloon,
-                  const virTypedParameterPtr item)
+int
+vmshapes_init(VmShapes **shapes)
 {
-    if (strequals(item->field, "balloon.current")) {
-        balloon->current = item->value.ul;
-        return 0;
+    VmShapes *s = calloc(1, sizeof(*s));
+    if (s) {
+        s->slots = calloc(SHAPE_TABLE_SIZE, sizeof(ShapeEntry));
+    }
+    if (!s || !s->slots) {
+        free(s);
+        return -1;
     }
-    if (strequals(item->field, "balloon.maximum")) {
-        balloon->maximum = item->value.ul;
-    } 
+    s->size = SHAPE_TABLE_SIZE;
+    pthread_mutex_init(&s->lock, NULL);
+    *shapes = s;
     return 0;
 }
 
+void
+vmshapes_free(VmShapes *shapes)
+{
+    size_t j;
 
-enum {
-    OFF_BUF_LEN = 128
-};
+    if (!shapes) {
+        return;
+    }
+    for (j = 0; j < shapes->size; j++) {
+        free(shapes->slots[j].shape);
+    }
+    pthread_mutex_destroy(&shapes->lock);
+    free(shapes->slots);
+    free(shapes);
+}
 
-struct FieldScanner {
-    const char *prefix;
-    size_t maxoffset;
-};
+void
+vmshapes_stats(VmShapes *shapes, unsigned long *domains,
+               unsigned long *hits, unsigned long *learned)
+{
+    pthread_mutex_lock(&shapes->lock);
+    *domains = shapes->used;
+    *hits = shapes->hits;
+    *learned = shapes->learned;
+    pthread_mutex_unlock(&shapes->lock);
+}
 
-struct FieldMatch {
-    const char *suffix;
-    size_t offset;
-};
+/* returns the slot holding key, or the free one where it belongs */
+static ShapeEntry *
+shapes_find(ShapeEntry *slots, size_t size, unsigned long long key)
+{
+    size_t j = ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+    while (slots[j].key && slots[j].key != key) {
+        j = (j + 1) & (size - 1);
+    }
+    return &slots[j];
+}
 
+/* must be called with the lock held */
 static void
-scan_init(struct FieldScanner *scan, const char *prefix, size_t maxoffset)
+shapes_unref(VmShape *shape)
 {
-    scan->prefix = prefix;
-    scan->maxoffset = maxoffset;
+    if (shape && --shape->refs == 0) {
+        free(shape);
+    }
 }
 
+/* keeps the load below one half */
 static int
-scan_field(struct FieldScanner *scan,
-           const char *virFieldName, struct FieldMatch *match)
+shapes_grow(VmShapes *shapes, time_t now)
 {
-    const char *pc = virFieldName;
-    char buf[OFF_BUF_LEN] = { '\0' };
-    size_t j = 0;
+    ShapeEntry *slots = calloc(shapes->size * 2, sizeof(ShapeEntry));
+    size_t j;
 
-    if (!scan || !strstartswith(virFieldName, scan->prefix)) {
-        return 0;
+    if (!slots) {
+        return -1;
     }
-
-    for (j = 0;  j < sizeof(buf)-1 && virFieldName && isdigit(*pc); j++) {
-        buf[j] = *pc++;
+    shapes->used = 0;
+    for (j = 0; j < shapes->size; j++) {
+        ShapeEntry *se = &shapes->slots[j];
+        if (se->key && now - se->seen < SHAPE_STALE) {
+            *shapes_find(slots, shapes->size * 2, se->key) = *se;
+            shapes->used++;
+        } else {
+            shapes_unref(se->shape);
+        }
     }
-    pc++; /* skip '.' separator */
+    free(shapes->slots);
+    shapes->slots = slots;
+    shapes->size *= 2;
+    return 0;
+}
 
-    if (match) {
-        match->suffix = pc;
-        match->offset = atol(buf);
-        return (pc != NULL && match->offset < scan->maxoffset);
+/* the caller releases the shape */
+static VmShape *
+shapes_get(VmShapes *shapes, unsigned long long key)
+{
+    VmShape *shape = NULL;
+    ShapeEntry *se = NULL;
+
+    pthread_mutex_lock(&shapes->lock);
+    se = shapes_find(shapes->slots, shapes->size, key);
+    if (se->key) {
+        se->seen = time(NULL);
+        shape = se->shape;
+        shape->refs++;
+        shapes->hits++;
     }
-    return (pc != NULL);
+    pthread_mutex_unlock(&shapes->lock);
+    return shape;
 }
 
-static int
-vcpuinfo_parse(VCpuInfo *vcpu,
-               const virTypedParameterPtr item)
+static void
+shapes_release(VmShapes *shapes, VmShape *shape)
 {
-    VCpuStats *stats = (vcpu->xstats) ?vcpu->xstats :vcpu->stats;
-    struct FieldScanner scan;
-    struct FieldMatch match;
+    pthread_mutex_lock(&shapes->lock);
+    shapes_unref(shape);
+    pthread_mutex_unlock(&shapes->lock);
+}
 
-    scan_init(&scan, "vcpu.", vcpu->nstats);
+/* takes the reference to shape */
+static void
+shapes_put(VmShapes *shapes, unsigned long long key, VmShape *shape)
+{
+    time_t now = time(NULL);
+    ShapeEntry *se = NULL;
 
-    if (scan_field(&scan, item->field, &match)) {
-        vcpuinfo_parse_field(stats + match.offset,
-                             match.suffix,
-                             item);
+    pthread_mutex_lock(&shapes->lock);
+    if ((shapes->used + 1) * 2 > shapes->size && shapes_grow(shapes, now) < 0) {
+        pthread_mutex_unlock(&shapes->lock);
+        free(shape);
+        return;
     }
+    se = shapes_find(shapes->slots, shapes->size, key);
+    if (se->key) {
+        shapes_unref(se->shape);
+    } else {
+        shapes->used++;
+    }
+    se->key = key;
+    se->seen = now;
+    se->shape = shape;
+    shapes->learned++;
+    pthread_mutex_unlock(&shapes->lock);
+}
 
-    return 0;
+
+static void *
+xstats_realloc(Arena *arena, void *xstats, size_t old_size, size_t size)
+{
+    if (arena) {
+        return arena_realloc(arena, xstats, (xstats) ?old_size :0, size);
+    }
+    return realloc(xstats, size);
 }
 
+#define RESIZE_XSTATS(subset, MAXSTATS, N) do { \
+    size_t itemsize = sizeof(subset->stats[0]); \
+    if (N > MAXSTATS) { \
+        char *xstats = xstats_realloc(vm->arena, subset->xstats, \
+                                      subset->nstats * itemsize, \
+                                      N * itemsize); \
+        if (xstats == NULL) { \
+            return -1; \
+        } \
+        if (subset->xstats == NULL) { \
+            memcpy(xstats, subset->stats, subset->nstats * itemsize); \
+        } \
+        memset(xstats + subset->nstats * itemsize, 0, \
+               (N - subset->nstats) * itemsize); \
+        subset->xstats = (void *)xstats; \
+    } \
+    subset->nstats = N; \
+} while (0)
+
+/* the devices of the group are n at least: makes room for them */
 static int
-blockinfo_parse(BlockInfo *block,
-                const virTypedParameterPtr item)
+field_resize(VmInfo *vm, int group, size_t n)
 {
-    BlockStats *stats = (block->xstats) ?block->xstats :block->stats;
-    struct FieldScanner scan;
-    struct FieldMatch match;
-
-    scan_init(&scan, "block.", block->nstats);
+    VCpuInfo *vcpu = &vm->vcpu;
+    BlockInfo *block = &vm->block;
+    IfaceInfo *iface = &vm->iface;
 
-    if (scan_field(&scan, item->field, &match)) {
-        blockinfo_parse_field(stats + match.offset,
-                              match.suffix,
-                              item);
+    switch (group) {
+    case FIELD_GROUP_VCPU:
+        if (n > vcpu->nstats) {
+            RESIZE_XSTATS(vcpu, VCPU_STATS_NUM, n);
+        }
+        break;
+    case FIELD_GROUP_BLOCK:
+        if (n > block->nstats) {
+            RESIZE_XSTATS(block, BLOCK_STATS_NUM, n);
+        }
+        break;
+    case FIELD_GROUP_NET:
+        if (n > iface->nstats) {
+            RESIZE_XSTATS(iface, IFACE_STATS_NUM, n);
+        }
+        break;
     }
-
     return 0;
 }
 
+#undef RESIZE_XSTATS
+
 
+/*
+ * one pass: libvirt sends the device counts before the devices, which
+ * are sized then. A device past the count, or without one, grows them.
+ * Learns the shape of the record too, if any: dropped if it cannot.
+ */
 static int
-ifaceinfo_parse(IfaceInfo *iface,
-                const virTypedParameterPtr item)
+vminfo_parse_fields(VmInfo *vm, const virDomainStatsRecordPtr record,
+                    VmShape **shape)
 {
-    IfaceStats *stats = (iface->xstats) ?iface->xstats :iface->stats;
-    struct FieldScanner scan;
-    struct FieldMatch match;
+    char *bases[FIELD_GROUPS];
+    size_t counts[FIELD_GROUPS];
+    int i = 0;
 
-    scan_init(&scan, "iface.", iface->nstats);
+    field_bases(vm, bases, counts);
 
-    if (scan_field(&scan, item->field, &match)) {
-        ifaceinfo_parse_field(stats + match.offset,
-                              match.suffix,
-                              item);
+    for (i = 0; i < record->nparams; i++) {
+        const virTypedParameterPtr item = &record->params[i]; /* shortcut */
+        const FieldSlot *slot = NULL;
+        size_t index = 0;
+        size_t offset = 0;
+        size_t devices = 0; /* to make room for */
+
+        slot = field_lookup(item->field, &index);
+        if (!slot) {
+            continue;
+        }
+        if (slot->type == FIELD_COUNT) {
+            devices = typed_value(item);
+        } else if (index >= counts[slot->group]) {
+            devices = index + 1;
+        }
+        if (devices > FIELD_DEVICES_MAX) {
+            continue;
+        }
+        if (devices > counts[slot->group]) {
+            if (field_resize(vm, slot->group, devices) < 0) {
+                return -1;
+            }
+            field_bases(vm, bases, counts);
+        }
+
+        if (slot->type != FIELD_COUNT) {
+            offset = index * field_group_size[slot->group] + slot->offset;
+            field_write(vm, bases, slot->group, slot->type, offset, item);
+        }
+        if (*shape &&
+            shape_add(*shape, i, slot->group, slot->type, offset, item) < 0) {
+            free(*shape);
+            *shape = NULL;
+        }
     }
 
+    if (*shape) {
+        memcpy((*shape)->counts, counts, sizeof(counts));
+    }
     return 0;
 }
 
-#define TRY_TO_PARSE(subset, vm, record, i) do { \
-    if (subset ## info_parse(&vm->subset, &record->params[i]) < 0) { \
-        /* TODO: logging? */ \
-        return -1; \
-    } \
-} while (0)
-
 int
 vminfo_parse(VmInfo *vm,
              const virDomainStatsRecordPtr record)
 {
-    int i = 0;
+    VmShape *shape = NULL;
 
-    if (vminfo_setup(vm, record)) {
+    if (vminfo_parse_fields(vm, record, &shape) < 0) {
         return -1;
     }
-    if (virDomainGetUUIDString(record->dom, vm->uuid) < 0) {
-        return -1;
+    return (virDomainGetUUIDString(record->dom, vm->uuid) < 0) ?-1 :0;
+}
+
+int
+vminfo_parse_shaped(VmInfo *vm,
+                    const virDomainStatsRecordPtr record,
+                    VmShapes *shapes, unsigned long long key)
+{
+    VmShape *shape = NULL;
+    int err = 0;
+
+    if (!shapes || !key) {
+        return vminfo_parse(vm, record);
     }
 
-    for (i = 0; i < record->nparams; i++) {
-        /* intentionally ignore state, yet */
-        TRY_TO_PARSE(pcpu, vm, record, i);
-        TRY_TO_PARSE(balloon, vm, record, i);
-        TRY_TO_PARSE(vcpu, vm, record, i);
-        TRY_TO_PARSE(block, vm, record, i);
-        TRY_TO_PARSE(iface, vm, record, i);
+    shape = shapes_get(shapes, key);
+    if (shape) {
+        err = shape_apply(vm, shape, record);
+        shapes_release(shapes, shape);
+        if (err < 0) {
+            /* the devices changed, most likely: learn it again */
+            Arena *arena = vm->arena;
+            vminfo_free(vm);
+            vminfo_init_arena(vm, arena);
+            shape = NULL;
+        }
     }
 
-    return 0;
+    if (!shape) {
+        shape = shape_new(record->nparams);
+        err = vminfo_parse_fields(vm, record, &shape);
+        if (err == 0 && shape) {
+            shape->names = shape_names(record);
+            shapes_put(shapes, key, shape);
+        } else {
+            free(shape);
+        }
+    }
+    if (err < 0) {
+        return -1;
+    }
+    return (virDomainGetUUIDString(record->dom, vm->uuid) < 0) ?-1 :0;
 }
-
-#undef TRY_TO_PARSE
-
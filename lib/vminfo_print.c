@@ -19,173 +19,208 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-#include <ctype.h>
-#include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "jsonbuf.h"
 #include "vminfo.h"
 
 
+/* the counters of a device, with their key literals: no formatting */
+typedef struct JsonField JsonField;
+struct JsonField {
+    const char *key; /* quoted, with the separators */
+    size_t len;
+    size_t offset;
+};
+
+#define JSON_FIELD(SEP, KEY, TYPE, MEMBER) { \
+    SEP "\"" KEY "\": ", \
+    sizeof(SEP "\"" KEY "\": ") - 1, \
+    offsetof(TYPE, MEMBER) \
+}
+
+static const JsonField pcpu_fields[] = {
+    JSON_FIELD(" ", "cpu.time", PCpuInfo, time),
+    JSON_FIELD(", ", "cpu.user", PCpuInfo, user),
+    JSON_FIELD(", ", "cpu.system", PCpuInfo, system),
+};
+
+static const JsonField balloon_fields[] = {
+    JSON_FIELD(" ", "balloon.current", BalloonInfo, current),
+    JSON_FIELD(", ", "balloon.maximum", BalloonInfo, maximum),
+};
+
+static const JsonField block_fields[] = {
+    JSON_FIELD(" ", "rd_bytes", BlockStats, rd_bytes),
+    JSON_FIELD(", ", "rd_operations", BlockStats, rd_reqs),
+    JSON_FIELD(", ", "rd_total_times", BlockStats, rd_times),
+    JSON_FIELD(", ", "wr_bytes", BlockStats, wr_bytes),
+    JSON_FIELD(", ", "wr_operations", BlockStats, wr_reqs),
+    JSON_FIELD(", ", "wr_total_times", BlockStats, wr_times),
+    JSON_FIELD(", ", "allocation", BlockStats, allocation),
+    JSON_FIELD(", ", "capacity", BlockStats, capacity),
+    JSON_FIELD(", ", "physical", BlockStats, physical),
+};
+
+static const JsonField iface_fields[] = {
+    JSON_FIELD(" ", "rx_bytes", IfaceStats, rx_bytes),
+    JSON_FIELD(", ", "rx_pkts", IfaceStats, rx_pkts),
+    JSON_FIELD(", ", "rx_errs", IfaceStats, rx_errs),
+    JSON_FIELD(", ", "rx_drop", IfaceStats, rx_drop),
+    JSON_FIELD(", ", "tx_bytes", IfaceStats, tx_bytes),
+    JSON_FIELD(", ", "tx_pkts", IfaceStats, tx_pkts),
+    JSON_FIELD(", ", "tx_errs", IfaceStats, tx_errs),
+    JSON_FIELD(", ", "tx_drop", IfaceStats, tx_drop),
+};
+
+#undef JSON_FIELD
+
+/* the object of unsigned long long counters */
+static void
+fields_print_json(const JsonField *fields, size_t nfields,
+                  const void *base, JsonBuf *out)
+{
+    size_t i;
+
+    jsonbuf_lit(out, "{");
+    for (i = 0; i < nfields; i++) {
+        jsonbuf_raw(out, fields[i].key, fields[i].len);
+        jsonbuf_ullong(out, *(const unsigned long long *)
+                            ((const char *)base + fields[i].offset));
+    }
+    jsonbuf_lit(out, " }");
+}
+
 static int
-pcpu_print_json(const PCpuInfo *pcpu, FILE *out)
+pcpu_print_json(const PCpuInfo *pcpu, JsonBuf *out)
 {
-    fprintf(out, "\"pcpu\": "
-                 "{"
-                 " \"cpu.time\": %llu,"
-                 " \"cpu.user\": %llu,"
-                 " \"cpu.system\": %llu "
-                 "}",
-                 pcpu->time,
-                 pcpu->user,
-                 pcpu->system);
+    jsonbuf_lit(out, "\"pcpu\": ");
+    fields_print_json(pcpu_fields, sizeof(pcpu_fields) / sizeof(JsonField),
+                      pcpu, out);
     return 0;
 }
 
 static int
-balloon_print_json(const BalloonInfo *balloon, FILE *out)
+balloon_print_json(const BalloonInfo *balloon, JsonBuf *out)
 {
-    fprintf(out, "\"balloon\": "
-                 "{"
-                 " \"balloon.current\": %llu,"
-                 " \"balloon.maximum\": %llu "
-                 "}",
-                 balloon->current,
-                 balloon->maximum);
+    jsonbuf_lit(out, "\"balloon\": ");
+    fields_print_json(balloon_fields,
+                      sizeof(balloon_fields) / sizeof(JsonField),
+                      balloon, out);
     return 0;
 }
 
 
 static int
-vcpu_print_json(const VCpuInfo *vcpu, FILE *out)
+vcpu_print_json(const VCpuInfo *vcpu, JsonBuf *out)
 {
     size_t i;
     const VCpuStats *stats = (vcpu->xstats) ?vcpu->xstats :vcpu->stats;
+    int printed = 0;
 
-    fprintf(out, "\"vcpu\":"
-                 " {");
+    jsonbuf_lit(out, "\"vcpu\": {");
 
     for (i = 0; i < vcpu->nstats; i++) {
         if (!stats[i].present) {
             continue;
         }
 
-        fprintf(out, " \"%zu\": { \"state\": %i,"
-                     " \"time\": %llu,"
-                     " }%s",
-                i,
-                stats[i].state,
-                stats[i].time,
-                (i == vcpu->nstats-1) ?"" :",");
+        /* the vcpus not present are skipped: so is their separator */
+        if (printed++ > 0) {
+            jsonbuf_lit(out, ",");
+        }
+        jsonbuf_lit(out, " \"");
+        jsonbuf_ullong(out, i);
+        jsonbuf_lit(out, "\": { \"state\": ");
+        jsonbuf_llong(out, stats[i].state);
+        jsonbuf_lit(out, ", \"time\": ");
+        jsonbuf_ullong(out, stats[i].time);
+        jsonbuf_lit(out, " }");
     }
 
-    fputs(" }", out);
+    jsonbuf_lit(out, " }");
 
     return 0;
 }
 
 
 static int
-block_print_json(const BlockInfo *block, FILE *out)
+block_print_json(const BlockInfo *block, JsonBuf *out)
 {
     size_t i;
     const BlockStats *stats = (block->xstats) ?block->xstats :block->stats;
 
-    fprintf(out, "\"block\":"
-                 " {");
+    jsonbuf_lit(out, "\"block\": {");
 
     for (i = 0; i < block->nstats; i++) {
         const char *name = (stats[i].xname) ?stats[i].xname :stats[i].name;
-        fprintf(out, " \"%s\": { \"rd_bytes\": %llu,"
-                     " \"rd_operations\": %llu,"
-                     " \"rd_total_times\": %llu,"
-                     " \"wr_bytes\": %llu,"
-                     " \"wr_operations\": %llu,"
-                     " \"wr_total_times\": %llu,"
-                     " \"allocation\": %llu,"
-                     " \"capacity\": %llu,"
-                     " \"physical\": %llu "
-                     " }%s",
-                name,
-                stats[i].rd_bytes,
-                stats[i].rd_reqs,
-                stats[i].rd_times,
-                stats[i].wr_bytes,
-                stats[i].wr_reqs,
-                stats[i].wr_times,
-                stats[i].allocation,
-                stats[i].capacity,
-                stats[i].physical,
-                (i == block->nstats-1) ?"" :",");
+        if (i > 0) {
+            jsonbuf_lit(out, ",");
+        }
+        jsonbuf_lit(out, " ");
+        jsonbuf_string(out, name);
+        jsonbuf_lit(out, ": ");
+        fields_print_json(block_fields,
+                          sizeof(block_fields) / sizeof(JsonField),
+                          &stats[i], out);
     }
 
-    fputs(" }", out);
+    jsonbuf_lit(out, " }");
 
     return 0;
 }
 
 
 static int
-iface_print_json(const IfaceInfo *iface, FILE *out)
+iface_print_json(const IfaceInfo *iface, JsonBuf *out)
 {
     size_t i;
     const IfaceStats *stats = (iface->xstats) ?iface->xstats :iface->stats;
 
-    fprintf(out, "\"iface\":"
-                 " {");
+    jsonbuf_lit(out, "\"iface\": {");
 
     for (i = 0; i < iface->nstats; i++) {
         const char *name = (stats[i].xname) ?stats[i].xname :stats[i].name;
-        fprintf(out, " \"%s\": { \"rx_bytes\": %llu,"
-                     " \"rx_pkts\": %llu,"
-                     " \"rx_errs\": %llu,"
-                     " \"rx_drop\": %llu,"
-                     " \"tx_bytes\": %llu,"
-                     " \"tx_pkts\": %llu,"
-                     " \"tx_errs\": %llu,"
-                     " \"tx_drop\": %llu,"
-                     " }%s",
-                name,
-                stats[i].rx_bytes,
-                stats[i].rx_pkts,
-                stats[i].rx_errs,
-                stats[i].rx_drop,
-                stats[i].tx_bytes,
-                stats[i].tx_pkts,
-                stats[i].tx_errs,
-                stats[i].tx_drop,
-                (i == iface->nstats-1) ?"" :",");
+        if (i > 0) {
+            jsonbuf_lit(out, ",");
+        }
+        jsonbuf_lit(out, " ");
+        jsonbuf_string(out, name);
+        jsonbuf_lit(out, ": ");
+        fields_print_json(iface_fields,
+                          sizeof(iface_fields) / sizeof(JsonField),
+                          &stats[i], out);
     }
 
-    fputs(" }", out);
+    jsonbuf_lit(out, " }");
 
     return 0;
 }
 
 
 int
-vminfo_print_json(VmInfo *vm, FILE *out)
+vminfo_print_json(VmInfo *vm, JsonBuf *out)
 {
-    fprintf(out,
-            "{"
-            " \"vm-id\": \"%s\",",
-            vm->uuid);
+    jsonbuf_lit(out, "{ \"vm-id\": ");
+    jsonbuf_string(out, vm->uuid);
+    jsonbuf_lit(out, ", ");
 
     /* intentionally ignore state, yet */
     pcpu_print_json(&vm->pcpu, out);
-    fputs(", ", out);
+    jsonbuf_lit(out, ", ");
 
     balloon_print_json(&vm->balloon, out);
-    fputs(", ", out);
+    jsonbuf_lit(out, ", ");
 
     vcpu_print_json(&vm->vcpu, out);
-    fputs(", ", out);
+    jsonbuf_lit(out, ", ");
 
     block_print_json(&vm->block, out);
-    fputs(", ", out);
+    jsonbuf_lit(out, ", ");
 
     iface_print_json(&vm->iface, out);
-    fputs(" }", out);
-    return 0;
+    jsonbuf_lit(out, " }");
+    return (out->error) ?-1 :0;
 }
-
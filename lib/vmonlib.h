@@ -35,8 +35,15 @@
 
 enum {
     TIMEOUT = 1 * 1000, /* milliseconds */
+    MIN_THREADS = 2,
     MAX_THREADS = 5,
+    SPARE_THREADS = 5, /* replacing the hung ones */
     TASKS_PER_THREAD = 200,
+    OVERFLOW_WAIT = 1 * 1000, /* milliseconds */
+    OVERFLOW_MAX_MEM = 16, /* MiB */
+    OUTPUT_MAX_MEM = 64, /* MiB */
+    SPOOL_SIZE = 256, /* MiB */
+    RECONCILE_PERIOD = 60, /* seconds */
 };
 
 enum {
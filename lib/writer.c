@@ -0,0 +1,749 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "slab.h"
+#include "writer.h"
+
+
+enum {
+    WRITER_IOV_MAX = 64, /* responses per syscall */
+    WRITER_BATCH_BYTES = 64 * 1024, /* enough to write without waiting */
+    WRITER_WINDOW = 1000, /* microseconds, waiting for more to batch */
+    WRITER_POLL_TIMEOUT = 1000, /* milliseconds */
+    WRITER_SPOOL_POLL = 10, /* milliseconds: the shed responses wait for it */
+    WRITER_SHED_PERCENT = 75, /* of the budget, left after shedding */
+    WRITER_KEYS_MIN = 1024 /* slots of the supersede table */
+};
+
+typedef struct WriterBuf WriterBuf;
+struct WriterBuf {
+    WriterBuf *next;
+    guint64 key;
+    size_t len;
+    size_t off; /* already written */
+    char data[];
+};
+
+/*
+ * byte ring in a mmap'd file, of records aligned to 8 bytes.
+ * A record never wraps: the space at the end too small for it is
+ * skipped, marked with SPOOL_WRAP if there is room for the header.
+ */
+typedef struct SpoolRecord SpoolRecord;
+struct SpoolRecord {
+    guint64 len;
+};
+
+#define SPOOL_WRAP G_MAXUINT64
+
+/* a key in the supersede table */
+typedef struct WriterKey WriterKey;
+struct WriterKey {
+    guint64 key;
+    unsigned long count;
+};
+
+typedef struct Spool Spool;
+struct Spool {
+    char *path;
+    char *map;
+    size_t size;
+    size_t head; /* oldest record */
+    size_t tail; /* where the next one goes */
+    unsigned long records;
+};
+
+struct Writer {
+    int fd;
+    Slab *bufs; /* recycled, the responses are alike in size */
+    WriterBuf *head;
+    WriterBuf **tail;
+    size_t queued; /* bytes */
+    unsigned long queued_num;
+    int policy;
+    size_t max_mem; /* bytes, 0 is unbounded */
+    WriterKey *keys; /* of writer_supersede, kept across the calls */
+    size_t keys_size;
+    Spool *spool; /* of the writer thread only */
+    WriterBuf *shed; /* to be spooled by the writer thread, oldest first */
+    WriterBuf **shed_tail;
+    gboolean shedding; /* logged once per episode */
+    gboolean running;
+    gboolean stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    WriterStats stats;
+};
+
+
+static size_t
+spool_record_size(size_t len)
+{
+    return (sizeof(SpoolRecord) + len + 7) & ~(size_t)7;
+}
+
+static int
+spool_open(Spool **sp, const char *path, size_t size)
+{
+    Spool *s = NULL;
+    int fd = -1;
+
+    size &= ~(size_t)7;
+    if (!path || size < spool_record_size(1)) {
+        return -1;
+    }
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_warning("writer: cannot open the spool %s: %s",
+                  path, strerror(errno));
+        return -1;
+    }
+    s = calloc(1, sizeof(*s));
+    if (s && ftruncate(fd, size) == 0) {
+        s->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (!s || !s->map || s->map == MAP_FAILED) {
+        g_warning("writer: cannot map the spool %s", path);
+        free(s);
+        unlink(path);
+        return -1;
+    }
+    s->path = strdup(path);
+    s->size = size;
+    *sp = s;
+    return 0;
+}
+
+static void
+spool_close(Spool *sp)
+{
+    if (!sp) {
+        return;
+    }
+    munmap(sp->map, sp->size);
+    unlink(sp->path);
+    free(sp->path);
+    free(sp);
+}
+
+/* where a record of `need' bytes goes, if there is room now */
+static gboolean
+spool_fits(Spool *sp, size_t need, size_t *at)
+{
+    if (sp->records == 0) {
+        sp->head = sp->tail = 0;
+        *at = 0;
+        return need <= sp->size;
+    }
+    if (sp->tail > sp->head) {
+        if (sp->size - sp->tail >= need) {
+            *at = sp->tail;
+            return TRUE;
+        }
+        *at = 0; /* wraps */
+        return sp->head >= need;
+    }
+    *at = sp->tail;
+    return sp->head - sp->tail >= need;
+}
+
+/* the oldest record, or NULL */
+static SpoolRecord *
+spool_peek(Spool *sp)
+{
+    SpoolRecord *rec = NULL;
+
+    if (sp->records == 0) {
+        return NULL;
+    }
+    if (sp->size - sp->head < sizeof(SpoolRecord)) {
+        sp->head = 0;
+    }
+    rec = (SpoolRecord *)(sp->map + sp->head);
+    if (rec->len == SPOOL_WRAP) {
+        sp->head = 0;
+        rec = (SpoolRecord *)sp->map;
+    }
+    return rec;
+}
+
+static void
+spool_pop(Spool *sp)
+{
+    SpoolRecord *rec = spool_peek(sp);
+
+    if (rec) {
+        sp->head += spool_record_size(rec->len);
+        if (sp->head == sp->size) {
+            sp->head = 0;
+        }
+        sp->records--;
+    }
+}
+
+/* makes room dropping the oldest records; returns how many */
+static long
+spool_put(Spool *sp, const char *data, size_t len)
+{
+    size_t need = spool_record_size(len);
+    SpoolRecord *rec = NULL;
+    long dropped = 0;
+    size_t at = 0;
+
+    if (need > sp->size) {
+        return -1;
+    }
+    while (!spool_fits(sp, need, &at)) {
+        spool_pop(sp);
+        dropped++;
+    }
+    if (at != sp->tail && sp->size - sp->tail >= sizeof(SpoolRecord)) {
+        ((SpoolRecord *)(sp->map + sp->tail))->len = SPOOL_WRAP;
+    }
+    rec = (SpoolRecord *)(sp->map + at);
+    rec->len = len;
+    memcpy(rec + 1, data, len);
+    sp->tail = at + need;
+    if (sp->tail == sp->size) {
+        sp->tail = 0;
+    }
+    sp->records++;
+    return dropped;
+}
+
+
+int
+writer_init(Writer **wr, int fd)
+{
+    pthread_condattr_t attr;
+    Writer *w = calloc(1, sizeof(*w));
+    if (!w) {
+        return -1;
+    }
+    if (slab_init(&w->bufs) < 0) {
+        free(w);
+        return -1;
+    }
+    w->fd = fd;
+    w->tail = &w->head;
+    w->shed_tail = &w->shed;
+    w->policy = WRITER_OVERFLOW_DROP_OLDEST;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->ready, &attr);
+    pthread_condattr_destroy(&attr);
+    *wr = w;
+    return 0;
+}
+
+int
+writer_set_budget(Writer *wr, int policy, size_t max_mem,
+                  const char *spool_path, size_t spool_size)
+{
+    if (wr->running) {
+        return -1;
+    }
+    if (policy == WRITER_OVERFLOW_KEEP_NEWEST && !wr->keys) {
+        wr->keys = calloc(WRITER_KEYS_MIN, sizeof(*wr->keys));
+        if (!wr->keys) {
+            return -1;
+        }
+        wr->keys_size = WRITER_KEYS_MIN;
+    }
+    if (policy == WRITER_OVERFLOW_SPOOL &&
+        spool_open(&wr->spool, spool_path, spool_size) < 0) {
+        return -1;
+    }
+    wr->policy = policy;
+    wr->max_mem = max_mem;
+    return 0;
+}
+
+static WriterBuf *
+writer_buf_new(Writer *wr, guint64 key, size_t len)
+{
+    WriterBuf *buf = slab_alloc(wr->bufs, sizeof(*buf) + len);
+    if (buf) {
+        buf->next = NULL;
+        buf->key = key;
+        buf->len = len;
+        buf->off = 0;
+    }
+    return buf;
+}
+
+static void
+writer_buf_free(Writer *wr, WriterBuf *buf)
+{
+    while (buf) {
+        WriterBuf *next = buf->next;
+        slab_release(wr->bufs, buf);
+        buf = next;
+    }
+}
+
+static void
+writer_drop(Writer *wr, WriterBuf *buf)
+{
+    unsigned long dropped = 0;
+    WriterBuf *b;
+
+    for (b = buf; b; b = b->next) {
+        dropped++;
+    }
+    writer_buf_free(wr, buf);
+    if (dropped) {
+        pthread_mutex_lock(&wr->lock);
+        wr->stats.dropped += dropped;
+        pthread_mutex_unlock(&wr->lock);
+    }
+}
+
+void
+writer_free(Writer *wr)
+{
+    if (!wr) {
+        return;
+    }
+    writer_drop(wr, wr->shed);
+    writer_drop(wr, wr->head);
+    free(wr->keys);
+    slab_free(wr->bufs);
+    spool_close(wr->spool);
+    pthread_cond_destroy(&wr->ready);
+    pthread_mutex_destroy(&wr->lock);
+    free(wr);
+}
+
+/* must be called with the lock held */
+static WriterBuf *
+writer_pop(Writer *wr)
+{
+    WriterBuf *buf = wr->head;
+
+    wr->head = buf->next;
+    if (!wr->head) {
+        wr->tail = &wr->head;
+    }
+    buf->next = NULL;
+    wr->queued -= buf->len;
+    wr->queued_num--;
+    return buf;
+}
+
+/*
+ * keeps only the newest queued response per key: a table of the
+ * keys seen, then one pass removing all but the last of each.
+ * The table is kept, and only grows with the queue.
+ * Must be called with the lock held.
+ */
+static void
+writer_supersede(Writer *wr)
+{
+    WriterKey *keys = wr->keys;
+    size_t size = WRITER_KEYS_MIN, mask, j;
+    WriterBuf **p, *b;
+
+    while (size < wr->queued_num * 2) {
+        size *= 2;
+    }
+    if (size > wr->keys_size) {
+        keys = realloc(wr->keys, size * sizeof(*keys));
+        if (!keys) {
+            return;
+        }
+        wr->keys = keys;
+        wr->keys_size = size;
+    }
+    memset(keys, 0, size * sizeof(*keys));
+    mask = size - 1;
+
+    for (b = wr->head; b; b = b->next) {
+        if (b->key) {
+            j = ((b->key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+            while (keys[j].key && keys[j].key != b->key) {
+                j = (j + 1) & mask;
+            }
+            keys[j].key = b->key;
+            keys[j].count++;
+        }
+    }
+
+    wr->tail = &wr->head;
+    for (p = &wr->head; *p; ) {
+        b = *p;
+        if (b->key) {
+            j = ((b->key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+            while (keys[j].key != b->key) {
+                j = (j + 1) & mask;
+            }
+            if (keys[j].count-- > 1) {
+                *p = b->next;
+                wr->queued -= b->len;
+                wr->queued_num--;
+                wr->stats.superseded++;
+                slab_release(wr->bufs, b);
+                continue;
+            }
+        }
+        p = &b->next;
+        wr->tail = p;
+    }
+}
+
+/* over budget: down to a fraction of it. Must be called with the lock held */
+static void
+writer_shed(Writer *wr)
+{
+    size_t low = wr->max_mem / 100 * WRITER_SHED_PERCENT;
+
+    if (!wr->shedding) {
+        g_warning("writer: the output is not keeping up,"
+                  " over the budget of %lu bytes",
+                  (unsigned long)wr->max_mem);
+        wr->shedding = TRUE;
+    }
+
+    if (wr->policy == WRITER_OVERFLOW_KEEP_NEWEST) {
+        writer_supersede(wr);
+    }
+    while (wr->head && wr->queued > low) {
+        WriterBuf *buf = writer_pop(wr);
+        if (wr->spool) {
+            /* the writer thread copies it */
+            *wr->shed_tail = buf;
+            wr->shed_tail = &buf->next;
+        } else {
+            wr->stats.shed++;
+            slab_release(wr->bufs, buf);
+        }
+    }
+}
+
+/*
+ * moves the responses shed by the producers into the spool, out of
+ * the lock: they are older than the queue, newer than the spool.
+ * Must be called by the writer thread, with the lock held.
+ */
+static void
+writer_spool(Writer *wr)
+{
+    while (wr->shed) {
+        WriterBuf *buf = wr->shed, *b;
+        unsigned long spooled = 0, shed = 0;
+
+        wr->shed = NULL;
+        wr->shed_tail = &wr->shed;
+        pthread_mutex_unlock(&wr->lock);
+
+        for (b = buf; b; b = b->next) {
+            long dropped = spool_put(wr->spool, b->data, b->len);
+            if (dropped < 0) {
+                shed++; /* too big to be spooled */
+            } else {
+                spooled++;
+                shed += dropped;
+            }
+        }
+        writer_buf_free(wr, buf);
+
+        pthread_mutex_lock(&wr->lock);
+        wr->stats.spooled += spooled;
+        wr->stats.shed += shed;
+    }
+}
+
+/* returns FALSE if the writer is stopping and the fd stays full */
+static gboolean
+writer_wait_fd(Writer *wr)
+{
+    struct pollfd pfd = { wr->fd, POLLOUT, 0 };
+    gboolean stopping = FALSE;
+    int ret = 0;
+
+    pthread_mutex_lock(&wr->lock);
+    wr->stats.waits++;
+    pthread_mutex_unlock(&wr->lock);
+
+    do {
+        ret = poll(&pfd, 1,
+                   (wr->spool) ?WRITER_SPOOL_POLL :WRITER_POLL_TIMEOUT);
+        if (ret == 0) {
+            pthread_mutex_lock(&wr->lock);
+            writer_spool(wr);
+            stopping = wr->stopping;
+            pthread_mutex_unlock(&wr->lock);
+        }
+    } while ((ret == 0 && !stopping) || (ret < 0 && errno == EINTR));
+    return ret > 0;
+}
+
+/* writes a whole batch, resuming partial writes; frees the buffers */
+static void
+writer_flush(Writer *wr, WriterBuf *buf)
+{
+    struct iovec iov[WRITER_IOV_MAX];
+    unsigned long writes = 0, partial = 0;
+
+    while (buf) {
+        WriterBuf *b = buf;
+        size_t total = 0;
+        ssize_t done = 0;
+        int n = 0;
+
+        for (; b && n < WRITER_IOV_MAX; b = b->next, n++) {
+            iov[n].iov_base = b->data + b->off;
+            iov[n].iov_len = b->len - b->off;
+            total += iov[n].iov_len;
+        }
+
+        done = writev(wr->fd, iov, n);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (writer_wait_fd(wr)) {
+                continue;
+            }
+        }
+        if (done < 0) {
+            g_warning("writer: failed to write the responses: %s",
+                      strerror(errno));
+            pthread_mutex_lock(&wr->lock);
+            wr->stats.errors++;
+            pthread_mutex_unlock(&wr->lock);
+            writer_drop(wr, buf);
+            break;
+        }
+
+        writes++;
+        if ((size_t)done < total) {
+            partial++;
+        }
+        while (buf && (size_t)done >= buf->len - buf->off) {
+            WriterBuf *next = buf->next;
+            done -= buf->len - buf->off;
+            slab_release(wr->bufs, buf);
+            buf = next;
+        }
+        if (buf) {
+            buf->off += done;
+        }
+    }
+
+    pthread_mutex_lock(&wr->lock);
+    wr->stats.writes += writes;
+    wr->stats.partial += partial;
+    pthread_mutex_unlock(&wr->lock);
+}
+
+/*
+ * the next batch, at most a syscall worth: what is not taken stays
+ * under the budget. The spooled responses are older, so they go
+ * first. Must be called by the writer thread, with the lock held.
+ */
+static WriterBuf *
+writer_take(Writer *wr)
+{
+    WriterBuf *batch = NULL;
+    WriterBuf **last = &batch;
+    size_t bytes = 0;
+    int n = 0;
+    SpoolRecord *rec = NULL;
+
+    while (wr->spool && n < WRITER_IOV_MAX && bytes < WRITER_BATCH_BYTES &&
+           (rec = spool_peek(wr->spool)) != NULL) {
+        WriterBuf *buf = writer_buf_new(wr, 0, rec->len);
+        if (!buf) {
+            break; /* try again later */
+        }
+        memcpy(buf->data, rec + 1, rec->len);
+        spool_pop(wr->spool);
+        wr->stats.replayed++;
+        *last = buf;
+        last = &buf->next;
+        bytes += buf->len;
+        n++;
+    }
+
+    while (wr->head && n < WRITER_IOV_MAX && bytes < WRITER_BATCH_BYTES) {
+        WriterBuf *buf = writer_pop(wr);
+        *last = buf;
+        last = &buf->next;
+        bytes += buf->len;
+        n++;
+    }
+
+    if (wr->shedding && wr->queued <= wr->max_mem / 2 &&
+        (!wr->spool || wr->spool->records == 0)) {
+        g_message("writer: the output is keeping up again");
+        wr->shedding = FALSE;
+    }
+    return batch;
+}
+
+/* must be called by the writer thread, with the lock held */
+static gboolean
+writer_pending(Writer *wr)
+{
+    return wr->head || wr->shed || (wr->spool && wr->spool->records > 0);
+}
+
+static void
+deadline_after(struct timespec *ts, long usecs)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_nsec += usecs * 1000;
+    ts->tv_sec += ts->tv_nsec / 1000000000L;
+    ts->tv_nsec %= 1000000000L;
+}
+
+static void *
+writer_run(void *data)
+{
+    Writer *wr = data;
+
+    for (;;) {
+        struct timespec deadline;
+        WriterBuf *batch = NULL;
+
+        pthread_mutex_lock(&wr->lock);
+        while (!writer_pending(wr) && !wr->stopping) {
+            pthread_cond_wait(&wr->ready, &wr->lock);
+        }
+        if (!writer_pending(wr)) {
+            pthread_mutex_unlock(&wr->lock);
+            break; /* stopping, and all written */
+        }
+
+        /* a small batch: wait a bit for the others in progress */
+        deadline_after(&deadline, WRITER_WINDOW);
+        while (!wr->stopping && wr->queued < WRITER_BATCH_BYTES &&
+               pthread_cond_timedwait(&wr->ready, &wr->lock,
+                                      &deadline) != ETIMEDOUT) {
+            ;
+        }
+
+        writer_spool(wr);
+        batch = writer_take(wr);
+        pthread_mutex_unlock(&wr->lock);
+
+        writer_flush(wr, batch);
+    }
+    return NULL;
+}
+
+int
+writer_start(Writer *wr)
+{
+    if (wr->running) {
+        return -1;
+    }
+    if (pthread_create(&wr->thread, NULL, writer_run, wr) != 0) {
+        g_warning("writer: failed to start the thread");
+        return -1;
+    }
+    wr->running = TRUE;
+    return 0;
+}
+
+int
+writer_stop(Writer *wr)
+{
+    WriterStats st;
+
+    if (!wr->running) {
+        return -1;
+    }
+    pthread_mutex_lock(&wr->lock);
+    wr->stopping = TRUE;
+    pthread_cond_signal(&wr->ready);
+    pthread_mutex_unlock(&wr->lock);
+
+    pthread_join(wr->thread, NULL);
+    wr->running = FALSE;
+
+    writer_get_stats(wr, &st);
+    g_message("writer stats: responses=%lu bytes=%lu writes=%lu"
+              " partial=%lu waits=%lu errors=%lu dropped=%lu"
+              " queued_peak=%lu shed=%lu superseded=%lu"
+              " spooled=%lu replayed=%lu",
+              st.responses, st.bytes, st.writes,
+              st.partial, st.waits, st.errors, st.dropped,
+              st.queued_peak, st.shed, st.superseded,
+              st.spooled, st.replayed);
+    return 0;
+}
+
+int
+writer_write(Writer *wr, guint64 key, const char *data, size_t len)
+{
+    WriterBuf *buf = writer_buf_new(wr, key, len);
+    gboolean wake = FALSE;
+
+    if (!buf) {
+        return -1;
+    }
+    memcpy(buf->data, data, len);
+
+    pthread_mutex_lock(&wr->lock);
+    /* the writer waits for the first one, and then for a full batch */
+    wake = !wr->head ||
+           (wr->queued < WRITER_BATCH_BYTES &&
+            wr->queued + len >= WRITER_BATCH_BYTES);
+    *wr->tail = buf;
+    wr->tail = &buf->next;
+    wr->queued += len;
+    wr->queued_num++;
+    wr->stats.responses++;
+    wr->stats.bytes += len;
+    wr->stats.queued_peak = MAX(wr->stats.queued_peak, wr->queued);
+    if (wr->max_mem && wr->queued > wr->max_mem) {
+        writer_shed(wr);
+    }
+    if (wake) {
+        pthread_cond_signal(&wr->ready);
+    }
+    pthread_mutex_unlock(&wr->lock);
+    return 0;
+}
+
+void
+writer_get_stats(Writer *wr, WriterStats *stats)
+{
+    pthread_mutex_lock(&wr->lock);
+    *stats = wr->stats;
+    pthread_mutex_unlock(&wr->lock);
+}
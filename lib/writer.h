@@ -0,0 +1,99 @@
+/*
+ * vmon - Virtual Machine MONitor for oVirt (et. al.)
+ * Copyright (C) 2014-2016 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+
+/*
+ * single consumer of the responses: producers only queue them,
+ * a dedicated thread writes them out in writev batches.
+ */
+typedef struct Writer Writer;
+
+typedef struct WriterStats WriterStats;
+struct WriterStats {
+    unsigned long responses;
+    unsigned long bytes;
+    unsigned long writes; /* syscalls */
+    unsigned long partial; /* writes which did not take the whole batch */
+    unsigned long waits; /* for the fd to become writable again */
+    unsigned long errors; /* failed writes */
+    unsigned long dropped; /* responses lost to them */
+    unsigned long queued_peak; /* bytes */
+    unsigned long shed; /* responses dropped over the budget */
+    unsigned long superseded; /* ... replaced by a newer one */
+    unsigned long spooled;
+    unsigned long replayed; /* ... from the spool */
+};
+
+/* what to do when the queued responses exceed the memory budget */
+enum {
+    WRITER_OVERFLOW_DROP_OLDEST = 0,
+    WRITER_OVERFLOW_KEEP_NEWEST, /* per key, then the oldest */
+    WRITER_OVERFLOW_SPOOL /* the oldest go to a file, and out later */
+};
+
+/* the fd may be non-blocking */
+int
+writer_init(Writer **wr, int fd);
+
+/* the writer must be stopped, or never started */
+void
+writer_free(Writer *wr);
+
+/*
+ * must be called before writer_start.
+ * max_mem: bytes, 0 means unbounded (default). Over it, the queue
+ * is cut down to 3/4 of it according to the policy; the batch being
+ * written is not counted.
+ * spool_path, spool_size: bytes, used by WRITER_OVERFLOW_SPOOL; the
+ * writer thread fills it. When full, its oldest responses are dropped.
+ */
+int
+writer_set_budget(Writer *wr, int policy, size_t max_mem,
+                  const char *spool_path, size_t spool_size);
+
+int
+writer_start(Writer *wr);
+
+/* flushes what is queued, then returns */
+int
+writer_stop(Writer *wr);
+
+/*
+ * queues a copy of the data, never waits for the fd.
+ * The responses are written whole and in order.
+ * key: responses with the same key supersede each other under
+ * WRITER_OVERFLOW_KEEP_NEWEST; 0 is no key.
+ */
+int
+writer_write(Writer *wr, guint64 key, const char *data, size_t len);
+
+/* at any time, while the writer runs too */
+void
+writer_get_stats(Writer *wr, WriterStats *stats);
+
+#endif /* WRITER_H */
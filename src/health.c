@@ -0,0 +1,267 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014-2015 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "health.h"
+
+
+enum {
+    HEALTH_TABLE_SIZE = 64, /* initial slots, keep this a power of 2 */
+    HEALTH_MISSES_MAX = 3, /* in a row, before backing off */
+    HEALTH_EWMA_SHIFT = 2 /* weight of the new sample: 1/4 */
+};
+
+/* microseconds */
+#define HEALTH_BACKOFF_MIN ((gint64)10 * G_USEC_PER_SEC)
+#define HEALTH_BACKOFF_MAX ((gint64)600 * G_USEC_PER_SEC)
+#define HEALTH_STALE ((gint64)3600 * G_USEC_PER_SEC) /* forgotten, if not seen */
+
+typedef struct HealthEntry HealthEntry;
+struct HealthEntry {
+    guint64 key; /* 0 is a free slot */
+    gint64 seen; /* monotonic microseconds */
+    gint64 next; /* ... of the next probe, if unresponsive */
+    gint64 started; /* ... of the call in flight, 0 if none */
+    gint64 missed; /* ... of the last miss it counted, 0 if none */
+    HealthInfo info;
+};
+
+/* open addressing, linear probing; stale entries go when growing */
+struct DomainHealth {
+    HealthEntry *slots;
+    size_t size;
+    size_t used;
+    gint64 slow;
+    unsigned long backoffs;
+    unsigned long recoveries;
+    pthread_mutex_t lock;
+};
+
+int
+health_init(DomainHealth **dh, gint64 slow)
+{
+    DomainHealth *h = calloc(1, sizeof(*h));
+    if (h) {
+        h->slots = calloc(HEALTH_TABLE_SIZE, sizeof(HealthEntry));
+    }
+    if (!h || !h->slots) {
+        free(h);
+        return -1;
+    }
+    h->size = HEALTH_TABLE_SIZE;
+    h->slow = slow;
+    pthread_mutex_init(&h->lock, NULL);
+    *dh = h;
+    return 0;
+}
+
+void
+health_free(DomainHealth *dh)
+{
+    if (!dh) {
+        return;
+    }
+    g_message("health: domains=%lu backoffs=%lu recoveries=%lu",
+              (unsigned long)dh->used, dh->backoffs, dh->recoveries);
+    pthread_mutex_destroy(&dh->lock);
+    free(dh->slots);
+    free(dh);
+}
+
+/* returns the slot holding key, or the free one where it belongs */
+static HealthEntry *
+health_find(HealthEntry *slots, size_t size, guint64 key)
+{
+    size_t j = ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+    while (slots[j].key && slots[j].key != key) {
+        j = (j + 1) & (size - 1);
+    }
+    return &slots[j];
+}
+
+/* keeps the load below one half */
+static int
+health_grow(DomainHealth *dh, gint64 now)
+{
+    HealthEntry *slots = calloc(dh->size * 2, sizeof(HealthEntry));
+    size_t j;
+
+    if (!slots) {
+        return -1;
+    }
+    dh->used = 0;
+    for (j = 0; j < dh->size; j++) {
+        HealthEntry *he = &dh->slots[j];
+        if (he->key && now - he->seen < HEALTH_STALE) {
+            *health_find(slots, dh->size * 2, he->key) = *he;
+            dh->used++;
+        }
+    }
+    free(dh->slots);
+    dh->slots = slots;
+    dh->size *= 2;
+    return 0;
+}
+
+/* must be called with the lock held */
+static void
+health_account(DomainHealth *dh, HealthEntry *he, gint64 now, gboolean miss)
+{
+    HealthInfo *hi = &he->info;
+
+    if (!miss) {
+        if (hi->unresponsive) {
+            g_message("domain %s responsive again", hi->uuid);
+            dh->recoveries++;
+        }
+        hi->misses = 0;
+        hi->unresponsive = FALSE;
+        hi->backoff = 0;
+    } else if (++hi->misses >= HEALTH_MISSES_MAX) {
+        if (!hi->unresponsive) {
+            g_warning("domain %s unresponsive: %i slow samplings in a row",
+                      hi->uuid, hi->misses);
+            dh->backoffs++;
+        }
+        hi->unresponsive = TRUE;
+        hi->backoff = (hi->backoff) ?MIN(hi->backoff * 2, HEALTH_BACKOFF_MAX)
+                                    :HEALTH_BACKOFF_MIN;
+        he->next = now + hi->backoff;
+    }
+}
+
+/*
+ * returns the entry of key, added if missing, or NULL if the table
+ * cannot grow. Must be called with the lock held.
+ */
+static HealthEntry *
+health_entry(DomainHealth *dh, guint64 key, const char *uuid, gint64 now)
+{
+    HealthEntry *he;
+
+    if ((dh->used + 1) * 2 > dh->size && health_grow(dh, now) < 0) {
+        g_warning("could not grow the health table: %lu domains",
+                  (unsigned long)dh->used);
+        return NULL;
+    }
+    he = health_find(dh->slots, dh->size, key);
+    if (!he->key) {
+        memset(he, 0, sizeof(*he));
+        he->key = key;
+        dh->used++;
+    }
+    g_strlcpy(he->info.uuid, uuid, sizeof(he->info.uuid));
+    he->seen = now;
+    return he;
+}
+
+gboolean
+health_due(DomainHealth *dh, guint64 key, gint64 now)
+{
+    gboolean due = TRUE;
+    HealthEntry *he;
+
+    pthread_mutex_lock(&dh->lock);
+    he = health_find(dh->slots, dh->size, key);
+    if (he->key && he->started && dh->slow > 0) {
+        /*
+         * still stuck in its call: a miss per slow threshold, then
+         * per back-off period, as if it were probed and timed out
+         */
+        gint64 since = (he->missed) ?he->missed :he->started;
+        gint64 period = (he->info.unresponsive) ?he->info.backoff :dh->slow;
+        if (now - since > period) {
+            he->missed = now;
+            health_account(dh, he, now, TRUE);
+        }
+    }
+    if (he->key && he->info.unresponsive) {
+        due = (now >= he->next);
+        if (due) {
+            he->next = now + he->info.backoff;
+        }
+    }
+    pthread_mutex_unlock(&dh->lock);
+    return due;
+}
+
+void
+health_begin(DomainHealth *dh, guint64 key, const char *uuid, gint64 now)
+{
+    HealthEntry *he;
+
+    pthread_mutex_lock(&dh->lock);
+    he = health_entry(dh, key, uuid, now);
+    if (he) {
+        he->started = now;
+        he->missed = 0;
+    }
+    pthread_mutex_unlock(&dh->lock);
+}
+
+void
+health_record(DomainHealth *dh, guint64 key, const char *uuid,
+              gint64 now, gint64 latency, gboolean timeout)
+{
+    HealthEntry *he;
+    HealthInfo *hi;
+    gboolean miss = timeout || (dh->slow > 0 && latency > dh->slow);
+
+    pthread_mutex_lock(&dh->lock);
+    he = health_entry(dh, key, uuid, now);
+    if (!he) {
+        pthread_mutex_unlock(&dh->lock);
+        return;
+    }
+    hi = &he->info;
+    he->started = 0;
+    he->missed = 0;
+    if (!hi->samples) {
+        hi->latency_avg = latency;
+    }
+    hi->samples++;
+    hi->latency_avg += (latency - hi->latency_avg) >> HEALTH_EWMA_SHIFT;
+    if (timeout) {
+        hi->timeouts++;
+    }
+    health_account(dh, he, now, miss);
+    pthread_mutex_unlock(&dh->lock);
+}
+
+int
+health_get(DomainHealth *dh, HealthInfo **infos)
+{
+    size_t j;
+    int n = 0;
+
+    pthread_mutex_lock(&dh->lock);
+    *infos = calloc(MAX(dh->used, 1), sizeof(HealthInfo));
+    for (j = 0; *infos && j < dh->size; j++) {
+        if (dh->slots[j].key) {
+            (*infos)[n++] = dh->slots[j].info;
+        }
+    }
+    pthread_mutex_unlock(&dh->lock);
+    return (*infos) ?n :-1;
+}
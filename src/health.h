@@ -0,0 +1,79 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014-2015 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <glib.h>
+
+#include <libvirt/libvirt.h>
+
+
+/*
+ * per-domain sampling health. A domain whose samplings time out,
+ * or take too long, several times in a row is unresponsive: it is
+ * sampled with an exponential back-off until a sampling goes well.
+ */
+typedef struct DomainHealth DomainHealth;
+
+typedef struct HealthInfo HealthInfo;
+struct HealthInfo {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    gboolean unresponsive;
+    int misses; /* in a row */
+    unsigned long samples;
+    unsigned long timeouts;
+    gint64 latency_avg; /* microseconds, moving average */
+    gint64 backoff; /* microseconds, 0 if responsive */
+};
+
+/* slow: microseconds, a sampling taking longer is a miss; 0 disables */
+int
+health_init(DomainHealth **dh, gint64 slow);
+
+void
+health_free(DomainHealth *dh);
+
+/*
+ * returns FALSE if the domain is backing off at `now'.
+ * A due unresponsive domain gets one probe per back-off period.
+ */
+gboolean
+health_due(DomainHealth *dh, guint64 key, gint64 now);
+
+/*
+ * a sampling of the domain calls libvirt: while the call outlasts the
+ * slow threshold, health_due counts a miss once per threshold, then
+ * once per back-off period.
+ */
+void
+health_begin(DomainHealth *dh, guint64 key, const char *uuid, gint64 now);
+
+/* the call returned; latency: microseconds */
+void
+health_record(DomainHealth *dh, guint64 key, const char *uuid,
+              gint64 now, gint64 latency, gboolean timeout);
+
+/* a snapshot of all the domains; the caller frees *infos */
+int
+health_get(DomainHealth *dh, HealthInfo **infos);
+
+#endif /* HEALTH_H */
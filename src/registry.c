@@ -0,0 +1,409 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014-2015 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "registry.h"
+
+
+enum {
+    REGISTRY_TABLE_SIZE = 64 /* initial slots, keep this a power of 2 */
+};
+
+typedef struct RegistryEntry RegistryEntry;
+struct RegistryEntry {
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    virDomainPtr dom; /* NULL is a free slot */
+};
+
+/* open addressing, linear probing, backward shift deletion */
+struct DomainRegistry {
+    RegistryEntry *slots;
+    size_t size;
+    size_t used;
+    virConnectPtr conn;
+    unsigned int flags;
+    int callback_id;
+    int timer_id;
+    int stopping;
+    gboolean running;
+    pthread_t loop;
+    unsigned long events;
+    unsigned long reconciles;
+    unsigned long drifts; /* changes the events missed */
+    pthread_mutex_t lock;
+};
+
+int
+registry_init(DomainRegistry **reg, virConnectPtr conn, unsigned int flags)
+{
+    DomainRegistry *r = calloc(1, sizeof(*r));
+    if (r) {
+        r->slots = calloc(REGISTRY_TABLE_SIZE, sizeof(RegistryEntry));
+    }
+    if (!r || !r->slots) {
+        free(r);
+        return -1;
+    }
+    r->size = REGISTRY_TABLE_SIZE;
+    r->conn = conn;
+    r->flags = flags;
+    r->callback_id = -1;
+    r->timer_id = -1;
+    pthread_mutex_init(&r->lock, NULL);
+    *reg = r;
+    return 0;
+}
+
+static void
+registry_release(RegistryEntry *slots, size_t size)
+{
+    size_t j;
+    for (j = 0; j < size; j++) {
+        if (slots[j].dom) {
+            virDomainFree(slots[j].dom);
+        }
+    }
+    free(slots);
+}
+
+void
+registry_free(DomainRegistry *reg)
+{
+    if (!reg) {
+        return;
+    }
+    g_message("registry: domains=%lu events=%lu reconciles=%lu drifts=%lu",
+              (unsigned long)reg->used, reg->events, reg->reconciles,
+              reg->drifts);
+    pthread_mutex_destroy(&reg->lock);
+    registry_release(reg->slots, reg->size);
+    free(reg);
+}
+
+static size_t
+registry_slot(size_t size, const unsigned char *uuid)
+{
+    guint64 a, b;
+    memcpy(&a, uuid, sizeof(a));
+    memcpy(&b, uuid + sizeof(a), sizeof(b));
+    return (((a ^ b) * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+/* returns the slot holding uuid, or the free one where it belongs */
+static RegistryEntry *
+registry_find(RegistryEntry *slots, size_t size, const unsigned char *uuid)
+{
+    size_t j = registry_slot(size, uuid);
+    while (slots[j].dom && memcmp(slots[j].uuid, uuid, VIR_UUID_BUFLEN)) {
+        j = (j + 1) & (size - 1);
+    }
+    return &slots[j];
+}
+
+/* keeps the load below one half */
+static RegistryEntry *
+registry_table(RegistryEntry *slots, size_t size, size_t *new_size,
+               size_t count)
+{
+    RegistryEntry *table = NULL;
+    size_t j;
+
+    *new_size = REGISTRY_TABLE_SIZE;
+    while ((count + 1) * 2 > *new_size) {
+        *new_size *= 2;
+    }
+    table = calloc(*new_size, sizeof(RegistryEntry));
+    for (j = 0; table && j < size; j++) {
+        if (slots[j].dom) {
+            *registry_find(table, *new_size, slots[j].uuid) = slots[j];
+        }
+    }
+    return table;
+}
+
+/* takes the reference to dom, if inserted */
+static gboolean
+registry_insert(DomainRegistry *reg, const unsigned char *uuid,
+                virDomainPtr dom)
+{
+    RegistryEntry *re = NULL;
+
+    if ((reg->used + 1) * 2 > reg->size) {
+        size_t size = 0;
+        RegistryEntry *slots = registry_table(reg->slots, reg->size, &size,
+                                              reg->used + 1);
+        if (!slots) {
+            g_warning("could not grow the registry: %lu domains",
+                      (unsigned long)reg->used);
+            return FALSE;
+        }
+        free(reg->slots);
+        reg->slots = slots;
+        reg->size = size;
+    }
+    re = registry_find(reg->slots, reg->size, uuid);
+    if (re->dom) {
+        return FALSE;
+    }
+    memcpy(re->uuid, uuid, VIR_UUID_BUFLEN);
+    re->dom = dom;
+    reg->used++;
+    return TRUE;
+}
+
+int
+registry_add(DomainRegistry *reg, virDomainPtr dom)
+{
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    gboolean inserted = FALSE;
+
+    if (virDomainGetUUID(dom, uuid) < 0 || virDomainRef(dom) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&reg->lock);
+    inserted = registry_insert(reg, uuid, dom);
+    pthread_mutex_unlock(&reg->lock);
+    if (!inserted) {
+        virDomainFree(dom);
+    }
+    return 0;
+}
+
+void
+registry_remove(DomainRegistry *reg, const unsigned char *uuid)
+{
+    virDomainPtr dom = NULL;
+    size_t mask, j, k;
+
+    pthread_mutex_lock(&reg->lock);
+    mask = reg->size - 1;
+    j = registry_find(reg->slots, reg->size, uuid) - reg->slots;
+    dom = reg->slots[j].dom;
+    if (dom) {
+        reg->slots[j].dom = NULL;
+        reg->used--;
+        for (k = (j + 1) & mask; reg->slots[k].dom; k = (k + 1) & mask) {
+            size_t home = registry_slot(reg->size, reg->slots[k].uuid);
+            /* move back unless home lies cyclically in (j, k] */
+            if (((k - home) & mask) >= ((k - j) & mask)) {
+                reg->slots[j] = reg->slots[k];
+                reg->slots[k].dom = NULL;
+                j = k;
+            }
+        }
+    }
+    pthread_mutex_unlock(&reg->lock);
+    if (dom) {
+        virDomainFree(dom);
+    }
+}
+
+int
+registry_get(DomainRegistry *reg, virDomainPtr **doms)
+{
+    virDomainPtr *list = NULL;
+    size_t j;
+    int n = 0;
+
+    pthread_mutex_lock(&reg->lock);
+    list = calloc(reg->used + 1, sizeof(virDomainPtr));
+    for (j = 0; list && j < reg->size; j++) {
+        if (reg->slots[j].dom && virDomainRef(reg->slots[j].dom) == 0) {
+            list[n++] = reg->slots[j].dom;
+        }
+    }
+    pthread_mutex_unlock(&reg->lock);
+    if (!list) {
+        return -1;
+    }
+    *doms = list;
+    return n;
+}
+
+int
+registry_reconcile(DomainRegistry *reg)
+{
+    virDomainPtr *doms = NULL;
+    RegistryEntry *slots = NULL;
+    RegistryEntry *old = NULL;
+    size_t j, size = 0, old_size = 0;
+    unsigned long added = 0, removed = 0;
+    int i, n, kept = 0;
+
+    n = virConnectListAllDomains(reg->conn, &doms, reg->flags);
+    if (n < 0) {
+        return n;
+    }
+    slots = registry_table(NULL, 0, &size, n);
+    for (i = 0; i < n; i++) {
+        unsigned char uuid[VIR_UUID_BUFLEN];
+        RegistryEntry *re = NULL;
+
+        if (!slots || virDomainGetUUID(doms[i], uuid) < 0) {
+            virDomainFree(doms[i]);
+            continue;
+        }
+        re = registry_find(slots, size, uuid);
+        memcpy(re->uuid, uuid, VIR_UUID_BUFLEN);
+        re->dom = doms[i];
+        kept++;
+    }
+    free(doms);
+    if (!slots) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&reg->lock);
+    for (j = 0; j < size; j++) {
+        if (slots[j].dom &&
+            !registry_find(reg->slots, reg->size, slots[j].uuid)->dom) {
+            added++;
+        }
+    }
+    removed = reg->used - (kept - added);
+    if (reg->reconciles > 0 && (added || removed)) {
+        g_message("registry: reconciliation added=%lu removed=%lu",
+                  added, removed);
+        reg->drifts += added + removed;
+    }
+    reg->reconciles++;
+    old = reg->slots;
+    old_size = reg->size;
+    reg->slots = slots;
+    reg->size = size;
+    reg->used = kept;
+    pthread_mutex_unlock(&reg->lock);
+
+    registry_release(old, old_size);
+    return kept;
+}
+
+/* runs in the event loop thread, like the reconciliation */
+static int
+registry_lifecycle(virConnectPtr conn, virDomainPtr dom,
+                   int event, int detail, void *opaque)
+{
+    DomainRegistry *reg = opaque;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+
+    (void)conn;
+    (void)detail;
+    reg->events++;
+    switch (event) {
+    case VIR_DOMAIN_EVENT_STARTED:
+    case VIR_DOMAIN_EVENT_SUSPENDED:
+    case VIR_DOMAIN_EVENT_RESUMED:
+    case VIR_DOMAIN_EVENT_PMSUSPENDED:
+        registry_add(reg, dom);
+        break;
+    case VIR_DOMAIN_EVENT_STOPPED:
+        if (virDomainGetUUID(dom, uuid) == 0) {
+            registry_remove(reg, uuid);
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+static void
+registry_tick(int timer, void *opaque)
+{
+    DomainRegistry *reg = opaque;
+
+    (void)timer;
+    if (__atomic_load_n(&reg->stopping, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (registry_reconcile(reg) < 0) {
+        g_warning("registry: reconciliation failed");
+    }
+}
+
+static void *
+registry_loop(void *data)
+{
+    DomainRegistry *reg = data;
+
+    while (!__atomic_load_n(&reg->stopping, __ATOMIC_ACQUIRE)) {
+        if (virEventRunDefaultImpl() < 0) {
+            g_warning("registry: the event loop failed, events stop here");
+            break;
+        }
+    }
+    return NULL;
+}
+
+int
+registry_start(DomainRegistry *reg, int period)
+{
+    /*
+     * first: the events queued meanwhile are replayed on the listing.
+     * The generic cast goes through void (*)(void), or -Wextra objects.
+     */
+    reg->callback_id = virConnectDomainEventRegisterAny(
+                            reg->conn, NULL,
+                            VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                            VIR_DOMAIN_EVENT_CALLBACK(
+                                (void (*)(void))registry_lifecycle),
+                            reg, NULL);
+    if (reg->callback_id < 0) {
+        return -1;
+    }
+    if (registry_reconcile(reg) < 0 ||
+        (reg->timer_id = virEventAddTimeout(period * 1000, registry_tick,
+                                            reg, NULL)) < 0) {
+        virConnectDomainEventDeregisterAny(reg->conn, reg->callback_id);
+        reg->callback_id = -1;
+        return -1;
+    }
+    if (pthread_create(&reg->loop, NULL, registry_loop, reg) != 0) {
+        virEventRemoveTimeout(reg->timer_id);
+        virConnectDomainEventDeregisterAny(reg->conn, reg->callback_id);
+        reg->timer_id = -1;
+        reg->callback_id = -1;
+        return -1;
+    }
+    reg->running = TRUE;
+    return 0;
+}
+
+void
+registry_stop(DomainRegistry *reg)
+{
+    if (!reg || !reg->running) {
+        return;
+    }
+    __atomic_store_n(&reg->stopping, 1, __ATOMIC_RELEASE);
+    /* wakes up the loop */
+    virEventUpdateTimeout(reg->timer_id, 0);
+    pthread_join(reg->loop, NULL);
+
+    virEventRemoveTimeout(reg->timer_id);
+    virConnectDomainEventDeregisterAny(reg->conn, reg->callback_id);
+    reg->timer_id = -1;
+    reg->callback_id = -1;
+    reg->running = FALSE;
+}
@@ -0,0 +1,73 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014-2015 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <glib.h>
+
+#include <libvirt/libvirt.h>
+
+
+/*
+ * the domains to sample, kept current by the libvirt lifecycle events
+ * and periodically reconciled with a full listing, in case any event
+ * went missing. Spares the sampling one listing per cycle.
+ */
+typedef struct DomainRegistry DomainRegistry;
+
+/* flags: VIR_CONNECT_LIST_DOMAINS_*, the active domains only */
+int
+registry_init(DomainRegistry **reg, virConnectPtr conn, unsigned int flags);
+
+void
+registry_free(DomainRegistry *reg);
+
+/*
+ * lists the domains, then follows the events from a thread running the
+ * libvirt event loop: virEventRegisterDefaultImpl() must be called
+ * before opening the connection. period: seconds between reconciliations.
+ */
+int
+registry_start(DomainRegistry *reg, int period);
+
+void
+registry_stop(DomainRegistry *reg);
+
+/* replaces the domains tracked with a full listing */
+int
+registry_reconcile(DomainRegistry *reg);
+
+/* both idempotent */
+int
+registry_add(DomainRegistry *reg, virDomainPtr dom);
+
+void
+registry_remove(DomainRegistry *reg, const unsigned char *uuid);
+
+/*
+ * the domains tracked, NULL terminated, like virConnectListAllDomains:
+ * the caller frees each domain and the array. Returns how many.
+ */
+int
+registry_get(DomainRegistry *reg, virDomainPtr **doms);
+
+#endif /* REGISTRY_H */
@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <pthread.h>
+
 #include <libvirt/libvirt.h>
 
 #include "contrib/jsmn/jsmn.h"
@@ -31,35 +33,44 @@
 #include "vmon_int.h"
 
 
-/* FIXME */
+static const struct {
+    const char *name;
+    unsigned int stats;
+} request_stats[] = {
+    { "state", VIR_DOMAIN_STATS_STATE },
+    { "cpu-total", VIR_DOMAIN_STATS_CPU_TOTAL },
+    { "balloon", VIR_DOMAIN_STATS_BALLOON },
+    { "vcpu", VIR_DOMAIN_STATS_VCPU },
+    { "interface", VIR_DOMAIN_STATS_INTERFACE },
+    { "block", VIR_DOMAIN_STATS_BLOCK },
+};
+
+int
+sampler_parse_stats(const char *name, size_t len, unsigned int *stats)
+{
+    size_t j;
+    for (j = 0; j < G_N_ELEMENTS(request_stats); j++) {
+        const char *stat = request_stats[j].name;
+        if (strlen(stat) == len && strncmp(stat, name, len) == 0) {
+            *stats |= request_stats[j].stats;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 static int
 parse_stats_string(SampleRequest *sr, const char *filter, size_t len)
 {
-    int err = 0;
-    unsigned int stat = 0;
-
-    if (!strncmp(filter, "state", len)) {
-        stat = VIR_DOMAIN_STATS_STATE;
-    } else if (!strncmp(filter, "cpu-total", len)) {
-        stat = VIR_DOMAIN_STATS_CPU_TOTAL;
-    } else if (!strncmp(filter, "balloon", len)) {
-        stat = VIR_DOMAIN_STATS_BALLOON;
-    } else if (!strncmp(filter, "vcpu", len)) {
-        stat = VIR_DOMAIN_STATS_VCPU;
-    } else if (!strncmp(filter, "interface", len)) {
-        stat = VIR_DOMAIN_STATS_INTERFACE;
-    } else if (!strncmp(filter, "block", len)) {
-        stat = VIR_DOMAIN_STATS_BLOCK;
-    } else {
+    int err = sampler_parse_stats(filter, len, &sr->stats);
+
+    if (err) {
         char req_uuid[VIR_UUID_STRING_BUFLEN] = { '\0' };
 
         uuid_unparse(sr->uuid, req_uuid);
         g_message("req-id=\"%s\" ignored unknown stat: %.*s",
                   req_uuid, (int)len, filter);
-        err = -1;
     }
-
-    sr->stats |= stat;
     return err;
 }
 
@@ -83,6 +94,52 @@ enum {
     JSON_REQUEST_MAX_TOKENS = 32
 };
 
+static const struct {
+    const char *name;
+    int priority;
+} request_priorities[] = {
+    { "high", EXECUTOR_PRIORITY_HIGH },
+    { "normal", EXECUTOR_PRIORITY_NORMAL },
+    { "low", EXECUTOR_PRIORITY_LOW },
+};
+
+static int
+parse_priority_string(SampleRequest *sr, const char *text, size_t len)
+{
+    size_t j;
+    for (j = 0; j < G_N_ELEMENTS(request_priorities); j++) {
+        const char *name = request_priorities[j].name;
+        if (strlen(name) == len && strncmp(name, text, len) == 0) {
+            sr->priority = request_priorities[j].priority;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int
+parse_uuid_token(const char *text, const jsmntok_t *tok,
+                 const char *key, uuid_t uuid)
+{
+    char uuidbuf[UUID_STRING_LEN] = { '\0' };
+    size_t len = tok->end - tok->start;
+    if (tok->type != JSMN_STRING) {
+        /* warning */
+        g_message("JSON request malformed: %s is not a string", key);
+        return -1;
+    }
+    if (len > VIR_UUID_STRING_BUFLEN) {
+        /* warning */
+        g_message("JSON request malformed: %s too long", key);
+        return -1;
+    }
+    strncpy(uuidbuf, text + tok->start,
+            MIN(len, UUID_STRING_LEN)); /* FIXME */
+    uuidbuf[UUID_STRING_LEN-1] = '\0';
+    uuid_parse(uuidbuf, uuid);
+    return 0;
+}
+
 VMON_PRIVATE int
 sampler_parse_request(SampleRequest *sr, const char *text, size_t size)
 {
@@ -93,6 +150,7 @@ sampler_parse_request(SampleRequest *sr, const char *text, size_t size)
 
     memset(sr, 0, sizeof(*sr));
     uuid_clear(sr->uuid);
+    sr->priority = EXECUTOR_PRIORITY_NORMAL;
 
     jsmn_init(&parser);
     r = jsmn_parse(&parser, text, size, tokens, sizeof(tokens)/sizeof(tokens[0]));
@@ -112,22 +170,24 @@ sampler_parse_request(SampleRequest *sr, const char *text, size_t size)
 
     for (i = 1; i < r; i++) {
         if (is_token(text, &tokens[i], "req-id") && has_next(i, r)) {
-            char uuidbuf[UUID_STRING_LEN] = { '\0' };
-            size_t len = tokens[i+1].end - tokens[i+1].start;
-            if (tokens[i+1].type != JSMN_STRING) {
-                /* warning */
-                g_message("JSON request malformed: req-id is not a string");
+            if (parse_uuid_token(text, &tokens[i+1], "req-id", sr->uuid) < 0) {
+                return -1;
+            }
+            i += 1;
+        } else if (is_token(text, &tokens[i], "cancel") && has_next(i, r)) {
+            /* the req-id to withdraw, not a new request */
+            if (parse_uuid_token(text, &tokens[i+1], "cancel", sr->uuid) < 0) {
                 return -1;
             }
-            if (len > VIR_UUID_STRING_BUFLEN) {
+            sr->cancel = TRUE;
+            i += 1;
+        } else if (is_token(text, &tokens[i], "get-health") && has_next(i, r)) {
+            if (tokens[i+1].type != JSMN_PRIMITIVE) {
                 /* warning */
-                g_message("JSON request malformed: req-id too long");
+                g_message("JSON request malformed: get-health is not a boolean");
                 return -1;
             }
-            strncpy(uuidbuf, text + tokens[i+1].start,
-                    MIN(len, UUID_STRING_LEN)); /* FIXME */
-            uuidbuf[UUID_STRING_LEN-1] = '\0';
-            uuid_parse(uuidbuf, sr->uuid);
+            sr->health = (text[tokens[i+1].start] == 't');
             i += 1;
         } else if (is_token(text, &tokens[i], "get-stats") && has_next(i, r)) {
             int j;
@@ -155,6 +215,16 @@ sampler_parse_request(SampleRequest *sr, const char *text, size_t size)
                 }
             }
             i += tokens[i+1].size + 1;
+        } else if (is_token(text, &tokens[i], "priority") && has_next(i, r)) {
+            if (tokens[i+1].type != JSMN_STRING ||
+                parse_priority_string(sr,
+                                      text + tokens[i+1].start,
+                                      tokens[i+1].end - tokens[i+1].start) < 0) {
+                /* warning */
+                g_message("JSON request malformed: bad priority");
+                return -1;
+            }
+            i += 1;
         } else {
             g_message("unexpected key: %.*s",
                       tokens[i].end - tokens[i].start,
@@ -164,12 +234,301 @@ sampler_parse_request(SampleRequest *sr, const char *text, size_t size)
     return 0;
 }
 
+/*
+ * single-flight: a request identical to one in progress, for the
+ * same stats of the same domains, does not call libvirt again.
+ * It joins the flight, and the results of the call are sent once
+ * per req-id. A flight takes new requests until its first response
+ * is out: a late one could not get the full results anymore.
+ */
+struct SamplerFlight {
+    SamplerFlight *next;
+    unsigned int stats;
+    int flags;
+    int priority;
+    TaskHandle handle; /* of the tasks doing the work */
+    gboolean closed; /* listed until freed, for cancellations */
+    int refs;
+    int req_ids_num;
+    int req_ids_size;
+    uuid_t *req_ids; /* the first one started the flight */
+};
+
+struct SamplerFlights {
+    pthread_mutex_t lock;
+    SamplerFlight *head;
+    unsigned long started;
+    unsigned long joined;
+};
+
+enum {
+    FLIGHT_MIN_REQ_IDS = 4
+};
+
+int
+sampler_init(VmonContext *ctx)
+{
+    SamplerFlights *fl = calloc(1, sizeof(*fl));
+    if (!fl) {
+        return -1;
+    }
+    pthread_mutex_init(&fl->lock, NULL);
+    ctx->flights = fl;
+
+    if (health_init(&ctx->health,
+                    (gint64)ctx->conf.timeout * 1000 / 2) < 0) {
+        g_warning("failed to track the domains health, no back-off");
+        ctx->health = NULL;
+    }
+    if (vmshapes_init(&ctx->shapes) < 0) {
+        g_warning("failed to cache the records shapes, parsing them all");
+        ctx->shapes = NULL;
+    }
+    return 0;
+}
+
+void
+sampler_free(VmonContext *ctx)
+{
+    SamplerFlights *fl = ctx->flights;
+    health_free(ctx->health);
+    ctx->health = NULL;
+    if (ctx->shapes) {
+        unsigned long domains = 0, hits = 0, learned = 0;
+        vmshapes_stats(ctx->shapes, &domains, &hits, &learned);
+        g_message("sampler: shapes domains=%lu hits=%lu learned=%lu",
+                  domains, hits, learned);
+        vmshapes_free(ctx->shapes);
+        ctx->shapes = NULL;
+    }
+    if (!fl) {
+        return;
+    }
+    g_message("sampler: flights started=%lu joined=%lu",
+              fl->started, fl->joined);
+    pthread_mutex_destroy(&fl->lock);
+    free(fl);
+    ctx->flights = NULL;
+}
+
+static int
+flight_add_req_id(SamplerFlight *f, const uuid_t req_id)
+{
+    if (f->req_ids_num == f->req_ids_size) {
+        int size = MAX(f->req_ids_size * 2, FLIGHT_MIN_REQ_IDS);
+        uuid_t *req_ids = realloc(f->req_ids, size * sizeof(uuid_t));
+        if (!req_ids) {
+            return -1;
+        }
+        f->req_ids = req_ids;
+        f->req_ids_size = size;
+    }
+    uuid_copy(f->req_ids[f->req_ids_num++], req_id);
+    return 0;
+}
+
+/* must be called with the lock held */
+static void
+flight_unlink(SamplerFlights *fl, SamplerFlight *f)
+{
+    SamplerFlight **p = &fl->head;
+
+    while (*p != f) {
+        p = &(*p)->next;
+    }
+    *p = f->next;
+}
+
+static guint64
+uuid_fold(const unsigned char *uuid)
+{
+    guint64 lo, hi;
+
+    memcpy(&lo, uuid, sizeof(lo));
+    memcpy(&hi, uuid + sizeof(lo), sizeof(hi));
+    return (lo ^ hi) ?lo ^ hi :1; /* never 0 */
+}
+
+/* all the work for a req-id is tagged with this */
+static TaskHandle
+request_handle(const uuid_t req_id)
+{
+    if (uuid_is_null(req_id)) {
+        return 0; /* cannot be cancelled */
+    }
+    return uuid_fold(req_id);
+}
+
+/* one sampling per domain at a time, so a stuck VM holds one worker */
+static TaskKey
+domain_key(virDomainPtr dom)
+{
+    unsigned char uuid[VIR_UUID_BUFLEN];
+
+    if (virDomainGetUUID(dom, uuid) < 0) {
+        return 0;
+    }
+    return uuid_fold(uuid);
+}
+
+/*
+ * returns TRUE if the request joined a flight: nothing else to do.
+ * Otherwise, the request may have started a new one.
+ * A request does not join a flight less urgent than itself.
+ */
+static gboolean
+flight_join(SamplerFlights *fl, VmonRequest *req)
+{
+    SamplerFlight *f = NULL;
+    gboolean joined = FALSE;
+
+    pthread_mutex_lock(&fl->lock);
+    for (f = fl->head; f; f = f->next) {
+        if (!f->closed &&
+            f->stats == req->sr.stats &&
+            f->flags == req->ctx->flags &&
+            f->priority <= req->sr.priority) {
+            break;
+        }
+    }
+
+    if (f) {
+        joined = (flight_add_req_id(f, req->sr.uuid) == 0);
+        fl->joined += joined;
+    } else {
+        f = calloc(1, sizeof(*f));
+        if (f && flight_add_req_id(f, req->sr.uuid) == 0) {
+            f->stats = req->sr.stats;
+            f->flags = req->ctx->flags;
+            f->priority = req->sr.priority;
+            f->handle = request_handle(req->sr.uuid);
+            f->refs = 1;
+            f->next = fl->head;
+            fl->head = f;
+            fl->started++;
+            req->flight = f;
+        } else {
+            free(f); /* no coalescing, then */
+        }
+    }
+    pthread_mutex_unlock(&fl->lock);
+
+    return joined;
+}
+
+static void
+flight_ref(VmonRequest *req, int refs)
+{
+    SamplerFlights *fl = req->ctx->flights;
+
+    if (req->flight) {
+        pthread_mutex_lock(&fl->lock);
+        req->flight->refs += refs;
+        pthread_mutex_unlock(&fl->lock);
+    }
+}
+
+static void
+flight_unref(VmonRequest *req)
+{
+    SamplerFlights *fl = req->ctx->flights;
+    SamplerFlight *f = req->flight;
+
+    if (!f) {
+        return;
+    }
+    pthread_mutex_lock(&fl->lock);
+    if (--f->refs == 0) {
+        flight_unlink(fl, f);
+    } else {
+        f = NULL;
+    }
+    pthread_mutex_unlock(&fl->lock);
+
+    if (f) {
+        free(f->req_ids);
+        free(f);
+    }
+}
+
+/*
+ * the req-ids to respond to. Once closed, the flight takes no
+ * other requests, so the list is stable.
+ */
 static int
-write_response(FILE *out, const char *response, ssize_t length)
+flight_close(VmonRequest *req, uuid_t **req_ids)
+{
+    SamplerFlights *fl = req->ctx->flights;
+    SamplerFlight *f = req->flight;
+
+    if (!f) {
+        *req_ids = &req->sr.uuid;
+        return 1;
+    }
+    pthread_mutex_lock(&fl->lock);
+    f->closed = TRUE;
+    pthread_mutex_unlock(&fl->lock);
+
+    *req_ids = f->req_ids;
+    return f->req_ids_num;
+}
+
+/*
+ * a requester gives up: returns the handle of the tasks to cancel,
+ * or 0 if other requesters still wait for their results.
+ */
+static TaskHandle
+flight_leave(SamplerFlights *fl, const uuid_t req_id)
+{
+    TaskHandle handle = request_handle(req_id);
+    SamplerFlight *f;
+    int i = 0;
+
+    pthread_mutex_lock(&fl->lock);
+    for (f = fl->head; f; f = f->next) {
+        for (i = 0; i < f->req_ids_num; i++) {
+            if (uuid_compare(f->req_ids[i], req_id) == 0) {
+                break;
+            }
+        }
+        if (i < f->req_ids_num || f->handle == handle) {
+            break;
+        }
+    }
+
+    if (f) {
+        if (f->req_ids_num == 1 && i == 0) {
+            handle = f->handle; /* the last one */
+        } else {
+            if (!f->closed && i < f->req_ids_num) {
+                /* not yet answered: can drop out */
+                memmove(&f->req_ids[i], &f->req_ids[i + 1],
+                        (f->req_ids_num - i - 1) * sizeof(uuid_t));
+                f->req_ids_num--;
+            }
+            handle = 0;
+        }
+    }
+    pthread_mutex_unlock(&fl->lock);
+
+    return handle;
+}
+
+static int
+write_response(VmonContext *ctx, guint64 key,
+               const char *response, ssize_t length)
 {
     ssize_t ret = 0;
 
-    ret = write(fileno(out), response, length);
+    if (ctx->writer) {
+        if (writer_write(ctx->writer, key, response, length) < 0) {
+            g_warning("write_response failure: cannot queue %zu bytes",
+                      length);
+        }
+        return 0;
+    }
+
+    ret = write(fileno(ctx->out), response, length);
     if (ret != length) {
         g_warning("write_response failure: expected=%zu wrote=%zu",
                   length, ret);
@@ -177,17 +536,29 @@ write_response(FILE *out, const char *response, ssize_t length)
     return 0; /* always succesfull */
 }
 
-static gint
-collect_error(VmonRequest *req, gint error, gboolean timeout)
+static const char *
+error_message(gint error)
+{
+    switch (error) {
+    case EXECUTOR_ERROR_BUSY:
+        return "busy";
+    case SAMPLER_ERROR_UNRESPONSIVE:
+        return "unresponsive";
+    case SAMPLER_ERROR_NO_MEMORY:
+        return "out of memory";
+    default:
+        return "";
+    }
+}
+
+static void
+respond_error(VmonContext *ctx, const uuid_t req_id, const char *dom_uuid,
+              gint error, gboolean timeout)
 {
-    char dom_uuid[VIR_UUID_STRING_BUFLEN] = { '\0' };
     char req_uuid[VIR_UUID_STRING_BUFLEN] = { '\0' };
     char buffer[4096]; /* TODO */
 
-    uuid_unparse(req->sr.uuid, req_uuid);
-    if (req->dom) {
-        virDomainGetUUIDString(req->dom, dom_uuid);
-    }
+    uuid_unparse(req_id, req_uuid);
     snprintf(buffer, sizeof(buffer),
             "{"
             " \"req-id\": \"%s\","
@@ -205,110 +576,255 @@ collect_error(VmonRequest *req, gint error, gboolean timeout)
             time(NULL),
             dom_uuid,
             error,
-            "",
+            error_message(error),
             (timeout) ?"yes" :"no");
 
-    write_response(req->ctx->out, buffer, strlen(buffer));
-    return 0;
+    write_response(ctx, 0, buffer, strlen(buffer));
 }
 
-
 static gint
-sample_domain_work(gpointer data)
+collect_error(VmonRequest *req, gint error, gboolean timeout)
 {
-    int ret = 0;
-    VmonRequest *req = data;
-    ret = virConnectGetAllDomainStats(req->ctx->conn, req->sr.stats, &req->records, 0); /* FIXME */
-    req->records_num = ret;
+    char dom_uuid[VIR_UUID_STRING_BUFLEN] = { '\0' };
+    uuid_t *req_ids = NULL;
+    int i, n;
+
+    if (req->dom) {
+        virDomainGetUUIDString(req->dom, dom_uuid);
+    }
+    n = flight_close(req, &req_ids);
+    for (i = 0; i < n; i++) {
+        respond_error(req->ctx, req_ids[i], dom_uuid, error, timeout);
+    }
     return 0;
 }
 
+static void
+health_begin_domain(VmonContext *ctx, virDomainPtr dom, gint64 now)
+{
+    char dom_uuid[VIR_UUID_STRING_BUFLEN] = { '\0' };
+
+    if (!ctx->health || !dom) {
+        return;
+    }
+    virDomainGetUUIDString(dom, dom_uuid);
+    health_begin(ctx->health, domain_key(dom), dom_uuid, now);
+}
+
+static void
+health_record_domain(VmonContext *ctx, virDomainPtr dom,
+                     gint64 now, gint64 latency, gboolean timeout)
+{
+    char dom_uuid[VIR_UUID_STRING_BUFLEN] = { '\0' };
+
+    if (!ctx->health || !dom) {
+        return;
+    }
+    virDomainGetUUIDString(dom, dom_uuid);
+    health_record(ctx->health, domain_key(dom), dom_uuid,
+                  now, latency, timeout);
+}
+
+/* the target domain only */
 static gint
-bulk_sampling_work(gpointer data)
+sample_domain_work(gpointer data)
 {
     int ret = 0;
     VmonRequest *req = data;
     virDomainPtr doms[] = { req->dom, NULL };
-    ret = virDomainListGetStats(doms, req->sr.stats, &req->records, 0); /* FIXME */
+    req->started = g_get_monotonic_time();
+    health_begin_domain(req->ctx, req->dom, req->started);
+    ret = virDomainListGetStats(doms, req->sr.stats, &req->records, 0);
     req->records_num = ret;
     return 0;
 }
 
 typedef struct VmonResponse VmonResponse;
 struct VmonResponse {
-    FILE *out;
-    char *ptr;
-    size_t len;
+    JsonBuf buf; /* handed as is to the output */
     time_t ts;
 };
 
+/*
+ * per thread: the records and their responses are carved from the
+ * arena, reset once each response is written. The response and body
+ * buffers are kept, so in the steady state nothing is malloc()ed.
+ */
+typedef struct VmonScratch VmonScratch;
+struct VmonScratch {
+    Arena *arena;
+    VmonResponse res;
+    JsonBuf body;
+};
+
+enum {
+    SCRATCH_ARENA_SIZE = 64 * 1024
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void
+scratch_free(void *data)
+{
+    VmonScratch *sc = data;
+    ArenaStats stats;
+
+    arena_get_stats(sc->arena, &stats);
+    g_debug("sampler: arena size=%zu peak=%zu spills=%lu resets=%lu",
+            stats.size, stats.peak, stats.spills, stats.resets);
+    jsonbuf_free(&sc->res.buf);
+    jsonbuf_free(&sc->body);
+    arena_free(sc->arena);
+    free(sc);
+}
+
+static void
+scratch_key_init(void)
+{
+    pthread_key_create(&scratch_key, scratch_free);
+}
+
+/* the one of the calling thread, made on first use */
+static VmonScratch *
+scratch_get(void)
+{
+    VmonScratch *sc = NULL;
+
+    pthread_once(&scratch_once, scratch_key_init);
+    sc = pthread_getspecific(scratch_key);
+    if (sc) {
+        return sc;
+    }
+
+    sc = calloc(1, sizeof(*sc));
+    if (!sc) {
+        return NULL;
+    }
+    if (arena_init(&sc->arena, SCRATCH_ARENA_SIZE) < 0) {
+        free(sc);
+        return NULL;
+    }
+    if (jsonbuf_init(&sc->res.buf, 0) < 0 || jsonbuf_init(&sc->body, 0) < 0 ||
+        pthread_setspecific(scratch_key, sc) != 0) {
+        scratch_free(sc);
+        return NULL;
+    }
+    return sc;
+}
+
+/* every response of the thread becomes invalid */
+static void
+scratch_reset(VmonScratch *sc)
+{
+    jsonbuf_clear(&sc->res.buf);
+    arena_reset(sc->arena);
+}
+
 static void
 response_init(VmonResponse *res)
 {
-    memset(res, 0, sizeof(*res));
     res->ts = time(NULL);
 }
 
+/* forgets what was written */
 static void
 response_open(VmonResponse *res)
 {
-    res->out = open_memstream(&res->ptr, &res->len);
+    jsonbuf_clear(&res->buf);
 }
 
 static void
-response_begin(VmonResponse *res, uuid_t req_id)
+response_begin(VmonResponse *res, const uuid_t req_id)
 {
     char req_uuid[VIR_UUID_STRING_BUFLEN] = { '\0' };
     uuid_unparse(req_id, req_uuid);
-    fprintf(res->out,
-            "{"
-            " \"req-id\": \"%s\","
-            " \"timestamp\": %zu,"
-            " \"data\": ",
-            req_uuid,
-            res->ts);
+    jsonbuf_lit(&res->buf, "{ \"req-id\": \"");
+    jsonbuf_raw(&res->buf, req_uuid, strlen(req_uuid));
+    jsonbuf_lit(&res->buf, "\", \"timestamp\": ");
+    jsonbuf_ullong(&res->buf, res->ts);
+    jsonbuf_lit(&res->buf, ", \"data\": ");
 }
 
 static void
-response_close(VmonResponse *res, FILE *out)
+response_close(VmonResponse *res, VmonContext *ctx, guint64 key)
 {
-    fclose(res->out);
-    write_response(out, res->ptr, res->len);
-    free(res->ptr);
+    if (res->buf.error) {
+        g_warning("response failure: cannot buffer the response");
+        return;
+    }
+    write_response(ctx, key, res->buf.ptr, res->buf.len);
 }
 
 static void
 response_finish(VmonResponse *res)
 {
-    fputs(" }\n", res->out);
+    jsonbuf_lit(&res->buf, " }\n");
 }
 
-static gint
+/* a newer response for the same domain and stats makes this one stale */
+static guint64
+response_key(const VmonRequest *req, virDomainPtr dom)
+{
+    return domain_key(dom) ^ ((guint64)req->sr.stats << 32);
+}
+
+VMON_PRIVATE int
 collect_success(VmonRequest *req)
 {
-    int j = 0;
-    VmonResponse res;
-    response_init(&res);
+    int i, j = 0;
+    VmonScratch *sc = scratch_get();
+    VmonResponse *res = NULL;
+    JsonBuf *body = NULL;
+    uuid_t *req_ids = NULL;
+    guint64 key = 0;
+    int n = 0;
+
+    if (!sc) {
+        g_warning("collect failure: cannot allocate the responses");
+        collect_error(req, SAMPLER_ERROR_NO_MEMORY, FALSE);
+        virDomainStatsRecordListFree(req->records);
+        return 0;
+    }
+    res = &sc->res;
+    body = &sc->body;
+    response_init(res);
 
     VmChecks checks;
     checks.disk_usage_perc = req->ctx->conf.disk_usage_perc;
 
+    if (req->records_num > 0) {
+        n = flight_close(req, &req_ids);
+    }
+
     for (j = 0; j < req->records_num; j++) {
         VmInfo vm;
-        vminfo_init(&vm);
+        guint64 shape = response_key(req, req->records[j]->dom);
+        vminfo_init_arena(&vm, sc->arena);
 
-        vminfo_parse(&vm, req->records[j]); /* FIXME */
+        vminfo_parse_shaped(&vm, req->records[j], req->ctx->shapes, shape); /* FIXME */
 
-        response_open(&res);
-        vminfo_send_events(&vm, &checks, res.out);
+        response_open(res);
+        vminfo_send_events(&vm, &checks, &res->buf);
+        /* events are never superseded */
+        key = (res->buf.len > 0) ?0 :shape;
         if (!req->ctx->conf.events_only) {
-            response_begin(&res, req->sr.uuid);
-            vminfo_print_json(&vm, res.out);
-            response_finish(&res);
+            /* the same for all the req-ids: serialized once */
+            jsonbuf_clear(body);
+            if (vminfo_print_json(&vm, body) < 0) {
+                g_warning("collect failure: response truncated");
+            }
+
+            for (i = 0; i < n; i++) {
+                response_begin(res, req_ids[i]);
+                jsonbuf_raw(&res->buf, body->ptr, body->len);
+                response_finish(res);
+            }
         }
-        response_close(&res, req->ctx->out);
+        response_close(res, req->ctx, key);
 
         vminfo_free(&vm);
+        scratch_reset(sc);
     }
 
     virDomainStatsRecordListFree(req->records);
@@ -316,13 +832,33 @@ collect_success(VmonRequest *req)
     return 0;
 }
 
+/*
+ * the per-domain samplings which actually called libvirt, even if
+ * the results are not wanted anymore; the bulk and the shard ones
+ * feed their domains in their own collect.
+ */
+static void
+health_update(VmonRequest *req, gboolean timeout)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (!req->dom || !req->started) {
+        return;
+    }
+    health_record_domain(req->ctx, req->dom, now, now - req->started, timeout);
+}
+
 static gint
 sampling_collect(gpointer data, gint error, gboolean timeout)
 {
     VmonRequest *req = data;
-    gboolean ret;
+    gboolean ret = 0;
 
-    if (error || timeout) {
+    health_update(req, timeout);
+    if (error == EXECUTOR_ERROR_CANCELLED) {
+        /* nobody wants the results anymore */
+        virDomainStatsRecordListFree(req->records);
+    } else if (error || timeout) {
         ret = collect_error(req, error, timeout);
     } else {
         ret = collect_success(req);
@@ -330,46 +866,607 @@ sampling_collect(gpointer data, gint error, gboolean timeout)
     if (req->dom) {
         virDomainFree(req->dom);
     }
+    flight_unref(req);
     return ret;
 }
 
+/* for the domains not sampled */
+static void
+domain_error(VmonRequest *req, virDomainPtr dom, gint error)
+{
+    VmonRequest vreq;
+    memcpy(&vreq, req, sizeof(vreq));
+    vreq.dom = dom;
+    collect_error(&vreq, error, FALSE);
+    virDomainFree(dom);
+    flight_unref(&vreq);
+}
+
+/* the caller frees each domain and the array */
+static int
+list_domains(VmonContext *ctx, virDomainPtr **domains)
+{
+    if (ctx->registry) {
+        return registry_get(ctx->registry, domains);
+    }
+    return virConnectListAllDomains(ctx->conn, domains, ctx->flags);
+}
+
 static gint
 list_domains_work(gpointer data)
 {
     VmonRequest *req = data;
+    DomainHealth *health = req->ctx->health;
     virDomainPtr *domains;
-    size_t i;
+    VmonRequest *vreqs = NULL;
+    TaskRequest *tasks = NULL;
+    gint64 now = g_get_monotonic_time();
+    int i;
+    int n = 0;
     int ret = -1;
+    int queued = 0;
+    int err = 0;
+
+    ret = list_domains(req->ctx, &domains);
+    if (ret < 0) {
+        collect_error(req, ret, FALSE);
+        return ret;
+    }
+
+    vreqs = calloc(ret, sizeof(*vreqs));
+    tasks = calloc(ret, sizeof(*tasks));
+    /* taken upfront: busy domains are collected during the dispatch */
+    flight_ref(req, ret);
+
+    for (i = 0; vreqs && tasks && i < ret; i++) {
+        TaskKey key = domain_key(domains[i]);
+
+        if (health && !health_due(health, key, now)) {
+            domain_error(req, domains[i], SAMPLER_ERROR_UNRESPONSIVE);
+            continue;
+        }
+
+        memcpy(&vreqs[n], req, sizeof(vreqs[n]));
+        vreqs[n].dom = domains[i];
+
+        tasks[n].work = sample_domain_work;
+        tasks[n].collect = sampling_collect;
+        tasks[n].data = &vreqs[n];
+        tasks[n].size = sizeof(vreqs[n]);
+        tasks[n].timeout = req->ctx->conf.timeout;
+        tasks[n].priority = req->sr.priority;
+        tasks[n].handle = request_handle(req->sr.uuid);
+        tasks[n].key = key;
+        n++;
+    }
+
+    if (vreqs && tasks) {
+        /* one shot for all the domains */
+        queued = (n > 0) ?executor_dispatch_batch(req->ctx->executor, tasks, n) :0;
+    } else {
+        err = EXECUTOR_ERROR_TOO_MANY_TASKS;
+        for (i = 0; i < ret; i++) {
+            domain_error(req, domains[i], err);
+        }
+    }
+
+    if (queued < 0) {
+        err = queued;
+        queued = 0;
+    } else if (queued < n) {
+        err = EXECUTOR_ERROR_TOO_MANY_TASKS;
+    }
+
+    for (i = queued; i < n; i++) {
+        domain_error(req, vreqs[i].dom, err);
+    }
+
+    free(tasks);
+    free(vreqs);
+    free(domains);
+    return (err) ?err :0;
+}
+
+gboolean
+sampler_record_partial(const virDomainStatsRecordPtr record, unsigned int stats)
+{
+    unsigned int disks = 0, sampled = 0;
+    int i;
+
+    if (stats && !(stats & VIR_DOMAIN_STATS_BLOCK)) {
+        return FALSE;
+    }
+    /* empty drives, like a CD-ROM without media, have neither */
+    for (i = 0; i < record->nparams; i++) {
+        const char *field = record->params[i].field;
+        if (!g_str_has_prefix(field, "block.")) {
+            continue;
+        }
+        if (g_str_has_suffix(field, ".path")) {
+            disks++;
+        } else if (g_str_has_suffix(field, ".rd.reqs")) {
+            sampled++;
+        }
+    }
+    return sampled < disks;
+}
+
+#if LIBVIR_CHECK_VERSION(4, 5, 0)
+enum {
+    BULK_NOWAIT = VIR_CONNECT_GET_ALL_DOMAINS_STATS_NOWAIT
+};
+#else
+enum {
+    BULK_NOWAIT = 0
+};
+#endif
+
+/*
+ * the domains busy with a job came back partial: sampled again one by
+ * one, on their own workers, and answered to the same req-ids.
+ * Their records move past the ones to answer now; returns how many.
+ * If they cannot be retried, or are backing off, the partial records
+ * are better than none.
+ */
+static int
+bulk_retry_busy(VmonRequest *req)
+{
+    virDomainStatsRecordPtr *records = req->records;
+    virDomainStatsRecordPtr rec = NULL;
+    VmonRequest *vreqs = NULL;
+    TaskRequest *tasks = NULL;
+    gint64 now = g_get_monotonic_time();
+    int n = req->records_num;
+    int i, k = n;
+    int busy = 0;
+    int queued = 0;
+
+    for (i = 0; i < k; ) {
+        if (sampler_record_partial(records[i], req->sr.stats) &&
+            (!req->ctx->health ||
+             health_due(req->ctx->health, domain_key(records[i]->dom), now))) {
+            k--;
+            rec = records[i];
+            records[i] = records[k];
+            records[k] = rec;
+        } else {
+            i++;
+        }
+    }
+    busy = n - k;
+    if (busy == 0) {
+        return 0;
+    }
+
+    vreqs = calloc(busy, sizeof(*vreqs));
+    tasks = calloc(busy, sizeof(*tasks));
+    if (!vreqs || !tasks) {
+        free(tasks);
+        free(vreqs);
+        return 0;
+    }
+    flight_ref(req, busy);
+
+    /* from the last one: those queued are the tail of the records */
+    for (i = 0; i < busy; i++) {
+        virDomainPtr dom = records[n - 1 - i]->dom;
+
+        memcpy(&vreqs[i], req, sizeof(vreqs[i]));
+        vreqs[i].records = NULL;
+        vreqs[i].records_num = 0;
+        vreqs[i].started = 0;
+        vreqs[i].dom = (virDomainRef(dom) == 0) ?dom :NULL;
+
+        tasks[i].work = sample_domain_work;
+        tasks[i].collect = sampling_collect;
+        tasks[i].data = &vreqs[i];
+        tasks[i].size = sizeof(vreqs[i]);
+        tasks[i].timeout = req->ctx->conf.timeout;
+        tasks[i].priority = req->sr.priority;
+        tasks[i].handle = request_handle(req->sr.uuid);
+        tasks[i].key = domain_key(dom);
+    }
+
+    queued = executor_dispatch_batch(req->ctx->executor, tasks, busy);
+    queued = MAX(queued, 0);
+    for (i = queued; i < busy; i++) {
+        if (vreqs[i].dom) {
+            virDomainFree(vreqs[i].dom);
+        }
+        flight_unref(&vreqs[i]);
+    }
+    if (queued > 0) {
+        g_message("bulk sampling: %i busy domains retried alone", queued);
+    }
+
+    free(tasks);
+    free(vreqs);
+    return queued;
+}
+
+/*
+ * all the domains at once, not waiting for the busy ones: their
+ * records are partial, and they are retried alone.
+ */
+static gint
+bulk_sampling_work(gpointer data)
+{
+    int ret = 0;
+    VmonRequest *req = data;
+    VmonContext *ctx = req->ctx;
+    virErrorPtr err = NULL;
+    int flags = ctx->flags;
+    gboolean nowait = (BULK_NOWAIT &&
+                       !__atomic_load_n(&ctx->nowait_refused, __ATOMIC_RELAXED));
+
+    req->started = g_get_monotonic_time();
+    if (nowait) {
+        ret = virConnectGetAllDomainStats(ctx->conn, req->sr.stats,
+                                          &req->records, flags | BULK_NOWAIT);
+        err = (ret < 0) ?virGetLastError() :NULL;
+        if (err && err->code == VIR_ERR_INVALID_ARG) {
+            g_message("bulk sampling: the driver waits for the busy domains");
+            __atomic_store_n(&ctx->nowait_refused, TRUE, __ATOMIC_RELAXED);
+            nowait = FALSE;
+        }
+    }
+    if (!nowait) {
+        ret = virConnectGetAllDomainStats(ctx->conn, req->sr.stats,
+                                          &req->records, flags);
+    }
+    req->records_num = ret;
+    if (nowait && ret > 0) {
+        req->records_num -= bulk_retry_busy(req);
+    }
+    return 0;
+}
+
+/*
+ * the domains answered share the latency of the call. The busy ones
+ * answered without waiting tell nothing, and those the call skipped
+ * are not known here.
+ */
+static gint
+bulk_collect(gpointer data, gint error, gboolean timeout)
+{
+    VmonRequest *req = data;
+    gint64 now = g_get_monotonic_time();
+    gint64 latency = 0;
+    int i;
+
+    if (req->ctx->health && req->started && req->records_num > 0) {
+        latency = (now - req->started) / req->records_num;
+        for (i = 0; i < req->records_num; i++) {
+            virDomainStatsRecordPtr rec = req->records[i];
+            if (!sampler_record_partial(rec, req->sr.stats)) {
+                health_record_domain(req->ctx, rec->dom,
+                                     now, latency, timeout);
+            }
+        }
+    }
+    return sampling_collect(req, error, timeout);
+}
+
+/* the counters of the output, while it runs */
+static void
+sampler_report_writer(Writer *wr, JsonBuf *out)
+{
+    WriterStats st;
+
+    writer_get_stats(wr, &st);
+    jsonbuf_lit(out, ", \"writer\": { \"responses\": ");
+    jsonbuf_ullong(out, st.responses);
+    jsonbuf_lit(out, ", \"bytes\": ");
+    jsonbuf_ullong(out, st.bytes);
+    jsonbuf_lit(out, ", \"writes\": ");
+    jsonbuf_ullong(out, st.writes);
+    jsonbuf_lit(out, ", \"partial\": ");
+    jsonbuf_ullong(out, st.partial);
+    jsonbuf_lit(out, ", \"waits\": ");
+    jsonbuf_ullong(out, st.waits);
+    jsonbuf_lit(out, ", \"errors\": ");
+    jsonbuf_ullong(out, st.errors);
+    jsonbuf_lit(out, ", \"dropped\": ");
+    jsonbuf_ullong(out, st.dropped);
+    jsonbuf_lit(out, ", \"queued-peak\": ");
+    jsonbuf_ullong(out, st.queued_peak);
+    jsonbuf_lit(out, ", \"shed\": ");
+    jsonbuf_ullong(out, st.shed);
+    jsonbuf_lit(out, ", \"superseded\": ");
+    jsonbuf_ullong(out, st.superseded);
+    jsonbuf_lit(out, ", \"spooled\": ");
+    jsonbuf_ullong(out, st.spooled);
+    jsonbuf_lit(out, ", \"replayed\": ");
+    jsonbuf_ullong(out, st.replayed);
+    jsonbuf_lit(out, " }");
+}
+
+static int
+sampler_report_health(VmonContext *ctx, const uuid_t req_id)
+{
+    HealthInfo *infos = NULL;
+    VmonScratch *sc = NULL;
+    VmonResponse *res = NULL;
+    int i, n = 0;
+
+    if (ctx->health) {
+        n = health_get(ctx->health, &infos);
+        if (n < 0) {
+            respond_error(ctx, req_id, "", n, FALSE);
+            return n;
+        }
+    }
+
+    sc = scratch_get();
+    if (!sc) {
+        free(infos);
+        respond_error(ctx, req_id, "", -1, FALSE);
+        return -1;
+    }
+    res = &sc->res;
+    response_init(res);
+    response_open(res);
+    response_begin(res, req_id);
+    jsonbuf_lit(&res->buf, "{ \"health\": [");
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            jsonbuf_lit(&res->buf, ",");
+        }
+        jsonbuf_lit(&res->buf, " { \"vm-id\": ");
+        jsonbuf_string(&res->buf, infos[i].uuid);
+        jsonbuf_lit(&res->buf, ", \"state\": ");
+        jsonbuf_string(&res->buf,
+                       (infos[i].unresponsive) ?"unresponsive" :"ok");
+        jsonbuf_lit(&res->buf, ", \"misses\": ");
+        jsonbuf_llong(&res->buf, infos[i].misses);
+        jsonbuf_lit(&res->buf, ", \"samples\": ");
+        jsonbuf_ullong(&res->buf, infos[i].samples);
+        jsonbuf_lit(&res->buf, ", \"timeouts\": ");
+        jsonbuf_ullong(&res->buf, infos[i].timeouts);
+        jsonbuf_lit(&res->buf, ", \"latency-avg\": ");
+        jsonbuf_llong(&res->buf, infos[i].latency_avg / 1000); /* msecs */
+        jsonbuf_lit(&res->buf, ", \"backoff\": ");
+        jsonbuf_llong(&res->buf, infos[i].backoff / G_USEC_PER_SEC);
+        jsonbuf_lit(&res->buf, " }");
+    }
+    jsonbuf_lit(&res->buf, " ]");
+    if (ctx->writer) {
+        sampler_report_writer(ctx->writer, &res->buf);
+    }
+    jsonbuf_lit(&res->buf, " }");
+    response_finish(res);
+    response_close(res, ctx, 0);
+    scratch_reset(sc);
+
+    free(infos);
+    return 0;
+}
+
+/*
+ * sharded sampling: one virDomainListGetStats per chunk of domains,
+ * the chunks run in parallel. The domains of a chunk travel in the
+ * task payload, which the executor keeps out of line in its slab.
+ */
+typedef struct ShardRequest ShardRequest;
+struct ShardRequest {
+    VmonRequest req; /* must be the first */
+    int doms_num;
+    virDomainPtr doms[]; /* NULL terminated */
+};
+
+enum {
+    SHARD_DOMAINS_MIN = 8, /* per chunk: fewer are not worth a worker */
+    SHARD_TARGET_LATENCY = 100 * 1000, /* microseconds per chunk */
+    SHARD_EWMA_SHIFT = 2 /* weight of the new sample: 1/4 */
+};
+
+int
+sampler_shard_count(int domains, int max_shards, gint64 cost)
+{
+    int per = SHARD_DOMAINS_MIN;
+    int shards = 0;
+
+    if (domains <= 0) {
+        return 0;
+    }
+    if (cost > 0) {
+        per = MAX(SHARD_TARGET_LATENCY / cost, SHARD_DOMAINS_MIN);
+    }
+    shards = (domains + per - 1) / per;
+    return CLAMP(shards, 1, MAX(max_shards, 1));
+}
+
+static gint
+shard_sampling_work(gpointer data)
+{
+    ShardRequest *sr = data;
+    VmonRequest *req = &sr->req;
+    int i;
+
+    req->started = g_get_monotonic_time();
+    for (i = 0; i < sr->doms_num; i++) {
+        health_begin_domain(req->ctx, sr->doms[i], req->started);
+    }
+    req->records_num = virDomainListGetStats(sr->doms, req->sr.stats,
+                                             &req->records, 0);
+    return 0;
+}
+
+/*
+ * the domains of the chunk share the latency of the call; those
+ * without a record count as timed out. The records come in the order
+ * of the domains asked for.
+ */
+static void
+shard_health_update(ShardRequest *sr, gboolean timeout)
+{
+    VmonRequest *req = &sr->req;
+    gint64 now = g_get_monotonic_time();
+    gint64 latency = 0;
+    int i, j = 0;
+
+    if (!req->ctx->health || !req->started || sr->doms_num <= 0) {
+        return;
+    }
+    latency = (now - req->started) / sr->doms_num;
+    for (i = 0; i < sr->doms_num; i++) {
+        guint64 key = domain_key(sr->doms[i]);
+        gboolean found = (j < req->records_num &&
+                          domain_key(req->records[j]->dom) == key);
+
+        j += found;
+        health_record_domain(req->ctx, sr->doms[i], now, latency,
+                             timeout || !found);
+    }
+}
+
+static void
+shard_release(ShardRequest *sr)
+{
+    int i;
+    for (i = 0; i < sr->doms_num; i++) {
+        virDomainFree(sr->doms[i]);
+    }
+    sr->doms_num = 0;
+}
+
+static gint
+shard_collect(gpointer data, gint error, gboolean timeout)
+{
+    ShardRequest *sr = data;
+    VmonRequest *req = &sr->req;
+
+    if (!error && !timeout && req->started && sr->doms_num > 0) {
+        /* microseconds per domain, sizes the next chunks */
+        gint64 cost = (g_get_monotonic_time() - req->started) / sr->doms_num;
+        gint64 avg = __atomic_load_n(&req->ctx->shard_cost, __ATOMIC_RELAXED);
+        avg = (avg) ?avg + ((cost - avg) >> SHARD_EWMA_SHIFT) :cost;
+        avg = MAX(avg, 1); /* zero means unknown */
+        __atomic_store_n(&req->ctx->shard_cost, avg, __ATOMIC_RELAXED);
+    }
+    shard_health_update(sr, timeout);
+    shard_release(sr);
+    return sampling_collect(req, error, timeout);
+}
+
+static gint
+shard_domains_work(gpointer data)
+{
+    VmonRequest *req = data;
+    VmonContext *ctx = req->ctx;
+    virDomainPtr *domains = NULL;
+    TaskRequest *tasks = NULL;
+    char *payloads = NULL;
+    size_t size = 0;
+    gint64 now = g_get_monotonic_time();
+    int i, j, n = 0;
+    int shards = 0;
+    int queued = 0;
     int err = 0;
+    int ret = 0;
 
-    ret = virConnectListAllDomains(req->ctx->conn,
-                                   &domains,
-                                   req->ctx->flags);
+    ret = list_domains(ctx, &domains);
     if (ret < 0) {
         collect_error(req, ret, FALSE);
         return ret;
     }
 
-    for (i = 0; i < (size_t)ret; i++) {
-        VmonRequest vreq;
-        memcpy(&vreq, req, sizeof(vreq));
-        vreq.dom = domains[i];
+    for (i = 0; i < ret; i++) {
+        if (ctx->health &&
+            !health_due(ctx->health, domain_key(domains[i]), now)) {
+            flight_ref(req, 1);
+            domain_error(req, domains[i], SAMPLER_ERROR_UNRESPONSIVE);
+        } else {
+            domains[n++] = domains[i];
+        }
+    }
 
-        err = executor_dispatch(vreq.ctx->executor,
-                                sample_domain_work,
-                                sampling_collect,
-                                &vreq,
-                                sizeof(vreq),
-                                vreq.ctx->conf.timeout);
-        if (err) {
-            collect_error(&vreq, err, FALSE);
+    shards = sampler_shard_count(n, ctx->conf.shards,
+                                 __atomic_load_n(&ctx->shard_cost,
+                                                 __ATOMIC_RELAXED));
+    if (shards > 0) {
+        /* the first chunks take one more domain each, if uneven */
+        size = sizeof(ShardRequest) +
+               ((n + shards - 1) / shards + 1) * sizeof(virDomainPtr);
+        tasks = calloc(shards, sizeof(*tasks));
+        payloads = calloc(shards, size);
+        if (!tasks || !payloads) {
+            err = EXECUTOR_ERROR_TOO_MUCH_DATA;
+            for (i = 0; i < n; i++) {
+                virDomainFree(domains[i]);
+            }
+            collect_error(req, err, FALSE);
+            shards = 0;
         }
     }
+    flight_ref(req, shards);
 
+    for (i = 0, j = 0; i < shards; i++) {
+        ShardRequest *sr = (ShardRequest *)(payloads + i * size);
+        int num = n / shards + (i < n % shards);
+
+        memcpy(&sr->req, req, sizeof(sr->req));
+        memcpy(sr->doms, domains + j, num * sizeof(virDomainPtr));
+        sr->doms[num] = NULL;
+        sr->doms_num = num;
+        j += num;
+
+        tasks[i].work = shard_sampling_work;
+        tasks[i].collect = shard_collect;
+        tasks[i].data = sr;
+        tasks[i].size = sizeof(ShardRequest) + (num + 1) * sizeof(virDomainPtr);
+        tasks[i].timeout = ctx->conf.timeout;
+        tasks[i].priority = req->sr.priority;
+        tasks[i].handle = request_handle(req->sr.uuid);
+    }
+
+    if (shards > 0) {
+        /* one shot for all the chunks */
+        queued = executor_dispatch_batch(ctx->executor, tasks, shards);
+        if (queued < 0) {
+            err = queued;
+            queued = 0;
+        } else if (queued < shards) {
+            err = EXECUTOR_ERROR_TOO_MANY_TASKS;
+        }
+    }
+
+    for (i = queued; i < shards; i++) {
+        ShardRequest *sr = (ShardRequest *)(payloads + i * size);
+        shard_release(sr);
+        collect_error(&sr->req, err, FALSE);
+        flight_unref(&sr->req);
+    }
+
+    free(payloads);
+    free(tasks);
     free(domains);
     return (err) ?err :0;
 }
 
+/*
+ * no response: the requester is gone. The work already done for it
+ * is not undone, only what is left.
+ */
+static int
+sampler_cancel_request(VmonContext *ctx, const uuid_t req_id)
+{
+    char req_uuid[VIR_UUID_STRING_BUFLEN] = { '\0' };
+    TaskHandle handle = 0;
+
+    if (ctx->flights) {
+        handle = flight_leave(ctx->flights, req_id);
+    } else {
+        handle = request_handle(req_id);
+    }
+
+    uuid_unparse(req_id, req_uuid);
+    g_message("req-id=\"%s\" cancelled%s", req_uuid,
+              (handle) ?"" :", still wanted by other requests");
+
+    return (handle) ?executor_cancel(ctx->executor, handle) :0;
+}
+
 int
 sampler_handle_request(VmonContext *ctx, const char *text, size_t size)
 {
@@ -379,7 +1476,11 @@ sampler_handle_request(VmonContext *ctx, const char *text, size_t size)
     req.ctx = ctx;
 
     err = sampler_parse_request(&req.sr, text, size);
-    if (!err) {
+    if (!err && req.sr.cancel) {
+        err = sampler_cancel_request(ctx, req.sr.uuid);
+    } else if (!err && req.sr.health) {
+        err = sampler_report_health(ctx, req.sr.uuid);
+    } else if (!err) {
         err = sampler_send_request(ctx, &req);
     } else {
         /* warning */
@@ -391,19 +1492,155 @@ sampler_handle_request(VmonContext *ctx, const char *text, size_t size)
 int
 sampler_send_request(VmonContext *ctx, VmonRequest *req)
 {
-    TaskFunction task;
+    TaskRequest task;
+    int queued = 0;
+    int err = 0;
 
-    if (ctx->conf.bulk_sampling) {
-        task = bulk_sampling_work;
+    if (ctx->flights && flight_join(ctx->flights, req)) {
+        char req_uuid[VIR_UUID_STRING_BUFLEN] = { '\0' };
+
+        uuid_unparse(req->sr.uuid, req_uuid);
+        g_message("req-id=\"%s\" joined the sampling in flight", req_uuid);
+        return 0;
+    }
+
+    memset(&task, 0, sizeof(task));
+    task.collect = sampling_collect;
+    if (ctx->conf.shards > 0) {
+        task.work = shard_domains_work;
+    } else if (ctx->conf.bulk_sampling) {
+        task.work = bulk_sampling_work;
+        task.collect = bulk_collect;
     } else {
-        task = list_domains_work;
+        task.work = list_domains_work;
+    }
+    task.data = req;
+    task.size = sizeof(*req);
+    task.timeout = ctx->conf.timeout;
+    task.priority = req->sr.priority;
+    task.handle = request_handle(req->sr.uuid);
+
+    queued = executor_dispatch_batch(ctx->executor, &task, 1);
+    if (queued < 0) {
+        err = queued;
+    } else if (queued == 0) {
+        err = EXECUTOR_ERROR_TOO_MANY_TASKS;
+    }
+
+    if (err && req->flight) {
+        /* the caller handles its own request */
+        uuid_t *req_ids = NULL;
+        int i, n = flight_close(req, &req_ids);
+        for (i = 0; i < n; i++) {
+            if (uuid_compare(req_ids[i], req->sr.uuid) != 0) {
+                respond_error(ctx, req_ids[i], "", err, FALSE);
+            }
+        }
+        flight_unref(req);
+    }
+    return err;
+}
+
+
+static int
+parse_schedule(SampleSchedule *sched, const char *spec, size_t len)
+{
+    const char *end = spec + len;
+    char *next = NULL;
+    long period = strtol(spec, &next, 10);
+
+    if (next == spec || period <= 0 || period > G_MAXINT / 1000) {
+        return -1;
+    }
+    sched->period = period;
+    sched->stats = 0;
+
+    if (next == end) {
+        return 0; /* all the groups */
+    }
+    if (*next != ':') {
+        return -1;
     }
 
-    return executor_dispatch(ctx->executor,
-                             task,
-                             sampling_collect,
-                             req,
-                             sizeof(*req),
-                             ctx->conf.timeout);
+    do {
+        const char *name = next + 1;
+        size_t name_len = strcspn(name, ".,");
+
+        if (sampler_parse_stats(name, name_len, &sched->stats) < 0) {
+            return -1;
+        }
+        next = (char *)name + name_len;
+    } while (next < end && *next == '.');
+
+    return (next == end) ?0 :-1;
+}
+
+int
+sampler_parse_schedules(VmonConfig *conf, const char *spec)
+{
+    for (;;) {
+        size_t len = strcspn(spec, ",");
+
+        if (conf->schedules_num >= SAMPLE_SCHEDULES_MAX) {
+            g_message("too many schedules, max %i", SAMPLE_SCHEDULES_MAX);
+            return -1;
+        }
+        if (parse_schedule(&conf->schedules[conf->schedules_num],
+                           spec, len) < 0) {
+            g_message("malformed schedule: %.*s", (int)len, spec);
+            return -1;
+        }
+        conf->schedules_num++;
+
+        spec += len;
+        if (*spec != ',') {
+            return 0;
+        }
+        spec++;
+    }
 }
 
+static int
+gcd(int a, int b)
+{
+    while (b) {
+        int r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+int
+sampler_schedule_base(const VmonConfig *conf)
+{
+    int base = 0;
+    int i;
+    for (i = 0; i < conf->schedules_num; i++) {
+        base = gcd(conf->schedules[i].period, base);
+    }
+    return base;
+}
+
+gboolean
+sampler_schedule_due(const VmonConfig *conf, int base,
+                     unsigned long tick, unsigned int *stats)
+{
+    gboolean due = FALSE;
+    gboolean all = FALSE;
+    int i;
+
+    *stats = 0;
+    for (i = 0; i < conf->schedules_num; i++) {
+        const SampleSchedule *sched = &conf->schedules[i];
+        if (tick % (sched->period / base) == 0) {
+            due = TRUE;
+            all |= (sched->stats == 0);
+            *stats |= sched->stats;
+        }
+    }
+    if (all) {
+        *stats = 0;
+    }
+    return due;
+}
@@ -25,11 +25,67 @@
 #include "vmon.h"
 
 
+enum {
+    SAMPLER_ERROR_UNRESPONSIVE = -32, /* past the executor errors */
+    SAMPLER_ERROR_NO_MEMORY = -33
+};
+
+/*
+ * enables the coalescing of the identical requests in flight,
+ * and the back-off of the unresponsive domains.
+ * Optional: without it, each request makes its own libvirt calls.
+ */
+int
+sampler_init(VmonContext *ctx);
+
+void
+sampler_free(VmonContext *ctx);
+
 int
 sampler_handle_request(VmonContext *ctx, const char *text, size_t size);
 
 int
 sampler_send_request(VmonContext *ctx, VmonRequest *req);
 
+/* a stats group name, like "block", to VIR_DOMAIN_STATS_* */
+int
+sampler_parse_stats(const char *name, size_t len, unsigned int *stats);
+
+/*
+ * appends the schedules in `spec' to the configuration.
+ * spec: SECS[:GROUP.GROUP...][,SECS[:GROUP...]...]
+ * with no groups, samples all of them.
+ */
+int
+sampler_parse_schedules(VmonConfig *conf, const char *spec);
+
+/*
+ * how many chunks to split the domains in, for the sharded sampling:
+ * enough for each to take about 100ms, given the cost per domain
+ * (microseconds, 0 if unknown) but not so many to be too small.
+ */
+int
+sampler_shard_count(int domains, int max_shards, gint64 cost);
+
+/*
+ * TRUE if the record misses what libvirt skips on a busy domain,
+ * with VIR_CONNECT_GET_ALL_DOMAINS_STATS_NOWAIT: of the fields
+ * vmon reads, the block I/O counters of the disks with a backing path.
+ */
+gboolean
+sampler_record_partial(const virDomainStatsRecordPtr record, unsigned int stats);
+
+/* greatest common divisor of the periods, seconds */
+int
+sampler_schedule_base(const VmonConfig *conf);
+
+/*
+ * the schedules due at the `tick'-th base period are merged in
+ * one sampling; returns FALSE if none is due
+ */
+gboolean
+sampler_schedule_due(const VmonConfig *conf, int base,
+                     unsigned long tick, unsigned int *stats);
+
 #endif /* SAMPLER_H */
 
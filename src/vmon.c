@@ -19,6 +19,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <fcntl.h>
 #include <string.h>
 
 #include <unistd.h>
@@ -37,9 +38,68 @@ config_defaults(VmonConfig *conf)
 {
     memset(conf, 0, sizeof(*conf));
     conf->timeout =  TIMEOUT;
+    conf->min_threads = MIN_THREADS;
     conf->threads = MAX_THREADS;
+    conf->spares = SPARE_THREADS;
     conf->tasks = MAX_THREADS * TASKS_PER_THREAD;
     conf->period = 0; /* better explicit than implicit */
+    conf->overflow_policy = EXECUTOR_OVERFLOW_GROW;
+    conf->overflow_wait = OVERFLOW_WAIT;
+    conf->overflow_max_mem = OVERFLOW_MAX_MEM;
+    conf->output_policy = WRITER_OVERFLOW_DROP_OLDEST;
+    conf->output_max_mem = OUTPUT_MAX_MEM;
+    conf->spool_size = SPOOL_SIZE;
+    conf->reconcile_period = RECONCILE_PERIOD;
+}
+
+static int
+config_parse_overflow_policy(VmonConfig *conf)
+{
+    const gchar *name = conf->overflow_policy_name;
+    int err = 0;
+
+    if (!name) {
+        return 0; /* keep the default */
+    }
+
+    if (!strcmp(name, "reject")) {
+        conf->overflow_policy = EXECUTOR_OVERFLOW_REJECT;
+    } else if (!strcmp(name, "block")) {
+        conf->overflow_policy = EXECUTOR_OVERFLOW_BLOCK;
+    } else if (!strcmp(name, "grow")) {
+        conf->overflow_policy = EXECUTOR_OVERFLOW_GROW;
+    } else {
+        err = -1;
+    }
+
+    g_free(conf->overflow_policy_name);
+    conf->overflow_policy_name = NULL;
+    return err;
+}
+
+static int
+config_parse_output_policy(VmonConfig *conf)
+{
+    const gchar *name = conf->output_policy_name;
+    int err = 0;
+
+    if (!name) {
+        return 0; /* keep the default */
+    }
+
+    if (!strcmp(name, "drop-oldest")) {
+        conf->output_policy = WRITER_OVERFLOW_DROP_OLDEST;
+    } else if (!strcmp(name, "keep-newest")) {
+        conf->output_policy = WRITER_OVERFLOW_KEEP_NEWEST;
+    } else if (!strcmp(name, "spool")) {
+        conf->output_policy = WRITER_OVERFLOW_SPOOL;
+    } else {
+        err = -1;
+    }
+
+    g_free(conf->output_policy_name);
+    conf->output_policy_name = NULL;
+    return err;
 }
 
 
@@ -49,7 +109,7 @@ config_parse_cmdline(VmonConfig *conf, int argc, char *argv[])
     GOptionEntry entries[] = {
         {
             "timeout", 'T', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
-            &conf->timeout, "Timeout (seconds). 0 to disable", "TIMEOUT"
+            &conf->timeout, "Timeout (milliseconds). 0 to disable", "TIMEOUT"
         },
         {
             "max-tasks", 't', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
@@ -57,12 +117,24 @@ config_parse_cmdline(VmonConfig *conf, int argc, char *argv[])
         },
         {
             "max-threads", 'c', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
-            &conf->threads, "Max threads to be used", "MAX_THREADS"
+            &conf->threads, "Max threads to be used (default: 5)", "MAX_THREADS"
+        },
+        {
+            "min-threads", 'm', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &conf->min_threads, "Min threads to be kept running; the pool grows up to max-threads on demand (default: 2)", "MIN_THREADS"
+        },
+        {
+            "spare-threads", 's', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &conf->spares, "Max extra threads replacing the hung ones", "SPARE_THREADS"
         },
         {
             "polling-period", 'p', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
             &conf->period, "Autonomously poll libvirt (seconds)", "PERIOD"
         },
+        {
+            "schedule", 'S', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+            &conf->schedules_spec, "Autonomously poll libvirt for some stats only; ticks falling together are merged (e.g. 2:cpu-total.vcpu,60:block)", "SECS:STATS,..."
+        },
         {
             "log-level", 'd', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
             &conf->log_level, "Control the amount of logging", "LEVEL"
@@ -75,6 +147,14 @@ config_parse_cmdline(VmonConfig *conf, int argc, char *argv[])
             "bulk-sampling", 'B', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
             &conf->bulk_sampling, "Use bulk sampling", NULL
         },
+        {
+            "shards", 'K', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &conf->shards, "Sample chunks of domains in parallel, at most SHARDS of them sized on the observed latency. 0 to disable", "SHARDS"
+        },
+        {
+            "reconcile-period", 'R', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &conf->reconcile_period, "Track the domains through the libvirt events, relisting them every PERIOD seconds. 0 to list them on every sampling", "PERIOD"
+        },
         {
             "disk-usage-monitor", 'U', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
             &conf->disk_usage_perc, "Deliver events when disk usage exceeds PERCentage of the physical size", "PERC"
@@ -83,12 +163,41 @@ config_parse_cmdline(VmonConfig *conf, int argc, char *argv[])
             "events-only", 'E', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
             &conf->events_only, "Send in output only events", NULL
         },
+        {
+            "overflow-policy", 'O', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+            &conf->overflow_policy_name, "When the task queue is full: reject, block or grow (default)", "POLICY"
+        },
+        {
+            "overflow-wait", 'W', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &conf->overflow_wait, "Max time to wait for room with the block policy (milliseconds)", "WAIT"
+        },
+        {
+            "overflow-max-mem", 'M', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &conf->overflow_max_mem, "Max memory used by the grow policy (MiB)", "MEM"
+        },
+        {
+            "output-policy", 'o', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+            &conf->output_policy_name, "When the output is over budget: drop-oldest (default), keep-newest (per VM) or spool", "POLICY"
+        },
+        {
+            "output-max-mem", 'b', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &conf->output_max_mem, "Max memory used by the responses not yet written (MiB). 0 for no limit", "MEM"
+        },
+        {
+            "spool-file", 'f', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+            &conf->spool_file, "Where the spool policy keeps the responses over budget", "FILE"
+        },
+        {
+            "spool-size", 'z', G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+            &conf->spool_size, "Max size of the spool file (MiB)", "SIZE"
+        },
         { NULL }
     };
 
     GError *error = NULL;
     GOptionContext *context;
     int ret = -1;
+    int err = 0;
 
     context = g_option_context_new("- vm sampling speedup tool");
     g_option_context_add_main_entries(context, entries, NULL);
@@ -103,6 +212,17 @@ config_parse_cmdline(VmonConfig *conf, int argc, char *argv[])
       goto clean;
     }
 
+    if (conf->min_threads <= 0) {
+      g_print("option 'min-threads' must be positive\n");
+      goto clean;
+    }
+    conf->min_threads = MIN(conf->min_threads, conf->threads);
+
+    if (conf->spares < 0) {
+      g_print("option 'spare-threads' cannot be negative\n");
+      goto clean;
+    }
+
     if (conf->tasks <= 0) {
       g_print("option 'max-tasks' cannot be negative\n");
       goto clean;
@@ -113,6 +233,67 @@ config_parse_cmdline(VmonConfig *conf, int argc, char *argv[])
       goto clean;
     }
 
+    if (config_parse_overflow_policy(conf) < 0) {
+      g_print("option 'overflow-policy' must be one of: reject, block, grow\n");
+      goto clean;
+    }
+
+    if (conf->overflow_wait < 0 || conf->overflow_max_mem < 0) {
+      g_print("options 'overflow-wait' and 'overflow-max-mem' cannot be negative\n");
+      goto clean;
+    }
+
+    if (conf->shards < 0) {
+      g_print("option 'shards' cannot be negative\n");
+      goto clean;
+    }
+    if (conf->shards > 0 && conf->bulk_sampling) {
+      g_print("options 'shards' and 'bulk-sampling' are mutually exclusive\n");
+      goto clean;
+    }
+    conf->shards = MIN(conf->shards, conf->threads);
+
+    if (conf->reconcile_period < 0) {
+      g_print("option 'reconcile-period' cannot be negative\n");
+      goto clean;
+    }
+
+    if (config_parse_output_policy(conf) < 0) {
+      g_print("option 'output-policy' must be one of: drop-oldest, keep-newest, spool\n");
+      goto clean;
+    }
+
+    if (conf->output_max_mem < 0 || conf->spool_size <= 0) {
+      g_print("option 'output-max-mem' cannot be negative, 'spool-size' must be positive\n");
+      goto clean;
+    }
+
+    if (conf->output_policy == WRITER_OVERFLOW_SPOOL && !conf->spool_file) {
+      g_print("the spool output policy needs the option 'spool-file'\n");
+      goto clean;
+    }
+
+    if (conf->period < 0) {
+      g_print("option 'polling-period' cannot be negative\n");
+      goto clean;
+    }
+
+    if (conf->period > 0) {
+        SampleSchedule *sched = &conf->schedules[conf->schedules_num++];
+        sched->period = conf->period;
+        sched->stats = 0; /* all */
+    }
+
+    if (conf->schedules_spec) {
+        err = sampler_parse_schedules(conf, conf->schedules_spec);
+        g_free(conf->schedules_spec);
+        conf->schedules_spec = NULL;
+        if (err < 0) {
+          g_print("option 'schedule' must be like SECS:STAT.STAT,SECS:STAT\n");
+          goto clean;
+        }
+    }
+
     ret = 0;
 
 clean:
@@ -150,8 +331,14 @@ main(int argc, char *argv[])
 
     vmon_setup_log(&ctx);
 
-    g_message("starting vmon v%s with %i threads and %i tasks",
-              VERSION, ctx.conf.threads, ctx.conf.tasks);
+    g_message("starting vmon v%s with %i-%i threads and %i tasks",
+              VERSION, ctx.conf.min_threads, ctx.conf.threads, ctx.conf.tasks);
+
+    /* the registry follows the events: the loop must come first */
+    if (ctx.conf.reconcile_period > 0 && virEventRegisterDefaultImpl() < 0) {
+        g_warning("failed to register the libvirt event loop");
+        ctx.conf.reconcile_period = 0;
+    }
 
     g_message("connecting to libvirt...");
 
@@ -178,6 +365,24 @@ main(int argc, char *argv[])
         goto cleanup_sched;
     }
 
+    /*
+     * one timeout per task: keep them off the main loop, and the
+     * polling, which may block on a full queue, off their thread
+     */
+    err = scheduler_init_wheel(&ctx.timers);
+    if (err) {
+        g_critical("failed to initialize the task timers");
+        err = -1;
+        goto cleanup_sched;
+    }
+
+    err = scheduler_start(ctx.timers);
+    if (err) {
+        g_critical("failed to start the task timers");
+        err = -1;
+        goto cleanup_timers;
+    }
+
     err = executor_init(&ctx.executor,
                         ctx.scheduler,
                         ctx.conf.threads,
@@ -185,9 +390,17 @@ main(int argc, char *argv[])
     if (err) {
         g_critical("failed to initialze the task executor");
         err = -1;
-        goto cleanup_sched;
+        goto cleanup_timers;
     }
 
+    executor_set_overflow(ctx.executor,
+                          ctx.conf.overflow_policy,
+                          ctx.conf.overflow_wait,
+                          (size_t)ctx.conf.overflow_max_mem * 1024 * 1024);
+    executor_set_spares(ctx.executor, ctx.conf.spares);
+    executor_set_timers(ctx.executor, ctx.timers);
+    executor_set_elastic(ctx.executor, ctx.conf.min_threads);
+
     err = executor_start(ctx.executor);
     if (err) {
         g_critical("failed to start the the task executor");
@@ -195,6 +408,35 @@ main(int argc, char *argv[])
         goto cleanup_exec;
     }
 
+    if (ctx.conf.reconcile_period > 0 &&
+        (registry_init(&ctx.registry, ctx.conn, ctx.flags) < 0 ||
+         registry_start(ctx.registry, ctx.conf.reconcile_period) < 0)) {
+        g_warning("failed to track the domains, they will be listed every time");
+        registry_free(ctx.registry);
+        ctx.registry = NULL;
+    }
+
+    if (sampler_init(&ctx) < 0) {
+        g_warning("failed to initialize the sampler, requests won't be coalesced");
+    }
+
+    /* keep the workers off the output pipe */
+    if (writer_init(&ctx.writer, fileno(ctx.out)) < 0 ||
+        writer_set_budget(ctx.writer,
+                          ctx.conf.output_policy,
+                          (size_t)ctx.conf.output_max_mem * 1024 * 1024,
+                          ctx.conf.spool_file,
+                          (size_t)ctx.conf.spool_size * 1024 * 1024) < 0 ||
+        writer_start(ctx.writer) < 0) {
+        g_warning("failed to start the writer, workers will write the responses");
+        writer_free(ctx.writer);
+        ctx.writer = NULL;
+    } else {
+        /* only the writer waits for the consumer */
+        fcntl(fileno(ctx.out), F_SETFL,
+              fcntl(fileno(ctx.out), F_GETFL) | O_NONBLOCK);
+    }
+
     vmon_setup_io(&ctx);
 
     g_message("running");
@@ -205,12 +447,25 @@ main(int argc, char *argv[])
 
     scheduler_stop(ctx.scheduler, TRUE);
     executor_stop(ctx.executor, TRUE);
+    scheduler_stop(ctx.timers, TRUE);
+    if (ctx.writer) {
+        writer_stop(ctx.writer);
+        writer_free(ctx.writer);
+        ctx.writer = NULL;
+    }
+    sampler_free(&ctx);
+    registry_stop(ctx.registry);
+    registry_free(ctx.registry);
+    ctx.registry = NULL;
 
     g_message("about to disconnected from libvirt...");
 
 cleanup_exec:
     executor_free(ctx.executor);
 
+cleanup_timers:
+    scheduler_free(ctx.timers);
+
 cleanup_sched:
     scheduler_free(ctx.scheduler);
 
@@ -33,28 +33,66 @@
 #include <libvirt/libvirt.h>
 
 #include "executor.h"
+#include "health.h"
+#include "registry.h"
+#include "vminfo.h"
 #include "vmonlib.h"
+#include "writer.h"
 
 
 typedef struct SampleRequest SampleRequest;
 struct SampleRequest {
     uuid_t uuid;
     unsigned int stats;
+    int priority; /* EXECUTOR_PRIORITY_* */
+    gboolean cancel; /* withdraws the request `uuid' instead */
+    gboolean health; /* reports the domains health instead */
+};
+
+enum {
+    SAMPLE_SCHEDULES_MAX = 16
+};
+
+/* one periodic sampling of some stats groups */
+typedef struct SampleSchedule SampleSchedule;
+struct SampleSchedule {
+    int period; /* seconds */
+    unsigned int stats; /* 0 means all */
 };
 
 typedef struct VmonConfig VmonConfig;
 struct VmonConfig {
+    int min_threads;
     int threads;
+    int spares;
     int tasks;
-    int timeout; /* seconds */
+    int timeout; /* milliseconds */
     int period; /* seconds */
+    gchar *schedules_spec;
+    SampleSchedule schedules[SAMPLE_SCHEDULES_MAX];
+    int schedules_num;
     int log_level;
     gchar *log_file;
     int bulk_sampling;
+    int shards; /* max chunks of the sharded sampling, 0 disables it */
+    int reconcile_period; /* seconds, 0 lists the domains every sampling */
     int disk_usage_perc;
     int events_only;
+    gchar *overflow_policy_name;
+    int overflow_policy;
+    int overflow_wait; /* milliseconds */
+    int overflow_max_mem; /* MiB */
+    gchar *output_policy_name;
+    int output_policy;
+    int output_max_mem; /* MiB */
+    gchar *spool_file;
+    int spool_size; /* MiB */
 };
 
+/* sampling calls in progress, see sampler.c */
+typedef struct SamplerFlight SamplerFlight;
+typedef struct SamplerFlights SamplerFlights;
+
 typedef struct VmonContext VmonContext;
 struct VmonContext {
     VmonConfig conf;
@@ -69,9 +107,19 @@ struct VmonContext {
     GIOChannel *io;
     guint io_watch_id;
     guint polling_id;
+    int polling_base; /* seconds: every schedule period is a multiple */
+    unsigned long polling_ticks;
 
     Executor *executor;
-    Scheduler *scheduler;
+    Scheduler *scheduler; /* on the main loop, for the periodic polling */
+    Scheduler *timers; /* of the task timeouts, off the main loop */
+    SamplerFlights *flights;
+    DomainHealth *health;
+    VmShapes *shapes; /* if NULL, every record is parsed by names */
+    DomainRegistry *registry; /* if NULL, the domains are listed every time */
+    Writer *writer; /* if NULL, responses are written by the collectors */
+    gint64 shard_cost; /* microseconds per domain, moving average */
+    gboolean nowait_refused; /* the bulk sampling waits for busy domains */
 
     unsigned long counter;
 };
@@ -83,7 +131,12 @@ struct VmonRequest {
     virDomainPtr dom;
     virDomainStatsRecordPtr *records;
     int records_num;
+    SamplerFlight *flight; /* shared with the requests coalesced */
+    gint64 started; /* monotonic microseconds, of the libvirt call */
 };
 
+/* dispatched once per domain: must not go out of line */
+G_STATIC_ASSERT(sizeof(VmonRequest) <= TASK_DATA_EMBED_MAX_SIZE);
+
 #endif /* VMON_H */
 
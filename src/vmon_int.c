@@ -193,14 +193,22 @@ poll_libvirt(gpointer ud)
     VmonRequest req;
     memset(&req, 0, sizeof(req));
 
+    ctx->polling_ticks++;
+    if (!sampler_schedule_due(&ctx->conf, ctx->polling_base,
+                              ctx->polling_ticks, &req.sr.stats)) {
+        return TRUE;
+    }
+
     req.ctx = ctx;
     uuid_generate(req.sr.uuid);
+    req.sr.priority = EXECUTOR_PRIORITY_LOW; /* on-demand requests go first */
 
     err = sampler_send_request(ctx, &req);
     if (err) {
         g_warning("error polling libvirt: %i", err);
     } else {
-        g_message("polling libvirt: loop #%zu", ctx->counter);
+        g_message("polling libvirt: loop #%zu stats=0x%x",
+                  ctx->counter, req.sr.stats);
         ctx->counter++;
     }
 
@@ -213,9 +221,11 @@ vmon_setup_io(VmonContext *ctx)
 {
     ctx->loop = g_main_loop_new(NULL, FALSE);
 
-    if (ctx->conf.period) {
+    if (ctx->conf.schedules_num) {
+        /* one timer for all the schedules */
+        ctx->polling_base = sampler_schedule_base(&ctx->conf);
         ctx->polling_id = scheduler_add(ctx->scheduler,
-                                        ctx->conf.period * 1000,
+                                        ctx->polling_base * 1000,
                                         poll_libvirt,
                                         ctx);
     } else {
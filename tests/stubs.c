@@ -41,12 +41,59 @@ sampler_send_request(VmonContext *ctx, VmonRequest *req)
     return 0;
 }
 
+int
+sampler_schedule_base(const VmonConfig *conf)
+{
+    UNUSED(conf);
+    return 1;
+}
+
+gboolean
+sampler_schedule_due(const VmonConfig *conf, int base,
+                     unsigned long tick, unsigned int *stats)
+{
+    UNUSED(conf);
+    UNUSED(base);
+    UNUSED(tick);
+    *stats = 0;
+    return TRUE;
+}
+
 #endif /* STUB_SAMPLER */
 
 #ifdef STUB_EXECUTOR
 
 #include "executor.h"
+#include "test_int.h"
 
+enum {
+    STUB_TASKS_MAX = 16
+};
+
+/* kept until stub_executor_run() */
+static struct {
+    TaskFunction work;
+    TaskCollect collect;
+    void *data;
+} stub_tasks[STUB_TASKS_MAX];
+static int stub_tasks_num = 0;
+
+int stub_executor_dispatched = 0;
+TaskHandle stub_executor_cancelled = 0;
+
+
+static void
+stub_task_add(TaskFunction work, TaskCollect collect, void *data, size_t size)
+{
+    stub_executor_dispatched++;
+    if (stub_tasks_num < STUB_TASKS_MAX) {
+        stub_tasks[stub_tasks_num].work = work;
+        stub_tasks[stub_tasks_num].collect = collect;
+        stub_tasks[stub_tasks_num].data = malloc(size);
+        memcpy(stub_tasks[stub_tasks_num].data, data, size);
+        stub_tasks_num++;
+    }
+}
 
 int
 executor_dispatch(Executor *exc,
@@ -54,14 +101,52 @@ executor_dispatch(Executor *exc,
                   TaskCollect collect,
                   void *data,
                   size_t size,
-                  int timeout)
+                  int timeout,
+                  int priority)
 {
     UNUSED(exc);
-    UNUSED(work);
-    UNUSED(collect);
-    UNUSED(data);
-    UNUSED(size);
     UNUSED(timeout);
+    UNUSED(priority);
+    stub_task_add(work, collect, data, size);
+    return 0;
+}
+
+int
+stub_executor_run(void)
+{
+    int i, n = stub_tasks_num;
+
+    stub_tasks_num = 0;
+    for (i = 0; i < n; i++) {
+        /* the work may dispatch more tasks, reusing this slot */
+        TaskCollect collect = stub_tasks[i].collect;
+        void *data = stub_tasks[i].data;
+        int err = stub_tasks[i].work(data);
+        collect(data, err, FALSE);
+        free(data);
+    }
+    return n;
+}
+
+int
+executor_dispatch_batch(Executor *exc,
+                        const TaskRequest *tasks,
+                        int n)
+{
+    int i;
+    UNUSED(exc);
+    for (i = 0; i < n; i++) {
+        stub_task_add(tasks[i].work, tasks[i].collect,
+                      tasks[i].data, tasks[i].size);
+    }
+    return n;
+}
+
+int
+executor_cancel(Executor *exc, TaskHandle handle)
+{
+    UNUSED(exc);
+    stub_executor_cancelled = handle;
     return 0;
 }
 
@@ -79,6 +164,14 @@ vminfo_init(VmInfo *vm)
     return;
 }
 
+void
+vminfo_init_arena(VmInfo *vm, Arena *arena)
+{
+    UNUSED(vm);
+    UNUSED(arena);
+    return;
+}
+
 int
 vminfo_parse(VmInfo *vm,
              const virDomainStatsRecordPtr record)
@@ -89,7 +182,43 @@ vminfo_parse(VmInfo *vm,
 }
 
 int
-vminfo_print_json(VmInfo *vm, FILE *out)
+vmshapes_init(VmShapes **shapes)
+{
+    *shapes = NULL;
+    return 0;
+}
+
+void
+vmshapes_free(VmShapes *shapes)
+{
+    UNUSED(shapes);
+    return;
+}
+
+void
+vmshapes_stats(VmShapes *shapes, unsigned long *domains,
+               unsigned long *hits, unsigned long *learned)
+{
+    UNUSED(shapes);
+    *domains = 0;
+    *hits = 0;
+    *learned = 0;
+}
+
+int
+vminfo_parse_shaped(VmInfo *vm,
+                    const virDomainStatsRecordPtr record,
+                    VmShapes *shapes, unsigned long long key)
+{
+    UNUSED(vm);
+    UNUSED(record);
+    UNUSED(shapes);
+    UNUSED(key);
+    return 0;
+}
+
+int
+vminfo_print_json(VmInfo *vm, JsonBuf *out)
 {
     UNUSED(vm);
     UNUSED(out);
@@ -97,7 +226,7 @@ vminfo_print_json(VmInfo *vm, FILE *out)
 }
 
 int
-vminfo_send_events(VmInfo *vm, const VmChecks *checks, FILE *out)
+vminfo_send_events(VmInfo *vm, const VmChecks *checks, JsonBuf *out)
 {
     UNUSED(vm);
     UNUSED(checks);
@@ -0,0 +1,123 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "arena.h"
+
+
+void
+test_alloc_reset(void)
+{
+    Arena *arena = NULL;
+    ArenaStats st;
+    char *p = NULL, *q = NULL;
+    int err = 0;
+
+    err = arena_init(&arena, 0);
+    g_assert_cmpint(err, ==, 0);
+
+    p = arena_alloc(arena, 3);
+    q = arena_alloc(arena, 100);
+    g_assert(p != NULL);
+    g_assert(q != NULL);
+    g_assert(q >= p + 3);
+    g_assert_cmpint((uintptr_t)q % sizeof(long double), ==, 0);
+
+    arena_reset(arena);
+    g_assert(arena_alloc(arena, 3) == p);
+
+    arena_get_stats(arena, &st);
+    g_assert_cmpint(st.allocs, ==, 3);
+    g_assert_cmpint(st.spills, ==, 0);
+    g_assert_cmpint(st.resets, ==, 1);
+
+    arena_free(arena);
+}
+
+void
+test_realloc(void)
+{
+    Arena *arena = NULL;
+    char *p = NULL, *q = NULL;
+
+    arena_init(&arena, 0);
+
+    p = arena_realloc(arena, NULL, 0, 16);
+    memcpy(p, "vmon", 5);
+    /* the most recent block grows in place */
+    q = arena_realloc(arena, p, 16, 256);
+    g_assert(p == q);
+
+    arena_alloc(arena, 8);
+    q = arena_realloc(arena, p, 256, 512);
+    g_assert(p != q);
+    g_assert_cmpstr(q, ==, "vmon");
+
+    arena_free(arena);
+}
+
+void
+test_spill(void)
+{
+    Arena *arena = NULL;
+    ArenaStats st;
+    unsigned long spills = 0;
+    int i;
+
+    arena_init(&arena, 4096);
+
+    for (i = 0; i < 16; i++) {
+        char *p = arena_alloc(arena, 1024);
+        g_assert(p != NULL);
+        memset(p, i, 1024);
+    }
+    arena_get_stats(arena, &st);
+    g_assert_cmpint(st.spills, >, 0);
+    g_assert_cmpint(st.peak, >=, 16 * 1024);
+    spills = st.spills;
+
+    /* merged: the same load fits now */
+    arena_reset(arena);
+    for (i = 0; i < 16; i++) {
+        arena_alloc(arena, 1024);
+    }
+    arena_get_stats(arena, &st);
+    g_assert_cmpint(st.spills, ==, spills);
+    g_assert_cmpint(st.size, >=, 16 * 1024);
+
+    arena_free(arena);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vmon/arena/alloc_reset", test_alloc_reset);
+    g_test_add_func("/vmon/arena/realloc", test_realloc);
+    g_test_add_func("/vmon/arena/spill", test_spill);
+    return g_test_run();
+}
@@ -172,7 +172,8 @@ test_dispatch_not_running(void)
     td.err = executor_stop(td.exec, FALSE);
     g_assert_cmpint(td.err, ==, 0);
 
-    td.err = executor_dispatch(td.exec, NullFunction, NullCollect, NULL, 0, 0);
+    td.err = executor_dispatch(td.exec, NullFunction, NullCollect, NULL, 0, 0,
+                               EXECUTOR_PRIORITY_NORMAL);
     g_assert_cmpint(td.err, ==, EXECUTOR_ERROR_NOT_RUNNING);
 
     teardown(&td);
@@ -203,7 +204,8 @@ test_dispatch(void)
 
     setup(&td);
 
-    td.err = executor_dispatch(td.exec, TestTaskFunction, NullCollect, &tt, sizeof(tt), 0);
+    td.err = executor_dispatch(td.exec, TestTaskFunction, NullCollect, &tt, sizeof(tt), 0,
+                               EXECUTOR_PRIORITY_NORMAL);
     g_assert_cmpint(td.err, ==, 0);
 
     run = event_wait(&executed, 100);
@@ -225,7 +227,8 @@ test_dispatch_with_timeout(void)
 
     setup(&td);
 
-    td.err = executor_dispatch(td.exec, TestTaskFunction, NullCollect, &tt, sizeof(tt), 100);
+    td.err = executor_dispatch(td.exec, TestTaskFunction, NullCollect, &tt, sizeof(tt), 100,
+                               EXECUTOR_PRIORITY_NORMAL);
     g_assert_cmpint(td.err, ==, 0);
 
     /* FIXME: there is a race lurking nearby */
@@ -236,6 +239,861 @@ test_dispatch_with_timeout(void)
     teardown(&td);
 }
 
+static gint
+SleepFunction(gpointer data)
+{
+    UNUSED(data);
+    usleep(200 * 1000);
+    return 0;
+}
+
+static gint
+TimeoutCollect(gpointer data, gint error, gboolean timeout)
+{
+    gint *timedout = *(gint **)data;
+    UNUSED(error);
+    g_atomic_int_set(timedout, timeout);
+    return 0;
+}
+
+void
+test_dispatch_timers(void)
+{
+    Scheduler *timers = NULL;
+    TestData td;
+    gint timedout = -1;
+    gint *ptr = &timedout;
+
+    td.err = scheduler_init(&td.sched, TRUE);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = scheduler_start(td.sched);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = scheduler_init_wheel(&timers);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = scheduler_start(timers);
+    g_assert_cmpint(td.err, ==, 0);
+
+    td.err = executor_init(&td.exec, td.sched, 2, 4);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_set_timers(td.exec, timers);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_start(td.exec);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_set_timers(td.exec, td.sched);
+    g_assert_cmpint(td.err, ==, EXECUTOR_ERROR_ALREADY_STARTED);
+
+    /* the timeout fires from the timers */
+    td.err = executor_dispatch(td.exec, SleepFunction, TimeoutCollect,
+                               &ptr, sizeof(ptr), 50,
+                               EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, 0);
+    usleep(400 * 1000);
+    g_assert_cmpint(g_atomic_int_get(&timedout), ==, TRUE);
+
+    teardown(&td);
+    scheduler_stop(timers, TRUE);
+    scheduler_free(timers);
+}
+
+
+typedef struct FanOutTask FanOutTask;
+struct FanOutTask {
+    Executor *exec;
+    gint count;
+    gint *executed;
+    Event *done;
+};
+
+static gint
+FanOutLeafFunction(gpointer data)
+{
+    FanOutTask *ft = data;
+    if (g_atomic_int_dec_and_test(ft->executed)) {
+        event_set(ft->done);
+    }
+    return 0;
+}
+
+static gint
+FanOutFunction(gpointer data)
+{
+    FanOutTask *ft = data;
+    gint i;
+    for (i = 0; i < ft->count; i++) {
+        gint err = executor_dispatch(ft->exec, FanOutLeafFunction, NullCollect,
+                                     ft, sizeof(*ft), 0,
+                                     EXECUTOR_PRIORITY_NORMAL);
+        g_assert_cmpint(err, ==, 0);
+    }
+    return 0;
+}
+
+void
+test_dispatch_from_worker(void)
+{
+    FanOutTask ft;
+    TestData td;
+    Event done;
+    gint executed = 8;
+    gboolean run = FALSE;
+
+    event_init(&done);
+
+    setup(&td);
+
+    ft.exec = td.exec;
+    ft.count = executed;
+    ft.executed = &executed;
+    ft.done = &done;
+
+    td.err = executor_dispatch(td.exec, FanOutFunction, NullCollect, &ft, sizeof(ft), 0,
+                               EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, 0);
+
+    run = event_wait(&done, 500);
+    g_assert(run);
+
+    teardown(&td);
+}
+
+void
+test_dispatch_batch(void)
+{
+    FanOutTask ft;
+    TaskRequest tasks[8];
+    TestData td;
+    Event done;
+    gint executed = G_N_ELEMENTS(tasks);
+    gboolean run = FALSE;
+    gsize i;
+
+    event_init(&done);
+
+    setup(&td);
+
+    ft.exec = td.exec;
+    ft.count = 0;
+    ft.executed = &executed;
+    ft.done = &done;
+
+    memset(tasks, 0, sizeof(tasks));
+    for (i = 0; i < G_N_ELEMENTS(tasks); i++) {
+        tasks[i].work = FanOutLeafFunction;
+        tasks[i].collect = NullCollect;
+        tasks[i].data = &ft;
+        tasks[i].size = sizeof(ft);
+        tasks[i].timeout = 0;
+        tasks[i].priority = EXECUTOR_PRIORITY_NORMAL;
+    }
+
+    td.err = executor_dispatch_batch(td.exec, tasks, G_N_ELEMENTS(tasks));
+    g_assert_cmpint(td.err, ==, G_N_ELEMENTS(tasks));
+
+    run = event_wait(&done, 500);
+    g_assert(run);
+
+    teardown(&td);
+}
+
+static gint
+SlowTaskFunction(gpointer data)
+{
+    Event *release = *(Event **)data;
+    event_wait(release, 1000);
+    return 0;
+}
+
+static void
+helper_fill_queue(TestData *td, Event *release, int policy, int wait, size_t max_mem)
+{
+    gint i;
+
+    td->err = scheduler_init(&td->sched, TRUE);
+    g_assert_cmpint(td->err, ==, 0);
+    td->err = scheduler_start(td->sched);
+    g_assert_cmpint(td->err, ==, 0);
+
+    /* one worker, room for two tasks */
+    td->err = executor_init(&td->exec, td->sched, 1, 2);
+    g_assert_cmpint(td->err, ==, 0);
+    td->err = executor_set_overflow(td->exec, policy, wait, max_mem);
+    g_assert_cmpint(td->err, ==, 0);
+    td->err = executor_start(td->exec);
+    g_assert_cmpint(td->err, ==, 0);
+
+    /* keep the only worker busy, then fill the queue */
+    td->err = executor_dispatch(td->exec, SlowTaskFunction, NullCollect,
+                                &release, sizeof(release), 0,
+                                EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td->err, ==, 0);
+    usleep(50 * 1000);
+
+    for (i = 0; i < 2; i++) {
+        td->err = executor_dispatch(td->exec, SlowTaskFunction, NullCollect,
+                                    &release, sizeof(release), 0,
+                                    EXECUTOR_PRIORITY_NORMAL);
+        g_assert_cmpint(td->err, ==, 0);
+    }
+}
+
+static gint
+CountCollect(gpointer data, gint error, gboolean timeout)
+{
+    gint *count = *(gint **)data;
+    UNUSED(error);
+    UNUSED(timeout);
+    g_atomic_int_inc(count);
+    return 0;
+}
+
+void
+test_stop_drain(void)
+{
+    TaskRequest tasks[3];
+    TestData td;
+    Event release;
+    Event *ev = &release;
+    gint collected = 0;
+    gint *count = &collected;
+    gint i;
+
+    event_init(&release);
+    td.err = scheduler_init(&td.sched, TRUE);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = scheduler_start(td.sched);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_init(&td.exec, td.sched, 1, 8);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_start(td.exec);
+    g_assert_cmpint(td.err, ==, 0);
+
+    td.err = executor_dispatch(td.exec, SlowTaskFunction, NullCollect,
+                               &ev, sizeof(ev), 0, EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, 0);
+    usleep(50 * 1000);
+
+    memset(tasks, 0, sizeof(tasks));
+    for (i = 0; i < (gint)G_N_ELEMENTS(tasks); i++) {
+        tasks[i].work = NullFunction;
+        tasks[i].collect = CountCollect;
+        tasks[i].data = &count;
+        tasks[i].size = sizeof(count);
+        tasks[i].priority = EXECUTOR_PRIORITY_LOW;
+    }
+    td.err = executor_dispatch_batch(td.exec, tasks, G_N_ELEMENTS(tasks));
+    g_assert_cmpint(td.err, ==, G_N_ELEMENTS(tasks));
+
+    /* one batch with the stop last: the others are parked behind it */
+    td.err = executor_stop(td.exec, FALSE);
+    g_assert_cmpint(td.err, ==, 0);
+    event_set(&release);
+    for (i = 0; i < 100 && g_atomic_int_get(&collected) < 3; i++) {
+        usleep(10 * 1000);
+    }
+    g_assert_cmpint(g_atomic_int_get(&collected), ==, 3);
+
+    td.err = scheduler_stop(td.sched, TRUE);
+    g_assert_cmpint(td.err, ==, 0);
+}
+
+void
+test_overflow_reject(void)
+{
+    ExecutorStats st;
+    TestData td;
+    Event release;
+
+    event_init(&release);
+    helper_fill_queue(&td, &release, EXECUTOR_OVERFLOW_REJECT, 0, 0);
+
+    td.err = executor_dispatch(td.exec, NullFunction, NullCollect, NULL, 0, 0,
+                               EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, EXECUTOR_ERROR_TOO_MANY_TASKS);
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.rejected, ==, 1);
+
+    event_set(&release);
+    usleep(100 * 1000); /* let the queue drain */
+    teardown(&td);
+}
+
+void
+test_overflow_block(void)
+{
+    ExecutorStats st;
+    TestData td;
+    Event release;
+
+    event_init(&release);
+    helper_fill_queue(&td, &release, EXECUTOR_OVERFLOW_BLOCK, 50, 0);
+
+    /* nobody makes room in time */
+    td.err = executor_dispatch(td.exec, NullFunction, NullCollect, NULL, 0, 0,
+                               EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, EXECUTOR_ERROR_TOO_MANY_TASKS);
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.blocked, ==, 1);
+    g_assert_cmpint(st.block_timeouts, ==, 1);
+
+    event_set(&release);
+    usleep(100 * 1000); /* let the queue drain */
+    teardown(&td);
+}
+
+void
+test_overflow_grow(void)
+{
+    ExecutorStats st;
+    TestData td;
+    Event release;
+    gint i;
+
+    event_init(&release);
+    helper_fill_queue(&td, &release, EXECUTOR_OVERFLOW_GROW, 0, 1024 * 1024);
+
+    for (i = 0; i < 100; i++) {
+        td.err = executor_dispatch(td.exec, NullFunction, NullCollect, NULL, 0, 0,
+                                   EXECUTOR_PRIORITY_NORMAL);
+        g_assert_cmpint(td.err, ==, 0);
+    }
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.overflowed, ==, 100);
+    g_assert_cmpint(st.segments, >, 0);
+    g_assert_cmpint(st.rejected, ==, 0);
+
+    event_set(&release);
+    usleep(100 * 1000); /* let the queue drain */
+    teardown(&td);
+}
+
+void
+test_quarantine(void)
+{
+    ExecutorStats st;
+    TestTask tt;
+    TestData td;
+    Event release[2];
+    Event executed;
+    Event *rel = NULL;
+    gboolean run = FALSE;
+
+    event_init(&release[0]);
+    event_init(&release[1]);
+    event_init(&executed);
+    testtask_init(&tt, 0, 0, &executed);
+
+    td.err = scheduler_init(&td.sched, TRUE);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = scheduler_start(td.sched);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_init(&td.exec, td.sched, 1, 10);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_set_spares(td.exec, 1);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_start(td.exec);
+    g_assert_cmpint(td.err, ==, 0);
+
+    /* hangs the only worker: a spare takes its place */
+    rel = &release[0];
+    td.err = executor_dispatch(td.exec, SlowTaskFunction, NullCollect,
+                               &rel, sizeof(rel), 50, EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, 0);
+    usleep(200 * 1000);
+
+    td.err = executor_dispatch(td.exec, TestTaskFunction, NullCollect,
+                               &tt, sizeof(tt), 0, EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, 0);
+    run = event_wait(&executed, 500);
+    g_assert(run);
+
+    /* hangs the spare too: the budget is exhausted */
+    rel = &release[1];
+    td.err = executor_dispatch(td.exec, SlowTaskFunction, NullCollect,
+                               &rel, sizeof(rel), 50, EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, 0);
+    usleep(200 * 1000);
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.quarantined, ==, 1);
+    g_assert_cmpint(st.spares_exhausted, ==, 1);
+    g_assert_cmpint(st.reclaimed, ==, 0);
+
+    event_set(&release[0]);
+    event_set(&release[1]);
+    usleep(100 * 1000);
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.reclaimed, ==, 1);
+
+    teardown(&td);
+}
+
+static gint
+SleepTaskFunction(gpointer data)
+{
+    gint *pending = *(gint **)data;
+    usleep(5 * 1000);
+    __atomic_sub_fetch(pending, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+test_elastic_pool(void)
+{
+    ExecutorStats st;
+    TestData td;
+    const gint count = 200;
+    gint pending = count;
+    gint *p = &pending;
+    gint i;
+
+    td.err = scheduler_init(&td.sched, TRUE);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = scheduler_start(td.sched);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_init(&td.exec, td.sched, 4, 1000);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_set_elastic(td.exec, 1);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_start(td.exec);
+    g_assert_cmpint(td.err, ==, 0);
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.workers, ==, 1);
+
+    /* one worker would need a second: the queue wait builds up */
+    for (i = 0; i < count; i++) {
+        td.err = executor_dispatch(td.exec, SleepTaskFunction, NullCollect,
+                                   &p, sizeof(p), 0, EXECUTOR_PRIORITY_NORMAL);
+        g_assert_cmpint(td.err, ==, 0);
+    }
+    while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0) {
+        usleep(10 * 1000);
+    }
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.grown, >, 0);
+    g_assert_cmpint(st.workers_peak, >, 1);
+
+    /* idle now: the pool gives the extra workers back */
+    usleep(3 * 1000 * 1000);
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.shrunk, >, 0);
+    g_assert_cmpint(st.workers, <, st.workers_peak);
+
+    teardown(&td);
+}
+
+typedef struct BigTask BigTask;
+struct BigTask {
+    Event *done;
+    guint8 payload[4 * TASK_DATA_SIZE];
+};
+
+static gint
+BigTaskFunction(gpointer data)
+{
+    BigTask *bt = data;
+    gsize i;
+
+    for (i = 0; i < sizeof(bt->payload); i++) {
+        if (bt->payload[i] != (guint8)i) {
+            return -1;
+        }
+    }
+    event_set(bt->done);
+    return 0;
+}
+
+void
+test_dispatch_big_data(void)
+{
+    BigTask bt;
+    TestData td;
+    Event done;
+    gboolean run = FALSE;
+    gsize i;
+
+    event_init(&done);
+    bt.done = &done;
+    for (i = 0; i < sizeof(bt.payload); i++) {
+        bt.payload[i] = (guint8)i;
+    }
+
+    setup(&td);
+
+    td.err = executor_dispatch(td.exec, BigTaskFunction, NullCollect,
+                               &bt, sizeof(bt), 0, EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, 0);
+    memset(&bt, 0, sizeof(bt)); /* the executor owns a copy */
+
+    run = event_wait(&done, 500);
+    g_assert(run);
+
+    teardown(&td);
+}
+
+typedef struct OrderTask OrderTask;
+struct OrderTask {
+    gint *order; /* shared log of the executed priorities */
+    gint *count;
+    gint priority;
+    Event *done;
+};
+
+static gint
+OrderTaskFunction(gpointer data)
+{
+    OrderTask *ot = data;
+    ot->order[(*ot->count)++] = ot->priority;
+    if (*ot->count == EXECUTOR_PRIORITY_NUM) {
+        event_set(ot->done);
+    }
+    return 0;
+}
+
+void
+test_dispatch_priority(void)
+{
+    OrderTask ot;
+    TestData td;
+    Event release;
+    Event done;
+    gint order[EXECUTOR_PRIORITY_NUM];
+    gint count = 0;
+    gint prio;
+    gboolean run = FALSE;
+
+    event_init(&release);
+    event_init(&done);
+    helper_fill_queue(&td, &release, EXECUTOR_OVERFLOW_GROW, 0, 1024 * 1024);
+
+    /* lowest first: the only worker is busy, so they all queue up */
+    ot.order = order;
+    ot.count = &count;
+    ot.done = &done;
+    for (prio = EXECUTOR_PRIORITY_NUM - 1; prio >= 0; prio--) {
+        ot.priority = prio;
+        td.err = executor_dispatch(td.exec, OrderTaskFunction, NullCollect,
+                                   &ot, sizeof(ot), 0, prio);
+        g_assert_cmpint(td.err, ==, 0);
+    }
+
+    event_set(&release);
+    run = event_wait(&done, 2000);
+    g_assert(run);
+
+    g_assert_cmpint(order[0], ==, EXECUTOR_PRIORITY_HIGH);
+    g_assert_cmpint(order[EXECUTOR_PRIORITY_NUM - 1], ==, EXECUTOR_PRIORITY_LOW);
+
+    usleep(100 * 1000); /* let the queue drain */
+    teardown(&td);
+}
+
+void
+test_dispatch_bad_priority(void)
+{
+    TestData td;
+
+    setup(&td);
+
+    td.err = executor_dispatch(td.exec, NullFunction, NullCollect, NULL, 0, 0,
+                               EXECUTOR_PRIORITY_NUM);
+    g_assert_cmpint(td.err, ==, EXECUTOR_ERROR_BAD_PRIORITY);
+
+    teardown(&td);
+}
+
+typedef struct CancelTask CancelTask;
+struct CancelTask {
+    Event *release; /* if set, wait for it */
+    gint *ran;
+    gint *cancelled; /* collected with EXECUTOR_ERROR_CANCELLED */
+};
+
+static gint
+CancelTaskFunction(gpointer data)
+{
+    CancelTask *ct = data;
+    if (ct->release) {
+        event_wait(ct->release, 1000);
+    }
+    g_atomic_int_inc(ct->ran);
+    return 0;
+}
+
+static gint
+CancelTaskCollect(gpointer data, gint error, gboolean timeout)
+{
+    CancelTask *ct = data;
+    UNUSED(timeout);
+    if (error == EXECUTOR_ERROR_CANCELLED) {
+        g_atomic_int_inc(ct->cancelled);
+    }
+    return 0;
+}
+
+void
+test_cancel(void)
+{
+    ExecutorStats st;
+    CancelTask ct;
+    TaskRequest tasks[4];
+    TestData td;
+    Event release;
+    Event running;
+    gint ran = 0;
+    gint cancelled = 0;
+    gint i;
+
+    event_init(&release);
+    event_init(&running);
+    helper_fill_queue(&td, &release, EXECUTOR_OVERFLOW_GROW, 0, 1024 * 1024);
+
+    /* queued behind the busy worker: three to withdraw, one to keep */
+    ct.release = NULL;
+    ct.ran = &ran;
+    ct.cancelled = &cancelled;
+    memset(tasks, 0, sizeof(tasks));
+    for (i = 0; i < 4; i++) {
+        tasks[i].work = CancelTaskFunction;
+        tasks[i].collect = CancelTaskCollect;
+        tasks[i].data = &ct;
+        tasks[i].size = sizeof(ct);
+        tasks[i].priority = EXECUTOR_PRIORITY_NORMAL;
+        tasks[i].handle = (i < 3) ?7 :8;
+    }
+    td.err = executor_dispatch_batch(td.exec, tasks, 4);
+    g_assert_cmpint(td.err, ==, 4);
+
+    td.err = executor_cancel(td.exec, 7);
+    g_assert_cmpint(td.err, ==, 0);
+    g_assert_cmpint(g_atomic_int_get(&cancelled), ==, 3); /* purged */
+
+    event_set(&release);
+    usleep(100 * 1000); /* let the queue drain */
+    g_assert_cmpint(g_atomic_int_get(&ran), ==, 1);
+    g_assert_cmpint(g_atomic_int_get(&cancelled), ==, 3);
+
+    /* already running: completes, but the result is dropped */
+    ct.release = &running;
+    tasks[0].handle = 9;
+    td.err = executor_dispatch_batch(td.exec, tasks, 1);
+    g_assert_cmpint(td.err, ==, 1);
+    usleep(50 * 1000);
+    executor_cancel(td.exec, 9);
+    event_set(&running);
+    usleep(100 * 1000);
+    g_assert_cmpint(g_atomic_int_get(&ran), ==, 2);
+    g_assert_cmpint(g_atomic_int_get(&cancelled), ==, 4);
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.cancelled, ==, 4);
+
+    teardown(&td);
+}
+
+void
+test_cancel_purge(void)
+{
+    CancelTask ct;
+    TaskRequest tasks[2];
+    TestData td;
+    Event release;
+    Event *ev = &release;
+    gint ran = 0;
+    gint cancelled = 0;
+    gint i;
+
+    event_init(&release);
+    td.err = scheduler_init(&td.sched, TRUE);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = scheduler_start(td.sched);
+    g_assert_cmpint(td.err, ==, 0);
+    /* one worker, room for two tasks */
+    td.err = executor_init(&td.exec, td.sched, 1, 2);
+    g_assert_cmpint(td.err, ==, 0);
+    td.err = executor_start(td.exec);
+    g_assert_cmpint(td.err, ==, 0);
+
+    td.err = executor_dispatch(td.exec, SlowTaskFunction, NullCollect,
+                               &ev, sizeof(ev), 0, EXECUTOR_PRIORITY_NORMAL);
+    g_assert_cmpint(td.err, ==, 0);
+    usleep(50 * 1000);
+
+    ct.release = NULL;
+    ct.ran = &ran;
+    ct.cancelled = &cancelled;
+    memset(tasks, 0, sizeof(tasks));
+    for (i = 0; i < 2; i++) {
+        tasks[i].work = CancelTaskFunction;
+        tasks[i].collect = CancelTaskCollect;
+        tasks[i].data = &ct;
+        tasks[i].size = sizeof(ct);
+        tasks[i].priority = EXECUTOR_PRIORITY_NORMAL;
+        tasks[i].handle = 7;
+    }
+    td.err = executor_dispatch_batch(td.exec, tasks, 2);
+    g_assert_cmpint(td.err, ==, 2);
+    td.err = executor_dispatch_batch(td.exec, tasks, 1);
+    g_assert_cmpint(td.err, ==, 0); /* full */
+
+    /* the room is given back at once */
+    executor_cancel(td.exec, 7);
+    g_assert_cmpint(g_atomic_int_get(&cancelled), ==, 2);
+
+    /* nothing is left with handle 7: it tags new tasks again */
+    td.err = executor_dispatch_batch(td.exec, tasks, 2);
+    g_assert_cmpint(td.err, ==, 2);
+
+    /* nothing in flight, nothing to remember */
+    td.err = executor_cancel(td.exec, 8);
+    g_assert_cmpint(td.err, ==, 0);
+
+    event_set(&release);
+    usleep(100 * 1000);
+    g_assert_cmpint(g_atomic_int_get(&ran), ==, 2);
+    g_assert_cmpint(g_atomic_int_get(&cancelled), ==, 2);
+
+    teardown(&td);
+}
+
+enum {
+    CANCEL_MANY_TASKS = 80 /* each with its own handle */
+};
+
+void
+test_cancel_many(void)
+{
+    ExecutorStats st;
+    CancelTask ct;
+    TaskRequest tasks[CANCEL_MANY_TASKS];
+    TestData td;
+    Event release;
+    gint ran = 0;
+    gint cancelled = 0;
+    gint i;
+
+    event_init(&release);
+    helper_fill_queue(&td, &release, EXECUTOR_OVERFLOW_GROW, 0, 1024 * 1024);
+
+    ct.release = NULL;
+    ct.ran = &ran;
+    ct.cancelled = &cancelled;
+    memset(tasks, 0, sizeof(tasks));
+    for (i = 0; i < CANCEL_MANY_TASKS; i++) {
+        tasks[i].work = CancelTaskFunction;
+        tasks[i].collect = CancelTaskCollect;
+        tasks[i].data = &ct;
+        tasks[i].size = sizeof(ct);
+        tasks[i].priority = EXECUTOR_PRIORITY_NORMAL;
+        tasks[i].handle = 100 + i;
+    }
+    td.err = executor_dispatch_batch(td.exec, tasks, CANCEL_MANY_TASKS);
+    g_assert_cmpint(td.err, ==, CANCEL_MANY_TASKS);
+
+    /* the earliest cancellations are not forgotten */
+    for (i = 0; i < CANCEL_MANY_TASKS; i++) {
+        td.err = executor_cancel(td.exec, 100 + i);
+        g_assert_cmpint(td.err, ==, 0);
+    }
+    g_assert_cmpint(g_atomic_int_get(&cancelled), ==, CANCEL_MANY_TASKS);
+
+    event_set(&release);
+    usleep(100 * 1000);
+    g_assert_cmpint(g_atomic_int_get(&ran), ==, 0);
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.cancelled, ==, CANCEL_MANY_TASKS);
+
+    teardown(&td);
+}
+
+typedef struct KeyTask KeyTask;
+struct KeyTask {
+    gint *ran;
+    gint *busy; /* collected with EXECUTOR_ERROR_BUSY */
+};
+
+static gint
+KeyTaskFunction(gpointer data)
+{
+    KeyTask *kt = data;
+    g_atomic_int_inc(kt->ran);
+    return 0;
+}
+
+static gint
+KeyTaskCollect(gpointer data, gint error, gboolean timeout)
+{
+    KeyTask *kt = data;
+    UNUSED(timeout);
+    if (error == EXECUTOR_ERROR_BUSY) {
+        g_atomic_int_inc(kt->busy);
+    }
+    return 0;
+}
+
+void
+test_serialization_key(void)
+{
+    ExecutorStats st;
+    KeyTask kt;
+    TaskRequest tasks[4];
+    TestData td;
+    Event release;
+    gint ran = 0;
+    gint busy = 0;
+    gint i;
+
+    event_init(&release);
+    helper_fill_queue(&td, &release, EXECUTOR_OVERFLOW_GROW, 0, 1024 * 1024);
+
+    /* queued behind the busy worker, so the keys stay in flight */
+    kt.ran = &ran;
+    kt.busy = &busy;
+    memset(tasks, 0, sizeof(tasks));
+    for (i = 0; i < 4; i++) {
+        tasks[i].work = KeyTaskFunction;
+        tasks[i].collect = KeyTaskCollect;
+        tasks[i].data = &kt;
+        tasks[i].size = sizeof(kt);
+        tasks[i].priority = EXECUTOR_PRIORITY_NORMAL;
+    }
+    tasks[0].key = 5;
+    tasks[1].key = 5;
+    tasks[2].key = 6;
+    tasks[3].key = 0; /* no key, never busy */
+    td.err = executor_dispatch_batch(td.exec, tasks, 4);
+    g_assert_cmpint(td.err, ==, 4);
+    /* collected during the dispatch */
+    g_assert_cmpint(g_atomic_int_get(&busy), ==, 1);
+
+    td.err = executor_dispatch_batch(td.exec, tasks + 2, 2);
+    g_assert_cmpint(td.err, ==, 2);
+    g_assert_cmpint(g_atomic_int_get(&busy), ==, 2);
+
+    event_set(&release);
+    usleep(100 * 1000); /* let the queue drain */
+    g_assert_cmpint(g_atomic_int_get(&ran), ==, 4);
+
+    /* done, so free again */
+    td.err = executor_dispatch_batch(td.exec, tasks, 2);
+    g_assert_cmpint(td.err, ==, 2);
+    usleep(50 * 1000);
+    g_assert_cmpint(g_atomic_int_get(&ran), ==, 5);
+    g_assert_cmpint(g_atomic_int_get(&busy), ==, 3);
+
+    executor_get_stats(td.exec, &st);
+    g_assert_cmpint(st.busy, ==, 3);
+
+    teardown(&td);
+}
+
 
 int
 main(int argc, char *argv[])
@@ -252,6 +1110,22 @@ main(int argc, char *argv[])
     g_test_add_func("/vmon/executor/start_twice", test_start_twice);
     g_test_add_func("/vmon/executor/dispatch", test_dispatch);
     g_test_add_func("/vmon/executor/dispatch_with_timeout", test_dispatch_with_timeout);
+    g_test_add_func("/vmon/executor/dispatch_timers", test_dispatch_timers);
+    g_test_add_func("/vmon/executor/dispatch_from_worker", test_dispatch_from_worker);
+    g_test_add_func("/vmon/executor/dispatch_batch", test_dispatch_batch);
+    g_test_add_func("/vmon/executor/stop_drain", test_stop_drain);
+    g_test_add_func("/vmon/executor/overflow_reject", test_overflow_reject);
+    g_test_add_func("/vmon/executor/overflow_block", test_overflow_block);
+    g_test_add_func("/vmon/executor/overflow_grow", test_overflow_grow);
+    g_test_add_func("/vmon/executor/dispatch_priority", test_dispatch_priority);
+    g_test_add_func("/vmon/executor/dispatch_big_data", test_dispatch_big_data);
+    g_test_add_func("/vmon/executor/quarantine", test_quarantine);
+    g_test_add_func("/vmon/executor/elastic_pool", test_elastic_pool);
+    g_test_add_func("/vmon/executor/dispatch_bad_priority", test_dispatch_bad_priority);
+    g_test_add_func("/vmon/executor/cancel", test_cancel);
+    g_test_add_func("/vmon/executor/cancel_purge", test_cancel_purge);
+    g_test_add_func("/vmon/executor/cancel_many", test_cancel_many);
+    g_test_add_func("/vmon/executor/serialization_key", test_serialization_key);
     return g_test_run();
 }
 
@@ -0,0 +1,198 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <glib.h>
+
+#include "health.h"
+
+
+enum {
+    SLOW = 1000000, /* microseconds */
+    KEY = 42
+};
+
+static const char *UUID = "f6e2e5a4-b1c2-4b3e-8d1f-6c0f5a2b3c4d";
+
+static DomainHealth *
+setup(void)
+{
+    DomainHealth *dh = NULL;
+    int err = health_init(&dh, SLOW);
+    g_assert_cmpint(err, ==, 0);
+    return dh;
+}
+
+static void
+test_unknown_due(void)
+{
+    DomainHealth *dh = setup();
+    HealthInfo *infos = NULL;
+
+    g_assert(health_due(dh, KEY, 0));
+    g_assert_cmpint(health_get(dh, &infos), ==, 0);
+
+    free(infos);
+    health_free(dh);
+}
+
+static void
+test_backoff(void)
+{
+    DomainHealth *dh = setup();
+    HealthInfo *infos = NULL;
+    gint64 now = 0;
+
+    /* a single miss is tolerated */
+    health_record(dh, KEY, UUID, now, SLOW * 2, TRUE);
+    g_assert(health_due(dh, KEY, now));
+    /* so is a slow one, as long as it completes */
+    health_record(dh, KEY, UUID, now, SLOW * 2, FALSE);
+    g_assert(health_due(dh, KEY, now));
+    health_record(dh, KEY, UUID, now, SLOW * 2, TRUE);
+    g_assert(!health_due(dh, KEY, now));
+
+    g_assert_cmpint(health_get(dh, &infos), ==, 1);
+    g_assert_cmpstr(infos[0].uuid, ==, UUID);
+    g_assert(infos[0].unresponsive);
+    g_assert_cmpint(infos[0].misses, ==, 3);
+    g_assert_cmpint(infos[0].samples, ==, 3);
+    g_assert_cmpint(infos[0].timeouts, ==, 2);
+    g_assert_cmpint(infos[0].backoff, >, 0);
+
+    /* one probe per period */
+    now += infos[0].backoff;
+    g_assert(health_due(dh, KEY, now));
+    g_assert(!health_due(dh, KEY, now));
+
+    /* still failing: the period doubles */
+    health_record(dh, KEY, UUID, now, SLOW * 2, TRUE);
+    free(infos);
+    g_assert_cmpint(health_get(dh, &infos), ==, 1);
+    g_assert_cmpint(infos[0].backoff, ==, 2 * 10 * G_USEC_PER_SEC);
+
+    free(infos);
+    health_free(dh);
+}
+
+static void
+test_recovery(void)
+{
+    DomainHealth *dh = setup();
+    HealthInfo *infos = NULL;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        health_record(dh, KEY, UUID, 0, SLOW * 2, TRUE);
+    }
+    g_assert(!health_due(dh, KEY, 0));
+
+    /* a good probe brings back the normal cadence */
+    health_record(dh, KEY, UUID, 0, SLOW / 2, FALSE);
+    g_assert(health_due(dh, KEY, 0));
+    g_assert(health_due(dh, KEY, 0));
+
+    g_assert_cmpint(health_get(dh, &infos), ==, 1);
+    g_assert(!infos[0].unresponsive);
+    g_assert_cmpint(infos[0].misses, ==, 0);
+    g_assert_cmpint(infos[0].backoff, ==, 0);
+
+    free(infos);
+    health_free(dh);
+}
+
+static void
+test_hung(void)
+{
+    DomainHealth *dh = setup();
+    HealthInfo *infos = NULL;
+    gint64 now = SLOW; /* 0 stands for no call in flight */
+    gint64 t;
+
+    health_begin(dh, KEY, UUID, now);
+    /* within the slow threshold the call is just in flight */
+    g_assert(health_due(dh, KEY, now + SLOW / 2));
+    /* past it, a miss per threshold, before it returns */
+    g_assert(health_due(dh, KEY, now + SLOW * 2));
+    g_assert(health_due(dh, KEY, now + SLOW * 2 + SLOW / 2));
+    g_assert(health_due(dh, KEY, now + SLOW * 3 + 1));
+    g_assert(!health_due(dh, KEY, now + SLOW * 4 + 2));
+
+    /* backing off: polling does not push the probe further out */
+    for (t = now + SLOW * 5; t < now + SLOW * 10; t += SLOW) {
+        g_assert(!health_due(dh, KEY, t));
+    }
+    g_assert_cmpint(health_get(dh, &infos), ==, 1);
+    g_assert_cmpstr(infos[0].uuid, ==, UUID);
+    g_assert(infos[0].unresponsive);
+    g_assert_cmpint(infos[0].misses, ==, 3);
+    g_assert_cmpint(infos[0].samples, ==, 0);
+    g_assert_cmpint(infos[0].backoff, ==, 10 * G_USEC_PER_SEC);
+
+    /* still stuck after a whole period: one more miss */
+    t = now + SLOW * 4 + 2 + infos[0].backoff + 1;
+    g_assert(!health_due(dh, KEY, t));
+    free(infos);
+    g_assert_cmpint(health_get(dh, &infos), ==, 1);
+    g_assert_cmpint(infos[0].misses, ==, 4);
+    g_assert_cmpint(infos[0].backoff, ==, 20 * G_USEC_PER_SEC);
+
+    /* once returned, it no longer piles up misses */
+    health_record(dh, KEY, UUID, t, t - now, TRUE);
+    g_assert(health_due(dh, KEY, t + infos[0].backoff * 2));
+    free(infos);
+    g_assert_cmpint(health_get(dh, &infos), ==, 1);
+    g_assert_cmpint(infos[0].misses, ==, 5);
+    g_assert_cmpint(infos[0].samples, ==, 1);
+    g_assert_cmpint(infos[0].timeouts, ==, 1);
+
+    free(infos);
+    health_free(dh);
+}
+
+static void
+test_many_domains(void)
+{
+    DomainHealth *dh = setup();
+    HealthInfo *infos = NULL;
+    guint64 key;
+
+    for (key = 1; key <= 1000; key++) {
+        health_record(dh, key, UUID, 0, SLOW / 2, FALSE);
+    }
+    health_record(dh, 1000, UUID, 0, SLOW / 2, FALSE);
+    g_assert_cmpint(health_get(dh, &infos), ==, 1000);
+
+    free(infos);
+    health_free(dh);
+}
+
+int
+main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vmon/health/unknown_due", test_unknown_due);
+    g_test_add_func("/vmon/health/backoff", test_backoff);
+    g_test_add_func("/vmon/health/recovery", test_recovery);
+    g_test_add_func("/vmon/health/hung", test_hung);
+    g_test_add_func("/vmon/health/many_domains", test_many_domains);
+    return g_test_run();
+}
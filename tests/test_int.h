@@ -27,6 +27,17 @@
 extern int
 sampler_parse_request(SampleRequest *sr, const char *text, size_t size);
 
+/* parses and answers the records of a sampling */
+extern int
+collect_success(VmonRequest *req);
+
+/* STUB_EXECUTOR: dispatched tasks run only on demand */
+extern int stub_executor_dispatched;
+extern TaskHandle stub_executor_cancelled; /* the latest */
+
+extern int
+stub_executor_run(void);
+
 typedef void (*rb_dump)(void *ud, const void *item);
 
 extern void
@@ -0,0 +1,122 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "jsonbuf.h"
+
+
+static void
+assert_text(const JsonBuf *jb, const char *text)
+{
+    g_assert_cmpint(jb->error, ==, 0);
+    g_assert_cmpint(jb->len, ==, strlen(text));
+    g_assert(memcmp(jb->ptr, text, jb->len) == 0);
+}
+
+void
+test_numbers(void)
+{
+    const unsigned long long values[] = {
+        0, 7, 10, 99, 100, 101, 12345, 1000000, 4294967296ULL, ULLONG_MAX
+    };
+    char expected[32];
+    JsonBuf jb;
+    size_t i;
+
+    g_assert_cmpint(jsonbuf_init(&jb, 0), ==, 0);
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        jsonbuf_clear(&jb);
+        jsonbuf_ullong(&jb, values[i]);
+        snprintf(expected, sizeof(expected), "%llu", values[i]);
+        assert_text(&jb, expected);
+    }
+
+    jsonbuf_clear(&jb);
+    jsonbuf_llong(&jb, -42);
+    assert_text(&jb, "-42");
+    jsonbuf_clear(&jb);
+    jsonbuf_llong(&jb, LLONG_MIN);
+    snprintf(expected, sizeof(expected), "%lli", LLONG_MIN);
+    assert_text(&jb, expected);
+
+    jsonbuf_free(&jb);
+}
+
+void
+test_strings(void)
+{
+    JsonBuf jb;
+
+    jsonbuf_init(&jb, 0);
+    jsonbuf_string(&jb, "vda");
+    assert_text(&jb, "\"vda\"");
+
+    jsonbuf_clear(&jb);
+    jsonbuf_string(&jb, "a\"b\\c\nd\x01");
+    assert_text(&jb, "\"a\\\"b\\\\c\\u000ad\\u0001\"");
+
+    jsonbuf_clear(&jb);
+    jsonbuf_string(&jb, "");
+    assert_text(&jb, "\"\"");
+
+    jsonbuf_free(&jb);
+}
+
+void
+test_grow(void)
+{
+    JsonBuf jb;
+    char *ptr = NULL;
+    int i;
+
+    jsonbuf_init(&jb, 4);
+    for (i = 0; i < 1000; i++) {
+        jsonbuf_lit(&jb, "{ }");
+    }
+    g_assert_cmpint(jb.error, ==, 0);
+    g_assert_cmpint(jb.len, ==, 3000);
+    g_assert(memcmp(jb.ptr + 2997, "{ }", 3) == 0);
+
+    /* kept for the next text */
+    ptr = jb.ptr;
+    jsonbuf_clear(&jb);
+    jsonbuf_lit(&jb, "[]");
+    assert_text(&jb, "[]");
+    g_assert(jb.ptr == ptr);
+
+    jsonbuf_free(&jb);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vmon/jsonbuf/numbers", test_numbers);
+    g_test_add_func("/vmon/jsonbuf/strings", test_strings);
+    g_test_add_func("/vmon/jsonbuf/grow", test_grow);
+    return g_test_run();
+}
@@ -0,0 +1,190 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* against the libvirt test driver, which emits the lifecycle events */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libvirt/libvirt.h>
+
+#include "registry.h"
+
+
+enum {
+    FLAGS = VIR_CONNECT_LIST_DOMAINS_ACTIVE,
+    WAIT_STEP = 10 * 1000, /* microseconds */
+    WAIT_STEPS = 500
+};
+
+static const char *TEST_URI = "test:///default";
+
+static const char *DOMAIN_XML =
+    "<domain type='test'>"
+    "<name>vmon-registry-%s</name>"
+    "<memory>8192</memory>"
+    "<vcpu>1</vcpu>"
+    "<os><type>hvm</type></os>"
+    "</domain>";
+
+static virConnectPtr conn = NULL;
+
+static virDomainPtr
+create_domain(const char *name)
+{
+    char xml[256];
+    snprintf(xml, sizeof(xml), DOMAIN_XML, name);
+    return virDomainCreateXML(conn, xml, 0);
+}
+
+static int
+count_domains(DomainRegistry *reg)
+{
+    virDomainPtr *doms = NULL;
+    int i, n = registry_get(reg, &doms);
+
+    g_assert_cmpint(n, >=, 0);
+    g_assert_null(doms[n]);
+    for (i = 0; i < n; i++) {
+        virDomainFree(doms[i]);
+    }
+    free(doms);
+    return n;
+}
+
+static int
+listed_domains(void)
+{
+    int n = virConnectNumOfDomains(conn);
+    g_assert_cmpint(n, >=, 0);
+    return n;
+}
+
+static void
+test_reconcile(void)
+{
+    DomainRegistry *reg = NULL;
+
+    if (!conn) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    g_assert_cmpint(registry_init(&reg, conn, FLAGS), ==, 0);
+    g_assert_cmpint(count_domains(reg), ==, 0);
+    g_assert_cmpint(registry_reconcile(reg), ==, listed_domains());
+    g_assert_cmpint(count_domains(reg), ==, listed_domains());
+    registry_free(reg);
+}
+
+static void
+test_add_remove(void)
+{
+    DomainRegistry *reg = NULL;
+    virDomainPtr dom = NULL;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    int n;
+
+    if (!conn) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    g_assert_cmpint(registry_init(&reg, conn, FLAGS), ==, 0);
+    n = registry_reconcile(reg);
+
+    dom = create_domain("add-remove");
+    g_assert_nonnull(dom);
+    g_assert_cmpint(virDomainGetUUID(dom, uuid), ==, 0);
+    g_assert_cmpint(registry_add(reg, dom), ==, 0);
+    g_assert_cmpint(registry_add(reg, dom), ==, 0);
+    g_assert_cmpint(count_domains(reg), ==, n + 1);
+
+    registry_remove(reg, uuid);
+    registry_remove(reg, uuid);
+    g_assert_cmpint(count_domains(reg), ==, n);
+
+    virDomainDestroy(dom);
+    virDomainFree(dom);
+    registry_free(reg);
+}
+
+static gboolean
+wait_domains(DomainRegistry *reg, int n)
+{
+    int i;
+    for (i = 0; i < WAIT_STEPS; i++) {
+        if (count_domains(reg) == n) {
+            return TRUE;
+        }
+        g_usleep(WAIT_STEP);
+    }
+    return FALSE;
+}
+
+static void
+test_events(void)
+{
+    DomainRegistry *reg = NULL;
+    virDomainPtr dom = NULL;
+    int n;
+
+    if (!conn) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    g_assert_cmpint(registry_init(&reg, conn, FLAGS), ==, 0);
+    /* no reconciliation in the way */
+    g_assert_cmpint(registry_start(reg, 3600), ==, 0);
+    n = count_domains(reg);
+    g_assert_cmpint(n, ==, listed_domains());
+
+    dom = create_domain("events");
+    g_assert_nonnull(dom);
+    g_assert_true(wait_domains(reg, n + 1));
+
+    virDomainDestroy(dom);
+    virDomainFree(dom);
+    g_assert_true(wait_domains(reg, n));
+
+    registry_stop(reg);
+    registry_free(reg);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ret = 0;
+
+    g_test_init(&argc, &argv, NULL);
+    /* before opening the connection */
+    if (virEventRegisterDefaultImpl() == 0) {
+        conn = virConnectOpen(TEST_URI);
+    }
+    g_test_add_func("/vmon/registry/reconcile", test_reconcile);
+    g_test_add_func("/vmon/registry/add_remove", test_add_remove);
+    g_test_add_func("/vmon/registry/events", test_events);
+    ret = g_test_run();
+
+    if (conn) {
+        virConnectClose(conn);
+    }
+    return ret;
+}
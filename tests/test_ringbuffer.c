@@ -19,6 +19,9 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <pthread.h>
+#include <sched.h>
+
 #include <glib.h>
 
 #include "ringbuffer.h"
@@ -115,7 +118,110 @@ test_put_full_overwrite(void)
 
     ringbuffer_free(rb);
 }
+void
+test_put_get_many(void)
+{
+    RingBuffer *rb = NULL;
+    int err = 0;
+    int in[5] = { 1, 2, 3, 4, 5 };
+    int out[5] = { 0 };
+    int i, done;
+
+    err = ringbuffer_init(&rb, 4, sizeof(int));
+    g_assert_cmpint(err, ==, 0);
+
+    /* partial put: only the room available is taken */
+    done = ringbuffer_put_many(rb, in, 5);
+    g_assert_cmpint(done, ==, 4);
+    g_assert(ringbuffer_full(rb));
+
+    done = ringbuffer_get_many(rb, out, 3);
+    g_assert_cmpint(done, ==, 3);
+    for (i = 0; i < done; i++) {
+        g_assert_cmpint(in[i], ==, out[i]);
+    }
+
+    /* wraps around */
+    done = ringbuffer_put_many(rb, in + 4, 1);
+    g_assert_cmpint(done, ==, 1);
+
+    done = ringbuffer_get_many(rb, out, 5);
+    g_assert_cmpint(done, ==, 2);
+    g_assert_cmpint(out[0], ==, 4);
+    g_assert_cmpint(out[1], ==, 5);
+
+    g_assert(ringbuffer_empty(rb));
+    done = ringbuffer_get_many(rb, out, 5);
+    g_assert_cmpint(done, ==, 0);
+
+    ringbuffer_free(rb);
+}
+
+
+enum {
+    MPMC_THREADS = 4,
+    MPMC_ITEMS = 100000
+};
+
+static void *
+mpmc_produce(void *data)
+{
+    RingBuffer *rb = data;
+    int i;
+
+    for (i = 1; i <= MPMC_ITEMS; i++) {
+        while (ringbuffer_put(rb, &i) < 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *
+mpmc_consume(void *data)
+{
+    RingBuffer *rb = data;
+    long long *sum = g_malloc0(sizeof(*sum));
+    int i, out;
+
+    for (i = 0; i < MPMC_ITEMS; i++) {
+        ringbuffer_get(rb, &out);
+        *sum += out;
+    }
+    return sum;
+}
+
+void
+test_mpmc(void)
+{
+    RingBuffer *rb = NULL;
+    pthread_t producers[MPMC_THREADS];
+    pthread_t consumers[MPMC_THREADS];
+    long long expected = (long long)MPMC_ITEMS * (MPMC_ITEMS + 1) / 2;
+    long long total = 0;
+    int err = 0;
+    int i;
+
+    err = ringbuffer_init(&rb, 64, sizeof(int));
+    g_assert_cmpint(err, ==, 0);
 
+    for (i = 0; i < MPMC_THREADS; i++) {
+        pthread_create(&consumers[i], NULL, mpmc_consume, rb);
+        pthread_create(&producers[i], NULL, mpmc_produce, rb);
+    }
+    for (i = 0; i < MPMC_THREADS; i++) {
+        void *sum = NULL;
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], &sum);
+        total += *(long long *)sum;
+        g_free(sum);
+    }
+
+    g_assert_cmpint(total, ==, expected * MPMC_THREADS);
+    g_assert(ringbuffer_empty(rb));
+
+    ringbuffer_free(rb);
+}
 
 
 int
@@ -126,6 +232,8 @@ main(int argc, char *argv[])
     g_test_add_func("/vmon/ringbuffer/put_get", test_put_get);
     g_test_add_func("/vmon/ringbuffer/put_full", test_put_full);
     g_test_add_func("/vmon/ringbuffer/put_full_overwrite", test_put_full_overwrite);
+    g_test_add_func("/vmon/ringbuffer/put_get_many", test_put_get_many);
+    g_test_add_func("/vmon/ringbuffer/mpmc", test_mpmc);
     return g_test_run();
 }
 
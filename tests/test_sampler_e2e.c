@@ -0,0 +1,370 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * end to end sampling against the libvirt test driver: counts the
+ * records each sampling mode emits for one request.
+ */
+
+#include <pthread.h>
+
+#include <libvirt/libvirt.h>
+
+#include "sampler.h"
+#include "vmon_int.h"
+#include "test_int.h"
+
+
+enum {
+    EXTRA_DOMAINS = 3,
+    COLLECTS = 100
+};
+
+static const char *TEST_URI = "test:///default";
+
+static const char *DOMAIN_XML =
+    "<domain type='test'>"
+    "<name>vmon-e2e-%i</name>"
+    "<memory>8192</memory>"
+    "<vcpu>1</vcpu>"
+    "<os><type>hvm</type></os>"
+    "</domain>";
+
+static const char *REQ =
+    "{ \"req-id\": \"6b4cd5b6-6c2e-4a0c-9a59-2d4c3bf3b6a1\","
+    " \"get-stats\": [ \"state\" ] }";
+
+/*
+ * counts the allocations of this thread, while armed, as test_vminfo.c
+ * does. Not the frees: the collect frees the records from libvirt.
+ * The next allocs_failing ones fail.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread int allocs_armed = 0;
+static __thread unsigned long allocs = 0;
+static __thread int allocs_failing = 0;
+
+void *
+malloc(size_t size)
+{
+    if (allocs_failing > 0) {
+        allocs_failing--;
+        return NULL;
+    }
+    allocs += allocs_armed;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    if (allocs_failing > 0) {
+        allocs_failing--;
+        return NULL;
+    }
+    allocs += allocs_armed;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    if (allocs_failing > 0) {
+        allocs_failing--;
+        return NULL;
+    }
+    allocs += allocs_armed;
+    return __libc_realloc(ptr, size);
+}
+
+static virConnectPtr conn = NULL;
+static int domains_num = -1;
+static int health_num = -1; /* domains known by the last sampling */
+
+static unsigned int
+list_flags(void)
+{
+    return VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE |
+           VIR_CONNECT_GET_ALL_DOMAINS_STATS_RUNNING |
+           VIR_CONNECT_GET_ALL_DOMAINS_STATS_PAUSED;
+}
+
+static int
+setup(void)
+{
+    virDomainStatsRecordPtr *records = NULL;
+    char xml[256];
+    int i, ret;
+
+    conn = virConnectOpen(TEST_URI);
+    if (!conn) {
+        return -1;
+    }
+    for (i = 0; i < EXTRA_DOMAINS; i++) {
+        virDomainPtr dom = NULL;
+        snprintf(xml, sizeof(xml), DOMAIN_XML, i);
+        dom = virDomainCreateXML(conn, xml, 0);
+        if (dom) {
+            virDomainFree(dom);
+        }
+    }
+    /* older test drivers cannot report stats at all */
+    ret = virConnectGetAllDomainStats(conn, VIR_DOMAIN_STATS_STATE,
+                                      &records, list_flags());
+    virDomainStatsRecordListFree(records);
+    return ret;
+}
+
+static int
+count_occurrences(const char *text, const char *needle)
+{
+    int n = 0;
+    while ((text = strstr(text, needle)) != NULL) {
+        text += strlen(needle);
+        n++;
+    }
+    return n;
+}
+
+static int
+sample_records(gboolean bulk_sampling, gboolean registry, int shards)
+{
+    VmonContext ctx;
+    HealthInfo *infos = NULL;
+    char *responses = NULL;
+    long size = 0;
+    int records = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.conn = conn;
+    ctx.flags = list_flags();
+    ctx.conf.timeout = 1000;
+    ctx.conf.bulk_sampling = bulk_sampling;
+    ctx.conf.shards = shards;
+    ctx.out = tmpfile();
+    g_assert_cmpint(sampler_init(&ctx), ==, 0);
+    if (registry) {
+        g_assert_cmpint(registry_init(&ctx.registry, conn, ctx.flags), ==, 0);
+        g_assert_cmpint(registry_reconcile(ctx.registry), ==, domains_num);
+    }
+
+    g_assert_cmpint(sampler_handle_request(&ctx, REQ, strlen(REQ)), ==, 0);
+    /* the listing dispatches the per-domain tasks */
+    while (stub_executor_run() > 0) {
+        ;
+    }
+
+    fseek(ctx.out, 0, SEEK_END);
+    size = ftell(ctx.out);
+    responses = calloc(1, size + 1);
+    rewind(ctx.out);
+    g_assert_cmpint(fread(responses, 1, size, ctx.out), ==, size);
+    records = count_occurrences(responses, "\"vm-id\"");
+    health_num = health_get(ctx.health, &infos);
+
+    free(infos);
+    free(responses);
+    fclose(ctx.out);
+    sampler_free(&ctx);
+    registry_free(ctx.registry);
+    return records;
+}
+
+static void
+test_per_domain(void)
+{
+    if (domains_num < 0) {
+        g_test_skip("no stats from the libvirt test driver");
+        return;
+    }
+    g_assert_cmpint(sample_records(FALSE, FALSE, 0), ==, domains_num);
+    g_assert_cmpint(health_num, ==, domains_num);
+}
+
+static void
+test_bulk(void)
+{
+    if (domains_num < 0) {
+        g_test_skip("no stats from the libvirt test driver");
+        return;
+    }
+    g_assert_cmpint(sample_records(TRUE, FALSE, 0), ==, domains_num);
+    g_assert_cmpint(health_num, ==, domains_num);
+}
+
+static void
+test_shards(void)
+{
+    if (domains_num < 0) {
+        g_test_skip("no stats from the libvirt test driver");
+        return;
+    }
+    g_assert_cmpint(sample_records(FALSE, FALSE, 2), ==, domains_num);
+    g_assert_cmpint(health_num, ==, domains_num);
+}
+
+static void
+test_per_domain_registry(void)
+{
+    if (domains_num < 0) {
+        g_test_skip("no stats from the libvirt test driver");
+        return;
+    }
+    g_assert_cmpint(sample_records(FALSE, TRUE, 0), ==, domains_num);
+}
+
+/* answers a sampling of all the domains, as a worker does */
+static void
+collect_records(VmonContext *ctx)
+{
+    VmonRequest req;
+
+    memset(&req, 0, sizeof(req));
+    req.ctx = ctx;
+    g_assert_cmpint(sampler_parse_request(&req.sr, REQ, strlen(REQ)), ==, 0);
+    req.records_num = virConnectGetAllDomainStats(conn, req.sr.stats,
+                                                  &req.records, list_flags());
+    g_assert_cmpint(req.records_num, ==, domains_num);
+
+    allocs_armed = 1;
+    g_assert_cmpint(collect_success(&req), ==, 0);
+    allocs_armed = 0;
+}
+
+static void
+test_collect_allocs(void)
+{
+    VmonContext ctx;
+    WriterStats st;
+    int i;
+
+    if (domains_num < 0) {
+        g_test_skip("no stats from the libvirt test driver");
+        return;
+    }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.conf.timeout = 1000;
+    ctx.out = tmpfile();
+    g_assert_cmpint(sampler_init(&ctx), ==, 0);
+    g_assert_cmpint(writer_init(&ctx.writer, fileno(ctx.out)), ==, 0);
+
+    /* sizes the scratch, learns the shapes, fills the writer pool */
+    for (i = 0; i < COLLECTS; i++) {
+        collect_records(&ctx);
+    }
+    /* all written: the buffers are back in the pool */
+    g_assert_cmpint(writer_start(ctx.writer), ==, 0);
+    g_assert_cmpint(writer_stop(ctx.writer), ==, 0);
+
+    allocs = 0;
+    for (i = 0; i < COLLECTS; i++) {
+        collect_records(&ctx);
+    }
+    g_assert_cmpuint(allocs, ==, 0);
+
+    writer_get_stats(ctx.writer, &st);
+    g_assert_cmpuint(st.responses, ==, 2 * COLLECTS * domains_num);
+    writer_free(ctx.writer);
+    fclose(ctx.out);
+    sampler_free(&ctx);
+}
+
+static void *
+collect_nomem_thread(void *data)
+{
+    VmonRequest *req = data;
+    int err;
+
+    /* a fresh thread: its scratch is the first allocation */
+    allocs_failing = 1;
+    err = collect_success(req);
+    allocs_failing = 0;
+    return GINT_TO_POINTER(err);
+}
+
+static void
+test_collect_nomem(void)
+{
+    VmonContext ctx;
+    VmonRequest req;
+    pthread_t thread;
+    void *err = NULL;
+    char *responses = NULL;
+    long size = 0;
+
+    if (domains_num < 0) {
+        g_test_skip("no stats from the libvirt test driver");
+        return;
+    }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.conf.timeout = 1000;
+    ctx.out = tmpfile();
+    g_assert_cmpint(sampler_init(&ctx), ==, 0);
+
+    memset(&req, 0, sizeof(req));
+    req.ctx = &ctx;
+    g_assert_cmpint(sampler_parse_request(&req.sr, REQ, strlen(REQ)), ==, 0);
+    req.records_num = virConnectGetAllDomainStats(conn, req.sr.stats,
+                                                  &req.records, list_flags());
+    g_assert_cmpint(req.records_num, ==, domains_num);
+
+    /* answered with an error, and the worker goes on */
+    g_assert_cmpint(pthread_create(&thread, NULL,
+                                   collect_nomem_thread, &req), ==, 0);
+    pthread_join(thread, &err);
+    g_assert_cmpint(GPOINTER_TO_INT(err), ==, 0);
+
+    size = ftell(ctx.out);
+    responses = calloc(1, size + 1);
+    rewind(ctx.out);
+    g_assert_cmpint(fread(responses, 1, size, ctx.out), ==, size);
+    g_assert_cmpint(count_occurrences(responses, "out of memory"), ==, 1);
+
+    free(responses);
+    fclose(ctx.out);
+    sampler_free(&ctx);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ret = 0;
+
+    g_test_init(&argc, &argv, NULL);
+    domains_num = setup();
+    g_test_add_func("/vmon/sampler_e2e/per_domain", test_per_domain);
+    g_test_add_func("/vmon/sampler_e2e/bulk", test_bulk);
+    g_test_add_func("/vmon/sampler_e2e/shards", test_shards);
+    g_test_add_func("/vmon/sampler_e2e/per_domain_registry",
+                    test_per_domain_registry);
+    g_test_add_func("/vmon/sampler_e2e/collect_allocs",
+                    test_collect_allocs);
+    g_test_add_func("/vmon/sampler_e2e/collect_nomem", test_collect_nomem);
+    ret = g_test_run();
+
+    if (conn) {
+        virConnectClose(conn);
+    }
+    return ret;
+}
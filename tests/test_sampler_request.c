@@ -19,6 +19,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include "sampler.h"
 #include "vmon_int.h"
 #include "test_int.h"
 
@@ -151,8 +152,401 @@ test_good_empty_data(void)
 
     g_assert_cmpint(sr.stats, ==, 0);
     g_assert_cmpint(uuid_compare(null_uuid, sr.uuid), ==, 0);
+    g_assert_cmpint(sr.priority, ==, EXECUTOR_PRIORITY_NORMAL);
 }
 
+static void
+test_good_priority_high(void)
+{
+    SampleRequest sr;
+
+    test_helper_correct_req(&sr, "{ \"priority\": \"high\" }");
+
+    g_assert_cmpint(sr.priority, ==, EXECUTOR_PRIORITY_HIGH);
+}
+
+static void
+test_bad_priority_type(void)
+{
+    test_helper_malformed_req("{ \"priority\": 0 }");
+}
+
+static void
+test_bad_priority_string(void)
+{
+    test_helper_malformed_req("{ \"priority\": \"hi\" }");
+}
+
+
+static void
+test_schedules_merge(void)
+{
+    VmonConfig conf;
+    unsigned int stats = 0;
+    int err = 0;
+    int base;
+
+    memset(&conf, 0, sizeof(conf));
+    err = sampler_parse_schedules(&conf, "2:cpu-total.vcpu,15:interface,60:block");
+    g_assert_cmpint(err, ==, 0);
+    g_assert_cmpint(conf.schedules_num, ==, 3);
+
+    base = sampler_schedule_base(&conf);
+    g_assert_cmpint(base, ==, 1);
+
+    g_assert_false(sampler_schedule_due(&conf, base, 1, &stats));
+    g_assert_true(sampler_schedule_due(&conf, base, 2, &stats));
+    g_assert_cmpuint(stats, ==, VIR_DOMAIN_STATS_CPU_TOTAL|VIR_DOMAIN_STATS_VCPU);
+    g_assert_true(sampler_schedule_due(&conf, base, 15, &stats));
+    g_assert_cmpuint(stats, ==, VIR_DOMAIN_STATS_INTERFACE);
+    /* one sampling for all */
+    g_assert_true(sampler_schedule_due(&conf, base, 60, &stats));
+    g_assert_cmpuint(stats, ==, VIR_DOMAIN_STATS_CPU_TOTAL|VIR_DOMAIN_STATS_VCPU|
+                                VIR_DOMAIN_STATS_INTERFACE|VIR_DOMAIN_STATS_BLOCK);
+}
+
+static void
+test_schedules_all_stats(void)
+{
+    VmonConfig conf;
+    unsigned int stats = 0;
+    int base;
+
+    memset(&conf, 0, sizeof(conf));
+    g_assert_cmpint(sampler_parse_schedules(&conf, "10:block,20"), ==, 0);
+
+    base = sampler_schedule_base(&conf);
+    g_assert_cmpint(base, ==, 10);
+
+    g_assert_true(sampler_schedule_due(&conf, base, 1, &stats));
+    g_assert_cmpuint(stats, ==, VIR_DOMAIN_STATS_BLOCK);
+    g_assert_true(sampler_schedule_due(&conf, base, 2, &stats));
+    g_assert_cmpuint(stats, ==, 0);
+}
+
+static void
+test_schedules_malformed(void)
+{
+    const char *specs[] = {
+        "", "x", "0:block", "-5", "2:", "2:block.", "2:blk", "2;block", "2:block,",
+    };
+    size_t j;
+
+    for (j = 0; j < G_N_ELEMENTS(specs); j++) {
+        VmonConfig conf;
+        memset(&conf, 0, sizeof(conf));
+        g_assert_cmpint(sampler_parse_schedules(&conf, specs[j]), <, 0);
+    }
+}
+
+static void
+test_shard_count(void)
+{
+    /* nothing to split */
+    g_assert_cmpint(sampler_shard_count(0, 16, 0), ==, 0);
+    g_assert_cmpint(sampler_shard_count(5, 16, 0), ==, 1);
+    /* unknown cost: small chunks, up to the limit */
+    g_assert_cmpint(sampler_shard_count(400, 16, 0), ==, 16);
+    g_assert_cmpint(sampler_shard_count(40, 16, 0), ==, 5);
+    /* cheap domains: fewer, bigger chunks */
+    g_assert_cmpint(sampler_shard_count(400, 16, 1000), ==, 4);
+    /* slow ones: as many as allowed */
+    g_assert_cmpint(sampler_shard_count(400, 16, 50000), ==, 16);
+    g_assert_cmpint(sampler_shard_count(400, 0, 1000), ==, 1);
+}
+
+static void
+test_record_partial(void)
+{
+    virTypedParameter busy[] = {
+        { .field = "state.state", .type = VIR_TYPED_PARAM_INT },
+        { .field = "block.count", .type = VIR_TYPED_PARAM_UINT, .value.ui = 1 },
+        { .field = "block.0.name", .type = VIR_TYPED_PARAM_STRING },
+        { .field = "block.0.path", .type = VIR_TYPED_PARAM_STRING },
+    };
+    virTypedParameter full[] = {
+        { .field = "block.count", .type = VIR_TYPED_PARAM_UINT, .value.ui = 1 },
+        { .field = "block.0.name", .type = VIR_TYPED_PARAM_STRING },
+        { .field = "block.0.path", .type = VIR_TYPED_PARAM_STRING },
+        { .field = "block.0.rd.reqs", .type = VIR_TYPED_PARAM_ULLONG },
+    };
+    virTypedParameter diskless[] = {
+        { .field = "block.count", .type = VIR_TYPED_PARAM_UINT, .value.ui = 0 },
+    };
+    /* a CD-ROM without media: no path, no I/O counters */
+    virTypedParameter empty_drive[] = {
+        { .field = "block.count", .type = VIR_TYPED_PARAM_UINT, .value.ui = 2 },
+        { .field = "block.0.name", .type = VIR_TYPED_PARAM_STRING },
+        { .field = "block.0.path", .type = VIR_TYPED_PARAM_STRING },
+        { .field = "block.0.rd.reqs", .type = VIR_TYPED_PARAM_ULLONG },
+        { .field = "block.1.name", .type = VIR_TYPED_PARAM_STRING },
+    };
+    virTypedParameter busy_empty_drive[] = {
+        { .field = "block.count", .type = VIR_TYPED_PARAM_UINT, .value.ui = 2 },
+        { .field = "block.0.name", .type = VIR_TYPED_PARAM_STRING },
+        { .field = "block.0.path", .type = VIR_TYPED_PARAM_STRING },
+        { .field = "block.1.name", .type = VIR_TYPED_PARAM_STRING },
+    };
+    virDomainStatsRecord record = { .params = busy, .nparams = G_N_ELEMENTS(busy) };
+
+    g_assert_true(sampler_record_partial(&record, 0));
+    g_assert_true(sampler_record_partial(&record, VIR_DOMAIN_STATS_BLOCK));
+    /* the block stats were not asked for */
+    g_assert_false(sampler_record_partial(&record, VIR_DOMAIN_STATS_STATE));
+
+    record.params = full;
+    record.nparams = G_N_ELEMENTS(full);
+    g_assert_false(sampler_record_partial(&record, 0));
+
+    record.params = diskless;
+    record.nparams = G_N_ELEMENTS(diskless);
+    g_assert_false(sampler_record_partial(&record, 0));
+
+    record.params = empty_drive;
+    record.nparams = G_N_ELEMENTS(empty_drive);
+    g_assert_false(sampler_record_partial(&record, 0));
+
+    record.params = busy_empty_drive;
+    record.nparams = G_N_ELEMENTS(busy_empty_drive);
+    g_assert_true(sampler_record_partial(&record, 0));
+}
+
+static char *
+read_all(FILE *out)
+{
+    long size = ftell(out);
+    char *text = calloc(1, size + 1);
+
+    rewind(out);
+    g_assert_cmpint(fread(text, 1, size, out), ==, size);
+    return text;
+}
+
+static void
+test_coalesce_same_stats(void)
+{
+    const char *req_ids[] = {
+        "6b4cd5b6-6c2e-4a0c-9a59-2d4c3bf3b6a1",
+        "8f7e4c3a-19a5-4b0e-9d55-0b6b1f9de0c2",
+        "c2a8c4e1-6f4d-4d3f-8c2b-57b1d7c0e9a3",
+    };
+    VmonContext ctx;
+    char text[256];
+    char *responses = NULL;
+    size_t j;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.out = tmpfile();
+    g_assert_cmpint(sampler_init(&ctx), ==, 0);
+    stub_executor_dispatched = 0;
+
+    for (j = 0; j < G_N_ELEMENTS(req_ids); j++) {
+        snprintf(text, sizeof(text),
+                 "{ \"req-id\": \"%s\", \"get-stats\": [ \"block\" ] }",
+                 req_ids[j]);
+        g_assert_cmpint(sampler_handle_request(&ctx, text, strlen(text)), ==, 0);
+    }
+    /* one libvirt call for all */
+    g_assert_cmpint(stub_executor_dispatched, ==, 1);
+
+    /* no connection: the call fails, and all of them know */
+    g_assert_cmpint(stub_executor_run(), ==, 1);
+    fflush(ctx.out);
+    responses = read_all(ctx.out);
+    for (j = 0; j < G_N_ELEMENTS(req_ids); j++) {
+        g_assert_nonnull(strstr(responses, req_ids[j]));
+    }
+    free(responses);
+
+    /* that one is over, a new request calls libvirt again */
+    g_assert_cmpint(sampler_handle_request(&ctx, text, strlen(text)), ==, 0);
+    g_assert_cmpint(stub_executor_dispatched, ==, 2);
+    stub_executor_run();
+
+    fclose(ctx.out);
+    sampler_free(&ctx);
+}
+
+static void
+test_coalesce_different(void)
+{
+    const char *requests[] = {
+        "{ \"get-stats\": [ \"block\" ], \"priority\": \"low\" }",
+        "{ \"get-stats\": [ \"vcpu\" ], \"priority\": \"low\" }",
+        /* must not wait behind a less urgent one */
+        "{ \"get-stats\": [ \"block\" ], \"priority\": \"high\" }",
+        /* but can ride a more urgent one */
+        "{ \"get-stats\": [ \"block\" ], \"priority\": \"normal\" }",
+    };
+    VmonContext ctx;
+    size_t j;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.out = tmpfile();
+    g_assert_cmpint(sampler_init(&ctx), ==, 0);
+    stub_executor_dispatched = 0;
+
+    for (j = 0; j < G_N_ELEMENTS(requests); j++) {
+        g_assert_cmpint(sampler_handle_request(&ctx, requests[j],
+                                               strlen(requests[j])), ==, 0);
+    }
+    g_assert_cmpint(stub_executor_dispatched, ==, 3);
+    g_assert_cmpint(stub_executor_run(), ==, 3);
+
+    fclose(ctx.out);
+    sampler_free(&ctx);
+}
+
+static void
+test_good_cancel(void)
+{
+    uuid_t req_id;
+    SampleRequest sr;
+
+    uuid_parse("6b4cd5b6-6c2e-4a0c-9a59-2d4c3bf3b6a1", req_id);
+    test_helper_correct_req(&sr,
+        "{ \"cancel\": \"6b4cd5b6-6c2e-4a0c-9a59-2d4c3bf3b6a1\" }");
+
+    g_assert_true(sr.cancel);
+    g_assert_cmpint(uuid_compare(req_id, sr.uuid), ==, 0);
+}
+
+static void
+test_bad_cancel_type(void)
+{
+    test_helper_malformed_req("{ \"cancel\": 1 }");
+}
+
+static void
+test_cancel_coalesced(void)
+{
+    const char *req = "{ \"req-id\": \"%s\", \"get-stats\": [ \"vcpu\" ] }";
+    const char *cancel = "{ \"cancel\": \"%s\" }";
+    const char *first = "6b4cd5b6-6c2e-4a0c-9a59-2d4c3bf3b6a1";
+    const char *second = "8f7e4c3a-19a5-4b0e-9d55-0b6b1f9de0c2";
+    VmonContext ctx;
+    char text[256];
+    char *responses = NULL;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.out = tmpfile();
+    g_assert_cmpint(sampler_init(&ctx), ==, 0);
+    stub_executor_cancelled = 0;
+
+    snprintf(text, sizeof(text), req, first);
+    sampler_handle_request(&ctx, text, strlen(text));
+    snprintf(text, sizeof(text), req, second);
+    sampler_handle_request(&ctx, text, strlen(text));
+
+    /* someone else still waits: the work goes on */
+    snprintf(text, sizeof(text), cancel, first);
+    g_assert_cmpint(sampler_handle_request(&ctx, text, strlen(text)), ==, 0);
+    g_assert_cmpuint(stub_executor_cancelled, ==, 0);
+
+    stub_executor_run();
+    fflush(ctx.out);
+    responses = read_all(ctx.out);
+    g_assert_null(strstr(responses, first));
+    g_assert_nonnull(strstr(responses, second));
+    free(responses);
+
+    /* alone in flight: the work is withdrawn */
+    snprintf(text, sizeof(text), req, first);
+    sampler_handle_request(&ctx, text, strlen(text));
+    snprintf(text, sizeof(text), cancel, first);
+    g_assert_cmpint(sampler_handle_request(&ctx, text, strlen(text)), ==, 0);
+    g_assert_cmpuint(stub_executor_cancelled, !=, 0);
+    stub_executor_run();
+
+    fclose(ctx.out);
+    sampler_free(&ctx);
+}
+
+static void
+test_good_get_health(void)
+{
+    SampleRequest sr;
+
+    test_helper_correct_req(&sr,
+        "{ \"req-id\": \"6b4cd5b6-6c2e-4a0c-9a59-2d4c3bf3b6a1\","
+        " \"get-health\": true }");
+
+    g_assert_true(sr.health);
+}
+
+static void
+test_bad_get_health_type(void)
+{
+    test_helper_malformed_req("{ \"get-health\": \"yes\" }");
+}
+
+static void
+test_report_health(void)
+{
+    const char *dom = "f6e2e5a4-b1c2-4b3e-8d1f-6c0f5a2b3c4d";
+    const char *req =
+        "{ \"req-id\": \"6b4cd5b6-6c2e-4a0c-9a59-2d4c3bf3b6a1\","
+        " \"get-health\": true }";
+    VmonContext ctx;
+    char *responses = NULL;
+    int i;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.out = tmpfile();
+    ctx.conf.timeout = 1000;
+    g_assert_cmpint(sampler_init(&ctx), ==, 0);
+    g_assert_nonnull(ctx.health);
+
+    for (i = 0; i < 3; i++) {
+        health_record(ctx.health, 1, dom, 0, G_USEC_PER_SEC, TRUE);
+    }
+    g_assert_cmpint(sampler_handle_request(&ctx, req, strlen(req)), ==, 0);
+
+    fflush(ctx.out);
+    responses = read_all(ctx.out);
+    g_assert_nonnull(strstr(responses, dom));
+    g_assert_nonnull(strstr(responses, "\"unresponsive\""));
+    free(responses);
+
+    fclose(ctx.out);
+    sampler_free(&ctx);
+}
+
+
+static void
+test_report_health_writer(void)
+{
+    const char *req =
+        "{ \"req-id\": \"6b4cd5b6-6c2e-4a0c-9a59-2d4c3bf3b6a1\","
+        " \"get-health\": true }";
+    VmonContext ctx;
+    char *responses = NULL;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.out = tmpfile();
+    ctx.conf.timeout = 1000;
+    g_assert_cmpint(sampler_init(&ctx), ==, 0);
+    g_assert_cmpint(writer_init(&ctx.writer, fileno(ctx.out)), ==, 0);
+    g_assert_cmpint(writer_start(ctx.writer), ==, 0);
+
+    /* the second one counts the first */
+    g_assert_cmpint(sampler_handle_request(&ctx, req, strlen(req)), ==, 0);
+    g_assert_cmpint(sampler_handle_request(&ctx, req, strlen(req)), ==, 0);
+    g_assert_cmpint(writer_stop(ctx.writer), ==, 0);
+    writer_free(ctx.writer);
+    ctx.writer = NULL;
+
+    fseek(ctx.out, 0, SEEK_END); /* written past the stream */
+    responses = read_all(ctx.out);
+    g_assert_nonnull(strstr(responses,
+                            "\"writer\": { \"responses\": 0, \"bytes\": 0,"));
+    g_assert_nonnull(strstr(responses,
+                            "\"writer\": { \"responses\": 1, \"bytes\": "));
+    free(responses);
+
+    fclose(ctx.out);
+    sampler_free(&ctx);
+}
 
 #define REQ_ID "9ec2b64f-e432-4020-98df-8dac9931f5f7"
 
@@ -201,6 +595,23 @@ main(int argc, char *argv[])
 
     g_test_add_func("/vmon/sample_request/good_empty_data", test_good_empty_data);
     g_test_add_func("/vmon/sample_request/good_block_only", test_good_block_only);
+    g_test_add_func("/vmon/sample_request/good_priority_high", test_good_priority_high);
+    g_test_add_func("/vmon/sample_request/bad_priority_type", test_bad_priority_type);
+    g_test_add_func("/vmon/sample_request/bad_priority_string", test_bad_priority_string);
+    g_test_add_func("/vmon/sample_request/schedules_merge", test_schedules_merge);
+    g_test_add_func("/vmon/sample_request/schedules_all_stats", test_schedules_all_stats);
+    g_test_add_func("/vmon/sample_request/schedules_malformed", test_schedules_malformed);
+    g_test_add_func("/vmon/sample_request/coalesce_same_stats", test_coalesce_same_stats);
+    g_test_add_func("/vmon/sample_request/coalesce_different", test_coalesce_different);
+    g_test_add_func("/vmon/sample_request/good_cancel", test_good_cancel);
+    g_test_add_func("/vmon/sample_request/bad_cancel_type", test_bad_cancel_type);
+    g_test_add_func("/vmon/sample_request/cancel_coalesced", test_cancel_coalesced);
+    g_test_add_func("/vmon/sample_request/shard_count", test_shard_count);
+    g_test_add_func("/vmon/sample_request/record_partial", test_record_partial);
+    g_test_add_func("/vmon/sample_request/good_get_health", test_good_get_health);
+    g_test_add_func("/vmon/sample_request/bad_get_health_type", test_bad_get_health_type);
+    g_test_add_func("/vmon/sample_request/report_health", test_report_health);
+    g_test_add_func("/vmon/sample_request/report_health_writer", test_report_health_writer);
 
     return g_test_run();
 }
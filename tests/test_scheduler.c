@@ -0,0 +1,162 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "scheduler.h"
+
+
+typedef struct TimerData TimerData;
+struct TimerData {
+    gint64 armed; /* microseconds */
+    gint64 fired;
+    gint count;
+    gint repeat;
+};
+
+static gboolean
+timer_function(gpointer data)
+{
+    TimerData *td = data;
+    if (!td->fired) {
+        td->fired = g_get_monotonic_time();
+    }
+    g_atomic_int_inc(&td->count);
+    return g_atomic_int_get(&td->count) < td->repeat;
+}
+
+static Scheduler *
+start_wheel(void)
+{
+    Scheduler *sched = NULL;
+    int err = 0;
+
+    err = scheduler_init_wheel(&sched);
+    g_assert_cmpint(err, ==, 0);
+    err = scheduler_start(sched);
+    g_assert_cmpint(err, ==, 0);
+    return sched;
+}
+
+static void
+stop_wheel(Scheduler *sched)
+{
+    scheduler_stop(sched, TRUE);
+    scheduler_free(sched);
+}
+
+
+void
+test_wheel_fire(void)
+{
+    Scheduler *sched = start_wheel();
+    TimerData td = { g_get_monotonic_time(), 0, 0, 1 };
+    guint id;
+
+    id = scheduler_add(sched, 50, timer_function, &td);
+    g_assert_cmpuint(id, !=, 0);
+
+    usleep(200 * 1000);
+    stop_wheel(sched);
+
+    g_assert_cmpint(td.count, ==, 1);
+    /* never early */
+    g_assert_cmpint(td.fired - td.armed, >=, 50 * 1000);
+}
+
+void
+test_wheel_del(void)
+{
+    Scheduler *sched = start_wheel();
+    TimerData td = { 0, 0, 0, 1 };
+    guint id;
+    int err = 0;
+
+    id = scheduler_add(sched, 50, timer_function, &td);
+    err = scheduler_del(sched, id);
+    g_assert_cmpint(err, ==, 0);
+
+    usleep(200 * 1000);
+    g_assert_cmpint(g_atomic_int_get(&td.count), ==, 0);
+
+    /* the id is stale now */
+    err = scheduler_del(sched, id);
+    g_assert_cmpint(err, ==, -1);
+
+    stop_wheel(sched);
+}
+
+void
+test_wheel_repeat(void)
+{
+    Scheduler *sched = start_wheel();
+    TimerData td = { 0, 0, 0, 3 };
+
+    scheduler_add(sched, 20, timer_function, &td);
+
+    usleep(300 * 1000);
+    g_assert_cmpint(g_atomic_int_get(&td.count), ==, 3);
+
+    stop_wheel(sched);
+}
+
+void
+test_wheel_cascade(void)
+{
+    Scheduler *sched = start_wheel();
+    TimerData td = { g_get_monotonic_time(), 0, 0, 1 };
+    TimerData near = { 0, 0, 0, 1 };
+    int i;
+
+    /* beyond the first level */
+    scheduler_add(sched, 900, timer_function, &td);
+    /* many short ones meanwhile, some cancelled */
+    for (i = 0; i < 100; i++) {
+        guint id = scheduler_add(sched, 10 + i, timer_function, &near);
+        if (i % 2) {
+            scheduler_del(sched, id);
+        }
+    }
+
+    usleep(600 * 1000);
+    g_assert_cmpint(g_atomic_int_get(&td.count), ==, 0);
+    g_assert_cmpint(g_atomic_int_get(&near.count), ==, 50);
+
+    usleep(600 * 1000);
+    stop_wheel(sched);
+
+    g_assert_cmpint(td.count, ==, 1);
+    g_assert_cmpint(td.fired - td.armed, >=, 900 * 1000);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vmon/scheduler/wheel_fire", test_wheel_fire);
+    g_test_add_func("/vmon/scheduler/wheel_del", test_wheel_del);
+    g_test_add_func("/vmon/scheduler/wheel_repeat", test_wheel_repeat);
+    g_test_add_func("/vmon/scheduler/wheel_cascade", test_wheel_cascade);
+    return g_test_run();
+}
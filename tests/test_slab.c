@@ -0,0 +1,131 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "slab.h"
+
+
+void
+test_alloc_release(void)
+{
+    Slab *slab = NULL;
+    SlabStats st;
+    char *p = NULL;
+    int err = 0;
+
+    err = slab_init(&slab);
+    g_assert_cmpint(err, ==, 0);
+
+    p = slab_alloc(slab, 300);
+    g_assert(p != NULL);
+    memset(p, 0x5a, 300);
+    slab_release(slab, p);
+
+    slab_get_stats(slab, &st);
+    g_assert_cmpint(st.allocs, ==, 1);
+    g_assert_cmpint(st.large, ==, 0);
+    g_assert_cmpint(st.slabs, ==, 1);
+
+    slab_free(slab);
+}
+
+void
+test_reuse(void)
+{
+    Slab *slab = NULL;
+    SlabStats st;
+    void *p = NULL, *q = NULL;
+    int i;
+
+    slab_init(&slab);
+
+    p = slab_alloc(slab, 1000);
+    slab_release(slab, p);
+    for (i = 0; i < 1000; i++) {
+        q = slab_alloc(slab, 1000);
+        slab_release(slab, q);
+    }
+    g_assert(p == q);
+
+    slab_get_stats(slab, &st);
+    g_assert_cmpint(st.slabs, ==, 1);
+
+    slab_free(slab);
+}
+
+void
+test_size_classes(void)
+{
+    Slab *slab = NULL;
+    void *small = NULL, *big = NULL;
+
+    slab_init(&slab);
+
+    small = slab_alloc(slab, 200);
+    big = slab_alloc(slab, 2000);
+    g_assert(small != NULL);
+    g_assert(big != NULL);
+    /* blocks of different classes never overlap */
+    memset(small, 1, 200);
+    memset(big, 2, 2000);
+    g_assert_cmpint(((char *)small)[199], ==, 1);
+
+    slab_release(slab, small);
+    slab_release(slab, big);
+    slab_free(slab);
+}
+
+void
+test_large(void)
+{
+    Slab *slab = NULL;
+    SlabStats st;
+    size_t size = 1024 * 1024;
+    char *p = NULL;
+
+    slab_init(&slab);
+
+    p = slab_alloc(slab, size);
+    g_assert(p != NULL);
+    p[size - 1] = 1;
+    slab_release(slab, p);
+
+    slab_get_stats(slab, &st);
+    g_assert_cmpint(st.large, ==, 1);
+    g_assert_cmpint(st.slabs, ==, 0);
+
+    slab_free(slab);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vmon/slab/alloc_release", test_alloc_release);
+    g_test_add_func("/vmon/slab/reuse", test_reuse);
+    g_test_add_func("/vmon/slab/size_classes", test_size_classes);
+    g_test_add_func("/vmon/slab/large", test_large);
+    return g_test_run();
+}
@@ -0,0 +1,683 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014-2015 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* synthetic records, on a domain of the libvirt test driver */
+
+#include <glib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libvirt/libvirt.h>
+
+#include "vminfo.h"
+
+
+enum {
+    MAX_PARAMS = 1024,
+    KEY = 42,
+    LARGE_VCPUS = VCPU_STATS_NUM + 4,
+    LARGE_NICS = IFACE_STATS_NUM + 2,
+    LARGE_DISKS = BLOCK_STATS_NUM + 4
+};
+
+static const char *TEST_URI = "test:///default";
+
+
+/*
+ * counts the allocations of this thread, while armed. glibc calls the
+ * replacements for its own allocations too, like in strdup().
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread int allocs_armed = 0;
+static __thread unsigned long allocs = 0;
+
+void *
+malloc(size_t size)
+{
+    allocs += allocs_armed;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    allocs += allocs_armed;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    allocs += allocs_armed;
+    return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+    allocs += (ptr) ?allocs_armed :0;
+    __libc_free(ptr);
+}
+
+static virConnectPtr conn = NULL;
+static virDomainPtr dom = NULL;
+
+typedef struct Record Record;
+struct Record {
+    virDomainStatsRecord rec;
+    virTypedParameter params[MAX_PARAMS];
+};
+
+static void
+record_init(Record *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->rec.dom = dom;
+    r->rec.params = r->params;
+}
+
+static virTypedParameterPtr
+record_add(Record *r, int type, const char *fmt, ...)
+{
+    virTypedParameterPtr item = &r->params[r->rec.nparams++];
+    va_list args;
+
+    g_assert_cmpint(r->rec.nparams, <=, MAX_PARAMS);
+    va_start(args, fmt);
+    vsnprintf(item->field, sizeof(item->field), fmt, args);
+    va_end(args);
+    item->type = type;
+    return item;
+}
+
+#define ADD_ULLONG(R, V, ...) \
+    record_add(R, VIR_TYPED_PARAM_ULLONG, __VA_ARGS__)->value.ul = (V)
+#define ADD_UINT(R, V, ...) \
+    record_add(R, VIR_TYPED_PARAM_UINT, __VA_ARGS__)->value.ui = (V)
+#define ADD_INT(R, V, ...) \
+    record_add(R, VIR_TYPED_PARAM_INT, __VA_ARGS__)->value.i = (V)
+#define ADD_STRING(R, V, ...) \
+    record_add(R, VIR_TYPED_PARAM_STRING, __VA_ARGS__)->value.s = (V)
+
+static void
+test_scalars(void)
+{
+    Record r;
+    VmInfo vm;
+
+    if (!dom) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    record_init(&r);
+    ADD_INT(&r, 1, "state.state");
+    ADD_ULLONG(&r, 100, "cpu.time");
+    ADD_ULLONG(&r, 20, "cpu.user");
+    ADD_ULLONG(&r, 30, "cpu.system");
+    ADD_ULLONG(&r, 1024, "balloon.current");
+    ADD_ULLONG(&r, 2048, "balloon.maximum");
+    ADD_ULLONG(&r, 7, "balloon.unknown");
+    ADD_ULLONG(&r, 7, "cpu");
+
+    vminfo_init(&vm);
+    g_assert_cmpint(vminfo_parse(&vm, &r.rec), ==, 0);
+    g_assert_cmpuint(vm.pcpu.time, ==, 100);
+    g_assert_cmpuint(vm.pcpu.user, ==, 20);
+    g_assert_cmpuint(vm.pcpu.system, ==, 30);
+    g_assert_cmpuint(vm.balloon.current, ==, 1024);
+    g_assert_cmpuint(vm.balloon.maximum, ==, 2048);
+    vminfo_free(&vm);
+}
+
+static void
+test_devices(void)
+{
+    Record r;
+    VmInfo vm;
+    char *longname = NULL;
+
+    if (!dom) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    longname = g_strnfill(STATS_NAME_LEN + 8, 'x');
+    record_init(&r);
+    ADD_UINT(&r, 2, "vcpu.current");
+    ADD_UINT(&r, 2, "vcpu.maximum");
+    ADD_INT(&r, 1, "vcpu.0.state");
+    ADD_ULLONG(&r, 500, "vcpu.0.time");
+    ADD_INT(&r, 1, "vcpu.1.state");
+    ADD_ULLONG(&r, 600, "vcpu.1.time");
+    ADD_UINT(&r, 2, "block.count");
+    ADD_STRING(&r, "vda", "block.0.name");
+    ADD_ULLONG(&r, 11, "block.0.rd.reqs");
+    ADD_ULLONG(&r, 12, "block.0.rd.bytes");
+    ADD_ULLONG(&r, 13, "block.0.wr.times");
+    ADD_ULLONG(&r, 14, "block.0.physical");
+    ADD_STRING(&r, longname, "block.1.name");
+    ADD_ULLONG(&r, 21, "block.1.allocation");
+    /* past the devices announced: there is one more */
+    ADD_ULLONG(&r, 99, "block.2.rd.reqs");
+    ADD_UINT(&r, 1, "net.count");
+    ADD_STRING(&r, "vnet0", "net.0.name");
+    ADD_ULLONG(&r, 31, "net.0.rx.bytes");
+    ADD_ULLONG(&r, 32, "net.0.tx.drop");
+
+    vminfo_init(&vm);
+    g_assert_cmpint(vminfo_parse(&vm, &r.rec), ==, 0);
+
+    g_assert_cmpuint(vm.vcpu.current, ==, 2);
+    g_assert_cmpuint(vm.vcpu.nstats, ==, 2);
+    g_assert_cmpint(vm.vcpu.stats[0].present, ==, 1);
+    g_assert_cmpuint(vm.vcpu.stats[0].time, ==, 500);
+    g_assert_cmpuint(vm.vcpu.stats[1].time, ==, 600);
+
+    g_assert_cmpuint(vm.block.nstats, ==, 3);
+    g_assert_cmpstr(vm.block.stats[0].name, ==, "vda");
+    g_assert_cmpuint(vm.block.stats[0].rd_reqs, ==, 11);
+    g_assert_cmpuint(vm.block.stats[0].rd_bytes, ==, 12);
+    g_assert_cmpuint(vm.block.stats[0].wr_times, ==, 13);
+    g_assert_cmpuint(vm.block.stats[0].physical, ==, 14);
+    g_assert_cmpstr(vm.block.stats[1].xname, ==, longname);
+    g_assert_cmpuint(vm.block.stats[1].allocation, ==, 21);
+    g_assert_cmpuint(vm.block.stats[2].rd_reqs, ==, 99);
+
+    g_assert_cmpuint(vm.iface.nstats, ==, 1);
+    g_assert_cmpstr(vm.iface.stats[0].name, ==, "vnet0");
+    g_assert_cmpuint(vm.iface.stats[0].rx_bytes, ==, 31);
+    g_assert_cmpuint(vm.iface.stats[0].tx_drop, ==, 32);
+
+    vminfo_free(&vm);
+    g_free(longname);
+}
+
+/* every field the parser knows, each of them with its own value */
+typedef struct KnownField KnownField;
+struct KnownField {
+    const char *name;
+    size_t offset; /* in VmInfo, or in the stats of device 0 */
+};
+
+#define VM_FIELD(NAME, MEMBER) { NAME, offsetof(VmInfo, MEMBER) }
+#define BLOCK_FIELD(NAME, MEMBER) { NAME, offsetof(BlockStats, MEMBER) }
+#define NET_FIELD(NAME, MEMBER) { NAME, offsetof(IfaceStats, MEMBER) }
+
+static const KnownField vm_fields[] = {
+    VM_FIELD("cpu.time", pcpu.time),
+    VM_FIELD("cpu.user", pcpu.user),
+    VM_FIELD("cpu.system", pcpu.system),
+    VM_FIELD("balloon.current", balloon.current),
+    VM_FIELD("balloon.maximum", balloon.maximum),
+};
+
+static const KnownField block_fields[] = {
+    BLOCK_FIELD("block.0.rd.reqs", rd_reqs),
+    BLOCK_FIELD("block.0.rd.bytes", rd_bytes),
+    BLOCK_FIELD("block.0.rd.times", rd_times),
+    BLOCK_FIELD("block.0.wr.reqs", wr_reqs),
+    BLOCK_FIELD("block.0.wr.bytes", wr_bytes),
+    BLOCK_FIELD("block.0.wr.times", wr_times),
+    BLOCK_FIELD("block.0.fl.bytes", fl_bytes),
+    BLOCK_FIELD("block.0.fl.times", fl_times),
+    BLOCK_FIELD("block.0.allocation", allocation),
+    BLOCK_FIELD("block.0.capacity", capacity),
+    BLOCK_FIELD("block.0.physical", physical),
+};
+
+static const KnownField net_fields[] = {
+    NET_FIELD("net.0.rx.bytes", rx_bytes),
+    NET_FIELD("net.0.rx.pkts", rx_pkts),
+    NET_FIELD("net.0.rx.errs", rx_errs),
+    NET_FIELD("net.0.rx.drop", rx_drop),
+    NET_FIELD("net.0.tx.bytes", tx_bytes),
+    NET_FIELD("net.0.tx.pkts", tx_pkts),
+    NET_FIELD("net.0.tx.errs", tx_errs),
+    NET_FIELD("net.0.tx.drop", tx_drop),
+};
+
+#undef NET_FIELD
+#undef BLOCK_FIELD
+#undef VM_FIELD
+
+#define FIELD_VALUE(BASE, FIELD) \
+    (*(const unsigned long long *)((const char *)(BASE) + (FIELD)->offset))
+
+/*
+ * the field slots are a hand tuned perfect hash: any key landing
+ * in the slot of another one shows up here as a lost value.
+ */
+static void
+test_fields(void)
+{
+    Record r;
+    VmInfo vm;
+    size_t i;
+
+    if (!dom) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    record_init(&r);
+    for (i = 0; i < G_N_ELEMENTS(vm_fields); i++) {
+        ADD_ULLONG(&r, 100 + i, "%s", vm_fields[i].name);
+    }
+    ADD_UINT(&r, 3, "vcpu.current");
+    ADD_UINT(&r, 4, "vcpu.maximum");
+    ADD_INT(&r, 2, "vcpu.0.state");
+    ADD_ULLONG(&r, 500, "vcpu.0.time");
+    ADD_UINT(&r, 5, "block.count");
+    ADD_STRING(&r, "vda", "block.0.name");
+    for (i = 0; i < G_N_ELEMENTS(block_fields); i++) {
+        ADD_ULLONG(&r, 200 + i, "%s", block_fields[i].name);
+    }
+    ADD_UINT(&r, 6, "net.count");
+    ADD_STRING(&r, "vnet0", "net.0.name");
+    for (i = 0; i < G_N_ELEMENTS(net_fields); i++) {
+        ADD_ULLONG(&r, 300 + i, "%s", net_fields[i].name);
+    }
+
+    vminfo_init(&vm);
+    g_assert_cmpint(vminfo_parse(&vm, &r.rec), ==, 0);
+
+    for (i = 0; i < G_N_ELEMENTS(vm_fields); i++) {
+        g_assert_cmpuint(FIELD_VALUE(&vm, &vm_fields[i]), ==, 100 + i);
+    }
+    g_assert_cmpuint(vm.vcpu.current, ==, 3);
+    g_assert_cmpuint(vm.vcpu.nstats, ==, 4);
+    g_assert_cmpint(vm.vcpu.stats[0].state, ==, 2);
+    g_assert_cmpuint(vm.vcpu.stats[0].time, ==, 500);
+
+    g_assert_cmpuint(vm.block.nstats, ==, 5);
+    g_assert_cmpstr(vm.block.stats[0].name, ==, "vda");
+    for (i = 0; i < G_N_ELEMENTS(block_fields); i++) {
+        g_assert_cmpuint(FIELD_VALUE(&vm.block.stats[0], &block_fields[i]),
+                         ==, 200 + i);
+    }
+
+    g_assert_cmpuint(vm.iface.nstats, ==, 6);
+    g_assert_cmpstr(vm.iface.stats[0].name, ==, "vnet0");
+    for (i = 0; i < G_N_ELEMENTS(net_fields); i++) {
+        g_assert_cmpuint(FIELD_VALUE(&vm.iface.stats[0], &net_fields[i]),
+                         ==, 300 + i);
+    }
+    vminfo_free(&vm);
+}
+
+#undef FIELD_VALUE
+
+/* past the inline stats of every group */
+static void
+large_record(Record *r, gboolean counts)
+{
+    int i;
+
+    record_init(r);
+    if (counts) {
+        ADD_UINT(r, LARGE_VCPUS, "vcpu.current");
+        ADD_UINT(r, LARGE_VCPUS, "vcpu.maximum");
+    }
+    for (i = 0; i < LARGE_VCPUS; i++) {
+        ADD_INT(r, 1, "vcpu.%i.state", i);
+        ADD_ULLONG(r, 1000 + i, "vcpu.%i.time", i);
+    }
+    if (counts) {
+        ADD_UINT(r, LARGE_NICS, "net.count");
+    }
+    for (i = 0; i < LARGE_NICS; i++) {
+        ADD_STRING(r, "vnet", "net.%i.name", i);
+        ADD_ULLONG(r, 2000 + i, "net.%i.rx.bytes", i);
+        ADD_ULLONG(r, 3000 + i, "net.%i.tx.bytes", i);
+    }
+    if (counts) {
+        ADD_UINT(r, LARGE_DISKS, "block.count");
+    }
+    for (i = 0; i < LARGE_DISKS; i++) {
+        ADD_STRING(r, "vd", "block.%i.name", i);
+        ADD_ULLONG(r, 4000 + i, "block.%i.rd.bytes", i);
+        ADD_ULLONG(r, 5000 + i, "block.%i.physical", i);
+    }
+}
+
+static void
+check_large(const VmInfo *vm)
+{
+    size_t i;
+
+    g_assert_cmpuint(vm->vcpu.nstats, ==, LARGE_VCPUS);
+    g_assert_nonnull(vm->vcpu.xstats);
+    for (i = 0; i < LARGE_VCPUS; i++) {
+        g_assert_cmpint(vm->vcpu.xstats[i].present, ==, 1);
+        g_assert_cmpuint(vm->vcpu.xstats[i].time, ==, 1000 + i);
+    }
+    g_assert_cmpuint(vm->iface.nstats, ==, LARGE_NICS);
+    g_assert_nonnull(vm->iface.xstats);
+    for (i = 0; i < LARGE_NICS; i++) {
+        g_assert_cmpstr(vm->iface.xstats[i].name, ==, "vnet");
+        g_assert_cmpuint(vm->iface.xstats[i].rx_bytes, ==, 2000 + i);
+        g_assert_cmpuint(vm->iface.xstats[i].tx_bytes, ==, 3000 + i);
+    }
+    g_assert_cmpuint(vm->block.nstats, ==, LARGE_DISKS);
+    g_assert_nonnull(vm->block.xstats);
+    for (i = 0; i < LARGE_DISKS; i++) {
+        g_assert_cmpstr(vm->block.xstats[i].name, ==, "vd");
+        g_assert_cmpuint(vm->block.xstats[i].rd_bytes, ==, 4000 + i);
+        g_assert_cmpuint(vm->block.xstats[i].physical, ==, 5000 + i);
+    }
+}
+
+static void
+test_large(void)
+{
+    Record r;
+    VmInfo vm;
+
+    if (!dom) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    large_record(&r, TRUE);
+    vminfo_init(&vm);
+    g_assert_cmpint(vminfo_parse(&vm, &r.rec), ==, 0);
+    g_assert_cmpuint(vm.vcpu.current, ==, LARGE_VCPUS);
+    check_large(&vm);
+    vminfo_free(&vm);
+}
+
+static void
+test_large_uncounted(void)
+{
+    Record r;
+    VmInfo vm;
+
+    if (!dom) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    /* the stats grow one device at a time */
+    large_record(&r, FALSE);
+    vminfo_init(&vm);
+    g_assert_cmpint(vminfo_parse(&vm, &r.rec), ==, 0);
+    check_large(&vm);
+    vminfo_free(&vm);
+}
+
+static void
+shaped_record(Record *r, int disks, unsigned long long value)
+{
+    int i;
+
+    record_init(r);
+    ADD_ULLONG(r, value, "cpu.time");
+    ADD_UINT(r, disks, "block.count");
+    for (i = 0; i < disks; i++) {
+        ADD_STRING(r, "vda", "block.%i.name", i);
+        ADD_ULLONG(r, value + i, "block.%i.rd.reqs", i);
+    }
+}
+
+static void
+check_shaped(VmShapes *shapes, int disks, unsigned long long value)
+{
+    Record r;
+    VmInfo vm;
+    const BlockStats *stats = NULL;
+    int i;
+
+    shaped_record(&r, disks, value);
+    vminfo_init(&vm);
+    g_assert_cmpint(vminfo_parse_shaped(&vm, &r.rec, shapes, KEY), ==, 0);
+    g_assert_cmpuint(vm.pcpu.time, ==, value);
+    g_assert_cmpuint(vm.block.nstats, ==, disks);
+    stats = (vm.block.xstats) ?vm.block.xstats :vm.block.stats;
+    for (i = 0; i < disks; i++) {
+        g_assert_cmpstr(stats[i].name, ==, "vda");
+        g_assert_cmpuint(stats[i].rd_reqs, ==, value + i);
+    }
+    vminfo_free(&vm);
+}
+
+static void
+test_shapes(void)
+{
+    VmShapes *shapes = NULL;
+    unsigned long domains = 0, hits = 0, learned = 0;
+
+    if (!dom) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    g_assert_cmpint(vmshapes_init(&shapes), ==, 0);
+    check_shaped(shapes, 2, 100);
+    check_shaped(shapes, 2, 200);
+    /* hot-plug, past the inline stats too */
+    check_shaped(shapes, BLOCK_STATS_NUM + 2, 300);
+    check_shaped(shapes, BLOCK_STATS_NUM + 2, 400);
+    check_shaped(shapes, 1, 500);
+
+    vmshapes_stats(shapes, &domains, &hits, &learned);
+    g_assert_cmpuint(domains, ==, 1);
+    g_assert_cmpuint(hits, ==, 4);
+    g_assert_cmpuint(learned, ==, 3);
+    vmshapes_free(shapes);
+}
+
+static unsigned long long
+parse_physical(VmShapes *shapes, const char *field)
+{
+    Record r;
+    VmInfo vm;
+    unsigned long long physical = 0;
+
+    record_init(&r);
+    ADD_UINT(&r, 1, "block.count");
+    ADD_STRING(&r, "vda", "block.0.name");
+    ADD_ULLONG(&r, 42, "%s", field);
+    vminfo_init(&vm);
+    g_assert_cmpint(vminfo_parse_shaped(&vm, &r.rec, shapes, KEY), ==, 0);
+    g_assert_cmpuint(vm.block.nstats, ==, 1);
+    physical = vm.block.stats[0].physical;
+    vminfo_free(&vm);
+    return physical;
+}
+
+static void
+test_shapes_names(void)
+{
+    VmShapes *shapes = NULL;
+    unsigned long domains = 0, hits = 0, learned = 0;
+
+    if (!dom) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    g_assert_cmpint(vmshapes_init(&shapes), ==, 0);
+    g_assert_cmpuint(parse_physical(shapes, "block.0.physical"), ==, 42);
+    /* same counts and types, another field: not the learned shape */
+    g_assert_cmpuint(parse_physical(shapes, "block.0.threshold"), ==, 0);
+
+    vmshapes_stats(shapes, &domains, &hits, &learned);
+    g_assert_cmpuint(hits, ==, 1);
+    g_assert_cmpuint(learned, ==, 2);
+    vmshapes_free(shapes);
+}
+
+static void
+test_print_json(void)
+{
+    VmInfo vm;
+    JsonBuf out;
+    const char *expected =
+        "{ \"vm-id\": \"u\","
+        " \"pcpu\": { \"cpu.time\": 1, \"cpu.user\": 2,"
+        " \"cpu.system\": 3 },"
+        " \"balloon\": { \"balloon.current\": 4,"
+        " \"balloon.maximum\": 5 },"
+        " \"vcpu\": { \"0\": { \"state\": 1, \"time\": 10 },"
+        " \"1\": { \"state\": -1, \"time\": 11 } },"
+        " \"block\": { \"vda\": { \"rd_bytes\": 0,"
+        " \"rd_operations\": 0, \"rd_total_times\": 0, \"wr_bytes\": 0,"
+        " \"wr_operations\": 0, \"wr_total_times\": 0,"
+        " \"allocation\": 0, \"capacity\": 0,"
+        " \"physical\": 18446744073709551615 } },"
+        " \"iface\": { \"vnet0\": { \"rx_bytes\": 100, \"rx_pkts\": 0,"
+        " \"rx_errs\": 0, \"rx_drop\": 0, \"tx_bytes\": 0,"
+        " \"tx_pkts\": 0, \"tx_errs\": 0, \"tx_drop\": 0 },"
+        " \"v\\\"1\": { \"rx_bytes\": 0, \"rx_pkts\": 0,"
+        " \"rx_errs\": 0, \"rx_drop\": 0, \"tx_bytes\": 0,"
+        " \"tx_pkts\": 0, \"tx_errs\": 0, \"tx_drop\": 7 } } }";
+
+    vminfo_init(&vm);
+    strcpy(vm.uuid, "u");
+    vm.pcpu.time = 1;
+    vm.pcpu.user = 2;
+    vm.pcpu.system = 3;
+    vm.balloon.current = 4;
+    vm.balloon.maximum = 5;
+    /* the last vcpu is not present: no separator before the end */
+    vm.vcpu.nstats = 3;
+    vm.vcpu.stats[0].present = 1;
+    vm.vcpu.stats[0].state = 1;
+    vm.vcpu.stats[0].time = 10;
+    vm.vcpu.stats[1].present = 1;
+    vm.vcpu.stats[1].state = -1;
+    vm.vcpu.stats[1].time = 11;
+    vm.block.nstats = 1;
+    strcpy(vm.block.stats[0].name, "vda");
+    vm.block.stats[0].physical = 18446744073709551615ULL;
+    vm.iface.nstats = 2;
+    strcpy(vm.iface.stats[0].name, "vnet0");
+    vm.iface.stats[0].rx_bytes = 100;
+    strcpy(vm.iface.stats[1].name, "v\"1");
+    vm.iface.stats[1].tx_drop = 7;
+
+    g_assert_cmpint(jsonbuf_init(&out, 16), ==, 0);
+    g_assert_cmpint(vminfo_print_json(&vm, &out), ==, 0);
+    g_assert_cmpuint(out.len, ==, strlen(expected));
+    g_assert(memcmp(out.ptr, expected, out.len) == 0);
+    jsonbuf_free(&out);
+    vminfo_free(&vm);
+}
+
+/* parse and serialize, as a sampler worker does */
+static void
+sample_record(Record *r, VmShapes *shapes, Arena *arena,
+              JsonBuf *body, JsonBuf *res)
+{
+    VmInfo vm;
+
+    vminfo_init_arena(&vm, arena);
+    g_assert_cmpint(vminfo_parse_shaped(&vm, &r->rec, shapes, KEY), ==, 0);
+    jsonbuf_clear(body);
+    g_assert_cmpint(vminfo_print_json(&vm, body), ==, 0);
+    jsonbuf_clear(res);
+    jsonbuf_raw(res, body->ptr, body->len);
+    g_assert_cmpuint(res->len, ==, body->len);
+    vminfo_free(&vm);
+    arena_reset(arena);
+}
+
+static void
+test_arena(void)
+{
+    Record r;
+    VmInfo vm;
+    VmShapes *shapes = NULL;
+    Arena *arena = NULL;
+    JsonBuf body, res;
+    char *longname = NULL;
+    int i;
+
+    if (!dom) {
+        g_test_skip("no libvirt test driver");
+        return;
+    }
+    longname = g_strnfill(STATS_NAME_LEN + 8, 'x');
+    large_record(&r, TRUE);
+    ADD_STRING(&r, longname, "block.0.name");
+
+    /* the counting works: the heap holds the large parts */
+    allocs_armed = 1;
+    vminfo_init(&vm);
+    g_assert_cmpint(vminfo_parse(&vm, &r.rec), ==, 0);
+    vminfo_free(&vm);
+    allocs_armed = 0;
+    g_assert_cmpuint(allocs, >, 0);
+
+    g_assert_cmpint(vmshapes_init(&shapes), ==, 0);
+    g_assert_cmpint(arena_init(&arena, 0), ==, 0);
+    g_assert_cmpint(jsonbuf_init(&body, 0), ==, 0);
+    g_assert_cmpint(jsonbuf_init(&res, 0), ==, 0);
+    /* learns the shape, sizes the buffers */
+    for (i = 0; i < 2; i++) {
+        sample_record(&r, shapes, arena, &body, &res);
+    }
+
+    allocs = 0;
+    allocs_armed = 1;
+    for (i = 0; i < 100; i++) {
+        sample_record(&r, shapes, arena, &body, &res);
+    }
+    allocs_armed = 0;
+    g_assert_cmpuint(allocs, ==, 0);
+
+    jsonbuf_free(&res);
+    jsonbuf_free(&body);
+    arena_free(arena);
+    vmshapes_free(shapes);
+    g_free(longname);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ret = 0;
+
+    g_test_init(&argc, &argv, NULL);
+    conn = virConnectOpen(TEST_URI);
+    if (conn) {
+        dom = virDomainLookupByName(conn, "test");
+    }
+    g_test_add_func("/vmon/vminfo/scalars", test_scalars);
+    g_test_add_func("/vmon/vminfo/devices", test_devices);
+    g_test_add_func("/vmon/vminfo/fields", test_fields);
+    g_test_add_func("/vmon/vminfo/large", test_large);
+    g_test_add_func("/vmon/vminfo/large_uncounted", test_large_uncounted);
+    g_test_add_func("/vmon/vminfo/shapes", test_shapes);
+    g_test_add_func("/vmon/vminfo/shapes_names", test_shapes_names);
+    g_test_add_func("/vmon/vminfo/print_json", test_print_json);
+    g_test_add_func("/vmon/vminfo/arena", test_arena);
+    ret = g_test_run();
+
+    if (dom) {
+        virDomainFree(dom);
+    }
+    if (conn) {
+        virConnectClose(conn);
+    }
+    return ret;
+}
@@ -0,0 +1,323 @@
+/*
+ * vmon - Virtual Machine MONitor speedup helper for VDSM
+ * Copyright (C) 2014 Red Hat, Inc.
+ * Written by Francesco Romani <fromani@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "writer.h"
+
+
+enum {
+    RESPONSES = 2000,
+    RESPONSE_SIZE = 1000
+};
+
+typedef struct Reader Reader;
+struct Reader {
+    int fd;
+    int delay; /* microseconds per read */
+    GString *data;
+};
+
+static gpointer
+reader_run(gpointer data)
+{
+    Reader *rd = data;
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = read(rd->fd, buf, sizeof(buf))) > 0) {
+        g_string_append_len(rd->data, buf, n);
+        if (rd->delay) {
+            usleep(rd->delay);
+        }
+    }
+    return NULL;
+}
+
+static void
+make_response(char *buf, int j)
+{
+    memset(buf, 'a' + j % 26, RESPONSE_SIZE);
+    snprintf(buf, RESPONSE_SIZE, "{ \"seq\": %i", j);
+    buf[strlen(buf)] = ' ';
+    buf[RESPONSE_SIZE - 1] = '\n';
+}
+
+static void
+check_responses(GString *data)
+{
+    char expected[RESPONSE_SIZE];
+    int j;
+
+    g_assert_cmpint(data->len, ==, RESPONSES * RESPONSE_SIZE);
+    for (j = 0; j < RESPONSES; j++) {
+        make_response(expected, j);
+        g_assert(memcmp(data->str + j * RESPONSE_SIZE,
+                        expected, RESPONSE_SIZE) == 0);
+    }
+}
+
+static void
+helper_write_all(int delay, gboolean nonblock, WriterStats *st)
+{
+    char buf[RESPONSE_SIZE];
+    Writer *wr = NULL;
+    Reader rd;
+    GThread *reader;
+    int fds[2];
+    int j;
+
+    g_assert_cmpint(pipe(fds), ==, 0);
+    if (nonblock) {
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    }
+    rd.fd = fds[0];
+    rd.delay = delay;
+    rd.data = g_string_new(NULL);
+    reader = g_thread_new("reader", reader_run, &rd);
+
+    g_assert_cmpint(writer_init(&wr, fds[1]), ==, 0);
+    g_assert_cmpint(writer_start(wr), ==, 0);
+    for (j = 0; j < RESPONSES; j++) {
+        make_response(buf, j);
+        g_assert_cmpint(writer_write(wr, 0, buf, sizeof(buf)), ==, 0);
+    }
+    g_assert_cmpint(writer_stop(wr), ==, 0);
+    writer_get_stats(wr, st);
+    writer_free(wr);
+
+    close(fds[1]);
+    g_thread_join(reader);
+    close(fds[0]);
+
+    check_responses(rd.data);
+    g_string_free(rd.data, TRUE);
+}
+
+static void
+test_write_batched(void)
+{
+    WriterStats st;
+
+    helper_write_all(0, FALSE, &st);
+    g_assert_cmpint(st.responses, ==, RESPONSES);
+    g_assert_cmpint(st.bytes, ==, RESPONSES * RESPONSE_SIZE);
+    g_assert_cmpint(st.dropped, ==, 0);
+    /* many responses per syscall */
+    g_assert_cmpint(st.writes, <, RESPONSES / 4);
+}
+
+static void
+test_write_slow_reader(void)
+{
+    WriterStats st;
+
+    /* the pipe fills up: partial writes, then EAGAIN */
+    helper_write_all(100, TRUE, &st);
+    g_assert_cmpint(st.partial, >, 0);
+    g_assert_cmpint(st.waits, >, 0);
+    g_assert_cmpint(st.errors, ==, 0);
+}
+
+static void
+test_write_error(void)
+{
+    WriterStats st;
+    Writer *wr = NULL;
+    int fds[2];
+
+    g_assert_cmpint(pipe(fds), ==, 0);
+    close(fds[0]); /* EPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    g_assert_cmpint(writer_init(&wr, fds[1]), ==, 0);
+    g_assert_cmpint(writer_start(wr), ==, 0);
+    g_assert_cmpint(writer_write(wr, 0, "lost\n", 5), ==, 0);
+    g_assert_cmpint(writer_stop(wr), ==, 0);
+    writer_get_stats(wr, &st);
+    writer_free(wr);
+    close(fds[1]);
+
+    g_assert_cmpint(st.errors, ==, 1);
+    g_assert_cmpint(st.dropped, ==, 1);
+}
+
+/*
+ * the consumer stalls while all the responses are queued,
+ * then catches up. Returns the sequence numbers received.
+ */
+static GArray *
+helper_stalled_consumer(int policy, size_t max_mem, int keys, WriterStats *st)
+{
+    char spool[] = "/tmp/test_writer_spool.XXXXXX";
+    char buf[RESPONSE_SIZE];
+    GArray *seqs = g_array_new(FALSE, FALSE, sizeof(int));
+    Writer *wr = NULL;
+    Reader rd;
+    GThread *reader;
+    const char *p;
+    int fds[2];
+    int j;
+
+    g_assert_cmpint(pipe(fds), ==, 0);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    close(mkstemp(spool));
+
+    g_assert_cmpint(writer_init(&wr, fds[1]), ==, 0);
+    g_assert_cmpint(writer_set_budget(wr, policy, max_mem,
+                                      spool, RESPONSES * RESPONSE_SIZE * 2),
+                    ==, 0);
+    g_assert_cmpint(writer_start(wr), ==, 0);
+    for (j = 0; j < RESPONSES; j++) {
+        make_response(buf, j);
+        g_assert_cmpint(writer_write(wr, (keys) ?j % keys + 1 :0,
+                                     buf, sizeof(buf)), ==, 0);
+    }
+    if (policy == WRITER_OVERFLOW_SPOOL) {
+        /* the writer thread spools the shed ones, even while stalled */
+        gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+        do {
+            g_usleep(1000);
+            writer_get_stats(wr, st);
+        } while (st->spooled == 0 && g_get_monotonic_time() < deadline);
+        g_assert_cmpint(st->spooled, >, 0);
+    }
+
+    rd.fd = fds[0];
+    rd.delay = 0;
+    rd.data = g_string_new(NULL);
+    reader = g_thread_new("reader", reader_run, &rd);
+
+    g_assert_cmpint(writer_stop(wr), ==, 0);
+    writer_get_stats(wr, st);
+    writer_free(wr);
+
+    close(fds[1]);
+    g_thread_join(reader);
+    close(fds[0]);
+    unlink(spool);
+
+    /* whole responses only */
+    g_assert_cmpint(rd.data->len % RESPONSE_SIZE, ==, 0);
+    for (p = rd.data->str; p < rd.data->str + rd.data->len; p += RESPONSE_SIZE) {
+        char expected[RESPONSE_SIZE];
+        int seq = atoi(p + strlen("{ \"seq\": "));
+        make_response(expected, seq);
+        g_assert(memcmp(p, expected, RESPONSE_SIZE) == 0);
+        g_array_append_val(seqs, seq);
+    }
+    g_string_free(rd.data, TRUE);
+    return seqs;
+}
+
+static void
+assert_in_order(GArray *seqs)
+{
+    guint i;
+    for (i = 1; i < seqs->len; i++) {
+        g_assert_cmpint(g_array_index(seqs, int, i - 1), <,
+                        g_array_index(seqs, int, i));
+    }
+}
+
+static void
+test_budget_drop_oldest(void)
+{
+    WriterStats st;
+    GArray *seqs = helper_stalled_consumer(WRITER_OVERFLOW_DROP_OLDEST,
+                                           64 * RESPONSE_SIZE, 0, &st);
+
+    assert_in_order(seqs);
+    g_assert_cmpint(st.shed, >, 0);
+    g_assert_cmpint(st.shed + seqs->len, ==, RESPONSES);
+    /* the newest made it */
+    g_assert_cmpint(g_array_index(seqs, int, seqs->len - 1), ==, RESPONSES - 1);
+
+    g_array_free(seqs, TRUE);
+}
+
+static void
+test_budget_keep_newest(void)
+{
+    WriterStats st;
+    gboolean seen[16] = { FALSE };
+    GArray *seqs = helper_stalled_consumer(WRITER_OVERFLOW_KEEP_NEWEST,
+                                           64 * RESPONSE_SIZE, 16, &st);
+    int j;
+
+    assert_in_order(seqs);
+    g_assert_cmpint(st.superseded, >, 0);
+    g_assert_cmpint(st.shed + st.superseded + seqs->len, ==, RESPONSES);
+    /* the latest response of every key made it */
+    for (j = 0; j < (int)seqs->len; j++) {
+        int seq = g_array_index(seqs, int, j);
+        if (seq >= RESPONSES - 16) {
+            seen[seq % 16] = TRUE;
+        }
+    }
+    for (j = 0; j < 16; j++) {
+        g_assert(seen[j]);
+    }
+
+    g_array_free(seqs, TRUE);
+}
+
+static void
+test_budget_spool(void)
+{
+    WriterStats st;
+    GArray *seqs = helper_stalled_consumer(WRITER_OVERFLOW_SPOOL,
+                                           64 * RESPONSE_SIZE, 0, &st);
+    int j;
+
+    /* the spool is large enough: nothing lost */
+    g_assert_cmpint(st.shed, ==, 0);
+    g_assert_cmpint(st.spooled, >, 0);
+    g_assert_cmpint(st.replayed, ==, st.spooled);
+    g_assert_cmpint(seqs->len, ==, RESPONSES);
+    for (j = 0; j < RESPONSES; j++) {
+        g_assert_cmpint(g_array_index(seqs, int, j), ==, j);
+    }
+
+    g_array_free(seqs, TRUE);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vmon/writer/write_batched", test_write_batched);
+    g_test_add_func("/vmon/writer/write_slow_reader", test_write_slow_reader);
+    g_test_add_func("/vmon/writer/write_error", test_write_error);
+    g_test_add_func("/vmon/writer/budget_drop_oldest", test_budget_drop_oldest);
+    g_test_add_func("/vmon/writer/budget_keep_newest", test_budget_keep_newest);
+    g_test_add_func("/vmon/writer/budget_spool", test_budget_spool);
+    return g_test_run();
+}